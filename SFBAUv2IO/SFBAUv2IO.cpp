@@ -5,16 +5,26 @@
 
 #import "SFBAUv2IO.hpp"
 
+#import <algorithm>
+#import <chrono>
+#import <cmath>
 #import <cstring>
+#import <functional>
+#import <future>
+#import <iterator>
 #import <limits>
 #import <memory>
 #import <new>
+#import <numeric>
 #import <stdexcept>
 
+#import <Accelerate/Accelerate.h>
 #import <os/log.h>
+#import <pthread.h>
 
 #import "SFBAudioUnitRecorder.hpp"
 #import "SFBCABufferList.hpp"
+#import "SFBCAChannelLayout.hpp"
 #import "SFBCAPropertyAddress.hpp"
 #import "SFBCAStreamBasicDescription.hpp"
 #import "SFBCATimeStamp.hpp"
@@ -22,10 +32,65 @@
 #import "SFBHALAudioStream.hpp"
 #import "SFBHALAudioSystemObject.hpp"
 
+#import "SFBAlignedBufferList.hpp"
+#import "SFBAudioProcessor.hpp"
+#import "SFBAuxiliaryOutput.hpp"
+#import "SFBConvolver.hpp"
+#import "SFBDucker.hpp"
+#import "SFBEchoCanceller.hpp"
+#import "SFBRenderWorkerPool.hpp"
+#import "SFBRTPReceiver.hpp"
+#import "SFBRTPSender.hpp"
+#import "SFBSharedMemoryWriter.hpp"
+#import "SFBSpatializer.hpp"
+#import "SFBTimeStretchPlayer.hpp"
+
 namespace {
 
+/// The number of slices allocated up front
 const size_t kScheduledAudioSliceCount = 16;
 
+/// The mixer input bus fed by routed input channels; bus 0 is fed by the player
+const UInt32 kInputMonitorMixerInputBus = static_cast<UInt32>(SFBAUv2IO::MixerInput::inputMonitor);
+/// The mixer input bus fed by network sources
+const UInt32 kNetworkMixerInputBus = static_cast<UInt32>(SFBAUv2IO::MixerInput::network);
+/// The mixer input bus fed by voices
+const UInt32 kVoicesMixerInputBus = static_cast<UInt32>(SFBAUv2IO::MixerInput::voices);
+const UInt32 kMixerInputBusCount = 4;
+
+/// The largest number of voices playing at once
+const UInt32 kVoiceCapacity = 4096;
+
+template <typename T>
+void ExchangeSlot(void *slot, void *value, void **previous) noexcept
+{
+	*previous = static_cast<std::atomic<T *> *>(slot)->exchange(static_cast<T *>(value));
+}
+
+template <typename T>
+void DisposeValue(void *value) noexcept
+{
+	delete static_cast<T *>(value);
+}
+
+/// The number of frames processed by the echo canceller at once
+const UInt32 kEchoCancellerBlockSize = 256;
+/// The length of the echo tail modeled by the echo canceller, in seconds
+const double kEchoCancellerTailDuration = 0.25;
+
+/// The capacity of the render command and reply queues
+const size_t kRenderCommandQueueCapacity = 256;
+/// The maximum number of render commands applied in one render cycle
+const UInt32 kMaximumRenderCommandsPerCycle = 16;
+/// How many output buffer durations to wait for the render thread before assuming the device has stalled
+const UInt32 kRenderCommandTimeoutBufferCount = 4;
+
+/// How often to check whether a player fade has finished, in nanoseconds
+const int64_t kPlayerFadeCheckInterval = 5 * NSEC_PER_MSEC;
+
+/// The capacity of the shared memory output ring in multiples of the maximum frames per slice
+const UInt32 kSharedMemoryOutputSliceCount = 16;
+
 SFB::CABufferList ReadFileContents(CFURLRef url, const AudioStreamBasicDescription& format)
 {
 	SFB::CAExtAudioFile eaf;
@@ -44,6 +109,51 @@ SFB::CABufferList ReadFileContents(CFURLRef url, const AudioStreamBasicDescripti
 	return abl;
 }
 
+/// Returns the BS.1770 weight of a channel: 0 for LFE, 1.41 for surrounds between 60° and 120° from front center, and 1 otherwise
+double LoudnessWeightForLabel(AudioChannelLabel label) noexcept
+{
+	switch(label) {
+		case kAudioChannelLabel_LFEScreen:
+		case kAudioChannelLabel_LFE2:
+			return 0;
+		case kAudioChannelLabel_LeftSurround:
+		case kAudioChannelLabel_RightSurround:
+		case kAudioChannelLabel_LeftSurroundDirect:
+		case kAudioChannelLabel_RightSurroundDirect:
+			return 1.41;
+		default:
+			return 1;
+	}
+}
+
+/// Returns the URL of file @c segment of the recording at @c url, such as @c Recording-2.caf for @c Recording.caf
+SFB::CFURL CreateRecordingSegmentURL(CFURLRef url, UInt32 segment)
+{
+	SFB::CFURL base(CFURLCreateCopyDeletingPathExtension(kCFAllocatorDefault, url));
+	if(!base)
+		throw std::bad_alloc();
+	SFB::CFURL directory(CFURLCreateCopyDeletingLastPathComponent(kCFAllocatorDefault, base));
+	SFB::CFString name(CFURLCopyLastPathComponent(base));
+	if(!directory || !name)
+		throw std::bad_alloc();
+
+	SFB::CFString segmentName(CFStringCreateWithFormat(kCFAllocatorDefault, nullptr, CFSTR("%@-%u"), static_cast<CFStringRef>(name), segment));
+	if(!segmentName)
+		throw std::bad_alloc();
+	SFB::CFURL segmentURL(CFURLCreateCopyAppendingPathComponent(kCFAllocatorDefault, directory, segmentName, false));
+	if(!segmentURL)
+		throw std::bad_alloc();
+
+	SFB::CFString extension(CFURLCopyPathExtension(url));
+	if(!extension)
+		return segmentURL;
+
+	SFB::CFURL segmentURLWithExtension(CFURLCreateCopyAppendingPathExtension(kCFAllocatorDefault, segmentURL, extension));
+	if(!segmentURLWithExtension)
+		throw std::bad_alloc();
+	return segmentURLWithExtension;
+}
+
 }
 
 class SFBScheduledAudioSlice : public ScheduledAudioSlice
@@ -51,37 +161,40 @@ class SFBScheduledAudioSlice : public ScheduledAudioSlice
 public:
 	SFBScheduledAudioSlice()
 	{
-		std::memset(this, 0, sizeof(ScheduledAudioSlice));
+		std::memset(static_cast<ScheduledAudioSlice *>(this), 0, sizeof(ScheduledAudioSlice));
 		mAvailable = true;
 	}
 
-	~SFBScheduledAudioSlice()
-	{
-		std::free(mBufferList);
-	}
-
 	void Clear()
 	{
-		std::free(mBufferList);
-		std::memset(this, 0, sizeof(ScheduledAudioSlice));
+		mStorage.Deallocate();
+		std::memset(static_cast<ScheduledAudioSlice *>(this), 0, sizeof(ScheduledAudioSlice));
 	}
 
+	/// The buffer referenced by @c mBufferList
+	SFBAlignedBufferList mStorage;
 	std::atomic_bool mAvailable;
 };
 
 SFBAUv2IO::SFBAUv2IO()
-: mInputUnit(nullptr), mPlayerUnit(nullptr), mMixerUnit(nullptr), mOutputUnit(nullptr), mFirstInputSampleTime(-1), mFirstOutputSampleTime(-1), mScheduledAudioSlices(nullptr)
+: mOutputRecordingFileType(0), mOutputRecordingFormat(), mOutputRecordingSegmentCount(0), mInputUnit(nullptr), mPlayerUnit(nullptr), mMixerUnit(nullptr), mOutputUnit(nullptr), mFirstInputSampleTime(-1), mFirstOutputSampleTime(-1), mThroughLatency(0), mOutputLatency(0), mEchoCancellationIsEnabled(false), mEchoCancellationSemaphore(nullptr), mPendingSliceCount(0), mPlayerIsRecorded(false), mPlayerFade(nullptr), mPlayerFadeQueue(nullptr), mPlayerFadeGroup(nullptr), mPlayerRenderGeneration(0), mPlayerRenderSampleTime(0), mRenderCommands(kRenderCommandQueueCapacity), mRenderReplies(kRenderCommandQueueCapacity), mOutstandingRenderCommandCount(0), mAuxiliaryOutputs(nullptr), mInputMonitorRouter(nullptr), mInputMonitorReader(mInputRingBuffer), mBusGraph(nullptr), mDucker(nullptr), mDuckerReader(mInputRingBuffer), mLoudnessMeter(nullptr), mSharedMemoryOutput(nullptr), mRTPSenders(nullptr), mRTPReceivers(nullptr), mTimeStretchPlayers(nullptr), mOutputKernels(), mPlayerKernels(), mStandbyOutputUnit(nullptr), mMonitoredOutputDeviceID(kAudioObjectUnknown), mFailoverQueue(nullptr), mOutputTimelineIsDiscontinuous(false), mOutputSampleTimeOffset(0), mNextOutputSampleTime(0)
 {
 	SFB::HALAudioSystemObject systemObject;
 	Initialize(systemObject.DefaultInputDevice(), systemObject.DefaultOutputDevice());
-	mScheduledAudioSlices = new SFBScheduledAudioSlice [kScheduledAudioSliceCount];
+	for(size_t i = 0; i < kScheduledAudioSliceCount; ++i)
+		mScheduledAudioSlices.push_back(std::make_unique<SFBScheduledAudioSlice>());
+	for(auto& silentFrameCount : mInsertSilentFrameCounts)
+		silentFrameCount = 0;
 }
 
 SFBAUv2IO::SFBAUv2IO(AudioObjectID inputDeviceID, AudioObjectID outputDeviceID)
-: mInputUnit(nullptr), mPlayerUnit(nullptr), mMixerUnit(nullptr), mOutputUnit(nullptr), mFirstInputSampleTime(-1), mFirstOutputSampleTime(-1), mScheduledAudioSlices(nullptr)
+: mOutputRecordingFileType(0), mOutputRecordingFormat(), mOutputRecordingSegmentCount(0), mInputUnit(nullptr), mPlayerUnit(nullptr), mMixerUnit(nullptr), mOutputUnit(nullptr), mFirstInputSampleTime(-1), mFirstOutputSampleTime(-1), mThroughLatency(0), mOutputLatency(0), mEchoCancellationIsEnabled(false), mEchoCancellationSemaphore(nullptr), mPendingSliceCount(0), mPlayerIsRecorded(false), mPlayerFade(nullptr), mPlayerFadeQueue(nullptr), mPlayerFadeGroup(nullptr), mPlayerRenderGeneration(0), mPlayerRenderSampleTime(0), mRenderCommands(kRenderCommandQueueCapacity), mRenderReplies(kRenderCommandQueueCapacity), mOutstandingRenderCommandCount(0), mAuxiliaryOutputs(nullptr), mInputMonitorRouter(nullptr), mInputMonitorReader(mInputRingBuffer), mBusGraph(nullptr), mDucker(nullptr), mDuckerReader(mInputRingBuffer), mLoudnessMeter(nullptr), mSharedMemoryOutput(nullptr), mRTPSenders(nullptr), mRTPReceivers(nullptr), mTimeStretchPlayers(nullptr), mOutputKernels(), mPlayerKernels(), mStandbyOutputUnit(nullptr), mMonitoredOutputDeviceID(kAudioObjectUnknown), mFailoverQueue(nullptr), mOutputTimelineIsDiscontinuous(false), mOutputSampleTimeOffset(0), mNextOutputSampleTime(0)
 {
 	Initialize(inputDeviceID, outputDeviceID);
-	mScheduledAudioSlices = new SFBScheduledAudioSlice [kScheduledAudioSliceCount];
+	for(size_t i = 0; i < kScheduledAudioSliceCount; ++i)
+		mScheduledAudioSlices.push_back(std::make_unique<SFBScheduledAudioSlice>());
+	for(auto& silentFrameCount : mInsertSilentFrameCounts)
+		silentFrameCount = 0;
 }
 
 SFBAUv2IO::~SFBAUv2IO()
@@ -91,6 +204,25 @@ SFBAUv2IO::~SFBAUv2IO()
 	if(mInputUnit)
 		AudioOutputUnitStop(mInputUnit);
 
+	// Commands left queued by a timed out wait still need the units and slots they target
+	ProcessRenderCommands(std::numeric_limits<UInt32>::max());
+	DrainRenderReplies();
+
+	{
+		// A pending fade check returns once it sees no fade
+		std::lock_guard<std::mutex> lock(mPlayerFadeLock);
+		delete mPlayerFade.exchange(nullptr);
+	}
+	if(mPlayerFadeGroup) {
+		dispatch_group_wait(mPlayerFadeGroup, DISPATCH_TIME_FOREVER);
+		dispatch_release(mPlayerFadeGroup);
+	}
+	if(mPlayerFadeQueue)
+		dispatch_release(mPlayerFadeQueue);
+
+	DisableEchoCancellation();
+	DisableStandbyOutput();
+
 	if(mInputRecorder)
 		mInputRecorder->Stop();
 	if(mPlayerRecorder)
@@ -118,7 +250,22 @@ SFBAUv2IO::~SFBAUv2IO()
 		AudioComponentInstanceDispose(mOutputUnit);
 	}
 
-	delete [] mScheduledAudioSlices;
+	for(auto& inserts : mInserts)
+		delete inserts.exchange(nullptr);
+	delete mAuxiliaryOutputs.exchange(nullptr);
+	delete mInputMonitorRouter.exchange(nullptr);
+	delete mBusGraph.exchange(nullptr);
+	delete mDucker.exchange(nullptr);
+	delete mLoudnessMeter.exchange(nullptr);
+	delete mSharedMemoryOutput.exchange(nullptr);
+	delete mRTPSenders.exchange(nullptr);
+	delete mRTPReceivers.exchange(nullptr);
+	delete mTimeStretchPlayers.exchange(nullptr);
+
+	if(mEchoCancellationSemaphore)
+		dispatch_release(mEchoCancellationSemaphore);
+	if(mFailoverQueue)
+		dispatch_release(mFailoverQueue);
 }
 
 SFB::HALAudioDevice SFBAUv2IO::InputDevice() const
@@ -132,6 +279,7 @@ SFB::HALAudioDevice SFBAUv2IO::InputDevice() const
 
 SFB::HALAudioDevice SFBAUv2IO::OutputDevice() const
 {
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
 	AudioObjectID deviceID;
 	UInt32 size = sizeof(deviceID);
 	auto result = AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &deviceID, &size);
@@ -141,57 +289,87 @@ SFB::HALAudioDevice SFBAUv2IO::OutputDevice() const
 
 void SFBAUv2IO::Start()
 {
-	if(IsRunning())
-		return;
+	{
+		std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+		if(IsRunning())
+			return;
+
+		if(mInputRecorder)
+			mInputRecorder->Start();
+		if(mPlayerRecorder) {
+			mPlayerRecorder->Start();
+			mPlayerIsRecorded = true;
+		}
+		if(mOutputRecorder)
+			mOutputRecorder->Start();
 
-	if(mInputRecorder)
-		mInputRecorder->Start();
-	if(mPlayerRecorder)
-		mPlayerRecorder->Start();
-	if(mOutputRecorder)
-		mOutputRecorder->Start();
+		auto result = AudioOutputUnitStart(mInputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStart (mInputUnit)");
+		result = AudioOutputUnitStart(mOutputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStart (mOutputUnit)");
+	}
 
-	auto result = AudioOutputUnitStart(mInputUnit);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStart (mInputUnit)");
-	result = AudioOutputUnitStart(mOutputUnit);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStart (mOutputUnit)");
+	std::lock_guard<std::mutex> lock(mAuxiliaryOutputLock);
+	auto auxiliaryOutputs = mAuxiliaryOutputs.load();
+	if(auxiliaryOutputs) {
+		for(const auto& auxiliaryOutput : *auxiliaryOutputs)
+			auxiliaryOutput->Start();
+	}
 }
 
 void SFBAUv2IO::StartAt(const AudioTimeStamp& timeStamp)
 {
-	if(IsRunning())
-		return;
-
-	AudioOutputUnitStartAtTimeParams startAtTime = {
-		.mTimestamp = timeStamp,
-		.mFlags = 0
-	};
-
-	// For some reason this is causing errors in AudioOutputUnitStart()
-	auto result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_StartTime, kAudioUnitScope_Global, 0, &startAtTime, sizeof(startAtTime));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTime)");
-	result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_StartTime, kAudioUnitScope_Global, 0, &startAtTime, sizeof(startAtTime));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTime)");
+	{
+		std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+		if(IsRunning())
+			return;
+
+		AudioOutputUnitStartAtTimeParams startAtTime = {
+			.mTimestamp = timeStamp,
+			.mFlags = 0
+		};
+
+		// For some reason this is causing errors in AudioOutputUnitStart()
+		auto result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_StartTime, kAudioUnitScope_Global, 0, &startAtTime, sizeof(startAtTime));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTime)");
+		result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_StartTime, kAudioUnitScope_Global, 0, &startAtTime, sizeof(startAtTime));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTime)");
+	}
 
 	Start();
 }
 
 void SFBAUv2IO::Stop()
 {
-	if(!IsRunning())
-		return;
+	{
+		std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+		if(!IsRunning())
+			return;
+
+		auto result = AudioOutputUnitStop(mInputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStop (mInputUnit)");
+		result = AudioOutputUnitStop(mOutputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStop (mOutputUnit)");
+	}
 
-	auto result = AudioOutputUnitStop(mInputUnit);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStop (mInputUnit)");
-	result = AudioOutputUnitStop(mOutputUnit);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStop (mOutputUnit)");
-	result = AudioUnitReset(mPlayerUnit, kAudioUnitScope_Global, 0);
+	{
+		std::lock_guard<std::mutex> lock(mAuxiliaryOutputLock);
+		auto auxiliaryOutputs = mAuxiliaryOutputs.load();
+		if(auxiliaryOutputs) {
+			for(const auto& auxiliaryOutput : *auxiliaryOutputs)
+				auxiliaryOutput->Stop();
+		}
+	}
+
+	auto result = AudioUnitReset(mPlayerUnit, kAudioUnitScope_Global, 0);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitReset (mPlayerUnit)");
 
 	if(mInputRecorder)
 		mInputRecorder->Stop();
-	if(mPlayerRecorder)
+	if(mPlayerRecorder) {
 		mPlayerRecorder->Stop();
+		mPlayerIsRecorded = false;
+	}
 	if(mOutputRecorder)
 		mOutputRecorder->Stop();
 
@@ -206,6 +384,7 @@ bool SFBAUv2IO::IsRunning() const
 
 bool SFBAUv2IO::OutputIsRunning() const
 {
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
 	UInt32 value;
 	UInt32 size = sizeof(value);
 	auto result = AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_IsRunning, kAudioUnitScope_Global, 0, &value, &size);
@@ -229,38 +408,119 @@ void SFBAUv2IO::Play(CFURLRef url)
 
 void SFBAUv2IO::PlayAt(CFURLRef url, const AudioTimeStamp& timeStamp)
 {
+	PlayAtBatch({ { url, timeStamp, 1, 0, 0 } });
+}
+
+void SFBAUv2IO::PlayAtBatch(const std::vector<Cue>& cues)
+{
+	if(cues.empty())
+		return;
+
 	SFB::CAStreamBasicDescription format;
-	UInt32 size = sizeof(format);
-	auto result = AudioUnitGetProperty(mPlayerUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &format, &size);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+	GetPlayerFormat(format);
+
+	// Decode each distinct file once
+	std::vector<CFURLRef> assetURLs;
+	std::vector<SFB::CABufferList> assets;
+	std::vector<size_t> cueAssets(cues.size());
+	for(size_t i = 0; i < cues.size(); ++i) {
+		if(!cues[i].mURL)
+			throw std::invalid_argument("Cue URL == nullptr");
+		auto match = std::find_if(assetURLs.begin(), assetURLs.end(), [&](CFURLRef url) { return CFEqual(url, cues[i].mURL); });
+		if(match == assetURLs.end()) {
+			assets.push_back(ReadFileContents(cues[i].mURL, format));
+			assetURLs.push_back(cues[i].mURL);
+			match = assetURLs.end() - 1;
+		}
+		cueAssets[i] = static_cast<size_t>(match - assetURLs.begin());
+	}
 
-	auto abl = ReadFileContents(url, format);
+	std::vector<size_t> order(cues.size());
+	std::iota(order.begin(), order.end(), 0);
+	const bool allSampleTimesValid = std::all_of(cues.begin(), cues.end(), [](const Cue& cue) { return (cue.mTimeStamp.mFlags & kAudioTimeStampSampleTimeValid) != 0; });
+	if(allSampleTimesValid)
+		std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return cues[lhs].mTimeStamp.mSampleTime < cues[rhs].mTimeStamp.mSampleTime; });
+
+	// Fade tables are shared by cues with the same fade lengths
+	std::vector<std::unique_ptr<SFBFadeEnvelope>> envelopes;
+	auto envelope = [&](UInt32 frameCount, SFBFadeEnvelope::Direction direction) {
+		auto match = std::find_if(envelopes.begin(), envelopes.end(), [&](const std::unique_ptr<SFBFadeEnvelope>& envelope) { return envelope->FrameCount() == frameCount && envelope->FadeDirection() == direction; });
+		if(match != envelopes.end())
+			return match->get();
+		envelopes.push_back(std::make_unique<SFBFadeEnvelope>(frameCount, direction));
+		return envelopes.back().get();
+	};
 
-	SFBScheduledAudioSlice *slice = nullptr;
-	for(size_t i = 0; i < kScheduledAudioSliceCount; ++i) {
-		if(mScheduledAudioSlices[i].mAvailable) {
-			slice = mScheduledAudioSlices + i;
-			break;
+	// Give every slice its own aligned buffer with the cue's gain and fades applied
+	std::vector<SFBAlignedBufferList> buffers(cues.size());
+	for(auto i : order) {
+		const auto& cue = cues[i];
+		const auto& asset = assets[cueAssets[i]];
+
+		const auto frameLength = asset.FrameLength();
+		if(!buffers[i].Allocate(format, frameLength, SFBAlignedBufferList::kCacheLineSize, true))
+			throw std::bad_alloc();
+
+		const AudioBufferList *input = asset;
+		const AudioBufferList *output = buffers[i];
+		for(UInt32 channel = 0; channel < output->mNumberBuffers; ++channel) {
+			if(cue.mGain == 1)
+				std::memcpy(output->mBuffers[channel].mData, input->mBuffers[channel].mData, frameLength * sizeof(float));
+			else
+				vDSP_vsmul(static_cast<const float *>(input->mBuffers[channel].mData), 1, &cue.mGain, static_cast<float *>(output->mBuffers[channel].mData), 1, frameLength);
+		}
+		buffers[i].SetFrameLength(frameLength);
+
+		// A fade longer than the file is truncated, keeping its shape at the file boundary
+		if(cue.mFadeInFrames) {
+			auto fadeIn = envelope(cue.mFadeInFrames, SFBFadeEnvelope::Direction::in);
+			fadeIn->Apply(buffers[i], 0, std::min(frameLength, cue.mFadeInFrames), 0);
+		}
+		if(cue.mFadeOutFrames) {
+			auto fadeOut = envelope(cue.mFadeOutFrames, SFBFadeEnvelope::Direction::out);
+			const auto fadeFrames = std::min(frameLength, cue.mFadeOutFrames);
+			fadeOut->Apply(buffers[i], frameLength - fadeFrames, fadeFrames, cue.mFadeOutFrames - fadeFrames);
 		}
 	}
 
-	if(!slice)
-		throw std::runtime_error("No available slices");
+	std::lock_guard<std::mutex> lock(mPlayerFadeLock);
 
-	slice->Clear();
-	slice->mTimeStamp				= timeStamp;
-	slice->mCompletionProc			= ScheduledAudioSliceCompletionProc;
-	slice->mCompletionProcUserData	= this;
-	slice->mNumberFrames			= abl.FrameLength();
-	slice->mBufferList				= abl.RelinquishABL();
-	slice->mAvailable 				= false;
+	// A pending fade would mute and then cancel these cues, so finish it now; its scheduled check finds nothing to do
+	if(mPlayerFade.load()) {
+		auto result = AudioUnitReset(mPlayerUnit, kAudioUnitScope_Global, 0);
+		Publish<PlayerFade>(mPlayerFade, nullptr);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitReset (mPlayerUnit)");
+	}
 
-	result = AudioUnitSetProperty(mPlayerUnit, kAudioUnitProperty_ScheduleAudioSlice, kAudioUnitScope_Global, 0, slice, sizeof(*slice));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_ScheduleAudioSlice)");
+	auto slices = AcquireScheduledAudioSlices(cues.size());
+
+	for(size_t j = 0; j < order.size(); ++j) {
+		const auto i = order[j];
+		auto slice = slices[j];
+
+		slice->Clear();
+		slice->mTimeStamp				= cues[i].mTimeStamp;
+		slice->mCompletionProc			= ScheduledAudioSliceCompletionProc;
+		slice->mCompletionProcUserData	= this;
+		slice->mNumberFrames			= buffers[i].FrameLength();
+		slice->mStorage					= std::move(buffers[i]);
+		slice->mBufferList				= slice->mStorage;
+
+		// The completion proc may run before AudioUnitSetProperty() returns
+		++mPendingSliceCount;
+		auto result = AudioUnitSetProperty(mPlayerUnit, kAudioUnitProperty_ScheduleAudioSlice, kAudioUnitScope_Global, 0, slice, sizeof(*slice));
+		if(result != noErr) {
+			--mPendingSliceCount;
+			// Return the unscheduled slices to the pool
+			for(size_t k = j; k < slices.size(); ++k)
+				slices[k]->mAvailable = true;
+			SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_ScheduleAudioSlice)");
+		}
+	}
 
 	SFB::CATimeStamp currentPlayTime;
-	size = sizeof(currentPlayTime);
-	result = AudioUnitGetProperty(mPlayerUnit, kAudioUnitProperty_CurrentPlayTime, kAudioUnitScope_Global, 0, &currentPlayTime, &size);
+	UInt32 size = sizeof(currentPlayTime);
+	auto result = AudioUnitGetProperty(mPlayerUnit, kAudioUnitProperty_CurrentPlayTime, kAudioUnitScope_Global, 0, &currentPlayTime, &size);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_CurrentPlayTime)");
 
 	if(currentPlayTime.SampleTimeIsValid() && currentPlayTime.mSampleTime == -1) {
@@ -270,6 +530,133 @@ void SFBAUv2IO::PlayAt(CFURLRef url, const AudioTimeStamp& timeStamp)
 	}
 }
 
+void SFBAUv2IO::CancelPlayback(UInt32 fadeOutFrames)
+{
+	CancelPlaybackAt(SFB::CATimeStamp{}, fadeOutFrames);
+}
+
+void SFBAUv2IO::CancelPlaybackAt(const AudioTimeStamp& timeStamp, UInt32 fadeOutFrames)
+{
+	std::lock_guard<std::mutex> lock(mPlayerFadeLock);
+
+	// The render thread applies the fade, so without output or a started player there is nothing to fade
+	Float64 startSampleTime = -1;
+	bool fadeOut = fadeOutFrames && OutputIsRunning();
+	if(fadeOut && (timeStamp.mFlags & kAudioTimeStampSampleTimeValid)) {
+		startSampleTime = OutputSampleTimeForPlayerSampleTime(timeStamp.mSampleTime);
+		fadeOut = startSampleTime >= 0;
+	}
+
+	if(!fadeOut) {
+		auto result = AudioUnitReset(mPlayerUnit, kAudioUnitScope_Global, 0);
+		Publish<PlayerFade>(mPlayerFade, nullptr);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitReset (mPlayerUnit)");
+		return;
+	}
+
+	if(!mPlayerFadeQueue) {
+		mPlayerFadeQueue = dispatch_queue_create("org.sbooth.AUv2IO.PlayerFade", DISPATCH_QUEUE_SERIAL);
+		mPlayerFadeGroup = dispatch_group_create();
+		if(!mPlayerFadeQueue || !mPlayerFadeGroup)
+			throw std::bad_alloc();
+	}
+
+	const bool checkPending = mPlayerFade.load() != nullptr;
+	Publish(mPlayerFade, std::make_unique<PlayerFade>(fadeOutFrames, startSampleTime));
+
+	// A check already scheduled for a previous fade picks up this one
+	if(!checkPending) {
+		dispatch_group_enter(mPlayerFadeGroup);
+		dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, kPlayerFadeCheckInterval), mPlayerFadeQueue, this, FinishPlayerFadeProc);
+	}
+}
+
+Float64 SFBAUv2IO::OutputSampleTimeForPlayerSampleTime(Float64 sampleTime)
+{
+	// The player's time advances with the time stamps it is rendered with, so one render fixes the offset between
+	// player and output time; the generation ensures the play time and render time come from the same render
+	for(;;) {
+		const auto generation = mPlayerRenderGeneration.load(std::memory_order_acquire);
+		const Float64 renderSampleTime = mPlayerRenderSampleTime.load(std::memory_order_relaxed);
+
+		SFB::CATimeStamp currentPlayTime;
+		UInt32 size = sizeof(currentPlayTime);
+		auto result = AudioUnitGetProperty(mPlayerUnit, kAudioUnitProperty_CurrentPlayTime, kAudioUnitScope_Global, 0, &currentPlayTime, &size);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_CurrentPlayTime)");
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(generation & 1 || mPlayerRenderGeneration.load(std::memory_order_relaxed) != generation) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		if(generation == 0 || !currentPlayTime.SampleTimeIsValid() || currentPlayTime.mSampleTime < 0)
+			return -1;
+		return sampleTime + renderSampleTime - currentPlayTime.mSampleTime;
+	}
+}
+
+void SFBAUv2IO::FinishPlayerFadeProc(void *context)
+{
+	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(context);
+
+	{
+		std::lock_guard<std::mutex> lock(THIS->mPlayerFadeLock);
+		auto fade = THIS->mPlayerFade.load();
+		if(fade) {
+			try {
+				if(!fade->mFinished && THIS->OutputIsRunning()) {
+					// Leave the group entered for the next check
+					dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, kPlayerFadeCheckInterval), THIS->mPlayerFadeQueue, THIS, FinishPlayerFadeProc);
+					return;
+				}
+
+				// The player stays muted by the finished fade until the reset has taken effect
+				auto result = AudioUnitReset(THIS->mPlayerUnit, kAudioUnitScope_Global, 0);
+				if(result != noErr)
+					os_log_error(OS_LOG_DEFAULT, "AudioUnitReset (mPlayerUnit) failed: %d", result);
+				THIS->Publish<PlayerFade>(THIS->mPlayerFade, nullptr);
+			}
+			catch(const std::exception& e) {
+				os_log_error(OS_LOG_DEFAULT, "Error finishing player fade: %{public}s", e.what());
+			}
+		}
+	}
+
+	dispatch_group_leave(THIS->mPlayerFadeGroup);
+}
+
+std::vector<SFBScheduledAudioSlice *> SFBAUv2IO::AcquireScheduledAudioSlices(size_t count)
+{
+	std::vector<SFBScheduledAudioSlice *> slices;
+	slices.reserve(count);
+
+	std::lock_guard<std::mutex> lock(mScheduledAudioSliceLock);
+	for(const auto& slice : mScheduledAudioSlices) {
+		if(slices.size() == count)
+			break;
+		bool available = true;
+		if(slice->mAvailable.compare_exchange_strong(available, false))
+			slices.push_back(slice.get());
+	}
+
+	try {
+		while(slices.size() < count) {
+			mScheduledAudioSlices.push_back(std::make_unique<SFBScheduledAudioSlice>());
+			auto slice = mScheduledAudioSlices.back().get();
+			slice->mAvailable = false;
+			slices.push_back(slice);
+		}
+	}
+	catch(...) {
+		for(auto slice : slices)
+			slice->mAvailable = true;
+		throw;
+	}
+
+	return slices;
+}
+
 void SFBAUv2IO::GetInputFormat(AudioStreamBasicDescription& format)
 {
 	UInt32 size = sizeof(format);
@@ -286,11 +673,82 @@ void SFBAUv2IO::GetPlayerFormat(AudioStreamBasicDescription& format)
 
 void SFBAUv2IO::GetOutputFormat(AudioStreamBasicDescription& format)
 {
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
 	UInt32 size = sizeof(format);
 	auto result = AudioUnitGetProperty(mOutputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &format, &size);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
 }
 
+void SFBAUv2IO::SetInputChannels(const std::vector<UInt32>& channels)
+{
+	if(IsRunning())
+		throw std::logic_error("Input channels cannot be changed while running");
+
+	SFB::CAStreamBasicDescription inputUnitInputFormat;
+	UInt32 size = sizeof(inputUnitInputFormat);
+	auto result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 1, &inputUnitInputFormat, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+
+	for(auto channel : channels) {
+		if(channel >= inputUnitInputFormat.ChannelCount())
+			throw std::out_of_range("Input channel out of range");
+	}
+
+	const bool echoCancellationWasEnabled = EchoCancellationIsEnabled();
+	DisableEchoCancellation();
+	SetInputMonitorRoutes({});
+
+	result = AudioUnitUninitialize(mInputUnit);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitUninitialize");
+
+	// For input the map has one entry per captured channel containing the device channel to capture
+	std::vector<SInt32> channelMap(channels.begin(), channels.end());
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 1, channelMap.data(), static_cast<UInt32>(channelMap.size() * sizeof(SInt32)));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_ChannelMap)");
+
+	SFB::CAStreamBasicDescription inputUnitOutputFormat;
+	GetInputFormat(inputUnitOutputFormat);
+	inputUnitOutputFormat.mChannelsPerFrame = channels.empty() ? inputUnitInputFormat.mChannelsPerFrame : static_cast<UInt32>(channels.size());
+	result = AudioUnitSetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &inputUnitOutputFormat, sizeof(inputUnitOutputFormat));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
+
+	AllocateInputBuffers(inputUnitOutputFormat);
+	if(!mInputMonitorBufferList.Allocate(inputUnitOutputFormat, MaximumFramesPerSlice()) || !mDuckerBufferList.Allocate(inputUnitOutputFormat, MaximumFramesPerSlice()))
+		throw std::bad_alloc();
+
+	mInputRecorder.reset();
+
+	result = AudioUnitInitialize(mInputUnit);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
+
+	if(echoCancellationWasEnabled)
+		EnableEchoCancellation();
+}
+
+std::vector<UInt32> SFBAUv2IO::InputChannels() const
+{
+	UInt32 size;
+	auto result = AudioUnitGetPropertyInfo(mInputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 1, &size, nullptr);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetPropertyInfo (kAudioOutputUnitProperty_ChannelMap)");
+
+	std::vector<SInt32> channelMap(size / sizeof(SInt32));
+	result = AudioUnitGetProperty(mInputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 1, channelMap.data(), &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioOutputUnitProperty_ChannelMap)");
+
+	// An identity map is equivalent to capturing every channel
+	std::vector<UInt32> channels;
+	bool identity = true;
+	for(SInt32 i = 0; i < static_cast<SInt32>(channelMap.size()); ++i) {
+		if(channelMap[i] < 0)
+			continue;
+		identity = identity && channelMap[i] == i;
+		channels.push_back(static_cast<UInt32>(channelMap[i]));
+	}
+	if(identity)
+		channels.clear();
+	return channels;
+}
+
 void SFBAUv2IO::SetInputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format)
 {
 	mInputRecorder = std::make_unique<SFB::AudioUnitRecorder>(mInputUnit, url, fileType, format, 1);
@@ -298,130 +756,573 @@ void SFBAUv2IO::SetInputRecordingURL(CFURLRef url, AudioFileTypeID fileType, con
 
 void SFBAUv2IO::SetPlayerRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format)
 {
+	// A recorder replaced while running is stopped and the new one doesn't start until Start()
+	mPlayerIsRecorded = false;
 	mPlayerRecorder = std::make_unique<SFB::AudioUnitRecorder>(mPlayerUnit, url, fileType, format);
 }
 
 void SFBAUv2IO::SetOutputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format)
 {
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
 	mOutputRecorder = std::make_unique<SFB::AudioUnitRecorder>(mOutputUnit, url, fileType, format);
+	mOutputRecordingURL = SFB::CFURL(static_cast<CFURLRef>(CFRetain(url)));
+	mOutputRecordingFileType = fileType;
+	mOutputRecordingFormat = format;
+	mOutputRecordingSegmentCount = 1;
 }
 
-void SFBAUv2IO::Initialize(AudioObjectID inputDeviceID, AudioObjectID outputDeviceID)
+void SFBAUv2IO::EnableEchoCancellation()
 {
-	CreateInputAU(inputDeviceID);
-	CreateOutputAU(outputDeviceID);
-	CreateMixerAU();
-	CreatePlayerAU();
-	BuildGraph();
-	mThroughLatency = MinimumThroughLatency();
-}
+	if(mEchoCancellationIsEnabled)
+		return;
 
-void SFBAUv2IO::CreateInputAU(AudioObjectID inputDeviceID)
-{
-	if(inputDeviceID == kAudioObjectUnknown)
-		throw std::invalid_argument("inputDevice == kAudioObjectUnknown");
+	SFB::CAStreamBasicDescription inputFormat;
+	GetInputFormat(inputFormat);
 
-	SFB::HALAudioDevice inputDevice(inputDeviceID);
-#if DEBUG
-	auto deviceName = inputDevice.Name();
-	if(deviceName)
-		os_log_debug(OS_LOG_DEFAULT, "Using input device %{public}@ (0x%x)", deviceName.Object(), inputDeviceID);
-#endif
+	SFB::CAStreamBasicDescription referenceFormat;
+	GetBusFormat(Bus::output, referenceFormat);
 
-	AudioComponentDescription componentDescription = {
-		.componentType 			= kAudioUnitType_Output,
-		.componentSubType 		= kAudioUnitSubType_HALOutput,
-		.componentManufacturer 	= kAudioUnitManufacturer_Apple,
-		.componentFlags 		= kAudioComponentFlag_SandboxSafe,
-		.componentFlagsMask 	= 0
-	};
+	if(inputFormat.mSampleRate != referenceFormat.mSampleRate)
+		throw std::runtime_error("Echo cancellation requires matching input and output sample rates");
+	if(!inputFormat.IsFloat() || !inputFormat.IsNonInterleaved() || inputFormat.mBitsPerChannel != 32 || !referenceFormat.IsFloat() || !referenceFormat.IsNonInterleaved() || referenceFormat.mBitsPerChannel != 32)
+		throw std::runtime_error("Echo cancellation requires deinterleaved 32-bit float input and output");
 
-	auto component = AudioComponentFindNext(nullptr, &componentDescription);
-	if(!component)
-		throw std::runtime_error("kAudioUnitSubType_HALOutput missing");
+	auto partitionCount = static_cast<UInt32>(std::ceil(kEchoCancellerTailDuration * inputFormat.mSampleRate / kEchoCancellerBlockSize));
+	mEchoCanceller = std::make_unique<SFBEchoCanceller>(kEchoCancellerBlockSize, partitionCount, inputFormat.ChannelCount());
 
-	auto result = AudioComponentInstanceNew(component, &mInputUnit);
-	SFB::ThrowIfCAAudioObjectError(result, "AudioComponentInstanceNew");
+	if(!mCleanedInputRingBuffer.Allocate(inputFormat, mInputRingBuffer.CapacityFrames()))
+		throw std::bad_alloc();
 
-	UInt32 enableIO = 1;
-	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Input, 1, &enableIO, sizeof(enableIO));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_EnableIO)");
+	if(!mEchoCancellationSemaphore) {
+		mEchoCancellationSemaphore = dispatch_semaphore_create(0);
+		if(!mEchoCancellationSemaphore)
+			throw std::bad_alloc();
+	}
 
-	enableIO = 0;
-	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Output, 0, &enableIO, sizeof(enableIO));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_EnableIO)");
+	mEchoCancellationIsEnabled = true;
+	try {
+		mEchoCancellationThread = std::thread(&SFBAUv2IO::EchoCancellationThreadEntry, this);
+	}
+	catch(...) {
+		mEchoCancellationIsEnabled = false;
+		throw;
+	}
+}
 
-	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &inputDeviceID, sizeof(inputDeviceID));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_CurrentDevice)");
+void SFBAUv2IO::DisableEchoCancellation()
+{
+	if(!mEchoCancellationIsEnabled)
+		return;
 
-	UInt32 startAtZero = 0;
-	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_StartTimestampsAtZero, kAudioUnitScope_Global, 0, &startAtZero, sizeof(startAtZero));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTimestampsAtZero)");
+	mEchoCancellationIsEnabled = false;
+	dispatch_semaphore_signal(mEchoCancellationSemaphore);
+	if(mEchoCancellationThread.joinable())
+		mEchoCancellationThread.join();
 
-	AURenderCallbackStruct inputCallback = {
-		.inputProc = InputRenderCallback,
-		.inputProcRefCon = this
-	};
+	mEchoCanceller.reset();
+}
 
-	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_SetInputCallback, kAudioUnitScope_Global, 0, &inputCallback, sizeof(inputCallback));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_SetInputCallback)");
+bool SFBAUv2IO::EchoCancellationIsEnabled() const
+{
+	return mEchoCancellationIsEnabled;
+}
 
-	SFB::CAPropertyAddress theAddress(kAudioDevicePropertyNominalSampleRate);
+bool SFBAUv2IO::ReadCleanedInput(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime)
+{
+	if(!mEchoCancellationIsEnabled)
+		return false;
+	return mCleanedInputRingBuffer.Read(bufferList, frameCount, sampleTime);
+}
 
-	auto inputDeviceSampleRate = inputDevice.NominalSampleRate();
+void SFBAUv2IO::SetCleanedInputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format)
+{
+	SFB::CAStreamBasicDescription inputFormat;
+	GetInputFormat(inputFormat);
 
-	SFB::CAStreamBasicDescription inputUnitInputFormat;
-	UInt32 size = sizeof(inputUnitInputFormat);
-	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 1, &inputUnitInputFormat, &size);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
-//	CFShow(inputUnitInputFormat.Description("input AU input format:  "));
+	auto recorder = std::make_unique<SFB::CAExtAudioFile>();
+	recorder->CreateWithURL(url, fileType, format, nullptr, kAudioFileFlags_EraseFile);
+	recorder->SetClientDataFormat(inputFormat);
 
+	std::lock_guard<std::mutex> lock(mCleanedInputRecorderLock);
+	mCleanedInputRecorder = std::move(recorder);
+}
 
-	SFB::CAStreamBasicDescription inputUnitOutputFormat;
-	size = sizeof(inputUnitOutputFormat);
-	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &inputUnitOutputFormat, &size);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+void SFBAUv2IO::GetBusFormat(Bus bus, AudioStreamBasicDescription& format)
+{
+	switch(bus) {
+		case Bus::player:
+			GetPlayerFormat(format);
+			break;
+		case Bus::output: {
+			std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+			UInt32 size = sizeof(format);
+			auto result = AudioUnitGetProperty(mOutputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &format, &size);
+			SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+			break;
+		}
+	}
+}
 
-	assert(inputDeviceSampleRate == inputUnitInputFormat.mSampleRate);
-	
-//	inputUnitOutputFormat.mSampleRate = inputDeviceSampleRate;
-	inputUnitOutputFormat.mSampleRate = inputUnitInputFormat.mSampleRate;
-	inputUnitOutputFormat.mChannelsPerFrame = inputUnitInputFormat.mChannelsPerFrame;
-	result = AudioUnitSetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &inputUnitOutputFormat, sizeof(inputUnitOutputFormat));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
-//	CFShow(inputUnitOutputFormat.Description("input AU output format: "));
+void SFBAUv2IO::AddInsert(Bus bus, std::shared_ptr<SFBAudioProcessor> processor)
+{
+	if(!processor)
+		throw std::invalid_argument("processor == nullptr");
+
+	std::lock_guard<std::mutex> lock(mInsertLock);
+	auto current = mInserts[static_cast<size_t>(bus)].load();
+	auto chain = current ? std::make_unique<InsertChain>(*current) : std::make_unique<InsertChain>();
+	chain->push_back(std::move(processor));
+	Publish(mInserts[static_cast<size_t>(bus)], std::move(chain));
+}
 
-//	UInt32 maxFramesPerSlice;
-//	size = sizeof(maxFramesPerSlice);
-//	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_MaximumFramesPerSlice, kAudioUnitScope_Global, 0, &maxFramesPerSlice, &size);
-//	SFBAudioUnitThrowIfError(result, "AudioUnitGetProperty");
+void SFBAUv2IO::RemoveInsert(Bus bus, const std::shared_ptr<SFBAudioProcessor>& processor)
+{
+	std::lock_guard<std::mutex> lock(mInsertLock);
+	auto current = mInserts[static_cast<size_t>(bus)].load();
+	if(!current)
+		return;
+	auto chain = std::make_unique<InsertChain>(*current);
+	chain->erase(std::remove(chain->begin(), chain->end(), processor), chain->end());
+	Publish(mInserts[static_cast<size_t>(bus)], chain->empty() ? nullptr : std::move(chain));
+}
 
-	UInt32 bufferFrameSize;
-	size = sizeof(bufferFrameSize);
-	result = AudioUnitGetProperty(mInputUnit, kAudioDevicePropertyBufferFrameSize, kAudioUnitScope_Global, 0, &bufferFrameSize, &size);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioDevicePropertyBufferFrameSize)");
+void SFBAUv2IO::RemoveAllInserts(Bus bus)
+{
+	std::lock_guard<std::mutex> lock(mInsertLock);
+	Publish<InsertChain>(mInserts[static_cast<size_t>(bus)], nullptr);
+}
 
-	if(!mInputBufferList.Allocate(inputUnitOutputFormat, bufferFrameSize))
-		throw std::bad_alloc();
-	if(!mInputRingBuffer.Allocate(inputUnitOutputFormat, 20 * bufferFrameSize))
-		throw std::bad_alloc();
+UInt32 SFBAUv2IO::InsertLatency(Bus bus) const
+{
+	std::lock_guard<std::mutex> lock(mInsertLock);
+	auto chain = mInserts[static_cast<size_t>(bus)].load();
+	if(!chain)
+		return 0;
+
+	UInt32 latency = 0;
+	for(const auto& processor : *chain)
+		latency += processor->Latency();
+	return latency;
+}
 
-	result = AudioUnitInitialize(mInputUnit);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
+std::shared_ptr<const SFBAudioAsset> SFBAUv2IO::LoadAsset(CFURLRef url)
+{
+	if(!url)
+		throw std::invalid_argument("url == nullptr");
+
+	SFB::CAStreamBasicDescription format;
+	GetPlayerFormat(format);
+
+	auto contents = ReadFileContents(url, format);
+	return std::make_shared<const SFBAudioAsset>(contents, contents.FrameLength(), format.mSampleRate);
 }
 
-void SFBAUv2IO::CreateOutputAU(AudioObjectID outputDeviceID)
+std::shared_ptr<SFBConvolver> SFBAUv2IO::AddConvolution(Bus bus, CFURLRef url)
 {
-	if(outputDeviceID == kAudioObjectUnknown)
-		throw std::invalid_argument("outputDevice == kAudioObjectUnknown");
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(bus, format);
 
-#if DEBUG
-	{
-		SFB::HALAudioDevice outputDevice(outputDeviceID);
-		auto deviceName = outputDevice.Name();
-		if(deviceName)
-			os_log_debug(OS_LOG_DEFAULT, "Using output device %{public}@ (0x%x)", deviceName.Object(), outputDeviceID);
+	auto impulseResponse = ReadFileContents(url, format);
+	auto convolver = std::make_shared<SFBConvolver>(impulseResponse, format.ChannelCount(), MaximumFramesPerSlice(), OutputDevice().BufferFrameSize());
+	AddInsert(bus, convolver);
+
+	return convolver;
+}
+
+void SFBAUv2IO::AddOutputDevice(AudioObjectID deviceID)
+{
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(Bus::output, format);
+
+	auto auxiliaryOutput = std::make_shared<SFBAuxiliaryOutput>(deviceID, format, OutputDevice().BufferFrameSize());
+
+	std::lock_guard<std::mutex> lock(mAuxiliaryOutputLock);
+	auto current = mAuxiliaryOutputs.load();
+	if(current) {
+		for(const auto& existing : *current) {
+			if(existing->Device().ObjectID() == deviceID)
+				throw std::invalid_argument("Output device already added");
+		}
+	}
+
+	if(OutputIsRunning())
+		auxiliaryOutput->Start();
+
+	auto auxiliaryOutputs = current ? std::make_unique<AuxiliaryOutputList>(*current) : std::make_unique<AuxiliaryOutputList>();
+	auxiliaryOutputs->push_back(std::move(auxiliaryOutput));
+	Publish(mAuxiliaryOutputs, std::move(auxiliaryOutputs));
+}
+
+void SFBAUv2IO::RemoveOutputDevice(AudioObjectID deviceID)
+{
+	std::lock_guard<std::mutex> lock(mAuxiliaryOutputLock);
+	auto current = mAuxiliaryOutputs.load();
+	if(!current)
+		return;
+
+	auto auxiliaryOutputs = std::make_unique<AuxiliaryOutputList>(*current);
+	auxiliaryOutputs->erase(std::remove_if(auxiliaryOutputs->begin(), auxiliaryOutputs->end(), [deviceID](const std::shared_ptr<SFBAuxiliaryOutput>& auxiliaryOutput) {
+		return auxiliaryOutput->Device().ObjectID() == deviceID;
+	}), auxiliaryOutputs->end());
+	Publish(mAuxiliaryOutputs, auxiliaryOutputs->empty() ? nullptr : std::move(auxiliaryOutputs));
+}
+
+std::vector<SFB::HALAudioDevice> SFBAUv2IO::AdditionalOutputDevices() const
+{
+	std::vector<SFB::HALAudioDevice> devices;
+	std::lock_guard<std::mutex> lock(mAuxiliaryOutputLock);
+	auto auxiliaryOutputs = mAuxiliaryOutputs.load();
+	if(auxiliaryOutputs) {
+		for(const auto& auxiliaryOutput : *auxiliaryOutputs)
+			devices.push_back(auxiliaryOutput->Device());
+	}
+	return devices;
+}
+
+void SFBAUv2IO::SetInputMonitorRoutes(const std::vector<SFBChannelRoute>& routes)
+{
+	std::unique_ptr<SFBChannelRouter> router;
+	if(!routes.empty()) {
+		SFB::CAStreamBasicDescription inputFormat;
+		GetInputFormat(inputFormat);
+
+		SFB::CAStreamBasicDescription playerFormat;
+		GetPlayerFormat(playerFormat);
+
+		if(inputFormat.mSampleRate != playerFormat.mSampleRate)
+			throw std::runtime_error("Input monitoring requires matching input and player sample rates");
+
+		router = std::make_unique<SFBChannelRouter>(routes, inputFormat.ChannelCount(), playerFormat.ChannelCount());
+	}
+
+	std::lock_guard<std::mutex> lock(mInputMonitorLock);
+	Publish(mInputMonitorRouter, std::move(router));
+}
+
+void SFBAUv2IO::EnableDucking(float threshold, float reduction, double attackTime, double releaseTime)
+{
+	SFB::CAStreamBasicDescription inputFormat;
+	GetInputFormat(inputFormat);
+
+	SFB::CAStreamBasicDescription playerFormat;
+	GetPlayerFormat(playerFormat);
+
+	if(inputFormat.mSampleRate != playerFormat.mSampleRate)
+		throw std::runtime_error("Ducking requires matching input and player sample rates");
+
+	auto ducker = std::make_unique<SFBDucker>(playerFormat.mSampleRate, MaximumFramesPerSlice(), threshold, reduction, attackTime, releaseTime);
+
+	std::lock_guard<std::mutex> lock(mDuckerLock);
+	Publish(mDucker, std::move(ducker));
+}
+
+void SFBAUv2IO::DisableDucking()
+{
+	std::lock_guard<std::mutex> lock(mDuckerLock);
+	Publish<SFBDucker>(mDucker, nullptr);
+}
+
+float SFBAUv2IO::DuckingGain() const
+{
+	std::lock_guard<std::mutex> lock(mDuckerLock);
+	auto ducker = mDucker.load();
+	return ducker ? ducker->Gain() : 1;
+}
+
+void SFBAUv2IO::SetOutputChannelMap(const std::vector<SInt32>& channelMap)
+{
+	SFB::CAStreamBasicDescription mixFormat;
+	GetBusFormat(Bus::output, mixFormat);
+
+	SFB::CAStreamBasicDescription deviceFormat;
+	GetOutputFormat(deviceFormat);
+
+	if(!channelMap.empty() && channelMap.size() != deviceFormat.ChannelCount())
+		throw std::invalid_argument("Channel map size must match the output device channel count");
+	for(auto channel : channelMap) {
+		if(channel < -1 || channel >= static_cast<SInt32>(mixFormat.ChannelCount()))
+			throw std::out_of_range("Channel map entry out of range");
+	}
+
+	// The output unit applies the map while converting to the device format, so routing costs nothing in the render callback
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+	auto result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 0, channelMap.data(), static_cast<UInt32>(channelMap.size() * sizeof(SInt32)));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_ChannelMap)");
+}
+
+void SFBAUv2IO::SetOutputChannelMap(const SFB::CAChannelLayout& mixLayout, const SFB::CAChannelLayout& deviceLayout)
+{
+	if(!mixLayout || !deviceLayout)
+		throw std::invalid_argument("Invalid channel layout");
+
+	const AudioChannelLayout *layouts [] = { mixLayout, deviceLayout };
+	std::vector<SInt32> channelMap(deviceLayout.ChannelCount());
+	UInt32 size = static_cast<UInt32>(channelMap.size() * sizeof(SInt32));
+	auto result = AudioFormatGetProperty(kAudioFormatProperty_ChannelMap, sizeof(layouts), layouts, &size, channelMap.data());
+	if(result != noErr)
+		throw std::runtime_error("AudioFormatGetProperty (kAudioFormatProperty_ChannelMap) failed");
+
+	SetOutputChannelMap(channelMap);
+}
+
+std::vector<SInt32> SFBAUv2IO::OutputChannelMap() const
+{
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+	UInt32 size;
+	auto result = AudioUnitGetPropertyInfo(mOutputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 0, &size, nullptr);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetPropertyInfo (kAudioOutputUnitProperty_ChannelMap)");
+
+	std::vector<SInt32> channelMap(size / sizeof(SInt32));
+	result = AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_ChannelMap, kAudioUnitScope_Output, 0, channelMap.data(), &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioOutputUnitProperty_ChannelMap)");
+	return channelMap;
+}
+
+void SFBAUv2IO::EnableLoudnessMeter(const std::vector<double>& channelWeights)
+{
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(Bus::output, format);
+
+	if(!channelWeights.empty() && channelWeights.size() != format.ChannelCount())
+		throw std::invalid_argument("Channel weight count does not match the output channel count");
+
+	auto loudnessMeter = std::make_unique<SFBLoudnessMeter>(format.mSampleRate, channelWeights.empty() ? DefaultLoudnessWeights(format.ChannelCount()) : channelWeights);
+
+	std::lock_guard<std::mutex> lock(mLoudnessMeterLock);
+	Publish(mLoudnessMeter, std::move(loudnessMeter));
+}
+
+void SFBAUv2IO::DisableLoudnessMeter()
+{
+	std::lock_guard<std::mutex> lock(mLoudnessMeterLock);
+	Publish<SFBLoudnessMeter>(mLoudnessMeter, nullptr);
+}
+
+SFBLoudnessMeter::Measurements SFBAUv2IO::LoudnessMeasurements() const
+{
+	std::lock_guard<std::mutex> lock(mLoudnessMeterLock);
+	auto loudnessMeter = mLoudnessMeter.load();
+	if(loudnessMeter)
+		return loudnessMeter->CurrentMeasurements();
+	const auto silence = -std::numeric_limits<double>::infinity();
+	return { silence, silence, silence, silence };
+}
+
+void SFBAUv2IO::ResetLoudnessMeter()
+{
+	std::lock_guard<std::mutex> lock(mLoudnessMeterLock);
+	auto loudnessMeter = mLoudnessMeter.load();
+	if(loudnessMeter)
+		loudnessMeter->Reset();
+}
+
+void SFBAUv2IO::EnableSharedMemoryOutput(const std::string& name)
+{
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(Bus::output, format);
+
+	std::lock_guard<std::mutex> lock(mSharedMemoryOutputLock);
+	// Unpublish first in case the same name is reused
+	Publish<SFBSharedMemoryWriter>(mSharedMemoryOutput, nullptr);
+	Publish(mSharedMemoryOutput, std::make_unique<SFBSharedMemoryWriter>(name, format, kSharedMemoryOutputSliceCount * MaximumFramesPerSlice(), OutputDevice().BufferFrameSize()));
+}
+
+void SFBAUv2IO::DisableSharedMemoryOutput()
+{
+	std::lock_guard<std::mutex> lock(mSharedMemoryOutputLock);
+	Publish<SFBSharedMemoryWriter>(mSharedMemoryOutput, nullptr);
+}
+
+std::shared_ptr<SFBRTPSender> SFBAUv2IO::AddRTPSender(const std::string& host, uint16_t port, SFBRTPEncoding encoding, double packetTime)
+{
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(Bus::output, format);
+
+	auto sender = std::make_shared<SFBRTPSender>(host, port, format, encoding, packetTime);
+
+	std::lock_guard<std::mutex> lock(mRTPSenderLock);
+	auto current = mRTPSenders.load();
+	auto senders = current ? std::make_unique<RTPSenderList>(*current) : std::make_unique<RTPSenderList>();
+	senders->push_back(sender);
+	Publish(mRTPSenders, std::move(senders));
+
+	return sender;
+}
+
+void SFBAUv2IO::RemoveRTPSender(const std::shared_ptr<SFBRTPSender>& sender)
+{
+	std::lock_guard<std::mutex> lock(mRTPSenderLock);
+	auto current = mRTPSenders.load();
+	if(!current)
+		return;
+
+	auto senders = std::make_unique<RTPSenderList>(*current);
+	senders->erase(std::remove(senders->begin(), senders->end(), sender), senders->end());
+	Publish(mRTPSenders, senders->empty() ? nullptr : std::move(senders));
+}
+
+std::shared_ptr<SFBRTPReceiver> SFBAUv2IO::AddRTPReceiver(uint16_t port, SFBRTPEncoding encoding, UInt32 channelCount)
+{
+	SFB::CAStreamBasicDescription format;
+	GetPlayerFormat(format);
+
+	auto receiver = std::make_shared<SFBRTPReceiver>(port, encoding, channelCount, format.mSampleRate, MaximumFramesPerSlice());
+
+	std::lock_guard<std::mutex> lock(mRTPReceiverLock);
+	auto current = mRTPReceivers.load();
+	auto receivers = current ? std::make_unique<RTPReceiverList>(*current) : std::make_unique<RTPReceiverList>();
+	receivers->push_back(receiver);
+	Publish(mRTPReceivers, std::move(receivers));
+
+	return receiver;
+}
+
+void SFBAUv2IO::RemoveRTPReceiver(const std::shared_ptr<SFBRTPReceiver>& receiver)
+{
+	std::lock_guard<std::mutex> lock(mRTPReceiverLock);
+	auto current = mRTPReceivers.load();
+	if(!current)
+		return;
+
+	auto receivers = std::make_unique<RTPReceiverList>(*current);
+	receivers->erase(std::remove(receivers->begin(), receivers->end(), receiver), receivers->end());
+	Publish(mRTPReceivers, receivers->empty() ? nullptr : std::move(receivers));
+}
+
+std::shared_ptr<SFBTimeStretchPlayer> SFBAUv2IO::PlayStretched(std::shared_ptr<const SFBAudioAsset> asset, double tempo, const AudioTimeStamp& timeStamp)
+{
+	if(!asset)
+		throw std::invalid_argument("asset == nullptr");
+
+	SFB::CAStreamBasicDescription format;
+	GetPlayerFormat(format);
+	if(asset->SampleRate() != format.mSampleRate || asset->ChannelCount() != format.ChannelCount())
+		throw std::invalid_argument("Asset format does not match the player format");
+
+	const auto startSampleTime = (timeStamp.mFlags & kAudioTimeStampSampleTimeValid) ? timeStamp.mSampleTime : -1;
+	auto player = std::make_shared<SFBTimeStretchPlayer>(std::move(asset), tempo, startSampleTime, MaximumFramesPerSlice());
+
+	std::lock_guard<std::mutex> lock(mTimeStretchPlayerLock);
+	auto current = mTimeStretchPlayers.load();
+	auto players = std::make_unique<TimeStretchPlayerList>();
+	// Drop players that have finished
+	if(current)
+		std::copy_if(current->begin(), current->end(), std::back_inserter(*players), [](const std::shared_ptr<SFBTimeStretchPlayer>& player) { return !player->IsFinished(); });
+	players->push_back(player);
+	Publish(mTimeStretchPlayers, std::move(players));
+
+	return player;
+}
+
+void SFBAUv2IO::StopStretched(const std::shared_ptr<SFBTimeStretchPlayer>& player)
+{
+	std::lock_guard<std::mutex> lock(mTimeStretchPlayerLock);
+	auto current = mTimeStretchPlayers.load();
+	if(!current)
+		return;
+
+	auto players = std::make_unique<TimeStretchPlayerList>(*current);
+	players->erase(std::remove(players->begin(), players->end(), player), players->end());
+	Publish(mTimeStretchPlayers, players->empty() ? nullptr : std::move(players));
+}
+
+void SFBAUv2IO::Initialize(AudioObjectID inputDeviceID, AudioObjectID outputDeviceID)
+{
+	for(auto& inserts : mInserts)
+		inserts = nullptr;
+
+	using clock = std::chrono::steady_clock;
+	const auto startTime = clock::now();
+
+	auto timed = [](std::chrono::microseconds& duration, const std::function<void()>& step) {
+		const auto stepStartTime = clock::now();
+		step();
+		duration = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - stepStartTime);
+	};
+
+	// Component lookup, instantiation, and device queries for each unit are independent
+	// The graph can only be built once the mixer and player exist
+	UInt32 inputLatency = 0, outputLatency = 0;
+	auto input = std::async(std::launch::async, [&] {
+		timed(mStartupTimes.mInput, [&] {
+			CreateInputAU(inputDeviceID);
+			inputLatency = MinimumInputLatency();
+		});
+	});
+	auto output = std::async(std::launch::async, [&] {
+		timed(mStartupTimes.mOutput, [&] {
+			mOutputUnit = CreateOutputAU(outputDeviceID);
+			outputLatency = MinimumOutputLatency();
+		});
+	});
+	auto player = std::async(std::launch::async, [&] {
+		timed(mStartupTimes.mPlayer, [&] { CreatePlayerAU(); });
+	});
+	timed(mStartupTimes.mMixer, [&] { CreateMixerAU(); });
+
+	// Wait for every step before rethrowing so none outlives this frame
+	std::exception_ptr error;
+	for(auto step : { &input, &output, &player }) {
+		try {
+			step->get();
+		}
+		catch(...) {
+			if(!error)
+				error = std::current_exception();
+		}
 	}
+	if(error)
+		std::rethrow_exception(error);
+
+	timed(mStartupTimes.mGraph, [&] { BuildGraph(); });
+	mThroughLatency = inputLatency + outputLatency;
+	mOutputLatency = outputLatency;
+
+	SFB::CAStreamBasicDescription outputUnitInputFormat;
+	UInt32 size = sizeof(outputUnitInputFormat);
+	auto result = AudioUnitGetProperty(mOutputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &outputUnitInputFormat, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+
+	if(!mOutputRingBuffer.Allocate(outputUnitInputFormat, mInputRingBuffer.CapacityFrames()))
+		throw std::bad_alloc();
+
+	if(!mInputMonitorBufferList.Allocate(mInputRingBuffer.Format(), MaximumFramesPerSlice()) || !mDuckerBufferList.Allocate(mInputRingBuffer.Format(), MaximumFramesPerSlice()))
+		throw std::bad_alloc();
+
+	SFB::CAStreamBasicDescription playerFormat;
+	GetPlayerFormat(playerFormat);
+	if(!mNetworkBufferList.Allocate(playerFormat, MaximumFramesPerSlice()))
+		throw std::bad_alloc();
+
+	mVoiceRenderer = std::make_unique<SFBVoiceRenderer>(kVoiceCapacity, playerFormat, MaximumFramesPerSlice());
+	if(!mVoicesBufferList.Allocate(playerFormat, MaximumFramesPerSlice()))
+		throw std::bad_alloc();
+
+	// Choose buffer kernels for the formats and slice size the render callbacks will see
+	const auto framesPerSlice = OutputDevice().BufferFrameSize();
+	mOutputKernels = SFBRenderKernels::KernelsForFormat(outputUnitInputFormat, framesPerSlice);
+	mPlayerKernels = SFBRenderKernels::KernelsForFormat(playerFormat, framesPerSlice);
+
+	mStartupTimes.mTotal = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - startTime);
+	os_log_info(OS_LOG_DEFAULT, "Initialized in %lld µs (input %lld µs, output %lld µs, mixer %lld µs, player %lld µs, graph %lld µs)",
+				static_cast<long long>(mStartupTimes.mTotal.count()),
+				static_cast<long long>(mStartupTimes.mInput.count()),
+				static_cast<long long>(mStartupTimes.mOutput.count()),
+				static_cast<long long>(mStartupTimes.mMixer.count()),
+				static_cast<long long>(mStartupTimes.mPlayer.count()),
+				static_cast<long long>(mStartupTimes.mGraph.count()));
+}
+
+void SFBAUv2IO::CreateInputAU(AudioObjectID inputDeviceID)
+{
+	if(inputDeviceID == kAudioObjectUnknown)
+		throw std::invalid_argument("inputDevice == kAudioObjectUnknown");
+
+	SFB::HALAudioDevice inputDevice(inputDeviceID);
+#if DEBUG
+	auto deviceName = inputDevice.Name();
+	if(deviceName)
+		os_log_debug(OS_LOG_DEFAULT, "Using input device %{public}@ (0x%x)", deviceName.Object(), inputDeviceID);
 #endif
 
 	AudioComponentDescription componentDescription = {
@@ -436,28 +1337,143 @@ void SFBAUv2IO::CreateOutputAU(AudioObjectID outputDeviceID)
 	if(!component)
 		throw std::runtime_error("kAudioUnitSubType_HALOutput missing");
 
-	auto result = AudioComponentInstanceNew(component, &mOutputUnit);
+	auto result = AudioComponentInstanceNew(component, &mInputUnit);
 	SFB::ThrowIfCAAudioObjectError(result, "AudioComponentInstanceNew");
 
-	result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &outputDeviceID, sizeof(outputDeviceID));
+	UInt32 enableIO = 1;
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Input, 1, &enableIO, sizeof(enableIO));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_EnableIO)");
+
+	enableIO = 0;
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Output, 0, &enableIO, sizeof(enableIO));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_EnableIO)");
+
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &inputDeviceID, sizeof(inputDeviceID));
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_CurrentDevice)");
 
 	UInt32 startAtZero = 0;
-	result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_StartTimestampsAtZero, kAudioUnitScope_Global, 0, &startAtZero, sizeof(startAtZero));
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_StartTimestampsAtZero, kAudioUnitScope_Global, 0, &startAtZero, sizeof(startAtZero));
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTimestampsAtZero)");
 
-	AURenderCallbackStruct outputCallback = {
-		.inputProc = OutputRenderCallback,
+	AURenderCallbackStruct inputCallback = {
+		.inputProc = InputRenderCallback,
 		.inputProcRefCon = this
 	};
 
-	result = AudioUnitSetProperty(mOutputUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &outputCallback, sizeof(outputCallback));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_SetRenderCallback)");
+	result = AudioUnitSetProperty(mInputUnit, kAudioOutputUnitProperty_SetInputCallback, kAudioUnitScope_Global, 0, &inputCallback, sizeof(inputCallback));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_SetInputCallback)");
+
+	SFB::CAPropertyAddress theAddress(kAudioDevicePropertyNominalSampleRate);
+
+	auto inputDeviceSampleRate = inputDevice.NominalSampleRate();
+
+	SFB::CAStreamBasicDescription inputUnitInputFormat;
+	UInt32 size = sizeof(inputUnitInputFormat);
+	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 1, &inputUnitInputFormat, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+//	CFShow(inputUnitInputFormat.Description("input AU input format:  "));
+
+
+	SFB::CAStreamBasicDescription inputUnitOutputFormat;
+	size = sizeof(inputUnitOutputFormat);
+	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &inputUnitOutputFormat, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+
+	assert(inputDeviceSampleRate == inputUnitInputFormat.mSampleRate);
+	
+//	inputUnitOutputFormat.mSampleRate = inputDeviceSampleRate;
+	inputUnitOutputFormat.mSampleRate = inputUnitInputFormat.mSampleRate;
+	inputUnitOutputFormat.mChannelsPerFrame = inputUnitInputFormat.mChannelsPerFrame;
+	result = AudioUnitSetProperty(mInputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &inputUnitOutputFormat, sizeof(inputUnitOutputFormat));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
+//	CFShow(inputUnitOutputFormat.Description("input AU output format: "));
 
-	result = AudioUnitInitialize(mOutputUnit);
+//	UInt32 maxFramesPerSlice;
+//	size = sizeof(maxFramesPerSlice);
+//	result = AudioUnitGetProperty(mInputUnit, kAudioUnitProperty_MaximumFramesPerSlice, kAudioUnitScope_Global, 0, &maxFramesPerSlice, &size);
+//	SFBAudioUnitThrowIfError(result, "AudioUnitGetProperty");
+
+	AllocateInputBuffers(inputUnitOutputFormat);
+
+	result = AudioUnitInitialize(mInputUnit);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
 }
 
+void SFBAUv2IO::AllocateInputBuffers(const AudioStreamBasicDescription& format)
+{
+	UInt32 bufferFrameSize;
+	UInt32 size = sizeof(bufferFrameSize);
+	auto result = AudioUnitGetProperty(mInputUnit, kAudioDevicePropertyBufferFrameSize, kAudioUnitScope_Global, 0, &bufferFrameSize, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioDevicePropertyBufferFrameSize)");
+
+	if(!mInputBufferList.Allocate(format, bufferFrameSize))
+		throw std::bad_alloc();
+	if(!mInputRingBuffer.Allocate(format, 20 * bufferFrameSize))
+		throw std::bad_alloc();
+}
+
+AudioUnit SFBAUv2IO::CreateOutputAU(AudioObjectID outputDeviceID, const AudioStreamBasicDescription *format)
+{
+	if(outputDeviceID == kAudioObjectUnknown)
+		throw std::invalid_argument("outputDevice == kAudioObjectUnknown");
+
+#if DEBUG
+	{
+		SFB::HALAudioDevice outputDevice(outputDeviceID);
+		auto deviceName = outputDevice.Name();
+		if(deviceName)
+			os_log_debug(OS_LOG_DEFAULT, "Using output device %{public}@ (0x%x)", deviceName.Object(), outputDeviceID);
+	}
+#endif
+
+	AudioComponentDescription componentDescription = {
+		.componentType 			= kAudioUnitType_Output,
+		.componentSubType 		= kAudioUnitSubType_HALOutput,
+		.componentManufacturer 	= kAudioUnitManufacturer_Apple,
+		.componentFlags 		= kAudioComponentFlag_SandboxSafe,
+		.componentFlagsMask 	= 0
+	};
+
+	auto component = AudioComponentFindNext(nullptr, &componentDescription);
+	if(!component)
+		throw std::runtime_error("kAudioUnitSubType_HALOutput missing");
+
+	AudioUnit outputUnit;
+	auto result = AudioComponentInstanceNew(component, &outputUnit);
+	SFB::ThrowIfCAAudioObjectError(result, "AudioComponentInstanceNew");
+
+	try {
+		result = AudioUnitSetProperty(outputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &outputDeviceID, sizeof(outputDeviceID));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_CurrentDevice)");
+
+		UInt32 startAtZero = 0;
+		result = AudioUnitSetProperty(outputUnit, kAudioOutputUnitProperty_StartTimestampsAtZero, kAudioUnitScope_Global, 0, &startAtZero, sizeof(startAtZero));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTimestampsAtZero)");
+
+		if(format) {
+			result = AudioUnitSetProperty(outputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, format, sizeof(*format));
+			SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
+		}
+
+		AURenderCallbackStruct outputCallback = {
+			.inputProc = OutputRenderCallback,
+			.inputProcRefCon = this
+		};
+
+		result = AudioUnitSetProperty(outputUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &outputCallback, sizeof(outputCallback));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_SetRenderCallback)");
+
+		result = AudioUnitInitialize(outputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
+	}
+	catch(...) {
+		AudioComponentInstanceDispose(outputUnit);
+		throw;
+	}
+
+	return outputUnit;
+}
+
 void SFBAUv2IO::CreateMixerAU()
 {
 	AudioComponentDescription componentDescription = {
@@ -496,15 +1512,31 @@ void SFBAUv2IO::CreatePlayerAU()
 
 void SFBAUv2IO::BuildGraph()
 {
-	// player out -> mixer input 0
-	AudioUnitConnection conn = {
-		.sourceAudioUnit 		= mPlayerUnit,
-		.sourceOutputNumber 	= 0,
-		.destInputNumber 		= 0
+	// player out -> player bus inserts -> mixer input 0
+	// input ring buffer -> input monitor routes -> mixer input 1
+	// network sources -> mixer input 2
+	// voices -> mixer input 3
+	UInt32 busCount = kMixerInputBusCount;
+	auto result = AudioUnitSetProperty(mMixerUnit, kAudioUnitProperty_ElementCount, kAudioUnitScope_Input, 0, &busCount, sizeof(busCount));
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_ElementCount)");
+
+	SFB::CAStreamBasicDescription playerFormat;
+	UInt32 size = sizeof(playerFormat);
+	result = AudioUnitGetProperty(mPlayerUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &playerFormat, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_StreamFormat)");
+
+	AURenderCallbackStruct mixerInputCallback = {
+		.inputProc = MixerInputRenderCallback,
+		.inputProcRefCon = this
 	};
 
-	auto result = AudioUnitSetProperty(mMixerUnit, kAudioUnitProperty_MakeConnection, kAudioUnitScope_Input, 0, &conn, sizeof(conn));
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_MakeConnection)");
+	for(UInt32 bus = 0; bus < kMixerInputBusCount; ++bus) {
+		result = AudioUnitSetProperty(mMixerUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, bus, &playerFormat, sizeof(playerFormat));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
+
+		result = AudioUnitSetProperty(mMixerUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, bus, &mixerInputCallback, sizeof(mixerInputCallback));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_SetRenderCallback)");
+	}
 
 	result = AudioUnitInitialize(mMixerUnit);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
@@ -514,12 +1546,540 @@ void SFBAUv2IO::BuildGraph()
 
 	// Set mixer volumes
 
-	result = AudioUnitSetParameter(mMixerUnit, kMultiChannelMixerParam_Volume, kAudioUnitScope_Input, 0, 1, 0);
-	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetParameter (kMultiChannelMixerParam_Volume)");
+	for(UInt32 bus = 0; bus < kMixerInputBusCount; ++bus) {
+		result = AudioUnitSetParameter(mMixerUnit, kMultiChannelMixerParam_Volume, kAudioUnitScope_Input, bus, 1, 0);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetParameter (kMultiChannelMixerParam_Volume)");
+	}
 	result = AudioUnitSetParameter(mMixerUnit, kMultiChannelMixerParam_Volume, kAudioUnitScope_Output, 0, 1, 0);
 	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetParameter (kMultiChannelMixerParam_Volume)");
 }
 
+void SFBAUv2IO::EnableStandbyOutput(AudioObjectID deviceID)
+{
+	// The standby unit must accept what the mixer renders for the current unit
+	SFB::CAStreamBasicDescription format;
+	GetBusFormat(Bus::output, format);
+
+	auto outputUnit = CreateOutputAU(deviceID, &format);
+
+	std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+
+	if(!mFailoverQueue)
+		mFailoverQueue = dispatch_queue_create("org.sbooth.AUv2IO.Failover", DISPATCH_QUEUE_SERIAL);
+
+	if(mStandbyOutputUnit) {
+		AudioUnitUninitialize(mStandbyOutputUnit);
+		AudioComponentInstanceDispose(mStandbyOutputUnit);
+	}
+	mStandbyOutputUnit = outputUnit;
+
+	try {
+		StartMonitoringOutputDevice();
+	}
+	catch(...) {
+		AudioUnitUninitialize(mStandbyOutputUnit);
+		AudioComponentInstanceDispose(mStandbyOutputUnit);
+		mStandbyOutputUnit = nullptr;
+		throw;
+	}
+}
+
+void SFBAUv2IO::DisableStandbyOutput()
+{
+	{
+		std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+		StopMonitoringOutputDevice();
+	}
+
+	// Let a failover already in progress finish
+	if(mFailoverQueue)
+		dispatch_sync_f(mFailoverQueue, nullptr, [](void *) {});
+
+	std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+	if(mStandbyOutputUnit) {
+		AudioUnitUninitialize(mStandbyOutputUnit);
+		AudioComponentInstanceDispose(mStandbyOutputUnit);
+		mStandbyOutputUnit = nullptr;
+	}
+}
+
+bool SFBAUv2IO::HasStandbyOutput() const
+{
+	std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+	return mStandbyOutputUnit != nullptr;
+}
+
+void SFBAUv2IO::SimulateOutputDeviceLoss()
+{
+	std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+	if(!mFailoverQueue)
+		throw std::logic_error("Standby output not enabled");
+	dispatch_async_f(mFailoverQueue, this, FailoverProc);
+}
+
+void SFBAUv2IO::StartMonitoringOutputDevice()
+{
+	if(mMonitoredOutputDeviceID != kAudioObjectUnknown)
+		return;
+
+	auto deviceID = OutputDevice().ObjectID();
+	SFB::CAPropertyAddress address(kAudioDevicePropertyDeviceIsAlive);
+	auto result = AudioObjectAddPropertyListener(deviceID, &address, OutputDeviceIsAliveChanged, this);
+	SFB::ThrowIfCAAudioObjectError(result, "AudioObjectAddPropertyListener (kAudioDevicePropertyDeviceIsAlive)");
+	mMonitoredOutputDeviceID = deviceID;
+}
+
+void SFBAUv2IO::StopMonitoringOutputDevice()
+{
+	if(mMonitoredOutputDeviceID == kAudioObjectUnknown)
+		return;
+
+	SFB::CAPropertyAddress address(kAudioDevicePropertyDeviceIsAlive);
+	auto result = AudioObjectRemovePropertyListener(mMonitoredOutputDeviceID, &address, OutputDeviceIsAliveChanged, this);
+	if(result != noErr)
+		os_log_error(OS_LOG_DEFAULT, "AudioObjectRemovePropertyListener (kAudioDevicePropertyDeviceIsAlive) failed: %d", result);
+	mMonitoredOutputDeviceID = kAudioObjectUnknown;
+}
+
+void SFBAUv2IO::FailOverToStandbyOutput()
+{
+	std::lock_guard<std::mutex> lock(mStandbyOutputLock);
+
+	if(!mStandbyOutputUnit) {
+		os_log_error(OS_LOG_DEFAULT, "Output device lost with no standby output");
+		return;
+	}
+
+	StopMonitoringOutputDevice();
+
+	// Control threads use the output unit only while holding the lock, so none can be using the failed unit when it is disposed
+	std::lock_guard<std::recursive_mutex> outputUnitLock(mOutputUnitLock);
+
+	// Queries against a vanished device may fail, in which case assume it was running
+	UInt32 wasRunning = 1;
+	UInt32 size = sizeof(wasRunning);
+	AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_IsRunning, kAudioUnitScope_Global, 0, &wasRunning, &size);
+
+	// Both units must never render the mixer at once
+	AudioOutputUnitStop(mOutputUnit);
+
+	// The output recorder observes the failed unit
+	if(mOutputRecorder) {
+		try {
+			mOutputRecorder->Stop();
+		}
+		catch(const std::exception& e) {
+			os_log_error(OS_LOG_DEFAULT, "Error stopping output recorder: %{public}s", e.what());
+		}
+		mOutputRecorder.reset();
+	}
+
+	auto failedOutputUnit = mOutputUnit;
+	mOutputUnit = mStandbyOutputUnit;
+	mStandbyOutputUnit = nullptr;
+
+	AudioUnitUninitialize(failedOutputUnit);
+	AudioComponentInstanceDispose(failedOutputUnit);
+
+	// Nothing renders until the standby unit starts, so state derived from the output device can be replaced
+	try {
+		const auto outputLatency = MinimumOutputLatency();
+		mThroughLatency += static_cast<Float64>(outputLatency) - static_cast<Float64>(mOutputLatency);
+		mOutputLatency = outputLatency;
+
+		SFB::CAStreamBasicDescription outputUnitInputFormat;
+		GetBusFormat(Bus::output, outputUnitInputFormat);
+		SFB::CAStreamBasicDescription playerFormat;
+		GetPlayerFormat(playerFormat);
+
+		const auto framesPerSlice = OutputDevice().BufferFrameSize();
+		mOutputKernels = SFBRenderKernels::KernelsForFormat(outputUnitInputFormat, framesPerSlice);
+		mPlayerKernels = SFBRenderKernels::KernelsForFormat(playerFormat, framesPerSlice);
+	}
+	catch(const std::exception& e) {
+		os_log_error(OS_LOG_DEFAULT, "Error configuring standby output: %{public}s", e.what());
+	}
+
+	// A recorder can't move to another unit, so the recording continues in a new file
+	if(mOutputRecordingURL) {
+		try {
+			auto url = CreateRecordingSegmentURL(mOutputRecordingURL, ++mOutputRecordingSegmentCount);
+			mOutputRecorder = std::make_unique<SFB::AudioUnitRecorder>(mOutputUnit, url, mOutputRecordingFileType, mOutputRecordingFormat);
+			if(wasRunning)
+				mOutputRecorder->Start();
+		}
+		catch(const std::exception& e) {
+			os_log_error(OS_LOG_DEFAULT, "Error continuing output recording: %{public}s", e.what());
+		}
+	}
+
+	mOutputTimelineIsDiscontinuous = true;
+	if(wasRunning) {
+		auto result = AudioOutputUnitStart(mOutputUnit);
+		if(result != noErr)
+			os_log_error(OS_LOG_DEFAULT, "AudioOutputUnitStart (standby output) failed: %d", result);
+	}
+
+	os_log_info(OS_LOG_DEFAULT, "Output failed over to standby device");
+}
+
+UInt32 SFBAUv2IO::MaximumFramesPerSlice() const
+{
+	std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+	UInt32 maximumFramesPerSlice;
+	UInt32 size = sizeof(maximumFramesPerSlice);
+	auto result = AudioUnitGetProperty(mOutputUnit, kAudioUnitProperty_MaximumFramesPerSlice, kAudioUnitScope_Global, 0, &maximumFramesPerSlice, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_MaximumFramesPerSlice)");
+	return maximumFramesPerSlice;
+}
+
+void SFBAUv2IO::SetMixerInputVolume(MixerInput input, float volume)
+{
+	RenderCommand command = {};
+	command.mType = RenderCommand::Type::setMixerInputVolume;
+	command.mElement = static_cast<UInt32>(input);
+	command.mVolume = volume;
+	SubmitRenderCommand(command, false);
+}
+
+void SFBAUv2IO::SetMixerOutputVolume(float volume)
+{
+	RenderCommand command = {};
+	command.mType = RenderCommand::Type::setMixerOutputVolume;
+	command.mVolume = volume;
+	SubmitRenderCommand(command, false);
+}
+
+void SFBAUv2IO::SetBuses(const std::vector<SFBBus>& buses)
+{
+	std::lock_guard<std::mutex> lock(mBusGraphLock);
+	auto previousBuses = std::move(mBuses);
+	mBuses = buses;
+	try {
+		PublishBusGraph();
+	}
+	catch(...) {
+		mBuses = std::move(previousBuses);
+		throw;
+	}
+}
+
+void SFBAUv2IO::SetBusGain(const std::string& name, float gain)
+{
+	std::lock_guard<std::mutex> lock(mBusGraphLock);
+	auto busGraph = mBusGraph.load();
+	if(!busGraph)
+		throw std::invalid_argument("Unknown bus");
+	const auto bus = busGraph->BusIndex(name);
+	busGraph->SetGain(bus, gain);
+	mBuses[bus].mGain = gain;
+}
+
+void SFBAUv2IO::SetBusMuted(const std::string& name, bool muted)
+{
+	std::lock_guard<std::mutex> lock(mBusGraphLock);
+	auto busGraph = mBusGraph.load();
+	if(!busGraph)
+		throw std::invalid_argument("Unknown bus");
+	const auto bus = busGraph->BusIndex(name);
+	busGraph->SetMuted(bus, muted);
+	mBuses[bus].mMuted = muted;
+}
+
+void SFBAUv2IO::SetRenderThreadCount(size_t threadCount)
+{
+	std::shared_ptr<SFBRenderWorkerPool> renderWorkers;
+	if(threadCount) {
+		const auto device = OutputDevice();
+		renderWorkers = std::make_shared<SFBRenderWorkerPool>(threadCount, device.BufferFrameSize() / device.NominalSampleRate());
+	}
+
+	std::lock_guard<std::mutex> lock(mBusGraphLock);
+	mRenderWorkers = std::move(renderWorkers);
+	PublishBusGraph();
+}
+
+void SFBAUv2IO::PublishBusGraph()
+{
+	std::unique_ptr<SFBBusGraph> busGraph;
+	if(!mBuses.empty()) {
+		SFB::CAStreamBasicDescription playerFormat;
+		GetPlayerFormat(playerFormat);
+		busGraph = std::make_unique<SFBBusGraph>(mBuses, kMixerInputBusCount, playerFormat, MaximumFramesPerSlice(), mRenderWorkers);
+	}
+
+	Publish(mBusGraph, std::move(busGraph));
+}
+
+template <typename T>
+void SFBAUv2IO::Publish(std::atomic<T *>& slot, std::unique_ptr<T> value)
+{
+	RenderCommand command = {};
+	command.mType = RenderCommand::Type::exchange;
+	command.mSlot = &slot;
+	command.mValue = value.get();
+	command.mExchange = ExchangeSlot<T>;
+	command.mDispose = DisposeValue<T>;
+
+	auto completion = SubmitRenderCommand(command, true);
+	// Ownership passes to the slot once the command is queued
+	value.release();
+	WaitForRenderCommand(completion);
+}
+
+SFBAUv2IO::RenderCompletion * SFBAUv2IO::SubmitRenderCommand(RenderCommand command, bool wait)
+{
+	// Every command is answered by one reply, so reserving a reply slot before queueing the command
+	// guarantees the render thread never finds the reply queue full
+	std::chrono::steady_clock::time_point deadline;
+	while(mOutstandingRenderCommandCount.fetch_add(1) >= kRenderCommandQueueCapacity) {
+		--mOutstandingRenderCommandCount;
+		{
+			std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+			if(!OutputIsRunning())
+				ProcessRenderCommands(std::numeric_limits<UInt32>::max());
+			else if(deadline == std::chrono::steady_clock::time_point{})
+				deadline = std::chrono::steady_clock::now() + RenderCommandTimeout();
+		}
+		DrainRenderReplies();
+		if(deadline != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() > deadline)
+			throw std::runtime_error("Timed out waiting for the render thread");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	command.mCompletion = wait ? new RenderCompletion : nullptr;
+
+	// The command queue holds no more commands than are outstanding
+	while(!mRenderCommands.Push(command))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	{
+		// The render thread only applies commands while output is running, and output can't be
+		// started, stopped, or replaced while the lock is held
+		std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+		if(!OutputIsRunning())
+			ProcessRenderCommands(std::numeric_limits<UInt32>::max());
+	}
+	DrainRenderReplies();
+
+	return command.mCompletion;
+}
+
+void SFBAUv2IO::WaitForRenderCommand(RenderCompletion *completion)
+{
+	// The reply handler may mark the completion after a timeout, so only this thread's reference is released
+	std::unique_ptr<RenderCompletion, void (*)(RenderCompletion *)> reference(completion, [](RenderCompletion *completion) { completion->Release(); });
+
+	std::chrono::steady_clock::time_point deadline;
+	for(;;) {
+		{
+			std::lock_guard<std::recursive_mutex> lock(mOutputUnitLock);
+			if(!OutputIsRunning())
+				ProcessRenderCommands(std::numeric_limits<UInt32>::max());
+			else if(deadline == std::chrono::steady_clock::time_point{})
+				deadline = std::chrono::steady_clock::now() + RenderCommandTimeout();
+		}
+		DrainRenderReplies();
+		if(completion->mCompleted)
+			return;
+
+		// A stalled device keeps output running without render cycles, so don't wait for it indefinitely
+		if(deadline != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() > deadline)
+			throw std::runtime_error("Timed out waiting for the render thread");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+std::chrono::nanoseconds SFBAUv2IO::RenderCommandTimeout() const
+{
+	const auto device = OutputDevice();
+	const auto bufferDuration = device.BufferFrameSize() / device.NominalSampleRate();
+	return std::chrono::nanoseconds(static_cast<int64_t>(kRenderCommandTimeoutBufferCount * bufferDuration * NSEC_PER_SEC));
+}
+
+void SFBAUv2IO::ProcessRenderCommands(UInt32 maximumCount) noexcept
+{
+	RenderCommand command;
+	for(UInt32 i = 0; i < maximumCount && mRenderCommands.Pop(command); ++i) {
+		RenderReply reply = { nullptr, nullptr, command.mCompletion };
+
+		switch(command.mType) {
+			case RenderCommand::Type::exchange:
+				command.mExchange(command.mSlot, command.mValue, &reply.mValue);
+				reply.mDispose = command.mDispose;
+				break;
+			case RenderCommand::Type::setMixerInputVolume: {
+				auto result = AudioUnitSetParameter(mMixerUnit, kMultiChannelMixerParam_Volume, kAudioUnitScope_Input, command.mElement, command.mVolume, 0);
+				if(result != noErr)
+					os_log_error(OS_LOG_DEFAULT, "Error setting mixer input volume: %d", result);
+				break;
+			}
+			case RenderCommand::Type::setMixerOutputVolume: {
+				auto result = AudioUnitSetParameter(mMixerUnit, kMultiChannelMixerParam_Volume, kAudioUnitScope_Output, 0, command.mVolume, 0);
+				if(result != noErr)
+					os_log_error(OS_LOG_DEFAULT, "Error setting mixer output volume: %d", result);
+				break;
+			}
+		}
+
+		// A slot was reserved when the command was submitted
+		mRenderReplies.Push(reply);
+	}
+}
+
+void SFBAUv2IO::DrainRenderReplies()
+{
+	RenderReply reply;
+	while(mRenderReplies.Pop(reply)) {
+		if(reply.mDispose && reply.mValue)
+			reply.mDispose(reply.mValue);
+		if(reply.mCompletion) {
+			reply.mCompletion->mCompleted.store(true);
+			reply.mCompletion->Release();
+		}
+		--mOutstandingRenderCommandCount;
+	}
+}
+
+bool SFBAUv2IO::ProcessInserts(const InsertChain *chain, AudioBufferList *bufferList, UInt32 frameCount, bool isSilent, UInt64& silentFrameCount) noexcept
+{
+	if(!chain)
+		return isSilent;
+
+	if(!isSilent)
+		silentFrameCount = 0;
+	else {
+		// Inserts such as reverb may produce output from silent input until their tails decay
+		UInt64 tailFrameCount = 0;
+		for(const auto& processor : *chain)
+			tailFrameCount = std::max(tailFrameCount, processor->TailFrameCount());
+		if(silentFrameCount >= tailFrameCount)
+			return true;
+		silentFrameCount += frameCount;
+	}
+
+	for(const auto& processor : *chain)
+		processor->Process(bufferList, frameCount);
+
+	return false;
+}
+
+bool SFBAUv2IO::MixerInputsAreSilent() const noexcept
+{
+	if(mPendingSliceCount > 0 || mPlayerIsRecorded)
+		return false;
+
+	// A fade only finishes once the player bus renders
+	auto fade = mPlayerFade.load();
+	if(fade && !fade->mFinished)
+		return false;
+
+	auto playerInserts = mInserts[static_cast<size_t>(Bus::player)].load();
+	if(playerInserts) {
+		// Mirror the test in ProcessInserts() without advancing the count
+		for(const auto& processor : *playerInserts) {
+			if(mInsertSilentFrameCounts[static_cast<size_t>(Bus::player)] < processor->TailFrameCount())
+				return false;
+		}
+	}
+
+	auto router = mInputMonitorRouter.load();
+	if(router && !router->IsEmpty())
+		return false;
+
+	auto receivers = mRTPReceivers.load();
+	if(receivers && !receivers->empty())
+		return false;
+
+	if(mVoiceRenderer && !mVoiceRenderer->IsIdle())
+		return false;
+
+	auto timeStretchPlayers = mTimeStretchPlayers.load();
+	if(timeStretchPlayers && std::any_of(timeStretchPlayers->begin(), timeStretchPlayers->end(), [](const std::shared_ptr<SFBTimeStretchPlayer>& player) { return !player->IsFinished(); }))
+		return false;
+
+	auto busGraph = mBusGraph.load();
+	if(busGraph && busGraph->HasTail())
+		return false;
+
+	return true;
+}
+
+OSStatus SFBAUv2IO::RenderInputMonitor(AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept
+{
+	auto outputSilence = [&]() {
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+		mPlayerKernels.mClear(ioData, inNumberFrames);
+		return noErr;
+	};
+
+	auto router = mInputMonitorRouter.load();
+	if(!router || router->IsEmpty())
+		return outputSilence();
+
+	// Input captured at input sample time t is played at output sample time t + through latency
+	mInputMonitorBufferList.Reset();
+	const auto sampleTime = static_cast<int64_t>(inTimeStamp->mSampleTime - mThroughLatency);
+	if(inNumberFrames > mInputMonitorBufferList.FrameCapacity() || !mInputMonitorReader.Read(mInputMonitorBufferList, inNumberFrames, sampleTime))
+		return outputSilence();
+
+	router->Route(mInputMonitorBufferList, ioData, inNumberFrames);
+
+	return noErr;
+}
+
+OSStatus SFBAUv2IO::RenderNetworkInput(AudioUnitRenderActionFlags *ioActionFlags, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept
+{
+	bool silent = true;
+
+	auto receivers = mRTPReceivers.load();
+	if(receivers) {
+		for(const auto& receiver : *receivers) {
+			// The first source renders in place and the rest are summed
+			if(silent) {
+				silent = !receiver->Render(ioData, inNumberFrames);
+				continue;
+			}
+
+			mNetworkBufferList.Reset();
+			if(inNumberFrames > mNetworkBufferList.FrameCapacity() || !receiver->Render(mNetworkBufferList, inNumberFrames))
+				continue;
+			mPlayerKernels.mAccumulate(mNetworkBufferList, ioData, inNumberFrames);
+		}
+	}
+
+	if(silent) {
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+		mPlayerKernels.mClear(ioData, inNumberFrames);
+	}
+
+	return noErr;
+}
+
+OSStatus SFBAUv2IO::RenderVoices(AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept
+{
+	bool silent = !mVoiceRenderer->Render(ioData, inNumberFrames, inTimeStamp->mSampleTime);
+
+	auto players = mTimeStretchPlayers.load();
+	if(players) {
+		for(const auto& player : *players) {
+			if(player->IsFinished())
+				continue;
+
+			mVoicesBufferList.Reset();
+			if(inNumberFrames > mVoicesBufferList.FrameCapacity() || !player->Render(mVoicesBufferList, inNumberFrames, inTimeStamp->mSampleTime))
+				continue;
+			mPlayerKernels.mAccumulate(mVoicesBufferList, ioData, inNumberFrames);
+			silent = false;
+		}
+	}
+
+	if(silent)
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+
+	return noErr;
+}
+
 UInt32 SFBAUv2IO::MinimumInputLatency() const
 {
 	auto inputDevice = InputDevice();
@@ -542,6 +2102,42 @@ UInt32 SFBAUv2IO::MinimumInputLatency() const
 	return safetyOffset + bufferFrameSize;
 }
 
+std::vector<double> SFBAUv2IO::DefaultLoudnessWeights(UInt32 channelCount) const
+{
+	std::vector<double> weights(channelCount, 1);
+
+	try {
+		const auto deviceID = OutputDevice().ObjectID();
+		SFB::CAPropertyAddress address(kAudioDevicePropertyPreferredChannelLayout, kAudioObjectPropertyScopeOutput);
+		UInt32 size = 0;
+		auto result = AudioObjectGetPropertyDataSize(deviceID, &address, 0, nullptr, &size);
+		SFB::ThrowIfCAAudioObjectError(result, "AudioObjectGetPropertyDataSize (kAudioDevicePropertyPreferredChannelLayout)");
+
+		std::vector<UInt8> storage(std::max<size_t>(size, sizeof(AudioChannelLayout)));
+		result = AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, storage.data());
+		SFB::ThrowIfCAAudioObjectError(result, "AudioObjectGetPropertyData (kAudioDevicePropertyPreferredChannelLayout)");
+
+		// The preferred layout may be given by tag or bitmap as well as channel by channel
+		const auto descriptions = SFBSpatializer::ChannelDescriptions(reinterpret_cast<const AudioChannelLayout *>(storage.data()));
+
+		// The mix reaches the device through the channel map, if any
+		const auto channelMap = OutputChannelMap();
+		for(UInt32 deviceChannel = 0; deviceChannel < descriptions.size(); ++deviceChannel) {
+			SInt32 mixChannel = static_cast<SInt32>(deviceChannel);
+			if(!channelMap.empty())
+				mixChannel = deviceChannel < channelMap.size() ? channelMap[deviceChannel] : -1;
+			if(mixChannel >= 0 && mixChannel < static_cast<SInt32>(channelCount))
+				weights[static_cast<size_t>(mixChannel)] = LoudnessWeightForLabel(descriptions[deviceChannel].mChannelLabel);
+		}
+	}
+	catch(const std::exception& e) {
+		os_log_error(OS_LOG_DEFAULT, "Unable to determine output channel layout, weighting channels equally: %{public}s", e.what());
+		std::fill(weights.begin(), weights.end(), 1);
+	}
+
+	return weights;
+}
+
 UInt32 SFBAUv2IO::MinimumOutputLatency() const
 {
 	auto outputDevice = OutputDevice();
@@ -578,7 +2174,10 @@ OSStatus SFBAUv2IO::InputRenderCallback(void *inRefCon, AudioUnitRenderActionFla
 		os_log_error(OS_LOG_DEFAULT, "Error rendering input: %d", result);
 
 	if(!THIS->mInputRingBuffer.Write(THIS->mInputBufferList, inNumberFrames, static_cast<int64_t>(inTimeStamp->mSampleTime)))
-		os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %.0f", inTimeStamp->mSampleTime);
+		os_log_debug(OS_LOG_DEFAULT, "SFBMultiReaderRingBuffer::Write failed at sample time %.0f", inTimeStamp->mSampleTime);
+
+	if(THIS->mEchoCancellationIsEnabled)
+		dispatch_semaphore_signal(THIS->mEchoCancellationSemaphore);
 
 	return result;
 }
@@ -587,11 +2186,20 @@ OSStatus SFBAUv2IO::OutputRenderCallback(void *inRefCon, AudioUnitRenderActionFl
 {
 	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(inRefCon);
 
+	THIS->ProcessRenderCommands(kMaximumRenderCommandsPerCycle);
+
+	// Carry the output timeline across a change of output device; everything downstream sees the adjusted time stamp
+	AudioTimeStamp timeStamp = *inTimeStamp;
+	if(THIS->mOutputTimelineIsDiscontinuous.exchange(false))
+		THIS->mOutputSampleTimeOffset = THIS->mNextOutputSampleTime - inTimeStamp->mSampleTime;
+	timeStamp.mSampleTime += THIS->mOutputSampleTimeOffset;
+	THIS->mNextOutputSampleTime = timeStamp.mSampleTime + inNumberFrames;
+	inTimeStamp = &timeStamp;
+
 	// Input not yet running
 	if(THIS->mFirstInputSampleTime < 0) {
 		*ioActionFlags = kAudioUnitRenderAction_OutputIsSilence;
-		for(UInt32 i = 0; i < ioData->mNumberBuffers; ++i)
-			std::memset(ioData->mBuffers[i].mData, 0, ioData->mBuffers[i].mDataByteSize);
+		THIS->mOutputKernels.mClear(ioData, inNumberFrames);
 		return noErr;
 	}
 
@@ -610,21 +2218,252 @@ OSStatus SFBAUv2IO::OutputRenderCallback(void *inRefCon, AudioUnitRenderActionFl
 #endif
 
 		*ioActionFlags = kAudioUnitRenderAction_OutputIsSilence;
-		for(UInt32 i = 0; i < ioData->mNumberBuffers; ++i)
-			std::memset(ioData->mBuffers[i].mData, 0, ioData->mBuffers[i].mDataByteSize);
+		THIS->mOutputKernels.mClear(ioData, inNumberFrames);
 		return noErr;
 	}
 
-	auto result = AudioUnitRender(THIS->mMixerUnit, ioActionFlags, inTimeStamp, inBusNumber, inNumberFrames, ioData);
-//	SFBAudioUnitThrowIfError(result, "AudioUnitRender (mMixerUnit)");
-	if(result != noErr)
-		os_log_error(OS_LOG_DEFAULT, "Error rendering mixer output: %d", result);
+	OSStatus result = noErr;
+	// Skip the mixer and its inputs entirely when idle
+	if(THIS->MixerInputsAreSilent()) {
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+		THIS->mOutputKernels.mClear(ioData, inNumberFrames);
+	}
+	else if(auto busGraph = THIS->mBusGraph.load()) {
+		if(!busGraph->Render(RenderBusGraphSource, THIS, inTimeStamp, ioData, inNumberFrames))
+			*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+	}
+	else {
+		result = AudioUnitRender(THIS->mMixerUnit, ioActionFlags, inTimeStamp, inBusNumber, inNumberFrames, ioData);
+//		SFBAudioUnitThrowIfError(result, "AudioUnitRender (mMixerUnit)");
+		if(result != noErr)
+			os_log_error(OS_LOG_DEFAULT, "Error rendering mixer output: %d", result);
+	}
+
+	if(result == noErr) {
+		auto inserts = THIS->mInserts[static_cast<size_t>(Bus::output)].load();
+		auto& silentFrameCount = THIS->mInsertSilentFrameCounts[static_cast<size_t>(Bus::output)];
+		if(!ProcessInserts(inserts, ioData, inNumberFrames, (*ioActionFlags & kAudioUnitRenderAction_OutputIsSilence) != 0, silentFrameCount))
+			*ioActionFlags &= ~kAudioUnitRenderAction_OutputIsSilence;
+	}
+
+	// Downstream consumers receive silence too so their timelines remain continuous
+	if(result == noErr) {
+		auto loudnessMeter = THIS->mLoudnessMeter.load();
+		if(loudnessMeter) {
+			const float *channels [SFBLoudnessMeter::kMaximumChannelCount];
+			const auto channelCount = std::min(ioData->mNumberBuffers, SFBLoudnessMeter::kMaximumChannelCount);
+			for(UInt32 i = 0; i < channelCount; ++i)
+				channels[i] = static_cast<const float *>(ioData->mBuffers[i].mData);
+			loudnessMeter->Process(channels, channelCount, inNumberFrames);
+		}
+
+		auto auxiliaryOutputs = THIS->mAuxiliaryOutputs.load();
+		if(auxiliaryOutputs) {
+			for(const auto& auxiliaryOutput : *auxiliaryOutputs)
+				auxiliaryOutput->Write(ioData, inNumberFrames, static_cast<int64_t>(inTimeStamp->mSampleTime));
+		}
+
+		auto sharedMemoryOutput = THIS->mSharedMemoryOutput.load();
+		if(sharedMemoryOutput)
+			sharedMemoryOutput->Write(ioData, inNumberFrames, *inTimeStamp);
+
+		auto senders = THIS->mRTPSenders.load();
+		if(senders) {
+			for(const auto& sender : *senders)
+				sender->Write(ioData, inNumberFrames, *inTimeStamp);
+		}
+	}
+
+	if(result == noErr && THIS->mEchoCancellationIsEnabled) {
+		if(!THIS->mOutputRingBuffer.Write(ioData, inNumberFrames, static_cast<int64_t>(inTimeStamp->mSampleTime)))
+			os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %.0f", inTimeStamp->mSampleTime);
+	}
 
 	return result;
 }
 
+OSStatus SFBAUv2IO::OutputDeviceIsAliveChanged(AudioObjectID inObjectID, UInt32 inNumberAddresses, const AudioObjectPropertyAddress *inAddresses, void *inClientData)
+{
+	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(inClientData);
+
+	UInt32 isAlive = 0;
+	UInt32 size = sizeof(isAlive);
+	SFB::CAPropertyAddress address(kAudioDevicePropertyDeviceIsAlive);
+	auto result = AudioObjectGetPropertyData(inObjectID, &address, 0, nullptr, &size, &isAlive);
+	if(result == noErr && isAlive)
+		return noErr;
+
+	os_log_error(OS_LOG_DEFAULT, "Output device 0x%x is no longer available", inObjectID);
+
+	// Listeners can't be removed from within a listener
+	dispatch_async_f(THIS->mFailoverQueue, THIS, FailoverProc);
+
+	return noErr;
+}
+
+void SFBAUv2IO::FailoverProc(void *context)
+{
+	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(context);
+	THIS->FailOverToStandbyOutput();
+}
+
+OSStatus SFBAUv2IO::MixerInputRenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData)
+{
+	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(inRefCon);
+
+	if(inBusNumber == kInputMonitorMixerInputBus)
+		return THIS->RenderInputMonitor(ioActionFlags, inTimeStamp, inNumberFrames, ioData);
+	if(inBusNumber == kNetworkMixerInputBus)
+		return THIS->RenderNetworkInput(ioActionFlags, inNumberFrames, ioData);
+	if(inBusNumber == kVoicesMixerInputBus)
+		return THIS->RenderVoices(ioActionFlags, inTimeStamp, inNumberFrames, ioData);
+
+	// The player only renders zeros when nothing is scheduled
+	if(THIS->mPendingSliceCount == 0 && !THIS->mPlayerIsRecorded) {
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+		THIS->mPlayerKernels.mClear(ioData, inNumberFrames);
+	}
+	else {
+		// Bracket the render so control threads can pair the player's play time with the output time
+		THIS->mPlayerRenderGeneration.fetch_add(1, std::memory_order_acq_rel);
+		THIS->mPlayerRenderSampleTime.store(inTimeStamp->mSampleTime, std::memory_order_relaxed);
+		auto result = AudioUnitRender(THIS->mPlayerUnit, ioActionFlags, inTimeStamp, 0, inNumberFrames, ioData);
+		THIS->mPlayerRenderGeneration.fetch_add(1, std::memory_order_release);
+		if(result != noErr) {
+			os_log_error(OS_LOG_DEFAULT, "Error rendering player output: %d", result);
+			return result;
+		}
+	}
+
+	auto fade = THIS->mPlayerFade.load();
+	if(fade) {
+		UInt32 offset = 0;
+		if(fade->mStartSampleTime > inTimeStamp->mSampleTime)
+			offset = static_cast<UInt32>(std::min(fade->mStartSampleTime - inTimeStamp->mSampleTime, static_cast<Float64>(inNumberFrames)));
+
+		if(offset < inNumberFrames) {
+			const auto frameCount = fade->mEnvelope.FrameCount();
+			if(offset == 0 && fade->mPosition == frameCount)
+				*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+			fade->mEnvelope.Apply(ioData, offset, inNumberFrames - offset, fade->mPosition);
+			fade->mPosition = std::min(frameCount, fade->mPosition + (inNumberFrames - offset));
+			if(fade->mPosition == frameCount)
+				fade->mFinished = true;
+		}
+	}
+
+	auto inserts = THIS->mInserts[static_cast<size_t>(Bus::player)].load();
+	auto& silentFrameCount = THIS->mInsertSilentFrameCounts[static_cast<size_t>(Bus::player)];
+	if(!ProcessInserts(inserts, ioData, inNumberFrames, (*ioActionFlags & kAudioUnitRenderAction_OutputIsSilence) != 0, silentFrameCount))
+		*ioActionFlags &= ~kAudioUnitRenderAction_OutputIsSilence;
+
+	// Input captured at input sample time t is heard at output sample time t + through latency
+	auto ducker = THIS->mDucker.load();
+	if(ducker) {
+		const AudioBufferList *sidechain = nullptr;
+		THIS->mDuckerBufferList.Reset();
+		const auto sampleTime = static_cast<int64_t>(inTimeStamp->mSampleTime - THIS->mThroughLatency);
+		if(inNumberFrames <= THIS->mDuckerBufferList.FrameCapacity() && THIS->mDuckerReader.Read(THIS->mDuckerBufferList, inNumberFrames, sampleTime))
+			sidechain = THIS->mDuckerBufferList;
+		ducker->Process(sidechain, ioData, inNumberFrames);
+	}
+
+	return noErr;
+}
+
+bool SFBAUv2IO::RenderBusGraphSource(void *context, UInt32 source, const AudioTimeStamp *timeStamp, AudioBufferList *bufferList, UInt32 frameCount)
+{
+	AudioUnitRenderActionFlags flags = 0;
+	auto result = MixerInputRenderCallback(context, &flags, timeStamp, source, frameCount, bufferList);
+	return result == noErr && !(flags & kAudioUnitRenderAction_OutputIsSilence);
+}
+
+void SFBAUv2IO::EchoCancellationThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.EchoCancellation");
+
+	const auto blockSize = mEchoCanceller->BlockSize();
+
+	SFBMultiReaderRingBuffer::Reader input(mInputRingBuffer);
+	SFB::CABufferList capture, reference;
+	if(!capture.Allocate(mInputRingBuffer.Format(), blockSize) || !reference.Allocate(mOutputRingBuffer.Format(), blockSize)) {
+		os_log_error(OS_LOG_DEFAULT, "Unable to allocate echo cancellation buffers");
+		return;
+	}
+
+	// The echo of output sample time t is captured at input sample time t - (output start - input start) + through latency.
+	// The reference is taken one block early so the adaptive filter sees the echo as causal despite latency estimation error.
+	const auto minimumThroughLatency = static_cast<int64_t>(MinimumThroughLatency());
+
+	int64_t nextSampleTime = -1;
+	while(mEchoCancellationIsEnabled) {
+		dispatch_semaphore_wait(mEchoCancellationSemaphore, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+
+		const double firstInputSampleTime = mFirstInputSampleTime;
+		const double firstOutputSampleTime = mFirstOutputSampleTime;
+		if(firstInputSampleTime < 0 || firstOutputSampleTime < 0) {
+			nextSampleTime = -1;
+			continue;
+		}
+
+		const auto referenceOffset = static_cast<int64_t>(firstOutputSampleTime - firstInputSampleTime) - minimumThroughLatency - blockSize;
+
+		int64_t inputStart, inputEnd;
+		if(!mInputRingBuffer.GetTimeBounds(inputStart, inputEnd))
+			continue;
+
+		if(nextSampleTime < inputStart) {
+			if(nextSampleTime != -1)
+				os_log_debug(OS_LOG_DEFAULT, "Echo cancellation skipped %lld frames", inputStart - nextSampleTime);
+			nextSampleTime = inputStart;
+		}
+
+		while(mEchoCancellationIsEnabled && nextSampleTime + blockSize <= inputEnd) {
+			int64_t referenceStart, referenceEnd;
+			if(!mOutputRingBuffer.GetTimeBounds(referenceStart, referenceEnd) || nextSampleTime + referenceOffset + blockSize > referenceEnd)
+				break;
+
+			capture.Reset();
+			if(!input.Read(capture, blockSize, nextSampleTime)) {
+				nextSampleTime = -1;
+				break;
+			}
+
+			// Output that has already been overwritten is treated as silence
+			reference.Reset();
+			if(!mOutputRingBuffer.Read(reference, blockSize, nextSampleTime + referenceOffset)) {
+				const AudioBufferList *abl = reference;
+				for(UInt32 i = 0; i < abl->mNumberBuffers; ++i)
+					std::memset(abl->mBuffers[i].mData, 0, abl->mBuffers[i].mDataByteSize);
+			}
+
+			mEchoCanceller->Process(capture, reference, capture);
+			capture.SetFrameLength(blockSize);
+
+			if(!mCleanedInputRingBuffer.Write(capture, blockSize, nextSampleTime))
+				os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %lld", nextSampleTime);
+
+			{
+				std::lock_guard<std::mutex> lock(mCleanedInputRecorderLock);
+				if(mCleanedInputRecorder) {
+					try {
+						mCleanedInputRecorder->Write(blockSize, capture);
+					}
+					catch(const std::exception& e) {
+						os_log_error(OS_LOG_DEFAULT, "Error writing cleaned input: %{public}s", e.what());
+						mCleanedInputRecorder.reset();
+					}
+				}
+			}
+
+			nextSampleTime += blockSize;
+		}
+	}
+}
+
 void SFBAUv2IO::ScheduledAudioSliceCompletionProc(void *userData, ScheduledAudioSlice *slice)
 {
-//	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(userData);
+	SFBAUv2IO *THIS = static_cast<SFBAUv2IO *>(userData);
 	static_cast<SFBScheduledAudioSlice *>(slice)->mAvailable = true;
+	--THIS->mPendingSliceCount;
 }
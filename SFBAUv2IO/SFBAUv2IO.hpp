@@ -6,26 +6,74 @@
 #pragma once
 
 #import <atomic>
+#import <chrono>
 #import <memory>
+#import <mutex>
+#import <string>
+#import <thread>
 #import <vector>
 
 #import <CoreAudio/CoreAudio.h>
 #import <AudioToolbox/AudioToolbox.h>
+#import <dispatch/dispatch.h>
 
+#import "SFBAlignedBufferList.hpp"
+#import "SFBBusGraph.hpp"
 #import "SFBCABufferList.hpp"
 #import "SFBCARingBuffer.hpp"
+#import "SFBCFWrapper.hpp"
+#import "SFBChannelRouter.hpp"
+#import "SFBFadeEnvelope.hpp"
 #import "SFBHALAudioDevice.hpp"
+#import "SFBLoudnessMeter.hpp"
+#import "SFBMessageQueue.hpp"
+#import "SFBMultiReaderRingBuffer.hpp"
+#import "SFBRTP.hpp"
+#import "SFBRenderKernels.hpp"
+#import "SFBVoiceRenderer.hpp"
 
 namespace SFB {
 	class AudioUnitRecorder;
+	class CAChannelLayout;
+	class CAExtAudioFile;
 }
+class SFBAudioProcessor;
+class SFBAuxiliaryOutput;
+class SFBConvolver;
+class SFBDucker;
+class SFBEchoCanceller;
+class SFBRTPReceiver;
+class SFBRenderWorkerPool;
+class SFBRTPSender;
 class SFBScheduledAudioSlice;
+class SFBSharedMemoryWriter;
+class SFBTimeStretchPlayer;
 
 class SFBAUv2IO
 {
 	
 public:
 
+	/// Audio buses on which inserts may be placed
+	enum class Bus {
+		/// Player output before mixing
+		player,
+		/// Mixer output before the output device
+		output,
+	};
+
+	/// Mixer inputs
+	enum class MixerInput : UInt32 {
+		/// The player
+		player 			= 0,
+		/// Routed input channels
+		inputMonitor 	= 1,
+		/// Network sources
+		network 		= 2,
+		/// Voices playing decoded assets
+		voices 			= 3,
+	};
+
 	/// Creates a new @c SFBAUv2IO for the default system input and output devices
 	SFBAUv2IO();
 
@@ -50,6 +98,36 @@ public:
 	SFB::HALAudioDevice InputDevice() const;
 	SFB::HALAudioDevice OutputDevice() const;
 
+	/// Returns the captured input, indexed by input sample time
+	///
+	/// Any number of @c SFBMultiReaderRingBuffer::Reader objects may consume it without copying the input again.
+	/// @note The buffer is reallocated by @c SetInputChannels(); readers must not be used across that call
+	inline const SFBMultiReaderRingBuffer& CapturedInput() const noexcept
+	{
+		return mInputRingBuffer;
+	}
+
+	/// Wall clock durations of the steps performed during construction
+	///
+	/// The input, output, mixer, and player steps run concurrently so @c mTotal is less than their sum.
+	struct StartupTimes
+	{
+		/// Input unit creation and input device queries
+		std::chrono::microseconds mInput;
+		/// Output unit creation and output device queries
+		std::chrono::microseconds mOutput;
+		std::chrono::microseconds mMixer;
+		std::chrono::microseconds mPlayer;
+		/// Mixer configuration and initialization once all units exist
+		std::chrono::microseconds mGraph;
+		std::chrono::microseconds mTotal;
+	};
+
+	inline const StartupTimes& InitializationTimes() const noexcept
+	{
+		return mStartupTimes;
+	}
+
 	void Start();
 	void StartAt(const AudioTimeStamp& timeStamp);
 	void Stop();
@@ -58,29 +136,333 @@ public:
 	bool OutputIsRunning() const;
 	bool InputIsRunning() const;
 
+	/// A file to play at a specific time
+	struct Cue
+	{
+		CFURLRef mURL;
+		AudioTimeStamp mTimeStamp;
+		/// The linear gain applied to the file
+		float mGain;
+		/// The length of an equal-power fade at the start of the file, or zero
+		UInt32 mFadeInFrames;
+		/// The length of an equal-power fade at the end of the file, or zero
+		///
+		/// Overlapping a cue's fade-out with the next cue's fade-in of the same length crossfades between them.
+		UInt32 mFadeOutFrames;
+	};
+
 	void Play(CFURLRef url);
 	void PlayAt(CFURLRef url, const AudioTimeStamp& timeStamp);
 
+	/// Schedules every cue in @c cues
+	///
+	/// Each distinct file is decoded once and the player state is checked once for the whole batch.
+	/// Cues are scheduled in time order if every cue has a valid sample time, and in the given order otherwise.
+	void PlayAtBatch(const std::vector<Cue>& cues);
+
+	/// Fades out the player over @c fadeOutFrames frames and then cancels everything scheduled
+	///
+	/// Unlike @c Stop() this leaves the input and output running. This returns once the fade is queued.
+	void CancelPlayback(UInt32 fadeOutFrames);
+	/// Fades out the player over @c fadeOutFrames frames beginning at the player sample time in @c timeStamp and then cancels everything scheduled
+	///
+	/// The fade begins at the start of the next render cycle if @c timeStamp has no valid sample time.
+	/// This returns once the fade is queued and the player is reset on a background queue after the fade finishes.
+	/// Scheduling cues before then cuts the fade short and resets the player first so the new cues play.
+	void CancelPlaybackAt(const AudioTimeStamp& timeStamp, UInt32 fadeOutFrames);
+
+	/// Decodes @c url in the player format for playback by voices
+	std::shared_ptr<const SFBAudioAsset> LoadAsset(CFURLRef url);
+	/// Returns the voices mixed into the voices mixer input
+	///
+	/// Voice sample times are in the same timeline as cue sample times.
+	inline SFBVoiceRenderer& Voices() noexcept
+	{
+		return *mVoiceRenderer;
+	}
+
+	/// Plays @c asset at @c tempo without changing its pitch, stretched on a background thread as it plays
+	///
+	/// Playback starts at the sample time in @c timeStamp, or with the next render cycle if it has no valid sample time,
+	/// and is mixed into the voices mixer input. The tempo may be changed while playing through the returned object.
+	/// @note Use @c SFBTimeStretcher::Stretch() to stretch an asset ahead of time instead
+	std::shared_ptr<SFBTimeStretchPlayer> PlayStretched(std::shared_ptr<const SFBAudioAsset> asset, double tempo, const AudioTimeStamp& timeStamp);
+	void StopStretched(const std::shared_ptr<SFBTimeStretchPlayer>& player);
+
 	void GetInputFormat(AudioStreamBasicDescription& format);
 	void GetPlayerFormat(AudioStreamBasicDescription& format);
 	void GetOutputFormat(AudioStreamBasicDescription& format);
 
+	/// Captures only the input device channels in @c channels, in order
+	///
+	/// Input buffers are sized for the selected channels, and only those channels are copied from the device each cycle.
+	/// Input channel indexes used elsewhere, such as in input monitor routes, refer to the selected channels.
+	/// Input monitor routes and the input recording are cleared.
+	/// @param channels The device channels to capture, or empty to capture every channel
+	/// @throw @c std::logic_error if called while running
+	/// @throw @c std::out_of_range if a channel does not exist on the input device
+	void SetInputChannels(const std::vector<UInt32>& channels);
+	/// Returns the captured input device channels, or an empty vector if every channel is captured
+	std::vector<UInt32> InputChannels() const;
+
 	void SetInputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format);
 	void SetPlayerRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format);
+	/// Records the output to @c url
+	///
+	/// If the output fails over to the standby device the recording continues in a new file next to @c url
+	/// with a numeric suffix, such as @c Recording-2.caf for @c Recording.caf.
 	void SetOutputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format);
 
+	/// Starts removing the echo of the output from the input on a background thread
+	/// @note The input and output devices must use the same sample rate
+	void EnableEchoCancellation();
+	/// Stops echo cancellation and waits for the background thread to exit
+	void DisableEchoCancellation();
+	bool EchoCancellationIsEnabled() const;
+
+	/// Reads echo-cancelled input starting at @c sampleTime in the input device's timeline
+	/// @return @c true on success, @c false if the requested frames are not available
+	bool ReadCleanedInput(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime);
+	/// Records echo-cancelled input to @c url
+	void SetCleanedInputRecordingURL(CFURLRef url, AudioFileTypeID fileType, const AudioStreamBasicDescription& format);
+
+	/// Returns the format of the audio passed to inserts on @c bus
+	void GetBusFormat(Bus bus, AudioStreamBasicDescription& format);
+
+	/// Sets the linear gain of @c input on the render thread
+	void SetMixerInputVolume(MixerInput input, float volume);
+	/// Sets the linear gain of the mix on the render thread
+	void SetMixerOutputVolume(float volume);
+
+	/// Mixes the mixer inputs through a tree of submix buses in place of the mixer unit
+	///
+	/// Bus sources are @c MixerInput values and mixer inputs not assigned to a bus are not rendered.
+	/// Mixer input and output volumes do not apply while buses are set. An empty list restores the mixer unit.
+	/// @throw @c std::invalid_argument if the buses are invalid
+	void SetBuses(const std::vector<SFBBus>& buses);
+	/// @throw @c std::invalid_argument if no bus is named @c name
+	void SetBusGain(const std::string& name, float gain);
+	/// @throw @c std::invalid_argument if no bus is named @c name
+	void SetBusMuted(const std::string& name, bool muted);
+	/// Renders buses summed directly into the master on @c threadCount real-time worker threads in addition to the output thread
+	///
+	/// Mixer inputs on different branches are rendered concurrently, so no more tasks run in parallel than there are mixer inputs;
+	/// the voices on the voices input are rendered serially. Zero renders every bus on the output thread.
+	void SetRenderThreadCount(size_t threadCount);
+
+	/// Appends @c processor to the inserts on @c bus
+	void AddInsert(Bus bus, std::shared_ptr<SFBAudioProcessor> processor);
+	/// Removes @c processor from the inserts on @c bus
+	void RemoveInsert(Bus bus, const std::shared_ptr<SFBAudioProcessor>& processor);
+	/// Removes all inserts from @c bus
+	void RemoveAllInserts(Bus bus);
+	/// Returns the total latency in frames of the inserts on @c bus
+	UInt32 InsertLatency(Bus bus) const;
+
+	/// Appends a convolver using the impulse response in @c url to the inserts on @c bus
+	///
+	/// The convolver's head partition is sized from the output device buffer size and its latency is included in @c InsertLatency().
+	std::shared_ptr<SFBConvolver> AddConvolution(Bus bus, CFURLRef url);
+
+	/// Adds an output device playing the same mix as the output device
+	///
+	/// The mix is rendered once for the output device, which is the master clock, and resampled to follow each added device's clock.
+	/// The master can't be changed to an added device; construct with a different @c outputDeviceID to clock the mix from another device.
+	void AddOutputDevice(AudioObjectID deviceID);
+	void RemoveOutputDevice(AudioObjectID deviceID);
+	std::vector<SFB::HALAudioDevice> AdditionalOutputDevices() const;
+
+	/// Routes input channels to the input monitor mixer bus, which has the player's channel count
+	///
+	/// Routes are sparse so only connected channels are processed. An empty route list disables input monitoring.
+	/// @note The input device and player must use the same sample rate
+	void SetInputMonitorRoutes(const std::vector<SFBChannelRoute>& routes);
+
+	/// Reduces the player bus level while the input level exceeds @c threshold dBFS
+	///
+	/// The input is read from the captured input at the time it is heard, so the reduction follows the through latency.
+	/// @param reduction The gain reduction in dB
+	/// @param attackTime The time in seconds to duck once the input exceeds the threshold
+	/// @param releaseTime The time in seconds to recover once the input falls below the threshold
+	/// @note The input device and player must use the same sample rate
+	void EnableDucking(float threshold, float reduction, double attackTime = 0.01, double releaseTime = 0.5);
+	void DisableDucking();
+	/// Returns the linear gain most recently applied to the player bus by ducking
+	float DuckingGain() const;
+
+	/// Maps mixer output channels to output device channels
+	/// @param channelMap For each output device channel, the mixer output channel played on it or @c -1 for silence
+	void SetOutputChannelMap(const std::vector<SInt32>& channelMap);
+	/// Maps mixer output channels to output device channels by matching channel labels
+	void SetOutputChannelMap(const SFB::CAChannelLayout& mixLayout, const SFB::CAChannelLayout& deviceLayout);
+	std::vector<SInt32> OutputChannelMap() const;
+
+	/// Measures the loudness and true peak of the output mix following ITU-R BS.1770 and EBU R 128
+	/// @param channelWeights The weight of each output channel, or empty to weight channels by the output device's preferred layout:
+	/// @c 0 for LFE, @c 1.41 for surrounds, and @c 1 for other or unknown channels
+	/// @throw @c std::invalid_argument if @c channelWeights does not match the output channel count
+	void EnableLoudnessMeter(const std::vector<double>& channelWeights = {});
+	void DisableLoudnessMeter();
+	/// Returns the most recent loudness measurements, all negative infinity if the meter is disabled
+	SFBLoudnessMeter::Measurements LoudnessMeasurements() const;
+	/// Restarts the integrated loudness and true peak
+	void ResetLoudnessMeter();
+
+	/// Publishes the output mix to other processes through the POSIX shared memory object @c name
+	///
+	/// Other processes read the mix with @c SFBSharedMemoryReader without opening the output device.
+	void EnableSharedMemoryOutput(const std::string& name);
+	void DisableSharedMemoryOutput();
+
+	/// Streams the output mix to @c host as RTP over UDP
+	/// @param packetTime The duration of audio in each packet, in seconds
+	std::shared_ptr<SFBRTPSender> AddRTPSender(const std::string& host, uint16_t port, SFBRTPEncoding encoding, double packetTime);
+	void RemoveRTPSender(const std::shared_ptr<SFBRTPSender>& sender);
+
+	/// Mixes RTP audio received on @c port into the network mixer bus
+	/// @note The stream must use the player's sample rate
+	std::shared_ptr<SFBRTPReceiver> AddRTPReceiver(uint16_t port, SFBRTPEncoding encoding, UInt32 channelCount);
+	void RemoveRTPReceiver(const std::shared_ptr<SFBRTPReceiver>& receiver);
+
+	/// Prepares an output unit on @c deviceID to take over if the current output device disappears
+	///
+	/// The standby unit is created and initialized ahead of time so failing over only requires starting it.
+	/// The output timeline continues across the switch so scheduled slices keep their times on the standby device.
+	/// Once used the standby unit must be enabled again to fail over a second time.
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::runtime_error
+	void EnableStandbyOutput(AudioObjectID deviceID);
+	void DisableStandbyOutput();
+	bool HasStandbyOutput() const;
+
+	/// Handles the loss of the output device as if it had been disconnected
+	/// @note This allows failover to be exercised without removing hardware
+	void SimulateOutputDeviceLoss();
+
 private:
 
+	using AuxiliaryOutputList = std::vector<std::shared_ptr<SFBAuxiliaryOutput>>;
+	using RTPSenderList = std::vector<std::shared_ptr<SFBRTPSender>>;
+	using RTPReceiverList = std::vector<std::shared_ptr<SFBRTPReceiver>>;
+	using TimeStretchPlayerList = std::vector<std::shared_ptr<SFBTimeStretchPlayer>>;
+
+	using InsertChain = std::vector<std::shared_ptr<SFBAudioProcessor>>;
+	static constexpr size_t kBusCount = 2;
+
 	void Initialize(AudioObjectID inputDeviceID, AudioObjectID outputDeviceID);
 
 	void CreateInputAU(AudioObjectID inputDeviceID);
-	void CreateOutputAU(AudioObjectID outputDeviceID);
+	void AllocateInputBuffers(const AudioStreamBasicDescription& format);
+	/// Returns a new initialized output unit for @c outputDeviceID rendering from @c OutputRenderCallback
+	/// @param format The input format to use instead of the unit's default, or @c nullptr
+	AudioUnit CreateOutputAU(AudioObjectID outputDeviceID, const AudioStreamBasicDescription *format = nullptr);
 	void CreateMixerAU();
 	void CreatePlayerAU();
 	void BuildGraph();
 
+	UInt32 MaximumFramesPerSlice() const;
+
+	/// The completion state of a command submitted with @c wait, shared by the submitting thread and the reply
+	struct RenderCompletion
+	{
+		RenderCompletion()
+		: mCompleted(false), mReferenceCount(2)
+		{}
+
+		/// Releases one of the two references, freeing the state once both the waiter and the reply handler are done with it
+		inline void Release() noexcept
+		{
+			if(mReferenceCount.fetch_sub(1) == 1)
+				delete this;
+		}
+
+		std::atomic_bool mCompleted;
+		std::atomic_uint mReferenceCount;
+	};
+
+	/// A request from a control thread, applied by the render thread between render cycles
+	struct RenderCommand
+	{
+		enum class Type {
+			/// Replaces the value in @c mSlot with @c mValue
+			exchange,
+			/// Sets the gain of mixer input @c mElement to @c mVolume
+			setMixerInputVolume,
+			/// Sets the mixer output gain to @c mVolume
+			setMixerOutputVolume,
+		};
+
+		Type mType;
+		void *mSlot;
+		void *mValue;
+		void (*mExchange)(void *slot, void *value, void **previous);
+		void (*mDispose)(void *value);
+		UInt32 mElement;
+		float mVolume;
+		/// Marked once the command has been applied and its reply handled, if not @c nullptr
+		RenderCompletion *mCompletion;
+	};
+
+	/// The result of a @c RenderCommand returned to the control threads
+	struct RenderReply
+	{
+		/// Frees @c mValue, if not @c nullptr
+		void (*mDispose)(void *value);
+		void *mValue;
+		RenderCompletion *mCompletion;
+	};
+
+	/// A fade applied to the player output before cancelling playback
+	struct PlayerFade
+	{
+		PlayerFade(UInt32 frameCount, Float64 startSampleTime)
+		: mEnvelope(frameCount, SFBFadeEnvelope::Direction::out), mStartSampleTime(startSampleTime), mPosition(0), mFinished(false)
+		{}
+
+		SFBFadeEnvelope mEnvelope;
+		/// The output sample time at which the fade begins, or a negative value to begin immediately
+		Float64 mStartSampleTime;
+		/// The number of envelope frames applied, accessed only by the render thread
+		UInt32 mPosition;
+		/// Set by the render thread once the player output is silent
+		std::atomic_bool mFinished;
+	};
+
+	/// Makes @c value visible to the render thread through @c slot and frees the previous value once the render thread is done with it
+	template <typename T>
+	void Publish(std::atomic<T *>& slot, std::unique_ptr<T> value);
+	/// Enqueues @c command for the render thread
+	///
+	/// Waits at most a few output buffer durations for a free reply slot.
+	/// @return The completion to pass to @c WaitForRenderCommand() if @c wait, otherwise @c nullptr
+	/// @throw @c std::runtime_error if the render thread has stopped consuming commands; @c command was not queued
+	RenderCompletion * SubmitRenderCommand(RenderCommand command, bool wait);
+	/// Waits at most a few output buffer durations for the command submitted with @c completion to be applied, then releases @c completion
+	/// @throw @c std::runtime_error if the render thread did not apply the command in time; it is still applied once rendering resumes or output stops
+	void WaitForRenderCommand(RenderCompletion *completion);
+	/// Returns the time to wait for the render thread before assuming the output device has stalled
+	std::chrono::nanoseconds RenderCommandTimeout() const;
+	/// Applies at most @c maximumCount pending commands
+	/// @note This is called at the start of each output render cycle, or from a control thread holding @c mOutputUnitLock while output is stopped
+	void ProcessRenderCommands(UInt32 maximumCount) noexcept;
+	/// Handles replies from the render thread
+	void DrainRenderReplies();
+	/// Processes @c bufferList through @c chain, skipping the chain once its tail has decayed after silent input
+	/// @param isSilent Whether @c bufferList contains silence
+	/// @param silentFrameCount The number of consecutive silent frames processed by @c chain
+	/// @return Whether @c bufferList contains silence after processing
+	static bool ProcessInserts(const InsertChain *chain, AudioBufferList *bufferList, UInt32 frameCount, bool isSilent, UInt64& silentFrameCount) noexcept;
+	/// Returns true if no mixer input can produce sound in this render cycle
+	bool MixerInputsAreSilent() const noexcept;
+
+	OSStatus RenderInputMonitor(AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept;
+	OSStatus RenderNetworkInput(AudioUnitRenderActionFlags *ioActionFlags, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept;
+	OSStatus RenderVoices(AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inNumberFrames, AudioBufferList *ioData) noexcept;
+
 	UInt32 MinimumInputLatency() const;
 	UInt32 MinimumOutputLatency() const;
+	/// Returns the BS.1770 weight of each output mix channel from the labels of the device channels it feeds
+	std::vector<double> DefaultLoudnessWeights(UInt32 channelCount) const;
 	inline UInt32 MinimumThroughLatency() const
 	{
 		return MinimumOutputLatency() + MinimumInputLatency();
@@ -89,26 +471,175 @@ private:
 	std::unique_ptr<SFB::AudioUnitRecorder> mInputRecorder;
 	std::unique_ptr<SFB::AudioUnitRecorder> mPlayerRecorder;
 	std::unique_ptr<SFB::AudioUnitRecorder> mOutputRecorder;
+	/// The output recording settings, used to continue the recording after failover
+	SFB::CFURL mOutputRecordingURL;
+	AudioFileTypeID mOutputRecordingFileType;
+	AudioStreamBasicDescription mOutputRecordingFormat;
+	/// The number of files the output recording has been written to
+	UInt32 mOutputRecordingSegmentCount;
 
 	AudioUnit mInputUnit;
 	AudioUnit mPlayerUnit;
 	AudioUnit mMixerUnit;
 	AudioUnit mOutputUnit;
+	/// Held while the output unit is started, stopped, or replaced and while a control thread applies render commands
+	/// @note This lock is always taken last
+	mutable std::recursive_mutex mOutputUnitLock;
+
+	StartupTimes mStartupTimes;
 
 	std::atomic<double> mFirstInputSampleTime;
 	std::atomic<double> mFirstOutputSampleTime;
 	Float64 mThroughLatency;
-
-	SFB::CABufferList mInputBufferList;
-	SFB::CARingBuffer mInputRingBuffer;
+	/// The output device's share of @c mThroughLatency
+	UInt32 mOutputLatency;
+
+	SFBAlignedBufferList mInputBufferList;
+	/// Captured input, shared by the input monitor, echo cancellation, and any other readers
+	SFBMultiReaderRingBuffer mInputRingBuffer;
+
+	/// Output rendered by the mixer, used as the echo reference
+	SFB::CARingBuffer mOutputRingBuffer;
+
+	std::unique_ptr<SFBEchoCanceller> mEchoCanceller;
+	std::atomic_bool mEchoCancellationIsEnabled;
+	std::thread mEchoCancellationThread;
+	dispatch_semaphore_t mEchoCancellationSemaphore;
+	SFB::CARingBuffer mCleanedInputRingBuffer;
+
+	std::mutex mCleanedInputRecorderLock;
+	std::unique_ptr<SFB::CAExtAudioFile> mCleanedInputRecorder;
+
+	void EchoCancellationThreadEntry();
+
+	/// Insert chains indexed by @c Bus, read by the render thread and replaced as a whole by the control thread
+	std::atomic<InsertChain *> mInserts [kBusCount];
+	mutable std::mutex mInsertLock;
+	/// Consecutive silent frames seen by each insert chain, accessed only by the render thread
+	UInt64 mInsertSilentFrameCounts [kBusCount];
+
+	/// The number of slices scheduled on the player and not yet completed
+	std::atomic_uint mPendingSliceCount;
+	/// Whether the player recorder is running, in which case the player is rendered while idle
+	std::atomic_bool mPlayerIsRecorded;
+	/// A fade to apply to the player output, if any
+	std::atomic<PlayerFade *> mPlayerFade;
+	std::mutex mPlayerFadeLock;
+	/// Waits for fades to finish so the player can be reset
+	dispatch_queue_t mPlayerFadeQueue;
+	/// Entered while a check for the end of a fade is scheduled on @c mPlayerFadeQueue
+	dispatch_group_t mPlayerFadeGroup;
+	/// Odd while the render thread is rendering the player
+	std::atomic_uint64_t mPlayerRenderGeneration;
+	/// The output sample time of the most recent player render
+	std::atomic<Float64> mPlayerRenderSampleTime;
+
+	/// Control to render thread requests
+	SFBMessageQueue<RenderCommand> mRenderCommands;
+	/// Render to control thread replies, one per command
+	SFBMessageQueue<RenderReply> mRenderReplies;
+	/// The number of commands submitted whose replies have not been handled, which never exceeds the reply queue capacity
+	std::atomic_uint mOutstandingRenderCommandCount;
+
+	/// Additional output devices fed from the output render callback
+	std::atomic<AuxiliaryOutputList *> mAuxiliaryOutputs;
+	mutable std::mutex mAuxiliaryOutputLock;
+
+	/// Routes from the input ring buffer to the input monitor mixer bus
+	std::atomic<SFBChannelRouter *> mInputMonitorRouter;
+	std::mutex mInputMonitorLock;
+	SFBMultiReaderRingBuffer::Reader mInputMonitorReader;
+	/// Input read from the ring buffer for the input monitor mixer bus
+	SFBAlignedBufferList mInputMonitorBufferList;
+
+	/// Submix buses used in place of the mixer unit, if any
+	std::atomic<SFBBusGraph *> mBusGraph;
+	std::mutex mBusGraphLock;
+	/// The buses in @c mBusGraph with their current gains and mutes, requires @c mBusGraphLock
+	std::vector<SFBBus> mBuses;
+	/// Threads shared by bus graphs for rendering branches, requires @c mBusGraphLock
+	std::shared_ptr<SFBRenderWorkerPool> mRenderWorkers;
+	/// Compiles and publishes @c mBuses, requires @c mBusGraphLock
+	void PublishBusGraph();
+
+	/// Gain reduction of the player bus driven by the input
+	std::atomic<SFBDucker *> mDucker;
+	mutable std::mutex mDuckerLock;
+	SFBMultiReaderRingBuffer::Reader mDuckerReader;
+	/// Input read from the ring buffer as the ducking sidechain
+	SFBAlignedBufferList mDuckerBufferList;
+
+	/// Measures the output delivered to the device
+	std::atomic<SFBLoudnessMeter *> mLoudnessMeter;
+	mutable std::mutex mLoudnessMeterLock;
+
+	/// Publishes output to other processes
+	std::atomic<SFBSharedMemoryWriter *> mSharedMemoryOutput;
+	std::mutex mSharedMemoryOutputLock;
+
+	/// Network streams fed from the output render callback
+	std::atomic<RTPSenderList *> mRTPSenders;
+	std::mutex mRTPSenderLock;
+
+	/// Network sources mixed into the network mixer bus
+	std::atomic<RTPReceiverList *> mRTPReceivers;
+	std::mutex mRTPReceiverLock;
+	SFBAlignedBufferList mNetworkBufferList;
+
+	/// Voices mixed into the voices mixer bus
+	std::unique_ptr<SFBVoiceRenderer> mVoiceRenderer;
+	/// Time-stretched assets mixed into the voices mixer bus
+	std::atomic<TimeStretchPlayerList *> mTimeStretchPlayers;
+	std::mutex mTimeStretchPlayerLock;
+	SFBAlignedBufferList mVoicesBufferList;
+
+	/// Buffer kernels for the output unit's input format
+	SFBRenderKernels mOutputKernels;
+	/// Buffer kernels for the player and mixer input format
+	SFBRenderKernels mPlayerKernels;
+
+	/// Replaces the output unit with the standby unit
+	void FailOverToStandbyOutput();
+	/// Watches the output device for disconnection, requires @c mStandbyOutputLock
+	void StartMonitoringOutputDevice();
+	/// Requires @c mStandbyOutputLock
+	void StopMonitoringOutputDevice();
+	static OSStatus OutputDeviceIsAliveChanged(AudioObjectID inObjectID, UInt32 inNumberAddresses, const AudioObjectPropertyAddress *inAddresses, void *inClientData);
+	static void FailoverProc(void *context);
+
+	/// Converts a player sample time to an output sample time, or returns a negative value if the player hasn't started
+	Float64 OutputSampleTimeForPlayerSampleTime(Float64 sampleTime);
+	/// Resets the player once the fade in @c mPlayerFade has finished, or checks again later
+	static void FinishPlayerFadeProc(void *context);
+
+	/// An initialized, stopped output unit on the backup device
+	AudioUnit mStandbyOutputUnit;
+	/// The output device with a listener installed, if any
+	AudioObjectID mMonitoredOutputDeviceID;
+	mutable std::mutex mStandbyOutputLock;
+	/// Serializes failover away from the HAL notification thread
+	dispatch_queue_t mFailoverQueue;
+	/// Set when the output timeline must be carried forward onto a new device
+	std::atomic_bool mOutputTimelineIsDiscontinuous;
+	/// Added to output device sample times to produce the output timeline, accessed only by the render thread
+	Float64 mOutputSampleTimeOffset;
+	/// The output timeline sample time following the last render cycle, accessed only by the render thread
+	Float64 mNextOutputSampleTime;
 
 	static OSStatus InputRenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData);
 	static OSStatus OutputRenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData);
 
 	static OSStatus MixerInputRenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData);
+	/// Renders a mixer input for the bus graph
+	static bool RenderBusGraphSource(void *context, UInt32 source, const AudioTimeStamp *timeStamp, AudioBufferList *bufferList, UInt32 frameCount);
+
+	/// Claims @c count available slices, growing the pool if necessary
+	std::vector<SFBScheduledAudioSlice *> AcquireScheduledAudioSlices(size_t count);
+
+	/// Slice storage; slices are never destroyed before the player so their addresses are stable
+	std::vector<std::unique_ptr<SFBScheduledAudioSlice>> mScheduledAudioSlices;
+	std::mutex mScheduledAudioSliceLock;
 
-	SFBScheduledAudioSlice *mScheduledAudioSlices;
-	
 	static void ScheduledAudioSliceCompletionProc(void *userData, ScheduledAudioSlice *slice);
 
 };
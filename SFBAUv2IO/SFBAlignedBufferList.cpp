@@ -0,0 +1,181 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBAlignedBufferList.hpp"
+
+#import <cstdlib>
+#import <cstring>
+#import <utility>
+
+#import <sys/mman.h>
+#if __APPLE__
+#import <mach/vm_statistics.h>
+#endif
+
+namespace {
+
+/// The virtual memory page size assumed when padding buffer strides
+const size_t kPageSize = 4096;
+
+inline size_t RoundUp(size_t value, size_t multiple) noexcept
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+/// Maps @c size bytes backed by huge pages if possible, returning @c nullptr on failure
+void * MapHugePages(size_t size, bool& usesHugePages) noexcept
+{
+#if __APPLE__
+	auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+	if(memory != MAP_FAILED) {
+		usesHugePages = true;
+		return memory;
+	}
+#elif __linux__
+	auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(memory != MAP_FAILED) {
+		usesHugePages = true;
+		return memory;
+	}
+
+	// Without a reserved huge page pool fall back to transparent huge pages
+	memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(memory != MAP_FAILED) {
+		usesHugePages = madvise(memory, size, MADV_HUGEPAGE) == 0;
+		return memory;
+	}
+#endif
+	return nullptr;
+}
+
+}
+
+SFBAlignedBufferList::SFBAlignedBufferList() noexcept
+: mBufferList(nullptr), mFrameCapacity(0), mFrameLength(0), mSize(0), mIsMapped(false), mUsesHugePages(false)
+{}
+
+SFBAlignedBufferList::~SFBAlignedBufferList()
+{
+	Deallocate();
+}
+
+SFBAlignedBufferList::SFBAlignedBufferList(SFBAlignedBufferList&& rhs) noexcept
+: mBufferList(rhs.mBufferList), mFormat(rhs.mFormat), mFrameCapacity(rhs.mFrameCapacity), mFrameLength(rhs.mFrameLength), mSize(rhs.mSize), mIsMapped(rhs.mIsMapped), mUsesHugePages(rhs.mUsesHugePages)
+{
+	rhs.mBufferList = nullptr;
+	rhs.mFrameCapacity = 0;
+	rhs.mFrameLength = 0;
+	rhs.mSize = 0;
+}
+
+SFBAlignedBufferList& SFBAlignedBufferList::operator=(SFBAlignedBufferList&& rhs) noexcept
+{
+	if(this != &rhs) {
+		Deallocate();
+
+		mBufferList = rhs.mBufferList;
+		mFormat = rhs.mFormat;
+		mFrameCapacity = rhs.mFrameCapacity;
+		mFrameLength = rhs.mFrameLength;
+		mSize = rhs.mSize;
+		mIsMapped = rhs.mIsMapped;
+		mUsesHugePages = rhs.mUsesHugePages;
+
+		rhs.mBufferList = nullptr;
+		rhs.mFrameCapacity = 0;
+		rhs.mFrameLength = 0;
+		rhs.mSize = 0;
+	}
+	return *this;
+}
+
+bool SFBAlignedBufferList::Allocate(const AudioStreamBasicDescription& format, UInt32 frameCapacity, size_t alignment, bool useHugePages) noexcept
+{
+	if(alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+		return false;
+
+	Deallocate();
+
+	SFB::CAStreamBasicDescription bufferFormat(format);
+	const UInt32 bufferCount = bufferFormat.IsNonInterleaved() ? bufferFormat.ChannelCount() : 1;
+	const UInt32 channelsPerBuffer = bufferFormat.IsNonInterleaved() ? 1 : bufferFormat.ChannelCount();
+	if(bufferCount == 0 || bufferFormat.mBytesPerFrame == 0)
+		return false;
+
+	const size_t headerSize = RoundUp(offsetof(AudioBufferList, mBuffers) + sizeof(AudioBuffer) * bufferCount, alignment);
+	const size_t bufferSize = static_cast<size_t>(frameCapacity) * bufferFormat.mBytesPerFrame;
+	auto bufferStride = RoundUp(bufferSize, alignment);
+	if(bufferCount > 1 && bufferStride % kPageSize == 0)
+		bufferStride += RoundUp(kCacheLineSize, alignment);
+
+	auto size = headerSize + bufferStride * bufferCount;
+
+	void *memory = nullptr;
+	if(useHugePages && size >= kHugePageSize) {
+		size = RoundUp(size, kHugePageSize);
+		memory = MapHugePages(size, mUsesHugePages);
+		mIsMapped = memory != nullptr;
+	}
+
+	if(!memory) {
+		if(posix_memalign(&memory, alignment, size) != 0)
+			return false;
+		mIsMapped = false;
+		mUsesHugePages = false;
+	}
+
+	std::memset(memory, 0, size);
+
+	mBufferList = static_cast<AudioBufferList *>(memory);
+	mBufferList->mNumberBuffers = bufferCount;
+	auto data = static_cast<unsigned char *>(memory) + headerSize;
+	for(UInt32 i = 0; i < bufferCount; ++i) {
+		mBufferList->mBuffers[i].mNumberChannels = channelsPerBuffer;
+		mBufferList->mBuffers[i].mData = data + i * bufferStride;
+		mBufferList->mBuffers[i].mDataByteSize = static_cast<UInt32>(bufferSize);
+	}
+
+	mFormat = bufferFormat;
+	mFrameCapacity = frameCapacity;
+	mFrameLength = frameCapacity;
+	mSize = size;
+
+	return true;
+}
+
+void SFBAlignedBufferList::Deallocate() noexcept
+{
+	if(!mBufferList)
+		return;
+
+	if(mIsMapped)
+		munmap(mBufferList, mSize);
+	else
+		std::free(mBufferList);
+
+	mBufferList = nullptr;
+	mFrameCapacity = 0;
+	mFrameLength = 0;
+	mSize = 0;
+	mIsMapped = false;
+	mUsesHugePages = false;
+}
+
+void SFBAlignedBufferList::Reset() noexcept
+{
+	SetFrameLength(mFrameCapacity);
+}
+
+bool SFBAlignedBufferList::SetFrameLength(UInt32 frameLength) noexcept
+{
+	if(!mBufferList || frameLength > mFrameCapacity)
+		return false;
+
+	mFrameLength = frameLength;
+	for(UInt32 i = 0; i < mBufferList->mNumberBuffers; ++i)
+		mBufferList->mBuffers[i].mDataByteSize = frameLength * mFormat.mBytesPerFrame;
+
+	return true;
+}
@@ -0,0 +1,101 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <cstddef>
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+/// An audio buffer list whose buffers are aligned and share a single allocation
+///
+/// The @c AudioBufferList header and each buffer start on an @c alignment boundary, and each buffer is padded to a
+/// multiple of @c alignment so no two buffers, nor a buffer and the header, share a cache line. Buffers whose stride
+/// would be a multiple of the page size are padded by one more cache line to avoid aliasing between channels.
+/// Large allocations may request huge pages, falling back to regular pages when unavailable.
+class SFBAlignedBufferList
+{
+
+public:
+
+	/// The size of a cache line, and the default alignment
+	static constexpr size_t kCacheLineSize = 64;
+	/// The huge page size; allocations smaller than this never use huge pages
+	static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+	SFBAlignedBufferList() noexcept;
+
+	// This class is non-copyable
+	SFBAlignedBufferList(const SFBAlignedBufferList& rhs) = delete;
+
+	// This class is non-assignable
+	SFBAlignedBufferList& operator=(const SFBAlignedBufferList& rhs) = delete;
+
+	~SFBAlignedBufferList();
+
+	SFBAlignedBufferList(SFBAlignedBufferList&& rhs) noexcept;
+	SFBAlignedBufferList& operator=(SFBAlignedBufferList&& rhs) noexcept;
+
+
+	/// Allocates space for @c frameCapacity frames in @c format
+	/// @param alignment The alignment of the header and each buffer, a power of two no smaller than @c sizeof(void *)
+	/// @param useHugePages Whether to back allocations of at least @c kHugePageSize with huge pages if possible
+	/// @return @c true on success
+	bool Allocate(const AudioStreamBasicDescription& format, UInt32 frameCapacity, size_t alignment = kCacheLineSize, bool useHugePages = false) noexcept;
+	void Deallocate() noexcept;
+
+	/// Sets the frame length to the frame capacity
+	void Reset() noexcept;
+
+	/// Sets the byte size of each buffer to hold @c frameLength frames
+	/// @return @c false if @c frameLength exceeds the capacity
+	bool SetFrameLength(UInt32 frameLength) noexcept;
+
+	inline UInt32 FrameLength() const noexcept
+	{
+		return mFrameLength;
+	}
+
+	inline UInt32 FrameCapacity() const noexcept
+	{
+		return mFrameCapacity;
+	}
+
+	inline const SFB::CAStreamBasicDescription& Format() const noexcept
+	{
+		return mFormat;
+	}
+
+	/// Returns @c true if the allocation is backed by huge pages
+	inline bool UsesHugePages() const noexcept
+	{
+		return mIsMapped && mUsesHugePages;
+	}
+
+	inline operator AudioBufferList *() const noexcept
+	{
+		return mBufferList;
+	}
+
+	inline explicit operator bool() const noexcept
+	{
+		return mBufferList != nullptr;
+	}
+
+private:
+
+	AudioBufferList *mBufferList;
+	SFB::CAStreamBasicDescription mFormat;
+	UInt32 mFrameCapacity;
+	UInt32 mFrameLength;
+	/// The size of the allocation in bytes
+	size_t mSize;
+	/// Whether the allocation came from @c mmap() rather than @c posix_memalign()
+	bool mIsMapped;
+	bool mUsesHugePages;
+
+};
@@ -0,0 +1,28 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBAudioAsset.hpp"
+
+#import <cstring>
+#import <new>
+#import <stdexcept>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+SFBAudioAsset::SFBAudioAsset(const AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleRate)
+: mFrameLength(frameCount)
+{
+	if(!bufferList || bufferList->mNumberBuffers == 0 || frameCount == 0)
+		throw std::invalid_argument("Empty asset");
+
+	SFB::CAStreamBasicDescription format(SFB::CommonPCMFormat::float32, sampleRate, bufferList->mNumberBuffers, false);
+	if(!mBuffers.Allocate(format, kGuardFrameCount + frameCount + kGuardFrameCount))
+		throw std::bad_alloc();
+
+	// The buffers are zeroed when allocated, which provides the guard frames
+	const AudioBufferList *storage = mBuffers;
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+		std::memcpy(static_cast<float *>(storage->mBuffers[i].mData) + kGuardFrameCount, bufferList->mBuffers[i].mData, frameCount * sizeof(float));
+}
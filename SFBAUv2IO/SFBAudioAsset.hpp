@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBAlignedBufferList.hpp"
+
+/// Immutable decoded audio shared by any number of voices
+///
+/// Samples are deinterleaved 32-bit float. Each channel is surrounded by silent guard frames so interpolating readers may
+/// look before the first frame and past the last frame without a bounds check.
+class SFBAudioAsset
+{
+
+public:
+
+	/// The number of silent frames preceding and following the audio in each channel
+	static constexpr UInt32 kGuardFrameCount = 4;
+
+	/// Creates a new @c SFBAudioAsset with a copy of @c frameCount frames of @c bufferList
+	/// @param bufferList Deinterleaved 32-bit float audio
+	/// @param sampleRate The sample rate of @c bufferList
+	/// @throw @c std::invalid_argument if @c bufferList has no channels or frames
+	/// @throw @c std::bad_alloc
+	SFBAudioAsset(const AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleRate);
+
+	// This class is non-copyable
+	SFBAudioAsset(const SFBAudioAsset& rhs) = delete;
+
+	// This class is non-assignable
+	SFBAudioAsset& operator=(const SFBAudioAsset& rhs) = delete;
+
+	~SFBAudioAsset() = default;
+
+	// This class is non-movable
+	SFBAudioAsset(SFBAudioAsset&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBAudioAsset& operator=(SFBAudioAsset&& rhs) = delete;
+
+
+	inline UInt32 ChannelCount() const noexcept
+	{
+		return static_cast<const AudioBufferList *>(mBuffers)->mNumberBuffers;
+	}
+
+	inline UInt32 FrameLength() const noexcept
+	{
+		return mFrameLength;
+	}
+
+	inline Float64 SampleRate() const noexcept
+	{
+		return mBuffers.Format().mSampleRate;
+	}
+
+	/// Returns the samples of channel @c channel, preceded and followed by @c kGuardFrameCount zeros
+	inline const float * Channel(UInt32 channel) const noexcept
+	{
+		return static_cast<const float *>(static_cast<const AudioBufferList *>(mBuffers)->mBuffers[channel].mData) + kGuardFrameCount;
+	}
+
+private:
+
+	SFBAlignedBufferList mBuffers;
+	UInt32 mFrameLength;
+
+};
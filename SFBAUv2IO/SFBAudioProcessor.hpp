@@ -0,0 +1,38 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <CoreAudio/CoreAudio.h>
+
+/// An in-place audio processor that may be inserted on a bus
+///
+/// Inserts receive deinterleaved 32-bit float audio in the bus format and are invoked on the render thread,
+/// so @c Process() must not allocate, lock, or perform I/O.
+class SFBAudioProcessor
+{
+
+public:
+
+	virtual ~SFBAudioProcessor() = default;
+
+	/// Processes @c frameCount frames in @c bufferList in place
+	virtual void Process(AudioBufferList *bufferList, UInt32 frameCount) noexcept = 0;
+
+	/// Returns the number of frames by which @c Process() delays its input
+	virtual UInt32 Latency() const noexcept
+	{
+		return 0;
+	}
+
+	/// Returns the number of frames of output that may follow the end of non-silent input
+	///
+	/// Once this many frames of silence have been processed @c Process() may be skipped until the input is non-silent again.
+	virtual UInt64 TailFrameCount() const noexcept
+	{
+		return 0;
+	}
+
+};
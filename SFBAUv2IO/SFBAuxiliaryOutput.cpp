@@ -0,0 +1,222 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBAuxiliaryOutput.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <cstring>
+#import <new>
+#import <stdexcept>
+
+#import <os/log.h>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+/// The largest deviation from unity resampling ratio the drift servo may apply
+const double kMaximumRatioDeviation = 0.002;
+/// The servo gain, as ratio deviation per target latency of error
+const double kServoGain = 0.002;
+/// The smoothing factor applied to the buffered frame count error each render cycle
+const double kErrorSmoothing = 0.01;
+/// The ring buffer capacity in multiples of the target latency
+const UInt32 kRingBufferLatencyMultiple = 8;
+
+}
+
+SFBAuxiliaryOutput::SFBAuxiliaryOutput(AudioObjectID deviceID, const AudioStreamBasicDescription& format, UInt32 masterBufferFrameSize)
+: mOutputUnit(nullptr), mTargetLatency(0), mReadPosition(0), mRatio(1), mFilteredError(0), mPrimed(false), mUnderrunCount(0)
+{
+	if(deviceID == kAudioObjectUnknown)
+		throw std::invalid_argument("deviceID == kAudioObjectUnknown");
+
+	SFB::CAStreamBasicDescription mixFormat(format);
+	if(!mixFormat.IsFloat() || !mixFormat.IsNonInterleaved() || mixFormat.mBitsPerChannel != 32)
+		throw std::invalid_argument("format must be deinterleaved 32-bit float");
+
+#if DEBUG
+	{
+		SFB::HALAudioDevice outputDevice(deviceID);
+		auto deviceName = outputDevice.Name();
+		if(deviceName)
+			os_log_debug(OS_LOG_DEFAULT, "Using auxiliary output device %{public}@ (0x%x)", deviceName.Object(), deviceID);
+	}
+#endif
+
+	AudioComponentDescription componentDescription = {
+		.componentType 			= kAudioUnitType_Output,
+		.componentSubType 		= kAudioUnitSubType_HALOutput,
+		.componentManufacturer 	= kAudioUnitManufacturer_Apple,
+		.componentFlags 		= kAudioComponentFlag_SandboxSafe,
+		.componentFlagsMask 	= 0
+	};
+
+	auto component = AudioComponentFindNext(nullptr, &componentDescription);
+	if(!component)
+		throw std::runtime_error("kAudioUnitSubType_HALOutput missing");
+
+	auto result = AudioComponentInstanceNew(component, &mOutputUnit);
+	SFB::ThrowIfCAAudioObjectError(result, "AudioComponentInstanceNew");
+
+	try {
+		result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &deviceID, sizeof(deviceID));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_CurrentDevice)");
+
+		UInt32 startAtZero = 0;
+		result = AudioUnitSetProperty(mOutputUnit, kAudioOutputUnitProperty_StartTimestampsAtZero, kAudioUnitScope_Global, 0, &startAtZero, sizeof(startAtZero));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioOutputUnitProperty_StartTimestampsAtZero)");
+
+		// The unit converts from the master's nominal sample rate if this device's differs
+		result = AudioUnitSetProperty(mOutputUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &mixFormat, sizeof(mixFormat));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_StreamFormat)");
+
+		AURenderCallbackStruct outputCallback = {
+			.inputProc = RenderCallback,
+			.inputProcRefCon = this
+		};
+
+		result = AudioUnitSetProperty(mOutputUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &outputCallback, sizeof(outputCallback));
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitSetProperty (kAudioUnitProperty_SetRenderCallback)");
+
+		UInt32 maximumFramesPerSlice;
+		UInt32 size = sizeof(maximumFramesPerSlice);
+		result = AudioUnitGetProperty(mOutputUnit, kAudioUnitProperty_MaximumFramesPerSlice, kAudioUnitScope_Global, 0, &maximumFramesPerSlice, &size);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioUnitProperty_MaximumFramesPerSlice)");
+
+		SFB::HALAudioDevice device(deviceID);
+		mTargetLatency = 2 * (masterBufferFrameSize + device.BufferFrameSize());
+
+		if(!mRingBuffer.Allocate(mixFormat, static_cast<UInt32>(kRingBufferLatencyMultiple * mTargetLatency)))
+			throw std::bad_alloc();
+		if(!mScratch.Allocate(mixFormat, static_cast<UInt32>(std::ceil(maximumFramesPerSlice * (1 + kMaximumRatioDeviation))) + 2))
+			throw std::bad_alloc();
+
+		result = AudioUnitInitialize(mOutputUnit);
+		SFB::ThrowIfCAAudioUnitError(result, "AudioUnitInitialize");
+	}
+	catch(...) {
+		AudioComponentInstanceDispose(mOutputUnit);
+		throw;
+	}
+}
+
+SFBAuxiliaryOutput::~SFBAuxiliaryOutput()
+{
+	AudioOutputUnitStop(mOutputUnit);
+	AudioUnitUninitialize(mOutputUnit);
+	AudioComponentInstanceDispose(mOutputUnit);
+}
+
+SFB::HALAudioDevice SFBAuxiliaryOutput::Device() const
+{
+	AudioObjectID deviceID;
+	UInt32 size = sizeof(deviceID);
+	auto result = AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &deviceID, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioOutputUnitProperty_CurrentDevice)");
+	return SFB::HALAudioDevice(deviceID);
+}
+
+void SFBAuxiliaryOutput::Start()
+{
+	if(IsRunning())
+		return;
+
+	mPrimed = false;
+	auto result = AudioOutputUnitStart(mOutputUnit);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStart (mOutputUnit)");
+}
+
+void SFBAuxiliaryOutput::Stop()
+{
+	if(!IsRunning())
+		return;
+
+	auto result = AudioOutputUnitStop(mOutputUnit);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioOutputUnitStop (mOutputUnit)");
+}
+
+bool SFBAuxiliaryOutput::IsRunning() const
+{
+	UInt32 value;
+	UInt32 size = sizeof(value);
+	auto result = AudioUnitGetProperty(mOutputUnit, kAudioOutputUnitProperty_IsRunning, kAudioUnitScope_Global, 0, &value, &size);
+	SFB::ThrowIfCAAudioUnitError(result, "AudioUnitGetProperty (kAudioOutputUnitProperty_IsRunning)");
+	return value != 0;
+}
+
+void SFBAuxiliaryOutput::Write(const AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept
+{
+	if(!mRingBuffer.Write(bufferList, frameCount, sampleTime))
+		os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %lld", sampleTime);
+}
+
+OSStatus SFBAuxiliaryOutput::RenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData)
+{
+	SFBAuxiliaryOutput *THIS = static_cast<SFBAuxiliaryOutput *>(inRefCon);
+
+	auto outputSilence = [&]() {
+		*ioActionFlags = kAudioUnitRenderAction_OutputIsSilence;
+		for(UInt32 i = 0; i < ioData->mNumberBuffers; ++i)
+			std::memset(ioData->mBuffers[i].mData, 0, ioData->mBuffers[i].mDataByteSize);
+		return noErr;
+	};
+
+	int64_t startTime, endTime;
+	if(!THIS->mRingBuffer.GetTimeBounds(startTime, endTime))
+		return outputSilence();
+
+	// Wait until enough audio is buffered before following the master timeline
+	if(!THIS->mPrimed) {
+		if(endTime - startTime < THIS->mTargetLatency)
+			return outputSilence();
+		THIS->mReadPosition = endTime - THIS->mTargetLatency;
+		THIS->mFilteredError = 0;
+		THIS->mRatio = 1;
+		THIS->mPrimed = true;
+	}
+
+	const double ratio = THIS->mRatio;
+
+	// Read the master frames spanned by this cycle, plus one for interpolation
+	const auto firstFrame = static_cast<int64_t>(std::floor(THIS->mReadPosition));
+	const auto lastFrame = static_cast<int64_t>(std::floor(THIS->mReadPosition + (inNumberFrames - 1) * ratio)) + 1;
+	const auto frameCount = static_cast<UInt32>(lastFrame - firstFrame + 1);
+
+	THIS->mScratch.Reset();
+	if(frameCount > THIS->mScratch.FrameCapacity() || lastFrame >= endTime || !THIS->mRingBuffer.Read(THIS->mScratch, frameCount, firstFrame)) {
+		++THIS->mUnderrunCount;
+		THIS->mPrimed = false;
+		return outputSilence();
+	}
+
+	// Linear interpolation
+	const AudioBufferList *scratch = THIS->mScratch;
+	const auto channels = std::min(ioData->mNumberBuffers, scratch->mNumberBuffers);
+	const double offset = THIS->mReadPosition - firstFrame;
+	for(UInt32 channel = 0; channel < channels; ++channel) {
+		auto input = static_cast<const float *>(scratch->mBuffers[channel].mData);
+		auto output = static_cast<float *>(ioData->mBuffers[channel].mData);
+		double position = offset;
+		for(UInt32 i = 0; i < inNumberFrames; ++i, position += ratio) {
+			auto index = static_cast<UInt32>(position);
+			auto fraction = static_cast<float>(position - index);
+			output[i] = input[index] + fraction * (input[index + 1] - input[index]);
+		}
+	}
+	for(UInt32 channel = channels; channel < ioData->mNumberBuffers; ++channel)
+		std::memset(ioData->mBuffers[channel].mData, 0, ioData->mBuffers[channel].mDataByteSize);
+
+	THIS->mReadPosition += inNumberFrames * ratio;
+
+	// Steer the ratio to hold the buffered frame count at the target
+	auto error = (endTime - THIS->mReadPosition) - THIS->mTargetLatency;
+	THIS->mFilteredError += kErrorSmoothing * (error - THIS->mFilteredError);
+	auto deviation = kServoGain * THIS->mFilteredError / THIS->mTargetLatency;
+	THIS->mRatio = 1 + std::min(std::max(deviation, -kMaximumRatioDeviation), kMaximumRatioDeviation);
+
+	return noErr;
+}
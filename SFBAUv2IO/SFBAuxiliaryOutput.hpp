@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+
+#import <CoreAudio/CoreAudio.h>
+#import <AudioToolbox/AudioToolbox.h>
+
+#import "SFBCABufferList.hpp"
+#import "SFBCARingBuffer.hpp"
+#import "SFBHALAudioDevice.hpp"
+
+/// An additional output device that plays audio rendered for the master output device
+///
+/// The master output render callback writes each rendered block once with @c Write(), timestamped in the master
+/// device's sample timeline. This device's own render callback reads from that timeline with a fractional read position,
+/// resampling by a ratio that is continuously adjusted to hold the amount of buffered audio constant.
+/// This compensates for drift between the two device clocks without rendering the mix again.
+class SFBAuxiliaryOutput
+{
+
+public:
+
+	/// Creates a new @c SFBAuxiliaryOutput
+	/// @param deviceID The output device
+	/// @param format The deinterleaved 32-bit float format of the master output's rendered audio
+	/// @param masterBufferFrameSize The master output device's buffer size in frames
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::runtime_error
+	/// @throw @c std::bad_alloc
+	SFBAuxiliaryOutput(AudioObjectID deviceID, const AudioStreamBasicDescription& format, UInt32 masterBufferFrameSize);
+
+	// This class is non-copyable
+	SFBAuxiliaryOutput(const SFBAuxiliaryOutput& rhs) = delete;
+
+	// This class is non-assignable
+	SFBAuxiliaryOutput& operator=(const SFBAuxiliaryOutput& rhs) = delete;
+
+	~SFBAuxiliaryOutput();
+
+	// This class is non-movable
+	SFBAuxiliaryOutput(SFBAuxiliaryOutput&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBAuxiliaryOutput& operator=(SFBAuxiliaryOutput&& rhs) = delete;
+
+
+	SFB::HALAudioDevice Device() const;
+
+	void Start();
+	void Stop();
+	bool IsRunning() const;
+
+	/// Stores @c frameCount frames rendered for the master output at @c sampleTime in the master device's timeline
+	/// @note This is called from the master output's render callback
+	void Write(const AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept;
+
+	/// Returns the current resampling ratio of master frames consumed per output frame
+	inline double Ratio() const noexcept
+	{
+		return mRatio;
+	}
+
+	/// Returns the number of times this device ran out of buffered audio
+	inline UInt64 UnderrunCount() const noexcept
+	{
+		return mUnderrunCount;
+	}
+
+private:
+
+	static OSStatus RenderCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumberFrames, AudioBufferList *ioData);
+
+	AudioUnit mOutputUnit;
+	SFB::CARingBuffer mRingBuffer;
+	SFB::CABufferList mScratch;
+
+	/// The number of buffered master frames the drift servo maintains
+	double mTargetLatency;
+	/// The master sample time of the next output frame
+	double mReadPosition;
+	std::atomic<double> mRatio;
+	double mFilteredError;
+	std::atomic_bool mPrimed;
+	std::atomic_uint64_t mUnderrunCount;
+
+};
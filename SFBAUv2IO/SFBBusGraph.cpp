@@ -0,0 +1,324 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBBusGraph.hpp"
+
+#import <algorithm>
+#import <cstring>
+#import <functional>
+#import <limits>
+#import <map>
+#import <stdexcept>
+
+#import <Accelerate/Accelerate.h>
+
+#import "SFBAudioProcessor.hpp"
+#import "SFBRenderWorkerPool.hpp"
+
+namespace {
+
+const size_t kNoBuffer = std::numeric_limits<size_t>::max();
+
+/// Hands out buffer indexes starting at a base, reusing released ones before creating new ones
+class BufferAllocator
+{
+public:
+	explicit BufferAllocator(size_t base)
+	: mBase(base)
+	{}
+
+	size_t Acquire()
+	{
+		if(mFree.empty())
+			return mBase + mCount++;
+		auto buffer = mFree.back();
+		mFree.pop_back();
+		return buffer;
+	}
+
+	void Release(size_t buffer)
+	{
+		mFree.push_back(buffer);
+	}
+
+	size_t Count() const
+	{
+		return mCount;
+	}
+
+private:
+	std::vector<size_t> mFree;
+	size_t mBase;
+	size_t mCount = 0;
+};
+
+}
+
+SFBBusGraph::SFBBusGraph(const std::vector<SFBBus>& buses, UInt32 sourceCount, const AudioStreamBasicDescription& format, UInt32 maximumFrameCount, std::shared_ptr<SFBRenderWorkerPool> workers)
+: mMasterOperation(0), mWorkers(std::move(workers)), mCycle{}, mMasterBuffer(kNoBuffer)
+{
+	// The master output is the root at index buses.size()
+	const size_t master = buses.size();
+
+	std::map<std::string, size_t> busIndexes;
+	for(size_t i = 0; i < buses.size(); ++i) {
+		if(!busIndexes.emplace(buses[i].mName, i).second)
+			throw std::invalid_argument("Duplicate bus name");
+	}
+
+	std::vector<std::vector<size_t>> children(buses.size() + 1);
+	std::vector<bool> sourceIsAssigned(sourceCount, false);
+	for(size_t i = 0; i < buses.size(); ++i) {
+		size_t destination = master;
+		if(!buses[i].mDestination.empty()) {
+			auto match = busIndexes.find(buses[i].mDestination);
+			if(match == busIndexes.end())
+				throw std::invalid_argument("Unknown destination bus");
+			destination = match->second;
+		}
+		children[destination].push_back(i);
+
+		for(auto source : buses[i].mSources) {
+			if(source >= sourceCount || sourceIsAssigned[source])
+				throw std::invalid_argument("Source out of range or assigned twice");
+			sourceIsAssigned[source] = true;
+		}
+	}
+
+	for(const auto& bus : buses) {
+		auto state = std::make_unique<Bus>();
+		state->mName = bus.mName;
+		state->mInserts = bus.mInserts;
+		state->mTailFrameCount = 0;
+		for(const auto& processor : bus.mInserts)
+			state->mTailFrameCount = std::max(state->mTailFrameCount, processor->TailFrameCount());
+		state->mSilentFrameCount = std::numeric_limits<UInt64>::max() / 2;
+		state->mGain = bus.mGain;
+		state->mMuted = bus.mMuted;
+		mBuses.push_back(std::move(state));
+	}
+
+	// Emit operations in depth-first post-order so each bus is complete before it is summed and the buffers
+	// live at once are those on the path from the master to the current bus. A bus with nothing feeding it is omitted.
+	std::vector<bool> visited(buses.size(), false);
+
+	// Returns the buffer holding the bus, or kNoBuffer if the bus is empty
+	std::function<size_t(size_t, BufferAllocator&, const std::vector<size_t>*)> compile = [&](size_t bus, BufferAllocator& allocator, const std::vector<size_t> *compiledChildren) -> size_t {
+		size_t buffer = kNoBuffer;
+
+		for(size_t i = 0; i < children[bus].size(); ++i) {
+			const auto child = children[bus][i];
+			visited[child] = true;
+			auto childBuffer = compiledChildren ? (*compiledChildren)[i] : compile(child, allocator, nullptr);
+			if(childBuffer == kNoBuffer)
+				continue;
+
+			const bool accumulate = buffer != kNoBuffer;
+			if(!accumulate)
+				buffer = allocator.Acquire();
+			mOperations.push_back({ Operation::Type::sumBus, 0, child, childBuffer, buffer, kNoBuffer, accumulate });
+			allocator.Release(childBuffer);
+		}
+
+		if(bus != master) {
+			for(auto source : buses[bus].mSources) {
+				const bool accumulate = buffer != kNoBuffer;
+				if(!accumulate)
+					buffer = allocator.Acquire();
+				size_t scratch = kNoBuffer;
+				if(accumulate) {
+					scratch = allocator.Acquire();
+					allocator.Release(scratch);
+				}
+				mOperations.push_back({ Operation::Type::renderSource, source, bus, buffer, buffer, scratch, accumulate });
+			}
+
+			if(buffer != kNoBuffer && !buses[bus].mInserts.empty())
+				mOperations.push_back({ Operation::Type::processInserts, 0, bus, buffer, buffer, kNoBuffer, false });
+		}
+
+		return buffer;
+	};
+
+	size_t bufferCount = 0;
+	if(mWorkers) {
+		// Each branch draws from its own range of buffers so branches may render concurrently
+		std::vector<size_t> branchBuffers;
+		for(auto child : children[master]) {
+			BufferAllocator allocator(bufferCount);
+			const auto firstOperation = mOperations.size();
+			branchBuffers.push_back(compile(child, allocator, nullptr));
+			bufferCount += allocator.Count();
+			if(mOperations.size() > firstOperation)
+				mBranches.push_back({ firstOperation, mOperations.size() });
+		}
+
+		mMasterOperation = mOperations.size();
+		BufferAllocator allocator(bufferCount);
+		mMasterBuffer = compile(master, allocator, &branchBuffers);
+		bufferCount += allocator.Count();
+
+		// A single branch gains nothing from the workers
+		if(mBranches.size() < 2) {
+			mBranches.clear();
+			mMasterOperation = 0;
+		}
+	}
+	else {
+		BufferAllocator allocator(0);
+		mMasterBuffer = compile(master, allocator, nullptr);
+		bufferCount = allocator.Count();
+	}
+
+	if(std::find(visited.begin(), visited.end(), false) != visited.end())
+		throw std::invalid_argument("Buses form a cycle");
+
+	mBuffers.resize(bufferCount);
+	for(auto& buffer : mBuffers) {
+		if(!buffer.Allocate(format, maximumFrameCount))
+			throw std::bad_alloc();
+	}
+	mBufferIsSilent.resize(mBuffers.size(), true);
+}
+
+size_t SFBBusGraph::BusIndex(const std::string& name) const
+{
+	for(size_t i = 0; i < mBuses.size(); ++i) {
+		if(mBuses[i]->mName == name)
+			return i;
+	}
+	throw std::invalid_argument("Unknown bus");
+}
+
+void SFBBusGraph::SetGain(size_t bus, float gain) noexcept
+{
+	if(bus < mBuses.size())
+		mBuses[bus]->mGain.store(gain, std::memory_order_relaxed);
+}
+
+void SFBBusGraph::SetMuted(size_t bus, bool muted) noexcept
+{
+	if(bus < mBuses.size())
+		mBuses[bus]->mMuted.store(muted, std::memory_order_relaxed);
+}
+
+bool SFBBusGraph::HasTail() const noexcept
+{
+	for(const auto& bus : mBuses) {
+		if(bus->mSilentFrameCount < bus->mTailFrameCount)
+			return true;
+	}
+	return false;
+}
+
+bool SFBBusGraph::Render(RenderSource renderSource, void *context, const AudioTimeStamp *timeStamp, AudioBufferList *bufferList, UInt32 frameCount) noexcept
+{
+	if(mMasterBuffer == kNoBuffer || mBuffers.empty() || frameCount > mBuffers[0].FrameCapacity()) {
+		for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+			std::memset(bufferList->mBuffers[i].mData, 0, frameCount * sizeof(float));
+		return false;
+	}
+
+	const Cycle cycle = { renderSource, context, timeStamp, frameCount };
+	if(!mBranches.empty()) {
+		// The workers have finished every branch when Run() returns
+		mCycle = cycle;
+		mWorkers->Run(ExecuteBranch, this, mBranches.size());
+	}
+	Execute(mMasterOperation, mOperations.size(), cycle);
+
+	// A silent buffer's contents are not necessarily zero
+	const bool masterIsSilent = mBufferIsSilent[mMasterBuffer];
+	const AudioBufferList *master = mBuffers[mMasterBuffer];
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i) {
+		if(i < master->mNumberBuffers && !masterIsSilent)
+			std::memcpy(bufferList->mBuffers[i].mData, master->mBuffers[i].mData, frameCount * sizeof(float));
+		else
+			std::memset(bufferList->mBuffers[i].mData, 0, frameCount * sizeof(float));
+		bufferList->mBuffers[i].mDataByteSize = frameCount * sizeof(float);
+	}
+
+	return !masterIsSilent;
+}
+
+void SFBBusGraph::ExecuteBranch(void *context, size_t branch) noexcept
+{
+	auto graph = static_cast<SFBBusGraph *>(context);
+	const auto& range = graph->mBranches[branch];
+	graph->Execute(range.mFirstOperation, range.mLastOperation, graph->mCycle);
+}
+
+void SFBBusGraph::Execute(size_t first, size_t last, const Cycle& cycle) noexcept
+{
+	const auto frameCount = cycle.mFrameCount;
+
+	for(size_t index = first; index < last; ++index) {
+		const auto& operation = mOperations[index];
+		auto& silent = mBufferIsSilent[operation.mDestinationBuffer];
+
+		switch(operation.mType) {
+			case Operation::Type::renderSource: {
+				auto& target = mBuffers[operation.mAccumulate ? operation.mScratchBuffer : operation.mBuffer];
+				target.SetFrameLength(frameCount);
+				const bool audible = cycle.mRenderSource(cycle.mContext, operation.mSource, cycle.mTimeStamp, target, frameCount);
+				if(!operation.mAccumulate)
+					silent = !audible;
+				else if(audible) {
+					const AudioBufferList *source = target;
+					const AudioBufferList *destination = mBuffers[operation.mBuffer];
+					for(UInt32 i = 0; i < destination->mNumberBuffers; ++i) {
+						auto output = static_cast<float *>(destination->mBuffers[i].mData);
+						vDSP_vadd(static_cast<const float *>(source->mBuffers[i].mData), 1, output, 1, output, 1, frameCount);
+					}
+					silent = false;
+				}
+				break;
+			}
+
+			case Operation::Type::processInserts: {
+				auto& bus = *mBuses[operation.mBus];
+				// Inserts such as reverb may produce output from silent input until their tails decay
+				if(!silent)
+					bus.mSilentFrameCount = 0;
+				else if(bus.mSilentFrameCount >= bus.mTailFrameCount)
+					break;
+				else
+					bus.mSilentFrameCount += frameCount;
+
+				for(const auto& processor : bus.mInserts)
+					processor->Process(mBuffers[operation.mBuffer], frameCount);
+				silent = false;
+				break;
+			}
+
+			case Operation::Type::sumBus: {
+				const auto& bus = *mBuses[operation.mBus];
+				const float gain = bus.mMuted.load(std::memory_order_relaxed) ? 0 : bus.mGain.load(std::memory_order_relaxed);
+				const bool childIsSilent = mBufferIsSilent[operation.mBuffer] || gain == 0;
+
+				const AudioBufferList *source = mBuffers[operation.mBuffer];
+				const AudioBufferList *destination = mBuffers[operation.mDestinationBuffer];
+				for(UInt32 i = 0; i < destination->mNumberBuffers; ++i) {
+					auto input = static_cast<const float *>(source->mBuffers[i].mData);
+					auto output = static_cast<float *>(destination->mBuffers[i].mData);
+					if(!operation.mAccumulate) {
+						if(childIsSilent)
+							vDSP_vclr(output, 1, frameCount);
+						else
+							vDSP_vsmul(input, 1, &gain, output, 1, frameCount);
+					}
+					else if(!childIsSilent)
+						vDSP_vsma(input, 1, &gain, output, 1, output, 1, frameCount);
+				}
+
+				if(!operation.mAccumulate)
+					silent = childIsSilent;
+				else if(!childIsSilent)
+					silent = false;
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,184 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <memory>
+#import <string>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+#import <AudioToolbox/AudioToolbox.h>
+
+#import "SFBAlignedBufferList.hpp"
+
+class SFBAudioProcessor;
+class SFBRenderWorkerPool;
+
+/// A submix bus in an @c SFBBusGraph
+struct SFBBus
+{
+	/// The unique name of the bus
+	std::string mName;
+	/// The name of the bus this bus is summed into, or empty for the master output
+	std::string mDestination;
+	/// The sources summed into this bus
+	std::vector<UInt32> mSources;
+	/// Processors applied in order to the summed bus, before its gain
+	std::vector<std::shared_ptr<SFBAudioProcessor>> mInserts;
+	/// The linear gain applied when summing into the destination
+	float mGain;
+	bool mMuted;
+};
+
+/// A tree of submix buses summed into a master output
+///
+/// The tree is compiled when the graph is created into a flat list of operations ordered so every bus is complete before it
+/// is summed into its destination. Bus buffers are assigned from a pool by liveness: a buffer is claimed when its bus is first
+/// written and returned once the bus has been summed, so the pool holds roughly one buffer per level of the tree rather than one per bus.
+/// Rendering performs no allocation and each sum is a single scaled vector accumulate per channel.
+///
+/// With a worker pool each bus summed directly into the master output is compiled as an independent branch with buffers of
+/// its own. Branches are rendered concurrently by the pool and the render thread, which then sums them into the master.
+class SFBBusGraph
+{
+
+public:
+
+	/// Renders @c frameCount frames of source @c source to @c bufferList
+	/// @return @c false if the rendered audio is silent
+	using RenderSource = bool (*)(void *context, UInt32 source, const AudioTimeStamp *timeStamp, AudioBufferList *bufferList, UInt32 frameCount);
+
+	/// Creates a new @c SFBBusGraph
+	/// @param buses The buses, each summed into another bus or the master output
+	/// @param sourceCount The number of sources that may be assigned to buses
+	/// @param format The deinterleaved 32-bit float format of the sources and every bus
+	/// @param maximumFrameCount The largest number of frames rendered at once
+	/// @param workers The threads used to render branches concurrently, or @c nullptr to render on the calling thread only
+	/// @throw @c std::invalid_argument if bus names are not unique, a destination does not exist, the buses form a cycle,
+	/// or a source is out of range or assigned to more than one bus
+	/// @throw @c std::bad_alloc
+	SFBBusGraph(const std::vector<SFBBus>& buses, UInt32 sourceCount, const AudioStreamBasicDescription& format, UInt32 maximumFrameCount, std::shared_ptr<SFBRenderWorkerPool> workers = nullptr);
+
+	// This class is non-copyable
+	SFBBusGraph(const SFBBusGraph& rhs) = delete;
+
+	// This class is non-assignable
+	SFBBusGraph& operator=(const SFBBusGraph& rhs) = delete;
+
+	~SFBBusGraph() = default;
+
+	// This class is non-movable
+	SFBBusGraph(SFBBusGraph&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBBusGraph& operator=(SFBBusGraph&& rhs) = delete;
+
+
+	inline size_t BusCount() const noexcept
+	{
+		return mBuses.size();
+	}
+
+	/// Returns the number of bus buffers allocated after liveness analysis
+	inline size_t BufferCount() const noexcept
+	{
+		return mBuffers.size();
+	}
+
+	/// Returns the number of branches rendered concurrently, or zero if rendered on the calling thread only
+	inline size_t BranchCount() const noexcept
+	{
+		return mBranches.size();
+	}
+
+	/// Returns the index of the bus named @c name
+	/// @throw @c std::invalid_argument if no bus is named @c name
+	size_t BusIndex(const std::string& name) const;
+
+	/// Sets the gain of bus @c bus, taking effect with the next render cycle
+	void SetGain(size_t bus, float gain) noexcept;
+	/// Mutes or unmutes bus @c bus, taking effect with the next render cycle
+	void SetMuted(size_t bus, bool muted) noexcept;
+
+	/// Returns @c true if an insert on a bus may still produce output from silent input
+	bool HasTail() const noexcept;
+
+	/// Renders @c frameCount frames of the master output to @c bufferList
+	///
+	/// Sources not assigned to any bus are not rendered. Channels of @c bufferList beyond the bus channel count are cleared.
+	/// @note With a worker pool @c renderSource is called concurrently for sources on different branches
+	/// @return @c false if the rendered audio is silent
+	bool Render(RenderSource renderSource, void *context, const AudioTimeStamp *timeStamp, AudioBufferList *bufferList, UInt32 frameCount) noexcept;
+
+private:
+
+	struct Bus
+	{
+		std::string mName;
+		std::vector<std::shared_ptr<SFBAudioProcessor>> mInserts;
+		UInt64 mTailFrameCount;
+		/// Consecutive silent frames processed by the inserts, accessed only while rendering
+		UInt64 mSilentFrameCount;
+		std::atomic<float> mGain;
+		std::atomic_bool mMuted;
+	};
+
+	struct Operation
+	{
+		enum class Type {
+			/// Renders source @c mSource into buffer @c mBuffer, through buffer @c mScratchBuffer if accumulating
+			renderSource,
+			/// Applies the inserts of bus @c mBus to buffer @c mBuffer
+			processInserts,
+			/// Sums buffer @c mBuffer scaled by the gain of bus @c mBus into buffer @c mDestinationBuffer
+			sumBus,
+		};
+
+		Type mType;
+		UInt32 mSource;
+		size_t mBus;
+		size_t mBuffer;
+		size_t mDestinationBuffer;
+		size_t mScratchBuffer;
+		/// Whether the destination already holds audio or this operation is its first writer
+		bool mAccumulate;
+	};
+
+	/// A contiguous run of operations that shares no buffers with other branches
+	struct Branch
+	{
+		size_t mFirstOperation;
+		size_t mLastOperation;
+	};
+
+	/// The arguments to @c Render() for the branches, accessed only during @c Render()
+	struct Cycle
+	{
+		RenderSource mRenderSource;
+		void *mContext;
+		const AudioTimeStamp *mTimeStamp;
+		UInt32 mFrameCount;
+	};
+
+	/// Performs operations @c first through @c last - 1
+	void Execute(size_t first, size_t last, const Cycle& cycle) noexcept;
+	static void ExecuteBranch(void *context, size_t branch) noexcept;
+
+	std::vector<std::unique_ptr<Bus>> mBuses;
+	std::vector<Operation> mOperations;
+	std::vector<Branch> mBranches;
+	/// The first operation following the branches
+	size_t mMasterOperation;
+	std::shared_ptr<SFBRenderWorkerPool> mWorkers;
+	Cycle mCycle;
+	std::vector<SFBAlignedBufferList> mBuffers;
+	/// Whether each buffer holds silence, accessed only while rendering the buffer's branch
+	std::vector<UInt8> mBufferIsSilent;
+	/// The buffer holding the master output, or @c SIZE_MAX if nothing is routed to it
+	size_t mMasterBuffer;
+
+};
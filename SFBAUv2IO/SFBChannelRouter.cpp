@@ -0,0 +1,90 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBChannelRouter.hpp"
+
+#import <algorithm>
+#import <cstring>
+#import <stdexcept>
+
+#import <Accelerate/Accelerate.h>
+
+SFBChannelRouter::SFBChannelRouter(const std::vector<SFBChannelRoute>& routes, UInt32 sourceChannelCount, UInt32 destinationChannelCount)
+: mSourceChannelCount(sourceChannelCount), mDestinations(destinationChannelCount)
+{
+	for(const auto& route : routes) {
+		if(route.mSource >= sourceChannelCount || route.mDestination >= destinationChannelCount)
+			throw std::out_of_range("Route channel out of range");
+	}
+
+	// Group the terms for each destination contiguously
+	auto sorted = routes;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const SFBChannelRoute& lhs, const SFBChannelRoute& rhs) {
+		return lhs.mDestination < rhs.mDestination;
+	});
+
+	mTerms.reserve(sorted.size());
+	for(const auto& route : sorted) {
+		if(route.mGain == 0)
+			continue;
+		auto& destination = mDestinations[route.mDestination];
+		if(destination.mTermCount == 0)
+			destination.mFirstTerm = static_cast<UInt32>(mTerms.size());
+		++destination.mTermCount;
+		mTerms.push_back({ route.mSource, route.mGain });
+	}
+}
+
+std::vector<UInt32> SFBChannelRouter::SourceChannels() const
+{
+	std::vector<UInt32> channels;
+	for(const auto& term : mTerms)
+		channels.push_back(term.mSource);
+	std::sort(channels.begin(), channels.end());
+	channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+	return channels;
+}
+
+void SFBChannelRouter::Route(const AudioBufferList *source, AudioBufferList *destination, UInt32 frameCount) const noexcept
+{
+	const auto byteCount = frameCount * static_cast<UInt32>(sizeof(float));
+	const auto destinationCount = std::min(destination->mNumberBuffers, DestinationChannelCount());
+
+	for(UInt32 i = 0; i < destinationCount; ++i) {
+		const auto& plan = mDestinations[i];
+		auto& buffer = destination->mBuffers[i];
+
+		if(plan.mTermCount == 0) {
+			if(buffer.mData)
+				std::memset(buffer.mData, 0, byteCount);
+			buffer.mDataByteSize = byteCount;
+			continue;
+		}
+
+		const auto *term = &mTerms[plan.mFirstTerm];
+		const auto input = static_cast<const float *>(source->mBuffers[term->mSource].mData);
+
+		if(plan.mTermCount == 1 && term->mGain == 1) {
+			if(!buffer.mData)
+				buffer.mData = const_cast<float *>(input);
+			else if(buffer.mData != input)
+				std::memcpy(buffer.mData, input, byteCount);
+			buffer.mDataByteSize = byteCount;
+			continue;
+		}
+
+		// Aliasing is not possible once gain or summing is required
+		if(!buffer.mData)
+			continue;
+
+		auto output = static_cast<float *>(buffer.mData);
+		vDSP_vsmul(input, 1, &term->mGain, output, 1, frameCount);
+		for(UInt32 j = 1; j < plan.mTermCount; ++j) {
+			++term;
+			vDSP_vsma(static_cast<const float *>(source->mBuffers[term->mSource].mData), 1, &term->mGain, output, 1, output, 1, frameCount);
+		}
+		buffer.mDataByteSize = byteCount;
+	}
+}
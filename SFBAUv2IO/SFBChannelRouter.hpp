@@ -0,0 +1,78 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+/// A connection from a source channel to a destination channel
+struct SFBChannelRoute
+{
+	/// The source channel index
+	UInt32 mSource;
+	/// The destination channel index
+	UInt32 mDestination;
+	/// The linear gain applied to the source channel
+	float mGain;
+};
+
+/// A sparse channel routing matrix for deinterleaved 32-bit float audio
+///
+/// Routes are compiled into a per-destination list of terms so routing cost is proportional to the number of routes
+/// rather than the size of the matrix. A destination fed by a single unity-gain route is copied, or aliased when the
+/// destination buffer pointer is @c nullptr; destinations with no routes are cleared.
+class SFBChannelRouter
+{
+
+public:
+
+	/// Creates a new @c SFBChannelRouter
+	/// @throw @c std::out_of_range if a route refers to a nonexistent channel
+	/// @throw @c std::bad_alloc
+	SFBChannelRouter(const std::vector<SFBChannelRoute>& routes, UInt32 sourceChannelCount, UInt32 destinationChannelCount);
+
+	inline UInt32 SourceChannelCount() const noexcept
+	{
+		return mSourceChannelCount;
+	}
+
+	inline UInt32 DestinationChannelCount() const noexcept
+	{
+		return static_cast<UInt32>(mDestinations.size());
+	}
+
+	/// Returns @c true if no source channel is routed to any destination
+	inline bool IsEmpty() const noexcept
+	{
+		return mTerms.empty();
+	}
+
+	/// Returns the sorted, unique source channels used by at least one route
+	std::vector<UInt32> SourceChannels() const;
+
+	/// Routes @c frameCount frames from @c source to @c destination
+	void Route(const AudioBufferList *source, AudioBufferList *destination, UInt32 frameCount) const noexcept;
+
+private:
+
+	struct Term
+	{
+		UInt32 mSource;
+		float mGain;
+	};
+
+	struct Destination
+	{
+		UInt32 mFirstTerm;
+		UInt32 mTermCount;
+	};
+
+	UInt32 mSourceChannelCount;
+	std::vector<Destination> mDestinations;
+	std::vector<Term> mTerms;
+
+};
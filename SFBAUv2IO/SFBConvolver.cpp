@@ -0,0 +1,312 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBConvolver.hpp"
+
+#import <algorithm>
+#import <cstring>
+#import <new>
+#import <stdexcept>
+
+#import <os/log.h>
+#import <pthread.h>
+
+#import "SFBRealFFT.hpp"
+
+namespace {
+
+/// The smallest head partition size
+const UInt32 kMinimumHeadBlockSize = 64;
+/// The ratio of the tail partition size to the head partition size
+const UInt32 kTailToHeadBlockSizeRatio = 16;
+
+UInt32 NextPowerOfTwo(UInt32 x) noexcept
+{
+	UInt32 result = 1;
+	while(result < x)
+		result <<= 1;
+	return result;
+}
+
+/// Returns a vector of pointers to the channels in @c bufferList
+std::vector<float *> Channels(const AudioBufferList *bufferList)
+{
+	std::vector<float *> channels(bufferList->mNumberBuffers);
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+		channels[i] = static_cast<float *>(bufferList->mBuffers[i].mData);
+	return channels;
+}
+
+}
+
+#pragma mark - Stage
+
+/// Uniformly partitioned overlap-save convolution of one segment of an impulse response
+class SFBConvolver::Stage
+{
+
+public:
+
+	/// Creates a stage convolving @c length frames of @c impulseResponse starting at @c offset
+	Stage(UInt32 blockSize, const AudioBufferList *impulseResponse, UInt32 offset, UInt32 length, UInt32 channelCount)
+	: mBlockSize(blockSize), mPartitionCount((length + blockSize - 1) / blockSize), mChannelCount(channelCount), mFilterChannelCount(impulseResponse->mNumberBuffers), mFFT(2 * static_cast<vDSP_Length>(blockSize)), mNewestPartition(0)
+	{
+		const size_t binCount = blockSize;
+
+		mFilterReal.resize(mFilterChannelCount * mPartitionCount * binCount);
+		mFilterImag.resize(mFilterChannelCount * mPartitionCount * binCount);
+		mInputHistory.resize(channelCount * 2 * blockSize);
+		mSpectraReal.resize(channelCount * mPartitionCount * binCount);
+		mSpectraImag.resize(channelCount * mPartitionCount * binCount);
+		mAccumulatorReal.resize(binCount);
+		mAccumulatorImag.resize(binCount);
+		mTime.resize(2 * blockSize);
+
+		// Round-trip FFT scaling and the factor of 2 in each forward transform are folded into the filter
+		const float scale = 1.f / (8 * blockSize);
+
+		for(UInt32 channel = 0; channel < mFilterChannelCount; ++channel) {
+			auto h = static_cast<const float *>(impulseResponse->mBuffers[channel].mData) + offset;
+			for(UInt32 p = 0; p < mPartitionCount; ++p) {
+				auto count = std::min(blockSize, length - p * blockSize);
+				std::fill(mTime.begin(), mTime.end(), 0.f);
+				std::copy(h + p * blockSize, h + p * blockSize + count, mTime.begin());
+
+				auto filter = Filter(channel, p);
+				mFFT.Forward(mTime.data(), filter);
+				vDSP_vsmul(filter.realp, 1, &scale, filter.realp, 1, binCount);
+				vDSP_vsmul(filter.imagp, 1, &scale, filter.imagp, 1, binCount);
+			}
+		}
+	}
+
+	/// Convolves one block of @c BlockSize() frames per channel from @c input into @c output
+	void Process(float * const *input, float * const *output) noexcept
+	{
+		const vDSP_Length n = mBlockSize;
+
+		mNewestPartition = (mNewestPartition + mPartitionCount - 1) % mPartitionCount;
+
+		DSPSplitComplex accumulator = { mAccumulatorReal.data(), mAccumulatorImag.data() };
+
+		for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+			auto history = mInputHistory.data() + channel * 2 * n;
+			std::memmove(history, history + n, n * sizeof(float));
+			std::memcpy(history + n, input[channel], n * sizeof(float));
+
+			mFFT.Forward(history, Spectrum(channel, 0));
+
+			vDSP_vclr(accumulator.realp, 1, n);
+			vDSP_vclr(accumulator.imagp, 1, n);
+			auto filterChannel = mFilterChannelCount == 1 ? 0 : channel;
+			for(UInt32 p = 0; p < mPartitionCount; ++p)
+				SFBRealFFT::MultiplyAccumulate(Filter(filterChannel, p), Spectrum(channel, p), accumulator, n);
+
+			mFFT.Inverse(accumulator, mTime.data());
+			std::memcpy(output[channel], mTime.data() + n, n * sizeof(float));
+		}
+	}
+
+private:
+
+	DSPSplitComplex Filter(UInt32 channel, UInt32 partition) noexcept
+	{
+		auto offset = (channel * mPartitionCount + partition) * mBlockSize;
+		return { mFilterReal.data() + offset, mFilterImag.data() + offset };
+	}
+
+	DSPSplitComplex Spectrum(UInt32 channel, UInt32 partition) noexcept
+	{
+		auto offset = (channel * mPartitionCount + (mNewestPartition + partition) % mPartitionCount) * mBlockSize;
+		return { mSpectraReal.data() + offset, mSpectraImag.data() + offset };
+	}
+
+	UInt32 mBlockSize;
+	UInt32 mPartitionCount;
+	UInt32 mChannelCount;
+	UInt32 mFilterChannelCount;
+
+	SFBRealFFT mFFT;
+
+	std::vector<float> mFilterReal;
+	std::vector<float> mFilterImag;
+
+	std::vector<float> mInputHistory;
+	std::vector<float> mSpectraReal;
+	std::vector<float> mSpectraImag;
+	UInt32 mNewestPartition;
+
+	std::vector<float> mAccumulatorReal;
+	std::vector<float> mAccumulatorImag;
+	std::vector<float> mTime;
+
+};
+
+#pragma mark - SFBConvolver
+
+SFBConvolver::SFBConvolver(const SFB::CABufferList& impulseResponse, UInt32 channelCount, UInt32 maximumFramesPerSlice, UInt32 preferredBlockSize)
+: mChannelCount(channelCount), mMaximumFramesPerSlice(maximumFramesPerSlice), mHeadBlockSize(0), mHeadFill(0), mTailFrameCount(0), mTailBlockSize(0), mTailDebt(0), mTailUnderrunCount(0), mTailThreadRunning(false), mTailSemaphore(nullptr)
+{
+	const auto& format = impulseResponse.Format();
+	if(!format.IsFloat() || !format.IsNonInterleaved() || format.mBitsPerChannel != 32)
+		throw std::invalid_argument("Impulse response must be deinterleaved 32-bit float");
+	if(format.ChannelCount() != 1 && format.ChannelCount() != channelCount)
+		throw std::invalid_argument("Impulse response channel count must be 1 or channelCount");
+	if(channelCount == 0 || maximumFramesPerSlice == 0 || preferredBlockSize == 0)
+		throw std::invalid_argument("channelCount == 0 || maximumFramesPerSlice == 0 || preferredBlockSize == 0");
+
+	const AudioBufferList *ir = impulseResponse;
+	const auto irLength = impulseResponse.FrameLength();
+	if(irLength == 0)
+		throw std::invalid_argument("Empty impulse response");
+
+	// Process() accepts slices longer than a head block, so the head is sized for the usual slice and not the largest
+	mHeadBlockSize = std::max(kMinimumHeadBlockSize, NextPowerOfTwo(std::min(preferredBlockSize, maximumFramesPerSlice)));
+	// A slice longer than a tail block would need the tail result in the same render cycle its input arrives
+	mTailBlockSize = std::max(kTailToHeadBlockSizeRatio * mHeadBlockSize, NextPowerOfTwo(maximumFramesPerSlice));
+	mTailFrameCount = irLength + 2 * static_cast<UInt64>(mTailBlockSize) + 2 * static_cast<UInt64>(mHeadBlockSize);
+
+	// The tail result for input block j is needed 2 tail blocks after j begins, so the head covers the first 2 tail blocks
+	const auto headLength = std::min(irLength, 2 * mTailBlockSize);
+	mHead = std::make_unique<Stage>(mHeadBlockSize, ir, 0, headLength, channelCount);
+
+	mHeadInput.resize(channelCount * mHeadBlockSize);
+	mHeadOutput.resize(channelCount * mHeadBlockSize);
+	for(UInt32 i = 0; i < channelCount; ++i) {
+		mHeadInputChannels.push_back(mHeadInput.data() + i * mHeadBlockSize);
+		mHeadOutputChannels.push_back(mHeadOutput.data() + i * mHeadBlockSize);
+	}
+
+	if(irLength <= headLength)
+		return;
+
+	mTail = std::make_unique<Stage>(mTailBlockSize, ir, headLength, irLength - headLength, channelCount);
+
+	SFB::CAStreamBasicDescription ringFormat(SFB::CommonPCMFormat::float32, format.mSampleRate, channelCount, false);
+
+	// The tail is delayed by two tail blocks plus the head latency
+	const auto tailDelay = 2 * mTailBlockSize + mHeadBlockSize;
+	if(!mTailInput.Allocate(ringFormat, 2 * mTailBlockSize + maximumFramesPerSlice))
+		throw std::bad_alloc();
+	if(!mTailOutput.Allocate(ringFormat, tailDelay + mTailBlockSize + maximumFramesPerSlice))
+		throw std::bad_alloc();
+	if(!mTailScratch.Allocate(ringFormat, std::max(tailDelay, maximumFramesPerSlice)))
+		throw std::bad_alloc();
+
+	mTailScratch.Reset();
+	const AudioBufferList *scratch = mTailScratch;
+	for(UInt32 i = 0; i < scratch->mNumberBuffers; ++i)
+		std::memset(scratch->mBuffers[i].mData, 0, scratch->mBuffers[i].mDataByteSize);
+	if(mTailOutput.Write(mTailScratch, tailDelay) != tailDelay)
+		throw std::bad_alloc();
+
+	mTailSemaphore = dispatch_semaphore_create(0);
+	if(!mTailSemaphore)
+		throw std::bad_alloc();
+
+	mTailThreadRunning = true;
+	try {
+		mTailThread = std::thread(&SFBConvolver::TailThreadEntry, this);
+	}
+	catch(...) {
+		dispatch_release(mTailSemaphore);
+		throw;
+	}
+}
+
+SFBConvolver::~SFBConvolver()
+{
+	if(mTailThread.joinable()) {
+		mTailThreadRunning = false;
+		dispatch_semaphore_signal(mTailSemaphore);
+		mTailThread.join();
+	}
+
+	if(mTailSemaphore)
+		dispatch_release(mTailSemaphore);
+}
+
+void SFBConvolver::Process(AudioBufferList *bufferList, UInt32 frameCount) noexcept
+{
+	if(bufferList->mNumberBuffers != mChannelCount || frameCount > mMaximumFramesPerSlice)
+		return;
+
+	// Hand the dry input to the tail before it is overwritten
+	if(mTail) {
+		if(mTailInput.Write(bufferList, frameCount) != frameCount)
+			os_log_debug(OS_LOG_DEFAULT, "SFBConvolver tail input overrun");
+		dispatch_semaphore_signal(mTailSemaphore);
+	}
+
+	// Head: the output for each sample is taken from the previous head block, for a latency of one head block
+	UInt32 framesProcessed = 0;
+	while(framesProcessed < frameCount) {
+		auto count = std::min(frameCount - framesProcessed, mHeadBlockSize - mHeadFill);
+		for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+			auto buffer = static_cast<float *>(bufferList->mBuffers[channel].mData) + framesProcessed;
+			std::memcpy(mHeadInputChannels[channel] + mHeadFill, buffer, count * sizeof(float));
+			std::memcpy(buffer, mHeadOutputChannels[channel] + mHeadFill, count * sizeof(float));
+		}
+
+		mHeadFill += count;
+		framesProcessed += count;
+
+		if(mHeadFill == mHeadBlockSize) {
+			mHead->Process(mHeadInputChannels.data(), mHeadOutputChannels.data());
+			mHeadFill = 0;
+		}
+	}
+
+	if(!mTail)
+		return;
+
+	// Frames the tail delivered late are discarded to stay aligned with the head
+	while(mTailDebt > 0) {
+		mTailScratch.Reset();
+		auto count = mTailOutput.Read(mTailScratch, std::min(mTailDebt, mMaximumFramesPerSlice));
+		if(count == 0)
+			break;
+		mTailDebt -= count;
+	}
+
+	mTailScratch.Reset();
+	auto count = mTailOutput.Read(mTailScratch, frameCount);
+	if(count < frameCount) {
+		mTailDebt += frameCount - count;
+		++mTailUnderrunCount;
+	}
+
+	const AudioBufferList *tail = mTailScratch;
+	for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+		auto buffer = static_cast<float *>(bufferList->mBuffers[channel].mData);
+		vDSP_vadd(buffer, 1, static_cast<const float *>(tail->mBuffers[channel].mData), 1, buffer, 1, count);
+	}
+}
+
+void SFBConvolver::TailThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.Convolver");
+
+	SFB::CABufferList input, output;
+	if(!input.Allocate(mTailInput.Format(), mTailBlockSize) || !output.Allocate(mTailInput.Format(), mTailBlockSize)) {
+		os_log_error(OS_LOG_DEFAULT, "Unable to allocate convolver tail buffers");
+		return;
+	}
+
+	auto inputChannels = Channels(input);
+	auto outputChannels = Channels(output);
+
+	while(mTailThreadRunning) {
+		dispatch_semaphore_wait(mTailSemaphore, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+
+		while(mTailThreadRunning && mTailInput.FramesAvailableToRead() >= mTailBlockSize && mTailOutput.FramesAvailableToWrite() >= mTailBlockSize) {
+			input.Reset();
+			mTailInput.Read(input, mTailBlockSize);
+			mTail->Process(inputChannels.data(), outputChannels.data());
+			output.SetFrameLength(mTailBlockSize);
+			mTailOutput.Write(output, mTailBlockSize);
+		}
+	}
+}
@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <memory>
+#import <thread>
+#import <vector>
+
+#import <dispatch/dispatch.h>
+
+#import "SFBAudioProcessor.hpp"
+#import "SFBAudioRingBuffer.hpp"
+#import "SFBCABufferList.hpp"
+
+/// A non-uniformly partitioned FFT convolver for long impulse responses
+///
+/// The impulse response is split into a head, convolved in the render callback using short partitions,
+/// and a tail, convolved on a background thread using long partitions. Input is handed to the background thread and
+/// results are returned through lock-free ring buffers. The tail is scheduled far enough ahead that the background thread
+/// has a full tail block period to produce each result, so the render thread never waits on it.
+///
+/// The convolver introduces a latency of @c Latency() frames, one head partition. The head partition is sized from the
+/// preferred block size, normally the device I/O buffer size, rather than the maximum slice so the latency stays low.
+class SFBConvolver : public SFBAudioProcessor
+{
+
+public:
+
+	/// Creates a new @c SFBConvolver
+	/// @param impulseResponse A deinterleaved 32-bit float impulse response with either one channel or @c channelCount channels
+	/// @param channelCount The number of channels to process; a mono impulse response is applied to every channel
+	/// @param maximumFramesPerSlice The maximum number of frames passed to @c Process()
+	/// @param preferredBlockSize The number of frames usually passed to @c Process(), rounded up to a power of two for the head partition
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::bad_alloc
+	/// @throw @c std::system_error if the background thread could not be started
+	SFBConvolver(const SFB::CABufferList& impulseResponse, UInt32 channelCount, UInt32 maximumFramesPerSlice, UInt32 preferredBlockSize);
+
+	// This class is non-copyable
+	SFBConvolver(const SFBConvolver& rhs) = delete;
+
+	// This class is non-assignable
+	SFBConvolver& operator=(const SFBConvolver& rhs) = delete;
+
+	~SFBConvolver();
+
+	// This class is non-movable
+	SFBConvolver(SFBConvolver&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBConvolver& operator=(SFBConvolver&& rhs) = delete;
+
+
+	/// Returns the processing latency in frames
+	UInt32 Latency() const noexcept override
+	{
+		return mHeadBlockSize;
+	}
+
+	/// Returns the number of times the background thread failed to deliver the tail in time
+	inline UInt64 TailUnderrunCount() const noexcept
+	{
+		return mTailUnderrunCount;
+	}
+
+	void Process(AudioBufferList *bufferList, UInt32 frameCount) noexcept override;
+	UInt64 TailFrameCount() const noexcept override
+	{
+		return mTailFrameCount;
+	}
+
+private:
+
+	class Stage;
+
+	void TailThreadEntry();
+
+	UInt32 mChannelCount;
+	UInt32 mMaximumFramesPerSlice;
+
+	UInt32 mHeadBlockSize;
+	std::unique_ptr<Stage> mHead;
+	std::vector<float> mHeadInput;
+	std::vector<float> mHeadOutput;
+	std::vector<float *> mHeadInputChannels;
+	std::vector<float *> mHeadOutputChannels;
+	UInt32 mHeadFill;
+	/// The impulse response length plus the head and tail latencies
+	UInt64 mTailFrameCount;
+
+	UInt32 mTailBlockSize;
+	std::unique_ptr<Stage> mTail;
+	SFB::AudioRingBuffer mTailInput;
+	SFB::AudioRingBuffer mTailOutput;
+	SFB::CABufferList mTailScratch;
+	UInt32 mTailDebt;
+	std::atomic_uint64_t mTailUnderrunCount;
+
+	std::atomic_bool mTailThreadRunning;
+	std::thread mTailThread;
+	dispatch_semaphore_t mTailSemaphore;
+
+};
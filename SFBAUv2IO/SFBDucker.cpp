@@ -0,0 +1,82 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBDucker.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <stdexcept>
+
+#import <Accelerate/Accelerate.h>
+
+namespace {
+
+/// The release time of the sidechain level detector, short enough to follow syllables
+const double kLevelReleaseTime = 0.05;
+
+/// Returns the one-pole coefficient that covers 1 - 1/e of a step in @c time seconds
+float SmoothingCoefficient(double time, Float64 sampleRate)
+{
+	if(time <= 0)
+		return 1;
+	return static_cast<float>(1 - std::exp(-1 / (time * sampleRate)));
+}
+
+}
+
+SFBDucker::SFBDucker(Float64 sampleRate, UInt32 maximumFrameCount, float threshold, float reduction, double attackTime, double releaseTime)
+: mLevel(0), mGain(1), mCurrentGain(1)
+{
+	if(sampleRate <= 0 || maximumFrameCount == 0)
+		throw std::invalid_argument("Invalid sample rate or frame count");
+	if(reduction < 0 || attackTime < 0 || releaseTime < 0)
+		throw std::invalid_argument("Invalid ducking parameters");
+
+	mThreshold = std::pow(10.f, threshold / 20);
+	mReducedGain = std::pow(10.f, -reduction / 20);
+	mAttackCoefficient = SmoothingCoefficient(attackTime, sampleRate);
+	mReleaseCoefficient = SmoothingCoefficient(releaseTime, sampleRate);
+	mLevelDecay = 1 - SmoothingCoefficient(kLevelReleaseTime, sampleRate);
+
+	mGains.resize(maximumFrameCount);
+}
+
+void SFBDucker::Process(const AudioBufferList *sidechain, AudioBufferList *bufferList, UInt32 frameCount) noexcept
+{
+	frameCount = std::min(frameCount, static_cast<UInt32>(mGains.size()));
+	if(frameCount == 0)
+		return;
+
+	auto level = mLevel;
+	auto gain = mGain;
+	const UInt32 sidechainChannels = sidechain ? sidechain->mNumberBuffers : 0;
+
+	for(UInt32 i = 0; i < frameCount; ++i) {
+		float peak = 0;
+		for(UInt32 channel = 0; channel < sidechainChannels; ++channel)
+			peak = std::max(peak, std::abs(static_cast<const float *>(sidechain->mBuffers[channel].mData)[i]));
+
+		level = std::max(peak, level * mLevelDecay);
+		if(level > mThreshold)
+			gain += mAttackCoefficient * (mReducedGain - gain);
+		else
+			gain = 1 - gain < 1e-6f ? 1 : gain + mReleaseCoefficient * (1 - gain);
+		mGains[i] = gain;
+	}
+
+	// Flush denormals from the level detector's tail
+	mLevel = level < 1e-9f ? 0 : level;
+	mGain = gain;
+	mCurrentGain.store(gain, std::memory_order_relaxed);
+
+	// No gain change to apply once fully released
+	if(gain == 1 && mGains[0] == 1)
+		return;
+
+	for(UInt32 channel = 0; channel < bufferList->mNumberBuffers; ++channel) {
+		auto samples = static_cast<float *>(bufferList->mBuffers[channel].mData);
+		vDSP_vmul(samples, 1, mGains.data(), 1, samples, 1, frameCount);
+	}
+}
@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+/// Reduces the level of deinterleaved 32-bit float audio while a sidechain signal exceeds a threshold
+///
+/// The sidechain level is the peak across its channels with a short exponential release. While it exceeds the threshold the
+/// gain moves toward the reduction with the attack time constant, and otherwise back to unity with the release time constant.
+class SFBDucker
+{
+
+public:
+
+	/// Creates a new @c SFBDucker
+	/// @param sampleRate The sample rate of the sidechain and the processed audio
+	/// @param maximumFrameCount The largest number of frames passed to @c Process()
+	/// @param threshold The sidechain level in dBFS above which the gain is reduced
+	/// @param reduction The gain reduction in dB, a positive value
+	/// @param attackTime The time in seconds to approach the reduced gain
+	/// @param releaseTime The time in seconds to return to unity gain
+	/// @throw @c std::invalid_argument if a parameter is out of range
+	/// @throw @c std::bad_alloc
+	SFBDucker(Float64 sampleRate, UInt32 maximumFrameCount, float threshold, float reduction, double attackTime, double releaseTime);
+
+	// This class is non-copyable
+	SFBDucker(const SFBDucker& rhs) = delete;
+
+	// This class is non-assignable
+	SFBDucker& operator=(const SFBDucker& rhs) = delete;
+
+	~SFBDucker() = default;
+
+	// This class is non-movable
+	SFBDucker(SFBDucker&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBDucker& operator=(SFBDucker&& rhs) = delete;
+
+
+	/// Applies the gain derived from @c sidechain to @c frameCount frames of @c bufferList
+	/// @param sidechain The sidechain frames aligned with @c bufferList, or @c nullptr if unavailable
+	/// @note Frames beyond the maximum frame count are left unchanged
+	void Process(const AudioBufferList *sidechain, AudioBufferList *bufferList, UInt32 frameCount) noexcept;
+
+	/// Returns the most recent linear gain applied
+	inline float Gain() const noexcept
+	{
+		return mCurrentGain.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	/// Linear sidechain threshold
+	float mThreshold;
+	/// Linear reduced gain
+	float mReducedGain;
+	/// Per-frame smoothing coefficients
+	float mAttackCoefficient;
+	float mReleaseCoefficient;
+	/// Per-frame level detector decay
+	float mLevelDecay;
+
+	float mLevel;
+	float mGain;
+	std::vector<float> mGains;
+
+	std::atomic<float> mCurrentGain;
+
+};
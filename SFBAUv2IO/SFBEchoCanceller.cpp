@@ -0,0 +1,180 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBEchoCanceller.hpp"
+
+#import <algorithm>
+#import <stdexcept>
+
+namespace {
+
+/// Smoothing factor for the reference power estimate
+const float kPowerSmoothing = 0.9f;
+/// Regularization added to the power estimate to avoid division by zero during silence
+const float kPowerRegularization = 1e-6f;
+/// Default normalized step size
+const float kDefaultStepSize = 0.5f;
+
+inline DSPSplitComplex Offset(const DSPSplitComplex& z, vDSP_Length offset) noexcept
+{
+	return { z.realp + offset, z.imagp + offset };
+}
+
+inline bool IsPowerOfTwo(UInt32 x) noexcept
+{
+	return x && !(x & (x - 1));
+}
+
+}
+
+SFBEchoCanceller::SFBEchoCanceller(UInt32 blockSize, UInt32 partitionCount, UInt32 channelCount)
+: mBlockSize(blockSize), mPartitionCount(partitionCount), mChannelCount(channelCount), mFFT(2 * static_cast<vDSP_Length>(blockSize)), mStepSize(kDefaultStepSize), mNewestPartition(0), mNyquistPower(0), mConstrainedPartition(0)
+{
+	if(!IsPowerOfTwo(blockSize) || blockSize < 2)
+		throw std::invalid_argument("blockSize must be a power of two");
+	if(partitionCount == 0)
+		throw std::invalid_argument("partitionCount == 0");
+	if(channelCount == 0)
+		throw std::invalid_argument("channelCount == 0");
+
+	// The FFT size is twice the block size for overlap-save, packed into N complex bins
+	const size_t binCount = blockSize;
+
+	mReferenceHistory.resize(2 * blockSize);
+	mReferenceSpectraReal.resize(partitionCount * binCount);
+	mReferenceSpectraImag.resize(partitionCount * binCount);
+	mFilterSpectraReal.resize(channelCount * partitionCount * binCount);
+	mFilterSpectraImag.resize(channelCount * partitionCount * binCount);
+	mPower.resize(binCount);
+	mInversePower.resize(binCount);
+	mTimeScratch.resize(2 * blockSize);
+	mSpectrumScratchReal.resize(binCount);
+	mSpectrumScratchImag.resize(binCount);
+	mErrorSpectrumReal.resize(binCount);
+	mErrorSpectrumImag.resize(binCount);
+}
+
+void SFBEchoCanceller::SetStepSize(float stepSize) noexcept
+{
+	mStepSize = std::min(std::max(stepSize, 0.f), 1.f);
+}
+
+void SFBEchoCanceller::Reset() noexcept
+{
+	std::fill(mReferenceHistory.begin(), mReferenceHistory.end(), 0.f);
+	std::fill(mReferenceSpectraReal.begin(), mReferenceSpectraReal.end(), 0.f);
+	std::fill(mReferenceSpectraImag.begin(), mReferenceSpectraImag.end(), 0.f);
+	std::fill(mFilterSpectraReal.begin(), mFilterSpectraReal.end(), 0.f);
+	std::fill(mFilterSpectraImag.begin(), mFilterSpectraImag.end(), 0.f);
+	std::fill(mPower.begin(), mPower.end(), 0.f);
+	mNyquistPower = 0;
+	mNewestPartition = 0;
+	mConstrainedPartition = 0;
+}
+
+void SFBEchoCanceller::Process(const AudioBufferList *capture, const AudioBufferList *reference, AudioBufferList *output) noexcept
+{
+	const vDSP_Length n = mBlockSize;
+	const auto fftSize = 2 * n;
+
+	// Shift the reference history and append the mono downmix of the current reference block
+	std::copy(mReferenceHistory.begin() + static_cast<ptrdiff_t>(n), mReferenceHistory.end(), mReferenceHistory.begin());
+	auto current = mReferenceHistory.data() + n;
+	vDSP_vclr(current, 1, n);
+	if(reference->mNumberBuffers > 0) {
+		const float scale = 1.f / reference->mNumberBuffers;
+		for(UInt32 i = 0; i < reference->mNumberBuffers; ++i)
+			vDSP_vsma(static_cast<const float *>(reference->mBuffers[i].mData), 1, &scale, current, 1, current, 1, n);
+	}
+
+	// The newest reference spectrum replaces the oldest
+	mNewestPartition = (mNewestPartition + mPartitionCount - 1) % mPartitionCount;
+	auto newest = ReferenceSpectrum(0);
+	mFFT.Forward(mReferenceHistory.data(), newest);
+
+	// Update the smoothed power estimate across all partitions
+	vDSP_vclr(mInversePower.data(), 1, n);
+	float nyquistPower = 0;
+	for(UInt32 p = 0; p < mPartitionCount; ++p) {
+		auto x = ReferenceSpectrum(p);
+		auto x1 = Offset(x, 1);
+		// Accumulate |X|² for bins 1..n-1 like the DC and Nyquist bins
+		vDSP_zvmgsa(&x1, 1, mInversePower.data() + 1, 1, mInversePower.data() + 1, 1, n - 1);
+		mInversePower[0] += x.realp[0] * x.realp[0];
+		nyquistPower += x.imagp[0] * x.imagp[0];
+	}
+
+	const float smoothing = kPowerSmoothing;
+	const float complement = 1.f - kPowerSmoothing;
+	vDSP_vsmul(mPower.data(), 1, &smoothing, mPower.data(), 1, n);
+	vDSP_vsma(mInversePower.data(), 1, &complement, mPower.data(), 1, mPower.data(), 1, n);
+	mNyquistPower = kPowerSmoothing * mNyquistPower + complement * nyquistPower;
+
+	const float regularization = kPowerRegularization;
+	const float one = 1;
+	vDSP_vsadd(mPower.data(), 1, &regularization, mInversePower.data(), 1, n);
+	vDSP_svdiv(&one, mInversePower.data(), 1, mInversePower.data(), 1, n);
+	const float inverseNyquistPower = 1.f / (mNyquistPower + kPowerRegularization);
+
+	// vDSP's forward and inverse real FFTs scale a round trip by 2 × the FFT size
+	const float inverseScale = 1.f / (2 * fftSize);
+
+	DSPSplitComplex scratch = { mSpectrumScratchReal.data(), mSpectrumScratchImag.data() };
+	DSPSplitComplex error = { mErrorSpectrumReal.data(), mErrorSpectrumImag.data() };
+
+	for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+		// Estimate the echo: y = last N samples of IFFT(Σ W_p × X_p)
+		vDSP_vclr(scratch.realp, 1, n);
+		vDSP_vclr(scratch.imagp, 1, n);
+		for(UInt32 p = 0; p < mPartitionCount; ++p)
+			SFBRealFFT::MultiplyAccumulate(FilterSpectrum(channel, p), ReferenceSpectrum(p), scratch, n);
+
+		mFFT.Inverse(scratch, mTimeScratch.data());
+		vDSP_vsmul(mTimeScratch.data() + n, 1, &inverseScale, mTimeScratch.data() + n, 1, n);
+
+		// e = d - y
+		auto captured = static_cast<const float *>(capture->mBuffers[channel].mData);
+		auto cleaned = static_cast<float *>(output->mBuffers[channel].mData);
+		vDSP_vsub(mTimeScratch.data() + n, 1, captured, 1, cleaned, 1, n);
+
+		// E = FFT([0, e]), normalized by the reference power
+		vDSP_vclr(mTimeScratch.data(), 1, n);
+		std::copy(cleaned, cleaned + n, mTimeScratch.data() + n);
+		mFFT.Forward(mTimeScratch.data(), error);
+
+		const auto errorNyquist = error.imagp[0] * inverseNyquistPower;
+		vDSP_zrvmul(&error, 1, mInversePower.data(), 1, &error, 1, n);
+		error.imagp[0] = errorNyquist;
+
+		// W_p += μ × conj(X_p) × E
+		for(UInt32 p = 0; p < mPartitionCount; ++p) {
+			auto w = FilterSpectrum(channel, p);
+			SFBRealFFT::ConjugateMultiply(ReferenceSpectrum(p), error, scratch, n);
+			vDSP_vsma(scratch.realp, 1, &mStepSize, w.realp, 1, w.realp, 1, n);
+			vDSP_vsma(scratch.imagp, 1, &mStepSize, w.imagp, 1, w.imagp, 1, n);
+		}
+
+		// Constrain one partition per block to a causal N-tap filter by zeroing the second half of its impulse response
+		auto w = FilterSpectrum(channel, mConstrainedPartition);
+		mFFT.Inverse(w, mTimeScratch.data());
+		vDSP_vsmul(mTimeScratch.data(), 1, &inverseScale, mTimeScratch.data(), 1, n);
+		vDSP_vclr(mTimeScratch.data() + n, 1, n);
+		mFFT.Forward(mTimeScratch.data(), w);
+	}
+
+	mConstrainedPartition = (mConstrainedPartition + 1) % mPartitionCount;
+}
+
+DSPSplitComplex SFBEchoCanceller::ReferenceSpectrum(UInt32 partition) noexcept
+{
+	auto offset = ((mNewestPartition + partition) % mPartitionCount) * mBlockSize;
+	return { mReferenceSpectraReal.data() + offset, mReferenceSpectraImag.data() + offset };
+}
+
+DSPSplitComplex SFBEchoCanceller::FilterSpectrum(UInt32 channel, UInt32 partition) noexcept
+{
+	auto offset = (channel * mPartitionCount + partition) * mBlockSize;
+	return { mFilterSpectraReal.data() + offset, mFilterSpectraImag.data() + offset };
+}
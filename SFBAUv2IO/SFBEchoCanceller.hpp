@@ -0,0 +1,111 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBRealFFT.hpp"
+
+/// A partitioned-block frequency-domain adaptive filter (PBFDAF) acoustic echo canceller
+///
+/// The echo path from a reference signal to each capture channel is modeled by an adaptive FIR filter
+/// split into equal partitions of @c BlockSize() frames. Filtering and adaptation are performed in the frequency domain
+/// using overlap-save, so the cost per block is proportional to the number of partitions rather than the filter length.
+class SFBEchoCanceller
+{
+
+public:
+
+	/// Creates a new @c SFBEchoCanceller
+	/// @param blockSize The number of frames processed per call to @c Process(), must be a power of two
+	/// @param partitionCount The number of filter partitions; the echo tail length is @c blockSize × @c partitionCount frames
+	/// @param channelCount The number of capture channels
+	/// @throw @c std::invalid_argument if @c blockSize is not a power of two or @c partitionCount or @c channelCount is zero
+	/// @throw @c std::bad_alloc
+	SFBEchoCanceller(UInt32 blockSize, UInt32 partitionCount, UInt32 channelCount);
+
+	// This class is non-copyable
+	SFBEchoCanceller(const SFBEchoCanceller& rhs) = delete;
+
+	// This class is non-assignable
+	SFBEchoCanceller& operator=(const SFBEchoCanceller& rhs) = delete;
+
+	~SFBEchoCanceller() = default;
+
+	// This class is non-movable
+	SFBEchoCanceller(SFBEchoCanceller&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBEchoCanceller& operator=(SFBEchoCanceller&& rhs) = delete;
+
+
+	/// Returns the number of frames processed per call to @c Process()
+	inline UInt32 BlockSize() const noexcept
+	{
+		return mBlockSize;
+	}
+
+	/// Returns the number of capture channels
+	inline UInt32 ChannelCount() const noexcept
+	{
+		return mChannelCount;
+	}
+
+	/// Sets the normalized adaptation step size, in the range (0, 1]
+	void SetStepSize(float stepSize) noexcept;
+
+	/// Discards all adapted state
+	void Reset() noexcept;
+
+	/// Removes the echo of @c reference from @c capture and stores the result in @c output
+	///
+	/// All buffer lists must contain @c BlockSize() frames of deinterleaved 32-bit float audio.
+	/// @c capture and @c output must contain @c ChannelCount() buffers; the channels in @c reference are mixed to mono.
+	/// @c output may be the same buffer list as @c capture.
+	void Process(const AudioBufferList *capture, const AudioBufferList *reference, AudioBufferList *output) noexcept;
+
+private:
+
+	DSPSplitComplex ReferenceSpectrum(UInt32 partition) noexcept;
+	DSPSplitComplex FilterSpectrum(UInt32 channel, UInt32 partition) noexcept;
+
+	UInt32 mBlockSize;
+	UInt32 mPartitionCount;
+	UInt32 mChannelCount;
+
+	SFBRealFFT mFFT;
+
+	float mStepSize;
+
+	/// The previous and current reference blocks
+	std::vector<float> mReferenceHistory;
+
+	/// Reference spectra, one per partition, stored as a ring with the newest at @c mNewestPartition
+	std::vector<float> mReferenceSpectraReal;
+	std::vector<float> mReferenceSpectraImag;
+	UInt32 mNewestPartition;
+
+	/// Filter spectra, @c mPartitionCount per channel
+	std::vector<float> mFilterSpectraReal;
+	std::vector<float> mFilterSpectraImag;
+
+	/// Smoothed reference power per bin, with the Nyquist bin stored separately due to packing
+	std::vector<float> mPower;
+	float mNyquistPower;
+	std::vector<float> mInversePower;
+
+	/// The next partition to which the gradient constraint will be applied, per channel
+	UInt32 mConstrainedPartition;
+
+	std::vector<float> mTimeScratch;
+	std::vector<float> mSpectrumScratchReal;
+	std::vector<float> mSpectrumScratchImag;
+	std::vector<float> mErrorSpectrumReal;
+	std::vector<float> mErrorSpectrumImag;
+
+};
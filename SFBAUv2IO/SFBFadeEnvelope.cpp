@@ -0,0 +1,44 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBFadeEnvelope.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <cstring>
+#import <stdexcept>
+
+#import <Accelerate/Accelerate.h>
+
+SFBFadeEnvelope::SFBFadeEnvelope(UInt32 frameCount, Direction direction, Shape shape)
+: mGains(frameCount), mDirection(direction)
+{
+	if(frameCount == 0)
+		throw std::invalid_argument("frameCount == 0");
+
+	// Gains are taken at frame centers so equal-power fades in and out of the same length are power complementary
+	for(UInt32 i = 0; i < frameCount; ++i) {
+		const double position = (i + 0.5) / frameCount;
+		double gain;
+		if(shape == Shape::equalPower)
+			gain = direction == Direction::in ? std::sin(M_PI_2 * position) : std::cos(M_PI_2 * position);
+		else
+			gain = direction == Direction::in ? position : 1 - position;
+		mGains[i] = static_cast<float>(gain);
+	}
+}
+
+void SFBFadeEnvelope::Apply(AudioBufferList *bufferList, UInt32 bufferOffset, UInt32 frameCount, UInt32 envelopePosition) const noexcept
+{
+	const auto envelopeFrames = envelopePosition < mGains.size() ? std::min(frameCount, static_cast<UInt32>(mGains.size()) - envelopePosition) : 0;
+
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i) {
+		auto samples = static_cast<float *>(bufferList->mBuffers[i].mData) + bufferOffset;
+		if(envelopeFrames)
+			vDSP_vmul(samples, 1, mGains.data() + envelopePosition, 1, samples, 1, envelopeFrames);
+		if(envelopeFrames < frameCount && mDirection == Direction::out)
+			std::memset(samples + envelopeFrames, 0, (frameCount - envelopeFrames) * sizeof(float));
+	}
+}
@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+/// A gain ramp for deinterleaved 32-bit float audio, precomputed so applying it costs one multiply per sample
+///
+/// Equal-power fade-in and fade-out envelopes of the same length sum to constant power, so overlapping a fade-out with
+/// a fade-in of the same length gives an equal-power crossfade.
+class SFBFadeEnvelope
+{
+
+public:
+
+	enum class Direction {
+		/// Rises from silence to unity gain
+		in,
+		/// Falls from unity gain to silence
+		out,
+	};
+
+	enum class Shape {
+		linear,
+		/// Sine and cosine quarter periods
+		equalPower,
+	};
+
+	/// Creates a new @c SFBFadeEnvelope lasting @c frameCount frames
+	/// @throw @c std::invalid_argument if @c frameCount is zero
+	/// @throw @c std::bad_alloc
+	SFBFadeEnvelope(UInt32 frameCount, Direction direction, Shape shape = Shape::equalPower);
+
+	inline UInt32 FrameCount() const noexcept
+	{
+		return static_cast<UInt32>(mGains.size());
+	}
+
+	inline Direction FadeDirection() const noexcept
+	{
+		return mDirection;
+	}
+
+	/// Returns the gain once the envelope has finished
+	inline float FinalGain() const noexcept
+	{
+		return mDirection == Direction::in ? 1 : 0;
+	}
+
+	/// Multiplies @c frameCount frames of @c bufferList starting at frame @c bufferOffset by the envelope starting at @c envelopePosition
+	///
+	/// Frames past the end of the envelope are multiplied by @c FinalGain().
+	void Apply(AudioBufferList *bufferList, UInt32 bufferOffset, UInt32 frameCount, UInt32 envelopePosition) const noexcept;
+
+private:
+
+	std::vector<float> mGains;
+	Direction mDirection;
+
+};
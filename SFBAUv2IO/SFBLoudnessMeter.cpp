@@ -0,0 +1,308 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBLoudnessMeter.hpp"
+
+#import <algorithm>
+#import <cfloat>
+#import <chrono>
+#import <cmath>
+#import <limits>
+#import <numeric>
+#import <stdexcept>
+
+#import <pthread.h>
+
+namespace {
+
+/// The number of 100 ms blocks in a momentary measurement and in a gating block
+const uint32_t kMomentaryBlockCount = 4;
+/// The number of 100 ms blocks in a short-term measurement
+const uint32_t kShortTermBlockCount = 30;
+/// The gating block energy below which blocks are excluded, -70 LUFS
+const double kAbsoluteGateEnergy = std::pow(10, (-70 + 0.691) / 10);
+/// The ratio of the relative gate to the loudness of the absolute-gated blocks, -10 LU
+const double kRelativeGateRatio = 0.1;
+
+/// The gating block histogram spans -70 to +30 LUFS in 0.1 LU bins
+const uint32_t kHistogramBinCount = 1000;
+const double kHistogramMinimumLoudness = -70;
+const double kHistogramBinWidth = 0.1;
+
+/// The length of the true-peak interpolation filter
+const uint32_t kOversamplingFilterLength = 49;
+
+/// The number of blocks that may wait for the background thread, about 6 s
+const size_t kBlockQueueCapacity = 64;
+/// How often the background thread checks for blocks
+const auto kMeasurementInterval = std::chrono::milliseconds(20);
+
+inline double LoudnessForEnergy(double energy) noexcept
+{
+	if(energy <= 0)
+		return -std::numeric_limits<double>::infinity();
+	return 10 * std::log10(energy) - 0.691;
+}
+
+inline double EnergyForLoudness(double loudness) noexcept
+{
+	return std::pow(10, (loudness + 0.691) / 10);
+}
+
+inline uint32_t HistogramBinForEnergy(double energy) noexcept
+{
+	const auto bin = std::floor((LoudnessForEnergy(energy) - kHistogramMinimumLoudness) / kHistogramBinWidth);
+	return static_cast<uint32_t>(std::min(std::max(bin, 0.0), static_cast<double>(kHistogramBinCount - 1)));
+}
+
+}
+
+SFBLoudnessMeter::SFBLoudnessMeter(double sampleRate, std::vector<double> channelWeights)
+: mChannelWeights(std::move(channelWeights)), mBlockFrameCount(0), mOversamplingFactor(1), mOversamplingTapCount(1), mBlockPosition(0), mBlock{0, 0}, mBlocks(kBlockQueueCapacity), mDroppedBlockCount(0), mBlockCount(0), mGatedBlockCount(0), mGatedEnergySum(0), mPeak(0), mMomentaryLoudness(-std::numeric_limits<double>::infinity()), mShortTermLoudness(-std::numeric_limits<double>::infinity()), mIntegratedLoudness(-std::numeric_limits<double>::infinity()), mTruePeak(-std::numeric_limits<double>::infinity()), mResetRequested(false), mMeasurementThreadRunning(false)
+{
+	if(!(sampleRate > 0))
+		throw std::invalid_argument("Sample rate must be positive");
+	if(mChannelWeights.empty() || mChannelWeights.size() > kMaximumChannelCount)
+		throw std::invalid_argument("Invalid channel count");
+
+	// Rounded as in the reference implementation
+	mBlockFrameCount = static_cast<uint32_t>((static_cast<uint64_t>(sampleRate) + 5) / 10);
+
+	// The high-shelf and high-pass stages of the K-weighting filter, derived for the sample rate and combined
+	double shelfNumerator [3], shelfDenominator [3] = { 1, 0, 0 };
+	{
+		const double f0 = 1681.974450955533;
+		const double G = 3.999843853973347;
+		const double Q = 0.7071752369554196;
+		const double K = std::tan(M_PI * f0 / sampleRate);
+		const double Vh = std::pow(10.0, G / 20.0);
+		const double Vb = std::pow(Vh, 0.4996667741545416);
+		const double a0 = 1.0 + K / Q + K * K;
+		shelfNumerator[0] = (Vh + Vb * K / Q + K * K) / a0;
+		shelfNumerator[1] = 2.0 * (K * K - Vh) / a0;
+		shelfNumerator[2] = (Vh - Vb * K / Q + K * K) / a0;
+		shelfDenominator[1] = 2.0 * (K * K - 1.0) / a0;
+		shelfDenominator[2] = (1.0 - K / Q + K * K) / a0;
+	}
+
+	const double highPassNumerator [3] = { 1, -2, 1 };
+	double highPassDenominator [3] = { 1, 0, 0 };
+	{
+		const double f0 = 38.13547087602444;
+		const double Q = 0.5003270373238773;
+		const double K = std::tan(M_PI * f0 / sampleRate);
+		highPassDenominator[1] = 2.0 * (K * K - 1.0) / (1.0 + K / Q + K * K);
+		highPassDenominator[2] = (1.0 - K / Q + K * K) / (1.0 + K / Q + K * K);
+	}
+
+	const auto convolve = [](const double *x, const double *y, double *z) {
+		z[0] = x[0] * y[0];
+		z[1] = x[0] * y[1] + x[1] * y[0];
+		z[2] = x[0] * y[2] + x[1] * y[1] + x[2] * y[0];
+		z[3] = x[1] * y[2] + x[2] * y[1];
+		z[4] = x[2] * y[2];
+	};
+	convolve(shelfNumerator, highPassNumerator, mFilterNumerator);
+	convolve(shelfDenominator, highPassDenominator, mFilterDenominator);
+
+	// True peak by oversampling to at least 192 kHz with a Hann-windowed sinc
+	if(sampleRate < 96000)
+		mOversamplingFactor = 4;
+	else if(sampleRate < 192000)
+		mOversamplingFactor = 2;
+
+	if(mOversamplingFactor > 1) {
+		mOversamplingTapCount = (kOversamplingFilterLength + mOversamplingFactor - 1) / mOversamplingFactor;
+		mOversamplingCoefficients.assign(mOversamplingFactor * mOversamplingTapCount, 0);
+		for(uint32_t tap = 0; tap < kOversamplingFilterLength; ++tap) {
+			const double m = static_cast<double>(tap) - static_cast<double>(kOversamplingFilterLength - 1) / 2;
+			double c = 1;
+			if(std::abs(m) > 1e-6)
+				c = std::sin(m * M_PI / mOversamplingFactor) / (m * M_PI / mOversamplingFactor);
+			c *= 0.5 * (1 - std::cos(2 * M_PI * tap / (kOversamplingFilterLength - 1)));
+			// Tap t of phase t % factor applies to the sample t / factor frames old
+			const auto phase = tap % mOversamplingFactor;
+			const auto age = tap / mOversamplingFactor;
+			mOversamplingCoefficients[phase * mOversamplingTapCount + mOversamplingTapCount - 1 - age] = static_cast<float>(c);
+		}
+	}
+
+	mChannels.resize(mChannelWeights.size());
+	for(auto& channel : mChannels) {
+		std::fill(std::begin(channel.mFilterState), std::end(channel.mFilterState), 0);
+		channel.mHistory.assign(2 * mOversamplingTapCount, 0);
+		channel.mHistoryPosition = 0;
+	}
+
+	mRecentEnergies.assign(kShortTermBlockCount, 0);
+
+	mGatedHistogram.assign(kHistogramBinCount, 0);
+	mHistogramEnergies.resize(kHistogramBinCount);
+	for(uint32_t i = 0; i < kHistogramBinCount; ++i)
+		mHistogramEnergies[i] = EnergyForLoudness(kHistogramMinimumLoudness + (i + 0.5) * kHistogramBinWidth);
+
+	mMeasurementThreadRunning = true;
+	mMeasurementThread = std::thread(&SFBLoudnessMeter::MeasurementThreadEntry, this);
+}
+
+SFBLoudnessMeter::~SFBLoudnessMeter()
+{
+	if(mMeasurementThread.joinable()) {
+		mMeasurementThreadRunning = false;
+		mMeasurementThread.join();
+	}
+}
+
+void SFBLoudnessMeter::Process(const float * const *channels, uint32_t channelCount, uint32_t frameCount) noexcept
+{
+	channelCount = std::min(channelCount, ChannelCount());
+
+	const auto b = mFilterNumerator;
+	const auto a = mFilterDenominator;
+	const auto tapCount = mOversamplingTapCount;
+	const auto coefficients = mOversamplingCoefficients.data();
+
+	uint32_t framesProcessed = 0;
+	while(framesProcessed < frameCount) {
+		const auto count = std::min(frameCount - framesProcessed, mBlockFrameCount - mBlockPosition);
+
+		for(uint32_t channel = 0; channel < channelCount; ++channel) {
+			const auto input = channels[channel] + framesProcessed;
+			auto& state = mChannels[channel];
+			auto peak = mBlock.mPeak;
+
+			// The K-weighting filter, in direct form II as in the reference implementation
+			if(mChannelWeights[channel] != 0) {
+				auto v = state.mFilterState;
+				double energy = 0;
+				for(uint32_t i = 0; i < count; ++i) {
+					v[0] = static_cast<double>(input[i]) - a[1] * v[1] - a[2] * v[2] - a[3] * v[3] - a[4] * v[4];
+					const auto y = b[0] * v[0] + b[1] * v[1] + b[2] * v[2] + b[3] * v[3] + b[4] * v[4];
+					v[4] = v[3];
+					v[3] = v[2];
+					v[2] = v[1];
+					v[1] = v[0];
+					energy += y * y;
+				}
+				for(uint32_t i = 1; i < 5; ++i) {
+					if(std::abs(v[i]) < DBL_MIN)
+						v[i] = 0;
+				}
+				mBlock.mEnergy += mChannelWeights[channel] * energy;
+			}
+
+			if(mOversamplingFactor == 1) {
+				for(uint32_t i = 0; i < count; ++i)
+					peak = std::max(peak, std::abs(input[i]));
+			}
+			else {
+				auto history = state.mHistory.data();
+				auto position = state.mHistoryPosition;
+				for(uint32_t i = 0; i < count; ++i) {
+					history[position] = history[position + tapCount] = input[i];
+					position = position + 1 == tapCount ? 0 : position + 1;
+					// The window holds the last tapCount samples from oldest to newest
+					const auto window = history + position;
+					peak = std::max(peak, std::abs(input[i]));
+					for(uint32_t phase = 0; phase < mOversamplingFactor; ++phase) {
+						const auto h = coefficients + phase * tapCount;
+						float sum = 0;
+						for(uint32_t tap = 0; tap < tapCount; ++tap)
+							sum += h[tap] * window[tap];
+						peak = std::max(peak, std::abs(sum));
+					}
+				}
+				state.mHistoryPosition = position;
+			}
+
+			mBlock.mPeak = peak;
+		}
+
+		framesProcessed += count;
+		mBlockPosition += count;
+		if(mBlockPosition == mBlockFrameCount) {
+			if(!mBlocks.Push(mBlock))
+				mDroppedBlockCount.fetch_add(1, std::memory_order_relaxed);
+			mBlock = { 0, 0 };
+			mBlockPosition = 0;
+		}
+	}
+}
+
+SFBLoudnessMeter::Measurements SFBLoudnessMeter::CurrentMeasurements() const noexcept
+{
+	return {
+		mMomentaryLoudness.load(std::memory_order_relaxed),
+		mShortTermLoudness.load(std::memory_order_relaxed),
+		mIntegratedLoudness.load(std::memory_order_relaxed),
+		mTruePeak.load(std::memory_order_relaxed),
+	};
+}
+
+void SFBLoudnessMeter::Reset() noexcept
+{
+	mResetRequested = true;
+}
+
+void SFBLoudnessMeter::MeasurementThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.LoudnessMeter");
+
+	while(mMeasurementThreadRunning) {
+		if(mResetRequested.exchange(false)) {
+			std::fill(mGatedHistogram.begin(), mGatedHistogram.end(), 0);
+			mGatedBlockCount = 0;
+			mGatedEnergySum = 0;
+			mPeak = 0;
+			mIntegratedLoudness = -std::numeric_limits<double>::infinity();
+			mTruePeak = -std::numeric_limits<double>::infinity();
+		}
+
+		Block block;
+		while(mBlocks.Pop(block))
+			AddBlock(block);
+
+		std::this_thread::sleep_for(kMeasurementInterval);
+	}
+}
+
+void SFBLoudnessMeter::AddBlock(const Block& block) noexcept
+{
+	std::rotate(mRecentEnergies.begin(), mRecentEnergies.begin() + 1, mRecentEnergies.end());
+	mRecentEnergies.back() = block.mEnergy;
+	++mBlockCount;
+
+	// Before enough blocks have arrived the measurements include the silence preceding them
+	const auto momentaryEnergy = std::accumulate(mRecentEnergies.end() - kMomentaryBlockCount, mRecentEnergies.end(), 0.0) / (kMomentaryBlockCount * static_cast<double>(mBlockFrameCount));
+	const auto shortTermEnergy = std::accumulate(mRecentEnergies.begin(), mRecentEnergies.end(), 0.0) / (kShortTermBlockCount * static_cast<double>(mBlockFrameCount));
+	mMomentaryLoudness = LoudnessForEnergy(momentaryEnergy);
+	mShortTermLoudness = LoudnessForEnergy(shortTermEnergy);
+
+	// Each 100 ms completes a 400 ms gating block once the first has been filled
+	if(mBlockCount >= kMomentaryBlockCount && momentaryEnergy >= kAbsoluteGateEnergy) {
+		++mGatedHistogram[HistogramBinForEnergy(momentaryEnergy)];
+		++mGatedBlockCount;
+		mGatedEnergySum += momentaryEnergy;
+	}
+
+	// The relative gate is computed exactly and applied to the bins, so the cost doesn't grow with the measurement
+	if(mGatedBlockCount) {
+		const auto relativeGateEnergy = mGatedEnergySum / mGatedBlockCount * kRelativeGateRatio;
+		auto start = HistogramBinForEnergy(relativeGateEnergy);
+		if(relativeGateEnergy > mHistogramEnergies[start])
+			++start;
+
+		double sum = 0;
+		uint64_t count = 0;
+		for(auto i = start; i < kHistogramBinCount; ++i) {
+			sum += mGatedHistogram[i] * mHistogramEnergies[i];
+			count += mGatedHistogram[i];
+		}
+		mIntegratedLoudness = count ? LoudnessForEnergy(sum / count) : -std::numeric_limits<double>::infinity();
+	}
+
+	mPeak = std::max(mPeak, block.mPeak);
+	mTruePeak = mPeak > 0 ? 20 * std::log10(static_cast<double>(mPeak)) : -std::numeric_limits<double>::infinity();
+}
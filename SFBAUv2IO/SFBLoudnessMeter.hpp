@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <cstdint>
+#import <thread>
+#import <vector>
+
+#import "SFBMessageQueue.hpp"
+
+/// Measures loudness following ITU-R BS.1770-4 and EBU R 128
+///
+/// The render thread K-weights each channel, sums the weighted energy of each 100 ms block, and tracks the true peak by
+/// oversampling. Block energies are passed through a lock-free queue to a background thread that computes the momentary
+/// (400 ms), short-term (3 s), and gated integrated loudness. The filters and gating follow the reference implementation
+/// in libebur128, so loudness matches it on the EBU test vectors.
+class SFBLoudnessMeter
+{
+
+public:
+
+	/// The largest number of channels measured
+	static constexpr uint32_t kMaximumChannelCount = 32;
+
+	/// Loudness in LUFS and true peak in dBTP, or negative infinity before there is anything to measure
+	struct Measurements
+	{
+		/// The loudness of the last 400 ms
+		double mMomentaryLoudness;
+		/// The loudness of the last 3 s
+		double mShortTermLoudness;
+		/// The gated loudness since the meter was created or reset
+		double mIntegratedLoudness;
+		/// The highest true peak since the meter was created or reset
+		double mTruePeak;
+	};
+
+	/// Creates a new @c SFBLoudnessMeter and starts its background thread
+	/// @param sampleRate The sample rate of the measured audio
+	/// @param channelWeights The weight of each channel: @c 1 for front channels, @c 1.41 for surround channels, and
+	/// @c 0 for LFE channels, which are then measured for true peak only
+	/// @throw @c std::invalid_argument if @c sampleRate is not positive or there are no channels or too many
+	/// @throw @c std::bad_alloc
+	/// @throw @c std::system_error if the background thread could not be started
+	SFBLoudnessMeter(double sampleRate, std::vector<double> channelWeights);
+
+	// This class is non-copyable
+	SFBLoudnessMeter(const SFBLoudnessMeter& rhs) = delete;
+
+	// This class is non-assignable
+	SFBLoudnessMeter& operator=(const SFBLoudnessMeter& rhs) = delete;
+
+	~SFBLoudnessMeter();
+
+	// This class is non-movable
+	SFBLoudnessMeter(SFBLoudnessMeter&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBLoudnessMeter& operator=(SFBLoudnessMeter&& rhs) = delete;
+
+
+	inline uint32_t ChannelCount() const noexcept
+	{
+		return static_cast<uint32_t>(mChannelWeights.size());
+	}
+
+	/// Measures @c frameCount frames of deinterleaved audio
+	/// @param channels Pointers to the samples of each channel
+	/// @note Only a single thread may process audio at a time
+	void Process(const float * const *channels, uint32_t channelCount, uint32_t frameCount) noexcept;
+
+	/// Returns the most recent measurements
+	/// @note The measurements are updated every 100 ms and are read individually, not as a consistent set
+	Measurements CurrentMeasurements() const noexcept;
+
+	/// Restarts the integrated loudness and true peak
+	void Reset() noexcept;
+
+	/// Returns the number of 100 ms blocks lost because the background thread fell behind
+	inline uint64_t DroppedBlockCount() const noexcept
+	{
+		return mDroppedBlockCount.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	/// The measurements of one 100 ms block
+	struct Block
+	{
+		/// The weighted sum over channels of the squared K-weighted samples
+		double mEnergy;
+		/// The highest absolute sample or oversampled value
+		float mPeak;
+	};
+
+	/// Render thread state for one channel
+	struct Channel
+	{
+		/// The K-weighting filter state
+		double mFilterState [5];
+		/// The most recent samples, stored twice so the oversampling window is contiguous
+		std::vector<float> mHistory;
+		uint32_t mHistoryPosition;
+	};
+
+	void MeasurementThreadEntry();
+	/// Adds @c block to the measurements, requires the background thread
+	void AddBlock(const Block& block) noexcept;
+
+	std::vector<double> mChannelWeights;
+	/// The number of frames in a 100 ms block
+	uint32_t mBlockFrameCount;
+
+	/// The K-weighting filter coefficients, the two stages combined into one fourth-order section
+	double mFilterNumerator [5];
+	double mFilterDenominator [5];
+
+	/// The true-peak oversampling factor, or @c 1 if the sample rate is high enough that none is needed
+	uint32_t mOversamplingFactor;
+	/// The number of input samples in the oversampling window
+	uint32_t mOversamplingTapCount;
+	/// For each oversampled phase, the interpolation coefficients ordered from the oldest sample to the newest
+	std::vector<float> mOversamplingCoefficients;
+
+	/// Render thread state
+	std::vector<Channel> mChannels;
+	uint32_t mBlockPosition;
+	Block mBlock;
+
+	/// Render to background thread blocks
+	SFBMessageQueue<Block> mBlocks;
+	std::atomic_uint64_t mDroppedBlockCount;
+
+	/// Background thread state: the energies of the last 3 s of blocks, most recent last
+	std::vector<double> mRecentEnergies;
+	uint64_t mBlockCount;
+	/// The number of 400 ms gating blocks above the absolute gate in each 0.1 LU loudness bin, as in the reference implementation
+	std::vector<uint64_t> mGatedHistogram;
+	/// The energy at the center of each histogram bin
+	std::vector<double> mHistogramEnergies;
+	uint64_t mGatedBlockCount;
+	double mGatedEnergySum;
+	float mPeak;
+
+	std::atomic<double> mMomentaryLoudness;
+	std::atomic<double> mShortTermLoudness;
+	std::atomic<double> mIntegratedLoudness;
+	std::atomic<double> mTruePeak;
+
+	std::atomic_bool mResetRequested;
+	std::atomic_bool mMeasurementThreadRunning;
+	std::thread mMeasurementThread;
+
+};
@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <cstddef>
+#import <cstdint>
+#import <memory>
+#import <type_traits>
+
+/// A bounded lock-free multiple-producer multiple-consumer queue
+///
+/// Storage is allocated once at construction, so @c Push() and @c Pop() never allocate, lock, or wait and are safe to
+/// call from a render callback. Each cell carries a sequence number that tells producers and consumers whether it is
+/// free or full for the current lap around the queue (D. Vyukov's bounded MPMC queue).
+template <typename T>
+class SFBMessageQueue
+{
+
+	static_assert(std::is_trivially_copyable<T>::value, "Messages must be trivially copyable");
+
+public:
+
+	/// Creates a new @c SFBMessageQueue holding at least @c capacity messages
+	/// @throw @c std::bad_alloc
+	explicit SFBMessageQueue(size_t capacity)
+	: mMask(0), mEnqueuePosition(0), mDequeuePosition(0)
+	{
+		size_t size = 2;
+		while(size < capacity)
+			size <<= 1;
+
+		mCells = std::make_unique<Cell []>(size);
+		for(size_t i = 0; i < size; ++i)
+			mCells[i].mSequence.store(i, std::memory_order_relaxed);
+		mMask = size - 1;
+	}
+
+	// This class is non-copyable
+	SFBMessageQueue(const SFBMessageQueue& rhs) = delete;
+
+	// This class is non-assignable
+	SFBMessageQueue& operator=(const SFBMessageQueue& rhs) = delete;
+
+	~SFBMessageQueue() = default;
+
+	// This class is non-movable
+	SFBMessageQueue(SFBMessageQueue&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBMessageQueue& operator=(SFBMessageQueue&& rhs) = delete;
+
+
+	/// Appends @c message to the queue
+	/// @return @c false if the queue is full
+	bool Push(const T& message) noexcept
+	{
+		auto position = mEnqueuePosition.load(std::memory_order_relaxed);
+		for(;;) {
+			auto& cell = mCells[position & mMask];
+			const auto sequence = cell.mSequence.load(std::memory_order_acquire);
+			const auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if(difference == 0) {
+				if(mEnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.mMessage = message;
+					cell.mSequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if(difference < 0)
+				return false;
+			else
+				position = mEnqueuePosition.load(std::memory_order_relaxed);
+		}
+	}
+
+	/// Removes the oldest message from the queue and stores it in @c message
+	/// @return @c false if the queue is empty
+	bool Pop(T& message) noexcept
+	{
+		auto position = mDequeuePosition.load(std::memory_order_relaxed);
+		for(;;) {
+			auto& cell = mCells[position & mMask];
+			const auto sequence = cell.mSequence.load(std::memory_order_acquire);
+			const auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+			if(difference == 0) {
+				if(mDequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					message = cell.mMessage;
+					cell.mSequence.store(position + mMask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if(difference < 0)
+				return false;
+			else
+				position = mDequeuePosition.load(std::memory_order_relaxed);
+		}
+	}
+
+private:
+
+	struct Cell
+	{
+		std::atomic<size_t> mSequence;
+		T mMessage;
+	};
+
+	std::unique_ptr<Cell []> mCells;
+	size_t mMask;
+
+	// Producers and consumers update separate cache lines
+	alignas(64) std::atomic<size_t> mEnqueuePosition;
+	alignas(64) std::atomic<size_t> mDequeuePosition;
+
+};
@@ -0,0 +1,221 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBMultiReaderRingBuffer.hpp"
+
+#import <algorithm>
+#import <cstring>
+
+namespace {
+
+UInt32 NextPowerOfTwo(UInt32 value)
+{
+	UInt32 result = 1;
+	while(result < value)
+		result <<= 1;
+	return result;
+}
+
+}
+
+SFBMultiReaderRingBuffer::SFBMultiReaderRingBuffer() noexcept
+: mCapacityFrames(0), mCapacityFramesMask(0), mGeneration(0), mStartTime(0), mEndTime(0), mWriteEndTime(0)
+{}
+
+bool SFBMultiReaderRingBuffer::Allocate(const AudioStreamBasicDescription& format, UInt32 capacityFrames) noexcept
+{
+	if(capacityFrames == 0 || capacityFrames > 0x80000000)
+		return false;
+
+	capacityFrames = NextPowerOfTwo(capacityFrames);
+	if(!mBuffers.Allocate(format, capacityFrames, SFBAlignedBufferList::kCacheLineSize, true))
+		return false;
+
+	mCapacityFrames = capacityFrames;
+	mCapacityFramesMask = capacityFrames - 1;
+	mGeneration = 0;
+	mStartTime = 0;
+	mEndTime = 0;
+	mWriteEndTime = 0;
+
+	return true;
+}
+
+void SFBMultiReaderRingBuffer::Deallocate() noexcept
+{
+	mBuffers.Deallocate();
+	mCapacityFrames = 0;
+	mCapacityFramesMask = 0;
+	mGeneration = 0;
+}
+
+bool SFBMultiReaderRingBuffer::Write(const AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept
+{
+	if(frameCount > mCapacityFrames || !mBuffers)
+		return false;
+	if(frameCount == 0)
+		return true;
+
+	const auto endTime = mEndTime.load(std::memory_order_relaxed);
+
+	// The generation is odd while the bounds change; readers that loaded the old generation reject anything copied after this point
+	int64_t writeStartTime = endTime;
+	const auto generation = mGeneration.load(std::memory_order_relaxed);
+	if(generation == 0 || sampleTime < endTime || sampleTime - endTime >= mCapacityFrames) {
+		mGeneration.store(generation + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		mStartTime.store(sampleTime, std::memory_order_relaxed);
+		mEndTime.store(sampleTime, std::memory_order_relaxed);
+		mWriteEndTime.store(sampleTime, std::memory_order_relaxed);
+		mGeneration.store(generation + 2, std::memory_order_release);
+		writeStartTime = sampleTime;
+	}
+
+	const auto writeEndTime = sampleTime + frameCount;
+	mWriteEndTime.store(writeEndTime, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	const AudioBufferList *storage = mBuffers;
+	const UInt32 bytesPerFrame = mBuffers.Format().mBytesPerFrame;
+	const auto bufferCount = std::min(storage->mNumberBuffers, bufferList->mNumberBuffers);
+
+	// Fill a gap since the last write with silence, then copy, wrapping as needed
+	auto store = [&](int64_t time, UInt32 count, const AudioBufferList *source, UInt32 sourceOffset) {
+		while(count > 0) {
+			const auto offset = static_cast<UInt32>(time) & mCapacityFramesMask;
+			const auto chunk = std::min(count, mCapacityFrames - offset);
+			for(UInt32 i = 0; i < bufferCount; ++i) {
+				auto destination = static_cast<unsigned char *>(storage->mBuffers[i].mData) + offset * bytesPerFrame;
+				if(source)
+					std::memcpy(destination, static_cast<const unsigned char *>(source->mBuffers[i].mData) + sourceOffset * bytesPerFrame, chunk * bytesPerFrame);
+				else
+					std::memset(destination, 0, chunk * bytesPerFrame);
+			}
+			time += chunk;
+			sourceOffset += chunk;
+			count -= chunk;
+		}
+	};
+
+	if(sampleTime > writeStartTime)
+		store(writeStartTime, static_cast<UInt32>(sampleTime - writeStartTime), nullptr, 0);
+	store(sampleTime, frameCount, bufferList, 0);
+
+	mEndTime.store(writeEndTime, std::memory_order_release);
+
+	return true;
+}
+
+bool SFBMultiReaderRingBuffer::GetTimeBounds(int64_t& startTime, int64_t& endTime) const noexcept
+{
+	const auto generation = mGeneration.load(std::memory_order_acquire);
+	if(generation == 0 || generation & 1)
+		return false;
+
+	endTime = mEndTime.load(std::memory_order_acquire);
+	startTime = std::max(mStartTime.load(std::memory_order_acquire), mWriteEndTime.load(std::memory_order_acquire) - static_cast<int64_t>(mCapacityFrames));
+	return true;
+}
+
+bool SFBMultiReaderRingBuffer::Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) const noexcept
+{
+	return Fetch(bufferList, frameCount, sampleTime) == ReadResult::success;
+}
+
+SFBMultiReaderRingBuffer::ReadResult SFBMultiReaderRingBuffer::Fetch(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) const noexcept
+{
+	const auto generation = mGeneration.load(std::memory_order_acquire);
+	if(generation == 0 || generation & 1 || frameCount > mCapacityFrames)
+		return ReadResult::unavailable;
+
+	int64_t startTime, endTime;
+	endTime = mEndTime.load(std::memory_order_acquire);
+	startTime = std::max(mStartTime.load(std::memory_order_acquire), mWriteEndTime.load(std::memory_order_acquire) - static_cast<int64_t>(mCapacityFrames));
+
+	if(sampleTime < startTime)
+		return ReadResult::overwritten;
+	if(sampleTime + frameCount > endTime)
+		return ReadResult::unavailable;
+
+	const AudioBufferList *storage = mBuffers;
+	const UInt32 bytesPerFrame = mBuffers.Format().mBytesPerFrame;
+	const auto bufferCount = std::min(storage->mNumberBuffers, bufferList->mNumberBuffers);
+
+	const auto offset = static_cast<UInt32>(sampleTime) & mCapacityFramesMask;
+	const auto firstChunk = std::min(frameCount, mCapacityFrames - offset);
+	for(UInt32 i = 0; i < bufferCount; ++i) {
+		auto source = static_cast<const unsigned char *>(storage->mBuffers[i].mData);
+		auto destination = static_cast<unsigned char *>(bufferList->mBuffers[i].mData);
+		std::memcpy(destination, source + offset * bytesPerFrame, firstChunk * bytesPerFrame);
+		if(firstChunk < frameCount)
+			std::memcpy(destination + firstChunk * bytesPerFrame, source, (frameCount - firstChunk) * bytesPerFrame);
+		bufferList->mBuffers[i].mDataByteSize = frameCount * bytesPerFrame;
+	}
+
+	// Discard the copy if the writer began overwriting any of it
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if(mGeneration.load(std::memory_order_relaxed) != generation || mWriteEndTime.load(std::memory_order_relaxed) - static_cast<int64_t>(mCapacityFrames) > sampleTime)
+		return ReadResult::overwritten;
+
+	return ReadResult::success;
+}
+
+SFBMultiReaderRingBuffer::Reader::Reader(const SFBMultiReaderRingBuffer& ringBuffer) noexcept
+: mRingBuffer(ringBuffer), mPosition(-1), mOverrunCount(0)
+{}
+
+bool SFBMultiReaderRingBuffer::Reader::Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept
+{
+	switch(mRingBuffer.Fetch(bufferList, frameCount, sampleTime)) {
+		case ReadResult::success:
+			mPosition = sampleTime + frameCount;
+			return true;
+		case ReadResult::overwritten:
+			++mOverrunCount;
+			return false;
+		case ReadResult::unavailable:
+			return false;
+	}
+	return false;
+}
+
+bool SFBMultiReaderRingBuffer::Reader::ReadNext(AudioBufferList *bufferList, UInt32 frameCount) noexcept
+{
+	int64_t startTime, endTime;
+	if(!mRingBuffer.GetTimeBounds(startTime, endTime))
+		return false;
+
+	if(mPosition < 0)
+		mPosition = std::max(startTime, endTime - static_cast<int64_t>(frameCount));
+	else if(mPosition < startTime) {
+		++mOverrunCount;
+		mPosition = startTime;
+	}
+
+	switch(mRingBuffer.Fetch(bufferList, frameCount, mPosition)) {
+		case ReadResult::success:
+			mPosition += frameCount;
+			return true;
+		case ReadResult::overwritten:
+			++mOverrunCount;
+			return false;
+		case ReadResult::unavailable:
+			// The writer restarted at an earlier time
+			if(mPosition > endTime)
+				mPosition = -1;
+			return false;
+	}
+	return false;
+}
+
+UInt32 SFBMultiReaderRingBuffer::Reader::FramesAvailable() const noexcept
+{
+	int64_t startTime, endTime;
+	if(!mRingBuffer.GetTimeBounds(startTime, endTime))
+		return 0;
+
+	const auto position = mPosition < 0 ? startTime : std::max(mPosition, startTime);
+	return endTime > position ? static_cast<UInt32>(endTime - position) : 0;
+}
@@ -0,0 +1,144 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <cstdint>
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBAlignedBufferList.hpp"
+#import "SFBCAStreamBasicDescription.hpp"
+
+/// A timestamped audio ring buffer with one writer and any number of readers
+///
+/// Audio is stored once and indexed by sample time. The writer never waits for readers: it announces the range it is
+/// about to overwrite, copies, and then publishes the new end time. Readers copy optimistically and discard the
+/// result if the writer overwrote any of it in the meantime, so a reader that falls behind only affects itself.
+/// Writing at a sample time before the current end, or more than the capacity past it, discards the buffered audio;
+/// a smaller gap is filled with silence.
+class SFBMultiReaderRingBuffer
+{
+
+public:
+
+	class Reader;
+
+	SFBMultiReaderRingBuffer() noexcept;
+
+	// This class is non-copyable
+	SFBMultiReaderRingBuffer(const SFBMultiReaderRingBuffer& rhs) = delete;
+
+	// This class is non-assignable
+	SFBMultiReaderRingBuffer& operator=(const SFBMultiReaderRingBuffer& rhs) = delete;
+
+	~SFBMultiReaderRingBuffer() = default;
+
+	// This class is non-movable
+	SFBMultiReaderRingBuffer(SFBMultiReaderRingBuffer&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBMultiReaderRingBuffer& operator=(SFBMultiReaderRingBuffer&& rhs) = delete;
+
+
+	/// Allocates space for at least @c capacityFrames frames in @c format, rounded up to a power of two
+	/// @note This must not be called while the buffer is in use
+	/// @return @c true on success
+	bool Allocate(const AudioStreamBasicDescription& format, UInt32 capacityFrames) noexcept;
+	void Deallocate() noexcept;
+
+	inline const SFB::CAStreamBasicDescription& Format() const noexcept
+	{
+		return mBuffers.Format();
+	}
+
+	inline UInt32 CapacityFrames() const noexcept
+	{
+		return mCapacityFrames;
+	}
+
+	/// Stores @c frameCount frames from @c bufferList at @c sampleTime
+	/// @note This may only be called from a single thread at a time
+	/// @return @c false if @c frameCount exceeds the capacity
+	bool Write(const AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept;
+
+	/// Retrieves the range of sample times currently held
+	/// @return @c false if nothing has been written
+	bool GetTimeBounds(int64_t& startTime, int64_t& endTime) const noexcept;
+
+	/// Copies @c frameCount frames starting at @c sampleTime to @c bufferList
+	/// @return @c false if the frames are not all held or were overwritten during the copy
+	bool Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) const noexcept;
+
+private:
+
+	enum class ReadResult {
+		success,
+		/// The frames have not been written yet
+		unavailable,
+		/// The frames were overwritten before or during the read
+		overwritten,
+	};
+
+	ReadResult Fetch(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) const noexcept;
+
+	SFBAlignedBufferList mBuffers;
+	UInt32 mCapacityFrames;
+	UInt32 mCapacityFramesMask;
+
+	/// Advanced by two each time buffered audio is discarded and odd while that happens; zero until the first write
+	alignas(SFBAlignedBufferList::kCacheLineSize) std::atomic_uint64_t mGeneration;
+	/// The first sample time written since the last discontinuity
+	std::atomic<int64_t> mStartTime;
+	/// The sample time following the last frame published
+	std::atomic<int64_t> mEndTime;
+	/// The sample time following the last frame being written; frames before this less the capacity are gone
+	std::atomic<int64_t> mWriteEndTime;
+
+};
+
+/// A consumer of an @c SFBMultiReaderRingBuffer with its own position and overrun count
+///
+/// Each reader must be used from one thread at a time. Readers are not registered with the ring buffer,
+/// so the number of readers has no effect on the writer.
+class SFBMultiReaderRingBuffer::Reader
+{
+
+public:
+
+	/// Creates a reader positioned at the most recent frames of @c ringBuffer
+	explicit Reader(const SFBMultiReaderRingBuffer& ringBuffer) noexcept;
+
+	/// Copies @c frameCount frames starting at @c sampleTime and moves the position past them
+	bool Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t sampleTime) noexcept;
+
+	/// Copies the @c frameCount frames following the position
+	///
+	/// A reader that has fallen behind the writer counts an overrun and skips to the oldest frames held.
+	bool ReadNext(AudioBufferList *bufferList, UInt32 frameCount) noexcept;
+
+	/// Returns the number of frames following the position that are available to read
+	UInt32 FramesAvailable() const noexcept;
+
+	/// Returns the sample time of the next frame to read, or -1 if not yet positioned
+	inline int64_t Position() const noexcept
+	{
+		return mPosition;
+	}
+
+	/// Returns the number of reads that failed because the writer overwrote the requested frames
+	inline UInt64 OverrunCount() const noexcept
+	{
+		return mOverrunCount;
+	}
+
+private:
+
+	const SFBMultiReaderRingBuffer& mRingBuffer;
+	int64_t mPosition;
+	UInt64 mOverrunCount;
+
+};
@@ -0,0 +1,148 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <algorithm>
+#import <cstddef>
+#import <cstdint>
+
+/// RTP (RFC 3550) definitions shared by the network sender and receiver
+
+/// Linear PCM RTP payload encodings (RFC 3551, RFC 3190)
+enum class SFBRTPEncoding {
+	/// 16-bit big-endian signed integer
+	L16,
+	/// 24-bit big-endian signed integer
+	L24,
+};
+
+/// The size of an RTP header without CSRCs or extensions
+constexpr size_t kSFBRTPHeaderSize = 12;
+/// The largest datagram that avoids IP fragmentation on a 1500-byte MTU with IPv6
+constexpr size_t kSFBRTPMaximumDatagramSize = 1452;
+/// The largest RTP payload in a datagram
+constexpr size_t kSFBRTPMaximumPayloadSize = kSFBRTPMaximumDatagramSize - kSFBRTPHeaderSize;
+
+inline size_t SFBRTPBytesPerSample(SFBRTPEncoding encoding) noexcept
+{
+	return encoding == SFBRTPEncoding::L16 ? 2 : 3;
+}
+
+/// Writes an RTP header for a packet without CSRCs or extensions to @c header
+inline void SFBRTPWriteHeader(unsigned char *header, uint8_t payloadType, uint16_t sequenceNumber, uint32_t timestamp, uint32_t ssrc) noexcept
+{
+	header[0] = 0x80; // V=2
+	header[1] = payloadType & 0x7f;
+	header[2] = static_cast<unsigned char>(sequenceNumber >> 8);
+	header[3] = static_cast<unsigned char>(sequenceNumber);
+	header[4] = static_cast<unsigned char>(timestamp >> 24);
+	header[5] = static_cast<unsigned char>(timestamp >> 16);
+	header[6] = static_cast<unsigned char>(timestamp >> 8);
+	header[7] = static_cast<unsigned char>(timestamp);
+	header[8] = static_cast<unsigned char>(ssrc >> 24);
+	header[9] = static_cast<unsigned char>(ssrc >> 16);
+	header[10] = static_cast<unsigned char>(ssrc >> 8);
+	header[11] = static_cast<unsigned char>(ssrc);
+}
+
+/// Parses the RTP header in @c packet and returns the payload offset, or @c 0 if the packet is not valid RTP
+/// @param payloadLength Receives the payload length excluding padding
+inline size_t SFBRTPReadHeader(const unsigned char *packet, size_t length, uint8_t& payloadType, uint16_t& sequenceNumber, uint32_t& timestamp, uint32_t& ssrc, size_t& payloadLength) noexcept
+{
+	if(length < kSFBRTPHeaderSize || (packet[0] >> 6) != 2)
+		return 0;
+
+	payloadType = packet[1] & 0x7f;
+	sequenceNumber = static_cast<uint16_t>((packet[2] << 8) | packet[3]);
+	timestamp = (static_cast<uint32_t>(packet[4]) << 24) | (static_cast<uint32_t>(packet[5]) << 16) | (static_cast<uint32_t>(packet[6]) << 8) | packet[7];
+	ssrc = (static_cast<uint32_t>(packet[8]) << 24) | (static_cast<uint32_t>(packet[9]) << 16) | (static_cast<uint32_t>(packet[10]) << 8) | packet[11];
+
+	size_t offset = kSFBRTPHeaderSize + 4 * (packet[0] & 0x0f);
+	// Header extension
+	if(packet[0] & 0x10) {
+		if(length < offset + 4)
+			return 0;
+		offset += 4 + 4 * static_cast<size_t>((packet[offset + 2] << 8) | packet[offset + 3]);
+	}
+	// Padding
+	if(packet[0] & 0x20) {
+		if(length == 0 || packet[length - 1] > length)
+			return 0;
+		length -= packet[length - 1];
+	}
+
+	if(offset >= length)
+		return 0;
+
+	payloadLength = length - offset;
+	return offset;
+}
+
+/// Converts deinterleaved float samples to interleaved big-endian integers with the encoding and channel count fixed at compile time
+/// @note A @c ChannelCount of @c 0 uses @c channelCount
+template <SFBRTPEncoding Encoding, size_t ChannelCount>
+void SFBRTPEncodeSamplesSpecialized(const float * const *channels, size_t channelCount, size_t frameCount, unsigned char *payload) noexcept
+{
+	const float scale = Encoding == SFBRTPEncoding::L16 ? 32767.f : 8388607.f;
+	const size_t count = ChannelCount ? ChannelCount : channelCount;
+	for(size_t frame = 0; frame < frameCount; ++frame) {
+		for(size_t channel = 0; channel < count; ++channel) {
+			auto sample = static_cast<int32_t>(std::min(std::max(channels[channel][frame], -1.f), 1.f) * scale);
+			if(Encoding == SFBRTPEncoding::L24)
+				*payload++ = static_cast<unsigned char>(sample >> 16);
+			*payload++ = static_cast<unsigned char>(sample >> 8);
+			*payload++ = static_cast<unsigned char>(sample);
+		}
+	}
+}
+
+/// Converts interleaved big-endian integers to deinterleaved float samples with the encoding and channel count fixed at compile time
+/// @note A @c ChannelCount of @c 0 uses @c channelCount
+template <SFBRTPEncoding Encoding, size_t ChannelCount>
+void SFBRTPDecodeSamplesSpecialized(const unsigned char *payload, size_t channelCount, size_t frameCount, float * const *channels) noexcept
+{
+	const size_t count = ChannelCount ? ChannelCount : channelCount;
+	for(size_t frame = 0; frame < frameCount; ++frame) {
+		for(size_t channel = 0; channel < count; ++channel) {
+			if(Encoding == SFBRTPEncoding::L16) {
+				channels[channel][frame] = static_cast<int16_t>((payload[0] << 8) | payload[1]) / 32768.f;
+				payload += 2;
+			}
+			else {
+				auto sample = static_cast<int32_t>((static_cast<uint32_t>(payload[0]) << 24) | (static_cast<uint32_t>(payload[1]) << 16) | (static_cast<uint32_t>(payload[2]) << 8));
+				channels[channel][frame] = (sample >> 8) / 8388608.f;
+				payload += 3;
+			}
+		}
+	}
+}
+
+using SFBRTPSampleEncoder = void (*)(const float * const *channels, size_t channelCount, size_t frameCount, unsigned char *payload);
+using SFBRTPSampleDecoder = void (*)(const unsigned char *payload, size_t channelCount, size_t frameCount, float * const *channels);
+
+/// Returns the encoder specialized for @c encoding and @c channelCount, or a general one for uncommon channel counts
+inline SFBRTPSampleEncoder SFBRTPSelectEncoder(SFBRTPEncoding encoding, size_t channelCount) noexcept
+{
+	const bool l16 = encoding == SFBRTPEncoding::L16;
+	switch(channelCount) {
+		case 1:		return l16 ? SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L16, 1> : SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L24, 1>;
+		case 2:		return l16 ? SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L16, 2> : SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L24, 2>;
+		case 8:		return l16 ? SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L16, 8> : SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L24, 8>;
+		default:	return l16 ? SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L16, 0> : SFBRTPEncodeSamplesSpecialized<SFBRTPEncoding::L24, 0>;
+	}
+}
+
+/// Returns the decoder specialized for @c encoding and @c channelCount, or a general one for uncommon channel counts
+inline SFBRTPSampleDecoder SFBRTPSelectDecoder(SFBRTPEncoding encoding, size_t channelCount) noexcept
+{
+	const bool l16 = encoding == SFBRTPEncoding::L16;
+	switch(channelCount) {
+		case 1:		return l16 ? SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L16, 1> : SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L24, 1>;
+		case 2:		return l16 ? SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L16, 2> : SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L24, 2>;
+		case 8:		return l16 ? SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L16, 8> : SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L24, 8>;
+		default:	return l16 ? SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L16, 0> : SFBRTPDecodeSamplesSpecialized<SFBRTPEncoding::L24, 0>;
+	}
+}
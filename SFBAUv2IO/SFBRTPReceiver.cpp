@@ -0,0 +1,367 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBRTPReceiver.hpp"
+
+#import <algorithm>
+#import <cerrno>
+#import <chrono>
+#import <cmath>
+#import <cstring>
+#import <new>
+#import <stdexcept>
+#import <system_error>
+
+#import <netinet/in.h>
+#import <os/log.h>
+#import <pthread.h>
+#import <sys/socket.h>
+#import <sys/time.h>
+#import <unistd.h>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+/// The size of the receive buffer
+const size_t kDatagramCapacity = 2048;
+
+/// The number of packets held waiting for a missing packet before it is concealed
+const size_t kReorderPacketCount = 4;
+
+/// The jitter buffer capacity, in seconds
+const double kRingBufferDuration = 1;
+/// The smallest and largest jitter buffer targets, in seconds
+const double kMinimumLatencyDuration = 0.005;
+const double kMaximumLatencyDuration = 0.25;
+/// The target latency in multiples of the interarrival jitter, in addition to the reorder window
+const double kJitterLatencyMultiple = 4;
+
+/// The largest deviation from unity resampling ratio the drift servo may apply
+const double kMaximumRatioDeviation = 0.002;
+/// The servo gain, as ratio deviation per target latency of error
+const double kServoGain = 0.002;
+/// The smoothing factor applied to the buffered frame count error each render cycle
+const double kErrorSmoothing = 0.01;
+
+int BoundDatagramSocket(uint16_t port)
+{
+	// Prefer a dual-stack socket
+	int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if(fd != -1) {
+		int v6only = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+
+		struct sockaddr_in6 address = {};
+		address.sin6_family = AF_INET6;
+		address.sin6_addr = in6addr_any;
+		address.sin6_port = htons(port);
+		if(bind(fd, reinterpret_cast<const struct sockaddr *>(&address), sizeof(address)) == 0)
+			return fd;
+		close(fd);
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd == -1)
+		throw std::system_error(errno, std::generic_category(), "socket");
+
+	struct sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if(bind(fd, reinterpret_cast<const struct sockaddr *>(&address), sizeof(address)) == -1) {
+		auto error = errno;
+		close(fd);
+		throw std::system_error(error, std::generic_category(), "bind");
+	}
+
+	return fd;
+}
+
+double SecondsSinceEpoch()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+SFBRTPReceiver::SFBRTPReceiver(uint16_t port, SFBRTPEncoding encoding, UInt32 channelCount, Float64 sampleRate, UInt32 maximumFramesPerSlice, uint8_t payloadType)
+: mSocket(-1), mEncoding(encoding), mPayloadType(payloadType), mChannelCount(channelCount), mDecodeSamples(SFBRTPSelectDecoder(encoding, channelCount)), mSampleRate(sampleRate), mMaximumFramesPerPacket(0), mStreamStarted(false), mSSRC(0), mLastTimestamp(0), mExtendedTimestamp(0), mNextTimestamp(0), mLastTransit(0), mLastPacketFrameCount(0), mReadPosition(0), mFilteredError(0), mPrimed(false), mJitter(0), mTargetLatency(0), mRatio(1), mPacketsReceived(0), mPacketsLost(0), mPacketsLate(0), mUnderrunCount(0), mReceiverThreadRunning(false)
+{
+	if(channelCount == 0)
+		throw std::invalid_argument("channelCount == 0");
+	if(sampleRate <= 0)
+		throw std::invalid_argument("sampleRate <= 0");
+	if(payloadType > 127)
+		throw std::invalid_argument("Invalid payloadType");
+
+	mMaximumFramesPerPacket = static_cast<UInt32>(kSFBRTPMaximumPayloadSize / (channelCount * SFBRTPBytesPerSample(encoding)));
+	if(mMaximumFramesPerPacket == 0)
+		throw std::invalid_argument("Too many channels for a single datagram");
+
+	SFB::CAStreamBasicDescription format(SFB::CommonPCMFormat::float32, sampleRate, channelCount, false);
+	if(!mRingBuffer.Allocate(format, static_cast<UInt32>(kRingBufferDuration * sampleRate)))
+		throw std::bad_alloc();
+	if(!mDecodeBufferList.Allocate(format, mMaximumFramesPerPacket) || !mLastPacketBufferList.Allocate(format, mMaximumFramesPerPacket))
+		throw std::bad_alloc();
+	if(!mScratch.Allocate(format, static_cast<UInt32>(std::ceil(maximumFramesPerSlice * (1 + kMaximumRatioDeviation))) + 2))
+		throw std::bad_alloc();
+
+	const AudioBufferList *decode = mDecodeBufferList;
+	for(UInt32 i = 0; i < decode->mNumberBuffers; ++i)
+		mDecodeChannels.push_back(static_cast<float *>(decode->mBuffers[i].mData));
+
+	mPendingPackets.reserve(kReorderPacketCount + 1);
+	mTargetLatency = kMinimumLatencyDuration * sampleRate;
+
+	mSocket = BoundDatagramSocket(port);
+
+	// Wake periodically so the receiver thread notices when it should exit
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 100000;
+	setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	int bufferSize = 1 << 20;
+	setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+	mReceiverThreadRunning = true;
+	try {
+		mReceiverThread = std::thread(&SFBRTPReceiver::ReceiverThreadEntry, this);
+	}
+	catch(...) {
+		close(mSocket);
+		throw;
+	}
+}
+
+SFBRTPReceiver::~SFBRTPReceiver()
+{
+	if(mReceiverThread.joinable()) {
+		mReceiverThreadRunning = false;
+		mReceiverThread.join();
+	}
+
+	if(mSocket != -1)
+		close(mSocket);
+}
+
+bool SFBRTPReceiver::Render(AudioBufferList *bufferList, UInt32 frameCount) noexcept
+{
+	auto outputSilence = [&]() {
+		for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+			std::memset(bufferList->mBuffers[i].mData, 0, bufferList->mBuffers[i].mDataByteSize);
+		return false;
+	};
+
+	int64_t startTime, endTime;
+	if(!mRingBuffer.GetTimeBounds(startTime, endTime))
+		return outputSilence();
+
+	const double targetLatency = mTargetLatency;
+
+	// Wait until the jitter buffer fills before following the stream, and start over if it has overfilled
+	if(mPrimed && endTime - mReadPosition > 4 * targetLatency)
+		mPrimed = false;
+	if(!mPrimed) {
+		if(endTime - startTime < targetLatency)
+			return outputSilence();
+		mReadPosition = endTime - targetLatency;
+		mFilteredError = 0;
+		mRatio = 1;
+		mPrimed = true;
+	}
+
+	const double ratio = mRatio;
+
+	// Read the stream frames spanned by this cycle, plus one for interpolation
+	const auto firstFrame = static_cast<int64_t>(std::floor(mReadPosition));
+	const auto lastFrame = static_cast<int64_t>(std::floor(mReadPosition + (frameCount - 1) * ratio)) + 1;
+	const auto readFrameCount = static_cast<UInt32>(lastFrame - firstFrame + 1);
+
+	mScratch.Reset();
+	if(readFrameCount > mScratch.FrameCapacity() || lastFrame >= endTime || !mRingBuffer.Read(mScratch, readFrameCount, firstFrame)) {
+		++mUnderrunCount;
+		mPrimed = false;
+		return outputSilence();
+	}
+
+	// Linear interpolation
+	const AudioBufferList *scratch = mScratch;
+	const auto channels = std::min(bufferList->mNumberBuffers, scratch->mNumberBuffers);
+	const double offset = mReadPosition - firstFrame;
+	for(UInt32 channel = 0; channel < channels; ++channel) {
+		auto input = static_cast<const float *>(scratch->mBuffers[channel].mData);
+		auto output = static_cast<float *>(bufferList->mBuffers[channel].mData);
+		double position = offset;
+		for(UInt32 i = 0; i < frameCount; ++i, position += ratio) {
+			auto index = static_cast<UInt32>(position);
+			auto fraction = static_cast<float>(position - index);
+			output[i] = input[index] + fraction * (input[index + 1] - input[index]);
+		}
+	}
+	for(UInt32 channel = channels; channel < bufferList->mNumberBuffers; ++channel)
+		std::memset(bufferList->mBuffers[channel].mData, 0, bufferList->mBuffers[channel].mDataByteSize);
+
+	mReadPosition += frameCount * ratio;
+
+	// Steer the ratio to hold the buffered frame count at the target
+	auto error = (endTime - mReadPosition) - targetLatency;
+	mFilteredError += kErrorSmoothing * (error - mFilteredError);
+	auto deviation = kServoGain * mFilteredError / targetLatency;
+	mRatio = 1 + std::min(std::max(deviation, -kMaximumRatioDeviation), kMaximumRatioDeviation);
+
+	return true;
+}
+
+void SFBRTPReceiver::ReceiverThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.RTPReceiver");
+
+	std::vector<unsigned char> buffer(kDatagramCapacity);
+
+	// macOS has no public batched receive, so each datagram is a separate system call
+	while(mReceiverThreadRunning) {
+		auto length = recv(mSocket, buffer.data(), kDatagramCapacity, 0);
+		if(length <= 0)
+			continue;
+
+		ReceivePacket(buffer.data(), static_cast<size_t>(length), SecondsSinceEpoch());
+	}
+}
+
+void SFBRTPReceiver::ReceivePacket(const unsigned char *packet, size_t length, double arrivalTime)
+{
+	uint8_t payloadType;
+	uint16_t sequenceNumber;
+	uint32_t timestamp, ssrc;
+	size_t payloadLength;
+	auto payloadOffset = SFBRTPReadHeader(packet, length, payloadType, sequenceNumber, timestamp, ssrc, payloadLength);
+	if(!payloadOffset || payloadType != mPayloadType)
+		return;
+
+	const auto bytesPerFrame = mChannelCount * SFBRTPBytesPerSample(mEncoding);
+	if(payloadLength % bytesPerFrame || payloadLength / bytesPerFrame > mMaximumFramesPerPacket)
+		return;
+	const auto frameCount = static_cast<UInt32>(payloadLength / bytesPerFrame);
+
+	++mPacketsReceived;
+
+	if(!mStreamStarted || ssrc != mSSRC) {
+		// Continue the timeline after any previous stream so the jitter buffer is never written backward
+		int64_t startTime, endTime;
+		const auto start = mRingBuffer.GetTimeBounds(startTime, endTime) ? endTime : 0;
+		mSSRC = ssrc;
+		mLastTimestamp = timestamp;
+		mExtendedTimestamp = start;
+		mNextTimestamp = start;
+		mLastTransit = arrivalTime * mSampleRate - start;
+		mPendingPackets.clear();
+		mLastPacketFrameCount = 0;
+		mStreamStarted = true;
+	}
+	else {
+		mExtendedTimestamp += static_cast<int32_t>(timestamp - mLastTimestamp);
+		mLastTimestamp = timestamp;
+	}
+
+	// Interarrival jitter (RFC 3550 section 6.4.1)
+	const auto transit = arrivalTime * mSampleRate - mExtendedTimestamp;
+	const auto jitter = mJitter + (std::abs(transit - mLastTransit) - mJitter) / 16;
+	mLastTransit = transit;
+	mJitter = jitter;
+
+	// Leave room for the reorder window and the observed jitter
+	const auto targetLatency = (kReorderPacketCount + 1) * frameCount + kJitterLatencyMultiple * jitter;
+	mTargetLatency = std::min(std::max(targetLatency, kMinimumLatencyDuration * mSampleRate), kMaximumLatencyDuration * mSampleRate);
+
+	if(mExtendedTimestamp < mNextTimestamp) {
+		++mPacketsLate;
+		return;
+	}
+
+	auto position = std::lower_bound(mPendingPackets.begin(), mPendingPackets.end(), mExtendedTimestamp, [](const PendingPacket& pending, int64_t value) {
+		return pending.mTimestamp < value;
+	});
+	if(position != mPendingPackets.end() && position->mTimestamp == mExtendedTimestamp)
+		return;
+
+	PendingPacket pending = { mExtendedTimestamp, frameCount, std::vector<unsigned char>(packet + payloadOffset, packet + payloadOffset + payloadLength) };
+	mPendingPackets.insert(position, std::move(pending));
+
+	FlushPendingPackets();
+}
+
+void SFBRTPReceiver::FlushPendingPackets()
+{
+	while(!mPendingPackets.empty()) {
+		auto& first = mPendingPackets.front();
+
+		if(first.mTimestamp > mNextTimestamp) {
+			// Wait for the missing audio unless the reorder window is full
+			if(mPendingPackets.size() <= kReorderPacketCount)
+				break;
+			const auto gap = first.mTimestamp - mNextTimestamp;
+			Conceal(mNextTimestamp, gap);
+			mPacketsLost += static_cast<uint64_t>(std::max<int64_t>(1, gap / std::max<UInt32>(first.mFrameCount, 1)));
+			mNextTimestamp = first.mTimestamp;
+		}
+
+		if(first.mTimestamp < mNextTimestamp)
+			++mPacketsLate;
+		else {
+			WritePayload(first.mPayload.data(), first.mFrameCount, first.mTimestamp);
+			mNextTimestamp = first.mTimestamp + first.mFrameCount;
+		}
+
+		mPendingPackets.erase(mPendingPackets.begin());
+	}
+}
+
+void SFBRTPReceiver::WritePayload(const unsigned char *payload, UInt32 frameCount, int64_t timestamp)
+{
+	mDecodeSamples(payload, mChannelCount, frameCount, mDecodeChannels.data());
+	mDecodeBufferList.SetFrameLength(frameCount);
+
+	if(!mRingBuffer.Write(mDecodeBufferList, frameCount, timestamp))
+		os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %lld", timestamp);
+
+	// Keep the audio for concealment
+	const AudioBufferList *decode = mDecodeBufferList;
+	const AudioBufferList *last = mLastPacketBufferList;
+	for(UInt32 i = 0; i < mChannelCount; ++i)
+		std::memcpy(last->mBuffers[i].mData, decode->mBuffers[i].mData, frameCount * sizeof(float));
+	mLastPacketFrameCount = frameCount;
+}
+
+void SFBRTPReceiver::Conceal(int64_t timestamp, int64_t frameCount)
+{
+	const auto packetFrameCount = mLastPacketFrameCount;
+	if(packetFrameCount == 0)
+		return;
+
+	// Repeat the last packet while fading to silence over two packet durations;
+	// the jitter buffer fills the remainder of a longer gap with silence when the next packet is written
+	const auto concealedFrameCount = std::min<int64_t>(frameCount, 2 * packetFrameCount);
+	const AudioBufferList *last = mLastPacketBufferList;
+
+	for(int64_t done = 0; done < concealedFrameCount; ) {
+		const auto chunk = static_cast<UInt32>(std::min<int64_t>(concealedFrameCount - done, mMaximumFramesPerPacket));
+		for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+			auto input = static_cast<const float *>(last->mBuffers[channel].mData);
+			auto output = mDecodeChannels[channel];
+			for(UInt32 i = 0; i < chunk; ++i) {
+				const auto frame = done + i;
+				const auto gain = 1 - static_cast<float>(frame) / (2 * packetFrameCount);
+				output[i] = input[frame % packetFrameCount] * gain;
+			}
+		}
+		mDecodeBufferList.SetFrameLength(chunk);
+
+		if(!mRingBuffer.Write(mDecodeBufferList, chunk, timestamp + done))
+			os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %lld", timestamp + done);
+
+		done += chunk;
+	}
+}
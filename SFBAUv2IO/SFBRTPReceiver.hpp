@@ -0,0 +1,160 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <thread>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBCABufferList.hpp"
+#import "SFBCARingBuffer.hpp"
+#import "SFBRTP.hpp"
+
+/// Receives RTP audio over UDP for rendering on a mixer input bus
+///
+/// A receiver thread reorders packets, conceals lost packets by fading out the last packet received, and stores audio
+/// in a jitter buffer timestamped in the stream's RTP timeline. The render thread reads the jitter buffer with a
+/// fractional read position, resampling by a ratio adjusted to hold the amount of buffered audio at a target. The target
+/// adapts to the measured interarrival jitter. This compensates for drift between the sender's clock and the output device.
+class SFBRTPReceiver
+{
+
+public:
+
+	/// Creates a new @c SFBRTPReceiver
+	/// @param port The local UDP port
+	/// @param encoding The payload encoding
+	/// @param channelCount The number of channels in the stream
+	/// @param sampleRate The stream's sample rate, which must match the render sample rate
+	/// @param maximumFramesPerSlice The maximum number of frames passed to @c Render()
+	/// @param payloadType The RTP payload type to accept
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::system_error if the socket could not be created or the receiver thread could not be started
+	/// @throw @c std::bad_alloc
+	SFBRTPReceiver(uint16_t port, SFBRTPEncoding encoding, UInt32 channelCount, Float64 sampleRate, UInt32 maximumFramesPerSlice, uint8_t payloadType = 96);
+
+	// This class is non-copyable
+	SFBRTPReceiver(const SFBRTPReceiver& rhs) = delete;
+
+	// This class is non-assignable
+	SFBRTPReceiver& operator=(const SFBRTPReceiver& rhs) = delete;
+
+	~SFBRTPReceiver();
+
+	// This class is non-movable
+	SFBRTPReceiver(SFBRTPReceiver&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBRTPReceiver& operator=(SFBRTPReceiver&& rhs) = delete;
+
+
+	/// Renders @c frameCount frames of received audio to @c bufferList
+	/// @note This is called from the render thread
+	/// @return @c false if no audio was available and @c bufferList was cleared
+	bool Render(AudioBufferList *bufferList, UInt32 frameCount) noexcept;
+
+	inline UInt64 PacketsReceived() const noexcept
+	{
+		return mPacketsReceived;
+	}
+
+	/// Returns the number of packets that were concealed because they never arrived
+	inline UInt64 PacketsLost() const noexcept
+	{
+		return mPacketsLost;
+	}
+
+	/// Returns the number of packets discarded because they arrived after their audio was concealed
+	inline UInt64 PacketsLate() const noexcept
+	{
+		return mPacketsLate;
+	}
+
+	/// Returns the interarrival jitter in frames
+	inline double Jitter() const noexcept
+	{
+		return mJitter;
+	}
+
+	/// Returns the number of buffered frames the jitter buffer currently maintains
+	inline double TargetLatency() const noexcept
+	{
+		return mTargetLatency;
+	}
+
+	/// Returns the current resampling ratio of stream frames consumed per rendered frame
+	inline double Ratio() const noexcept
+	{
+		return mRatio;
+	}
+
+	inline UInt64 UnderrunCount() const noexcept
+	{
+		return mUnderrunCount;
+	}
+
+private:
+
+	/// A packet waiting for an earlier packet
+	struct PendingPacket
+	{
+		int64_t mTimestamp;
+		UInt32 mFrameCount;
+		std::vector<unsigned char> mPayload;
+	};
+
+	void ReceiverThreadEntry();
+	void ReceivePacket(const unsigned char *packet, size_t length, double arrivalTime);
+	/// Writes pending packets to the jitter buffer in order, concealing gaps that are not filled in time
+	void FlushPendingPackets();
+	void WritePayload(const unsigned char *payload, UInt32 frameCount, int64_t timestamp);
+	void Conceal(int64_t timestamp, int64_t frameCount);
+
+	int mSocket;
+	SFBRTPEncoding mEncoding;
+	uint8_t mPayloadType;
+	UInt32 mChannelCount;
+	/// Selected for the encoding and channel count
+	SFBRTPSampleDecoder mDecodeSamples;
+	Float64 mSampleRate;
+	UInt32 mMaximumFramesPerPacket;
+
+	SFB::CARingBuffer mRingBuffer;
+
+	// Receiver thread state
+	bool mStreamStarted;
+	uint32_t mSSRC;
+	uint32_t mLastTimestamp;
+	int64_t mExtendedTimestamp;
+	int64_t mNextTimestamp;
+	double mLastTransit;
+	std::vector<PendingPacket> mPendingPackets;
+	SFB::CABufferList mDecodeBufferList;
+	std::vector<float *> mDecodeChannels;
+	SFB::CABufferList mLastPacketBufferList;
+	UInt32 mLastPacketFrameCount;
+
+	// Render thread state
+	SFB::CABufferList mScratch;
+	double mReadPosition;
+	double mFilteredError;
+	bool mPrimed;
+
+	std::atomic<double> mJitter;
+	std::atomic<double> mTargetLatency;
+	std::atomic<double> mRatio;
+
+	std::atomic_uint64_t mPacketsReceived;
+	std::atomic_uint64_t mPacketsLost;
+	std::atomic_uint64_t mPacketsLate;
+	std::atomic_uint64_t mUnderrunCount;
+
+	std::atomic_bool mReceiverThreadRunning;
+	std::thread mReceiverThread;
+
+};
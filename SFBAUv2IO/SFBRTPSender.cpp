@@ -0,0 +1,191 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBRTPSender.hpp"
+
+#import <cerrno>
+#import <cmath>
+#import <new>
+#import <random>
+#import <stdexcept>
+#import <system_error>
+
+#import <netdb.h>
+#import <os/log.h>
+#import <pthread.h>
+#import <sys/socket.h>
+#import <unistd.h>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+/// The maximum number of packets encoded before any of them are sent
+const size_t kPacketsPerBatch = 16;
+/// The duration of audio the ring buffer holds, in seconds
+const double kRingBufferDuration = 0.5;
+
+int ConnectedDatagramSocket(const std::string& host, uint16_t port)
+{
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	struct addrinfo *addresses = nullptr;
+	auto result = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+	if(result != 0)
+		throw std::runtime_error(gai_strerror(result));
+
+	int error = 0;
+	for(auto address = addresses; address; address = address->ai_next) {
+		int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if(fd == -1) {
+			error = errno;
+			continue;
+		}
+		if(connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+			freeaddrinfo(addresses);
+			return fd;
+		}
+		error = errno;
+		close(fd);
+	}
+
+	freeaddrinfo(addresses);
+	throw std::system_error(error, std::generic_category(), "connect");
+}
+
+}
+
+SFBRTPSender::SFBRTPSender(const std::string& host, uint16_t port, const AudioStreamBasicDescription& format, SFBRTPEncoding encoding, double packetTime, uint8_t payloadType)
+: mSocket(-1), mEncoding(encoding), mPayloadType(payloadType), mSSRC(0), mTimestampOffset(0), mSequenceNumber(0), mChannelCount(0), mEncodeSamples(nullptr), mFramesPerPacket(0), mPacketSize(0), mPacketsSent(0), mSendErrorCount(0), mSenderThreadRunning(false), mSenderSemaphore(nullptr)
+{
+	SFB::CAStreamBasicDescription sendFormat(format);
+	if(!sendFormat.IsFloat() || !sendFormat.IsNonInterleaved() || sendFormat.mBitsPerChannel != 32)
+		throw std::invalid_argument("format must be deinterleaved 32-bit float");
+	if(payloadType > 127)
+		throw std::invalid_argument("Invalid payloadType");
+
+	mChannelCount = sendFormat.ChannelCount();
+	mEncodeSamples = SFBRTPSelectEncoder(encoding, mChannelCount);
+	mFramesPerPacket = static_cast<UInt32>(std::lround(packetTime * sendFormat.mSampleRate));
+	if(mFramesPerPacket == 0)
+		throw std::invalid_argument("Packet time too short");
+
+	const auto payloadSize = mFramesPerPacket * mChannelCount * SFBRTPBytesPerSample(encoding);
+	if(payloadSize > kSFBRTPMaximumPayloadSize)
+		throw std::invalid_argument("Packet time too long for a single datagram");
+	mPacketSize = kSFBRTPHeaderSize + payloadSize;
+
+	// RFC 3550 recommends random initial values
+	std::random_device random;
+	mSSRC = random();
+	mTimestampOffset = random();
+	mSequenceNumber = static_cast<uint16_t>(random());
+
+	auto capacityFrames = std::max(static_cast<UInt32>(kRingBufferDuration * sendFormat.mSampleRate), 4 * mFramesPerPacket);
+	if(!mRingBuffer.Allocate(sendFormat, capacityFrames))
+		throw std::bad_alloc();
+	if(!mPacketBufferList.Allocate(sendFormat, mFramesPerPacket))
+		throw std::bad_alloc();
+	mPackets.resize(kPacketsPerBatch * mPacketSize);
+
+	mSocket = ConnectedDatagramSocket(host, port);
+
+	mSenderSemaphore = dispatch_semaphore_create(0);
+	if(!mSenderSemaphore) {
+		close(mSocket);
+		throw std::bad_alloc();
+	}
+
+	mSenderThreadRunning = true;
+	try {
+		mSenderThread = std::thread(&SFBRTPSender::SenderThreadEntry, this);
+	}
+	catch(...) {
+		dispatch_release(mSenderSemaphore);
+		close(mSocket);
+		throw;
+	}
+}
+
+SFBRTPSender::~SFBRTPSender()
+{
+	if(mSenderThread.joinable()) {
+		mSenderThreadRunning = false;
+		dispatch_semaphore_signal(mSenderSemaphore);
+		mSenderThread.join();
+	}
+
+	if(mSenderSemaphore)
+		dispatch_release(mSenderSemaphore);
+	if(mSocket != -1)
+		close(mSocket);
+}
+
+void SFBRTPSender::Write(const AudioBufferList *bufferList, UInt32 frameCount, const AudioTimeStamp& timeStamp) noexcept
+{
+	if(!mRingBuffer.Write(bufferList, frameCount, static_cast<int64_t>(timeStamp.mSampleTime)))
+		os_log_debug(OS_LOG_DEFAULT, "SFBCARingBuffer::Write failed at sample time %.0f", timeStamp.mSampleTime);
+	dispatch_semaphore_signal(mSenderSemaphore);
+}
+
+void SFBRTPSender::SenderThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.RTPSender");
+
+	std::vector<const float *> channels(mChannelCount);
+
+	int64_t nextSampleTime = -1;
+	while(mSenderThreadRunning) {
+		dispatch_semaphore_wait(mSenderSemaphore, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+
+		int64_t startTime, endTime;
+		if(!mRingBuffer.GetTimeBounds(startTime, endTime))
+			continue;
+
+		// Follow discontinuities in the render timeline, such as after a restart
+		if(nextSampleTime < startTime || nextSampleTime > endTime)
+			nextSampleTime = startTime;
+
+		size_t packetCount = 0;
+		while(mSenderThreadRunning && nextSampleTime + mFramesPerPacket <= endTime) {
+			mPacketBufferList.Reset();
+			if(!mRingBuffer.Read(mPacketBufferList, mFramesPerPacket, nextSampleTime)) {
+				nextSampleTime = -1;
+				break;
+			}
+
+			const AudioBufferList *abl = mPacketBufferList;
+			for(UInt32 i = 0; i < mChannelCount; ++i)
+				channels[i] = static_cast<const float *>(abl->mBuffers[i].mData);
+
+			auto packet = mPackets.data() + packetCount * mPacketSize;
+			SFBRTPWriteHeader(packet, mPayloadType, mSequenceNumber++, static_cast<uint32_t>(nextSampleTime) + mTimestampOffset, mSSRC);
+			mEncodeSamples(channels.data(), mChannelCount, mFramesPerPacket, packet + kSFBRTPHeaderSize);
+
+			nextSampleTime += mFramesPerPacket;
+			if(++packetCount == kPacketsPerBatch) {
+				SendPackets(packetCount);
+				packetCount = 0;
+			}
+		}
+
+		if(packetCount)
+			SendPackets(packetCount);
+	}
+}
+
+void SFBRTPSender::SendPackets(size_t packetCount)
+{
+	// macOS has no public batched send, so each packet is a separate system call
+	for(size_t i = 0; i < packetCount; ++i) {
+		if(send(mSocket, mPackets.data() + i * mPacketSize, mPacketSize, 0) == -1)
+			++mSendErrorCount;
+		else
+			++mPacketsSent;
+	}
+}
@@ -0,0 +1,112 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <string>
+#import <thread>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+#import <dispatch/dispatch.h>
+
+#import "SFBCABufferList.hpp"
+#import "SFBCARingBuffer.hpp"
+#import "SFBRTP.hpp"
+
+/// Sends audio rendered for the output device to a remote receiver as RTP over UDP
+///
+/// The output render callback stores each block with @c Write() in a lock-free ring buffer timestamped in the output
+/// device's sample timeline. A sender thread packetizes buffered audio and sends several packets per system call.
+/// RTP timestamps are the render sample times plus a random offset, so gaps in rendering appear as timestamp gaps.
+class SFBRTPSender
+{
+
+public:
+
+	/// Creates a new @c SFBRTPSender
+	/// @param host The receiver's host name or address
+	/// @param port The receiver's UDP port
+	/// @param format The deinterleaved 32-bit float format of the audio to send
+	/// @param encoding The payload encoding
+	/// @param packetTime The duration of audio in each packet, in seconds
+	/// @param payloadType The RTP payload type
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::runtime_error if @c host could not be resolved
+	/// @throw @c std::system_error if the socket could not be created or the sender thread could not be started
+	/// @throw @c std::bad_alloc
+	SFBRTPSender(const std::string& host, uint16_t port, const AudioStreamBasicDescription& format, SFBRTPEncoding encoding, double packetTime, uint8_t payloadType = 96);
+
+	// This class is non-copyable
+	SFBRTPSender(const SFBRTPSender& rhs) = delete;
+
+	// This class is non-assignable
+	SFBRTPSender& operator=(const SFBRTPSender& rhs) = delete;
+
+	~SFBRTPSender();
+
+	// This class is non-movable
+	SFBRTPSender(SFBRTPSender&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBRTPSender& operator=(SFBRTPSender&& rhs) = delete;
+
+
+	inline UInt32 FramesPerPacket() const noexcept
+	{
+		return mFramesPerPacket;
+	}
+
+	inline uint32_t SSRC() const noexcept
+	{
+		return mSSRC;
+	}
+
+	/// Stores @c frameCount frames rendered at @c timeStamp for sending
+	/// @note This is called from the output render callback
+	void Write(const AudioBufferList *bufferList, UInt32 frameCount, const AudioTimeStamp& timeStamp) noexcept;
+
+	inline UInt64 PacketsSent() const noexcept
+	{
+		return mPacketsSent;
+	}
+
+	inline UInt64 SendErrorCount() const noexcept
+	{
+		return mSendErrorCount;
+	}
+
+private:
+
+	void SenderThreadEntry();
+	/// Sends the first @c packetCount packets in @c mPackets
+	void SendPackets(size_t packetCount);
+
+	int mSocket;
+	SFBRTPEncoding mEncoding;
+	uint8_t mPayloadType;
+	uint32_t mSSRC;
+	uint32_t mTimestampOffset;
+	uint16_t mSequenceNumber;
+	UInt32 mChannelCount;
+	/// Selected for the encoding and channel count
+	SFBRTPSampleEncoder mEncodeSamples;
+	UInt32 mFramesPerPacket;
+	size_t mPacketSize;
+
+	SFB::CARingBuffer mRingBuffer;
+	SFB::CABufferList mPacketBufferList;
+	/// Packet storage for one batch
+	std::vector<unsigned char> mPackets;
+
+	std::atomic_uint64_t mPacketsSent;
+	std::atomic_uint64_t mSendErrorCount;
+
+	std::atomic_bool mSenderThreadRunning;
+	std::thread mSenderThread;
+	dispatch_semaphore_t mSenderSemaphore;
+
+};
@@ -0,0 +1,73 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBRealFFT.hpp"
+
+#import <new>
+#import <stdexcept>
+
+namespace {
+
+inline DSPSplitComplex Offset(const DSPSplitComplex& z, vDSP_Length offset) noexcept
+{
+	return { z.realp + offset, z.imagp + offset };
+}
+
+}
+
+SFBRealFFT::SFBRealFFT(vDSP_Length size)
+: mSize(size), mLog2Size(0), mSetup(nullptr)
+{
+	if(size < 4 || (size & (size - 1)))
+		throw std::invalid_argument("size must be a power of two >= 4");
+
+	while((vDSP_Length{1} << mLog2Size) < size)
+		++mLog2Size;
+
+	mSetup = vDSP_create_fftsetup(mLog2Size, kFFTRadix2);
+	if(!mSetup)
+		throw std::bad_alloc();
+}
+
+SFBRealFFT::~SFBRealFFT()
+{
+	if(mSetup)
+		vDSP_destroy_fftsetup(mSetup);
+}
+
+void SFBRealFFT::Forward(const float *input, const DSPSplitComplex& output) const noexcept
+{
+	vDSP_ctoz(reinterpret_cast<const DSPComplex *>(input), 2, &output, 1, BinCount());
+	vDSP_fft_zrip(mSetup, &output, 1, mLog2Size, kFFTDirection_Forward);
+}
+
+void SFBRealFFT::Inverse(const DSPSplitComplex& input, float *output) const noexcept
+{
+	vDSP_fft_zrip(mSetup, &input, 1, mLog2Size, kFFTDirection_Inverse);
+	vDSP_ztoc(&input, 1, reinterpret_cast<DSPComplex *>(output), 2, BinCount());
+}
+
+void SFBRealFFT::MultiplyAccumulate(const DSPSplitComplex& a, const DSPSplitComplex& b, const DSPSplitComplex& acc, vDSP_Length n) noexcept
+{
+	// DC and Nyquist are purely real and packed into element 0
+	acc.realp[0] += a.realp[0] * b.realp[0];
+	acc.imagp[0] += a.imagp[0] * b.imagp[0];
+
+	auto a1 = Offset(a, 1);
+	auto b1 = Offset(b, 1);
+	auto acc1 = Offset(acc, 1);
+	vDSP_zvma(&a1, 1, &b1, 1, &acc1, 1, &acc1, 1, n - 1);
+}
+
+void SFBRealFFT::ConjugateMultiply(const DSPSplitComplex& a, const DSPSplitComplex& b, const DSPSplitComplex& result, vDSP_Length n) noexcept
+{
+	auto dc = a.realp[0] * b.realp[0];
+	auto nyquist = a.imagp[0] * b.imagp[0];
+
+	vDSP_zvmul(&a, 1, &b, 1, &result, 1, n, -1);
+
+	result.realp[0] = dc;
+	result.imagp[0] = nyquist;
+}
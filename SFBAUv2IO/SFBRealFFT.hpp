@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <Accelerate/Accelerate.h>
+
+/// A thin wrapper around vDSP's packed real FFT
+///
+/// Spectra use the @c vDSP_fft_zrip packed format: @c Size() / 2 complex bins with the purely real DC and Nyquist
+/// components stored in @c realp[0] and @c imagp[0] respectively.
+/// A forward transform followed by an inverse transform scales the signal by 2 × @c Size().
+class SFBRealFFT
+{
+
+public:
+
+	/// Creates a new @c SFBRealFFT
+	/// @param size The transform size in real samples, must be a power of two ≥ 4
+	/// @throw @c std::invalid_argument if @c size is not a power of two ≥ 4
+	/// @throw @c std::bad_alloc
+	explicit SFBRealFFT(vDSP_Length size);
+
+	// This class is non-copyable
+	SFBRealFFT(const SFBRealFFT& rhs) = delete;
+
+	// This class is non-assignable
+	SFBRealFFT& operator=(const SFBRealFFT& rhs) = delete;
+
+	~SFBRealFFT();
+
+	// This class is non-movable
+	SFBRealFFT(SFBRealFFT&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBRealFFT& operator=(SFBRealFFT&& rhs) = delete;
+
+
+	/// Returns the transform size in real samples
+	inline vDSP_Length Size() const noexcept
+	{
+		return mSize;
+	}
+
+	/// Returns the number of packed complex bins
+	inline vDSP_Length BinCount() const noexcept
+	{
+		return mSize / 2;
+	}
+
+	/// Transforms @c Size() real samples from @c input to @c BinCount() packed bins in @c output
+	void Forward(const float *input, const DSPSplitComplex& output) const noexcept;
+
+	/// Transforms @c BinCount() packed bins from @c input to @c Size() real samples in @c output
+	/// @note The contents of @c input are overwritten
+	void Inverse(const DSPSplitComplex& input, float *output) const noexcept;
+
+	/// Computes @c acc += @c a × @c b for @c n packed bins
+	static void MultiplyAccumulate(const DSPSplitComplex& a, const DSPSplitComplex& b, const DSPSplitComplex& acc, vDSP_Length n) noexcept;
+
+	/// Computes @c result = conj(@c a) × @c b for @c n packed bins
+	static void ConjugateMultiply(const DSPSplitComplex& a, const DSPSplitComplex& b, const DSPSplitComplex& result, vDSP_Length n) noexcept;
+
+private:
+
+	vDSP_Length mSize;
+	vDSP_Length mLog2Size;
+	FFTSetup mSetup;
+
+};
@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBRenderKernels.hpp"
+
+#import <algorithm>
+#import <cstring>
+
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+// Deinterleaved 32-bit float kernels
+// A Channels of 0 uses the buffer count and a Frames of 0 uses the frame count passed in;
+// a fixed-size kernel called with a different frame count defers to the variable-size kernel
+
+template <UInt32 Channels, UInt32 Frames>
+void ClearFloat(AudioBufferList *bufferList, UInt32 frameCount)
+{
+	if(Frames && frameCount != Frames)
+		return ClearFloat<Channels, 0>(bufferList, frameCount);
+
+	const UInt32 channels = Channels ? Channels : bufferList->mNumberBuffers;
+	const UInt32 frames = Frames ? Frames : frameCount;
+	for(UInt32 i = 0; i < channels; ++i) {
+		std::memset(bufferList->mBuffers[i].mData, 0, frames * sizeof(float));
+		bufferList->mBuffers[i].mDataByteSize = frames * sizeof(float);
+	}
+}
+
+template <UInt32 Channels, UInt32 Frames>
+void AccumulateFloat(const AudioBufferList *source, AudioBufferList *destination, UInt32 frameCount)
+{
+	if(Frames && frameCount != Frames)
+		return AccumulateFloat<Channels, 0>(source, destination, frameCount);
+
+	const UInt32 channels = Channels ? Channels : std::min(source->mNumberBuffers, destination->mNumberBuffers);
+	const UInt32 frames = Frames ? Frames : frameCount;
+	for(UInt32 i = 0; i < channels; ++i) {
+		auto input = static_cast<const float *>(source->mBuffers[i].mData);
+		auto output = static_cast<float *>(destination->mBuffers[i].mData);
+		for(UInt32 j = 0; j < frames; ++j)
+			output[j] += input[j];
+	}
+}
+
+template <UInt32 Channels, UInt32 Frames>
+SFBRenderKernels FloatKernels() noexcept
+{
+	return { ClearFloat<Channels, Frames>, AccumulateFloat<Channels, Frames> };
+}
+
+template <UInt32 Channels>
+SFBRenderKernels FloatKernels(UInt32 framesPerSlice) noexcept
+{
+	switch(framesPerSlice) {
+		case 64:	return FloatKernels<Channels, 64>();
+		case 128:	return FloatKernels<Channels, 128>();
+		case 256:	return FloatKernels<Channels, 256>();
+		case 512:	return FloatKernels<Channels, 512>();
+		case 1024:	return FloatKernels<Channels, 1024>();
+		case 2048:	return FloatKernels<Channels, 2048>();
+		case 4096:	return FloatKernels<Channels, 4096>();
+		default:	return FloatKernels<Channels, 0>();
+	}
+}
+
+// General kernels for any format, using the buffer byte sizes
+
+// The byte sizes cover the whole slice, so the frame count is unused; it is only part of the mClear signature
+void ClearBytes(AudioBufferList *bufferList, UInt32 /*frameCount*/)
+{
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+		std::memset(bufferList->mBuffers[i].mData, 0, bufferList->mBuffers[i].mDataByteSize);
+}
+
+}
+
+SFBRenderKernels SFBRenderKernels::KernelsForFormat(const AudioStreamBasicDescription& format, UInt32 framesPerSlice) noexcept
+{
+	SFB::CAStreamBasicDescription kernelFormat(format);
+	if(kernelFormat.IsFloat() && kernelFormat.IsNonInterleaved() && kernelFormat.mBitsPerChannel == 32) {
+		switch(kernelFormat.ChannelCount()) {
+			case 1:		return FloatKernels<1>(framesPerSlice);
+			case 2:		return FloatKernels<2>(framesPerSlice);
+			case 8:		return FloatKernels<8>(framesPerSlice);
+			default:	return FloatKernels<0, 0>();
+		}
+	}
+
+	return { ClearBytes, nullptr };
+}
@@ -0,0 +1,25 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <CoreAudio/CoreAudio.h>
+
+/// Buffer operations for the render thread, specialized for one format and selected once
+///
+/// Deinterleaved 32-bit float audio with one, two, or eight channels uses kernels with the channel count fixed at
+/// compile time, and additionally the frame count when the expected slice size is a power of two from 64 to 4096,
+/// so the compiler can unroll and vectorize them. Other formats, and slices of an unexpected size, use general kernels.
+struct SFBRenderKernels
+{
+	/// Zeroes @c frameCount frames in every buffer of @c bufferList
+	void (*mClear)(AudioBufferList *bufferList, UInt32 frameCount);
+	/// Adds @c frameCount frames of @c source to @c destination
+	/// @note This is @c nullptr unless the format is 32-bit float
+	void (*mAccumulate)(const AudioBufferList *source, AudioBufferList *destination, UInt32 frameCount);
+
+	/// Returns the kernels for @c format when rendering slices of @c framesPerSlice frames
+	static SFBRenderKernels KernelsForFormat(const AudioStreamBasicDescription& format, UInt32 framesPerSlice) noexcept;
+};
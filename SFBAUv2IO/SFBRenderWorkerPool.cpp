@@ -0,0 +1,173 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBRenderWorkerPool.hpp"
+
+#import <algorithm>
+#import <stdexcept>
+
+#import <mach/mach.h>
+#import <mach/mach_time.h>
+#import <mach/thread_policy.h>
+#import <os/log.h>
+#import <pthread.h>
+
+namespace {
+
+/// Bit layout of the work word
+const uint64_t kIndexBits = 20;
+const uint64_t kCountBits = 20;
+const uint64_t kFieldMask = (uint64_t{1} << kIndexBits) - 1;
+
+inline uint64_t Cycle(uint64_t work) noexcept
+{
+	return work >> (kIndexBits + kCountBits);
+}
+
+inline size_t TaskCount(uint64_t work) noexcept
+{
+	return static_cast<size_t>((work >> kIndexBits) & kFieldMask);
+}
+
+inline size_t NextTask(uint64_t work) noexcept
+{
+	return static_cast<size_t>(work & kFieldMask);
+}
+
+/// The number of times an idle worker checks for a new cycle before sleeping
+const int kSpinCount = 4096;
+
+/// Hints to the processor that the calling thread is busy-waiting, freeing resources for a sibling hardware thread
+inline void SpinPause() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__arm64__) || defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+}
+
+SFBRenderWorkerPool::SFBRenderWorkerPool(size_t threadCount, double period)
+: mSemaphore(nullptr), mRunning(true), mPeriod(0), mWork(0), mCompletedTaskCount(0), mTask(nullptr), mContext(nullptr)
+{
+	if(threadCount == 0)
+		throw std::invalid_argument("threadCount == 0");
+
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	mPeriod = static_cast<uint64_t>(period * 1e9 * timebase.denom / timebase.numer);
+
+	mSemaphore = dispatch_semaphore_create(0);
+	if(!mSemaphore)
+		throw std::runtime_error("dispatch_semaphore_create failed");
+
+	try {
+		for(size_t i = 0; i < threadCount; ++i)
+			mThreads.emplace_back(&SFBRenderWorkerPool::ThreadEntry, this);
+	}
+	catch(...) {
+		mRunning = false;
+		for(size_t i = 0; i < mThreads.size(); ++i)
+			dispatch_semaphore_signal(mSemaphore);
+		for(auto& thread : mThreads)
+			thread.join();
+		dispatch_release(mSemaphore);
+		throw;
+	}
+}
+
+SFBRenderWorkerPool::~SFBRenderWorkerPool()
+{
+	mRunning = false;
+	for(size_t i = 0; i < mThreads.size(); ++i)
+		dispatch_semaphore_signal(mSemaphore);
+	for(auto& thread : mThreads)
+		thread.join();
+	dispatch_release(mSemaphore);
+}
+
+void SFBRenderWorkerPool::Run(Task task, void *context, size_t taskCount) noexcept
+{
+	if(taskCount == 0)
+		return;
+	if(taskCount == 1 || taskCount > kMaximumTaskCount) {
+		for(size_t i = 0; i < taskCount; ++i)
+			task(context, i);
+		return;
+	}
+
+	// Every task of the previous cycle was claimed and finished, so no worker still reads these
+	mTask.store(task, std::memory_order_relaxed);
+	mContext.store(context, std::memory_order_relaxed);
+	mCompletedTaskCount.store(0, std::memory_order_relaxed);
+
+	const auto cycle = Cycle(mWork.load(std::memory_order_relaxed)) + 1;
+	const auto work = (cycle << (kIndexBits + kCountBits)) | (static_cast<uint64_t>(taskCount) << kIndexBits);
+	mWork.store(work, std::memory_order_release);
+
+	const auto wakeCount = std::min(mThreads.size(), taskCount - 1);
+	for(size_t i = 0; i < wakeCount; ++i)
+		dispatch_semaphore_signal(mSemaphore);
+
+	RunTasks(work);
+
+	while(mCompletedTaskCount.load(std::memory_order_acquire) < taskCount)
+		SpinPause();
+}
+
+void SFBRenderWorkerPool::RunTasks(uint64_t work) noexcept
+{
+	const auto cycle = Cycle(work);
+	const auto taskCount = TaskCount(work);
+
+	// A claim only succeeds while this cycle has unclaimed tasks, so the task and context read before it belong to this cycle
+	const auto task = mTask.load(std::memory_order_relaxed);
+	const auto context = mContext.load(std::memory_order_relaxed);
+
+	for(;;) {
+		if(Cycle(work) != cycle || NextTask(work) >= taskCount)
+			return;
+		if(!mWork.compare_exchange_weak(work, work + 1, std::memory_order_acquire, std::memory_order_acquire))
+			continue;
+
+		task(context, NextTask(work));
+		mCompletedTaskCount.fetch_add(1, std::memory_order_release);
+		work = mWork.load(std::memory_order_acquire);
+	}
+}
+
+void SFBRenderWorkerPool::ThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.RenderWorker");
+
+	// Request the same scheduling as the render thread; the computation may use most of the cycle
+	thread_time_constraint_policy_data_t policy;
+	policy.period = static_cast<uint32_t>(mPeriod);
+	policy.computation = static_cast<uint32_t>(mPeriod / 2);
+	policy.constraint = static_cast<uint32_t>(mPeriod);
+	policy.preemptible = true;
+	auto result = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY, reinterpret_cast<thread_policy_t>(&policy), THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+	if(result != KERN_SUCCESS)
+		os_log_error(OS_LOG_DEFAULT, "Unable to set render worker thread policy: %d", result);
+
+	uint64_t lastCycle = 0;
+	while(mRunning) {
+		int spins = 0;
+		uint64_t work;
+		while(Cycle(work = mWork.load(std::memory_order_acquire)) == lastCycle && mRunning) {
+			if(++spins >= kSpinCount) {
+				dispatch_semaphore_wait(mSemaphore, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+				spins = 0;
+			}
+			else
+				SpinPause();
+		}
+
+		lastCycle = Cycle(work);
+		RunTasks(work);
+	}
+}
@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <thread>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+#import <dispatch/dispatch.h>
+
+/// Real-time threads that help the render thread finish independent tasks within a render cycle
+///
+/// The threads are started once and use the time constraint policy of the render thread. A cycle is published
+/// by advancing an atomic work word holding the cycle number, task count, and next task index; the render thread and
+/// the workers claim tasks from it with compare-and-swap until none remain, so an idle thread always takes the next unclaimed
+/// task. The render thread then spins on an atomic completion count. No locks are taken. Workers spin briefly between cycles
+/// before sleeping on a semaphore that the render thread signals when it publishes a cycle.
+class SFBRenderWorkerPool
+{
+
+public:
+
+	/// Runs task @c task of a cycle
+	using Task = void (*)(void *context, size_t task);
+
+	/// The largest number of tasks in a cycle
+	static constexpr size_t kMaximumTaskCount = (1 << 20) - 1;
+
+	/// Creates a new @c SFBRenderWorkerPool
+	/// @param threadCount The number of worker threads in addition to the render thread
+	/// @param period The render cycle duration in seconds
+	/// @throw @c std::invalid_argument if @c threadCount is zero
+	/// @throw @c std::runtime_error if the semaphore could not be created
+	/// @throw @c std::system_error if a thread could not be started
+	SFBRenderWorkerPool(size_t threadCount, double period);
+
+	// This class is non-copyable
+	SFBRenderWorkerPool(const SFBRenderWorkerPool& rhs) = delete;
+
+	// This class is non-assignable
+	SFBRenderWorkerPool& operator=(const SFBRenderWorkerPool& rhs) = delete;
+
+	~SFBRenderWorkerPool();
+
+	// This class is non-movable
+	SFBRenderWorkerPool(SFBRenderWorkerPool&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBRenderWorkerPool& operator=(SFBRenderWorkerPool&& rhs) = delete;
+
+
+	inline size_t ThreadCount() const noexcept
+	{
+		return mThreads.size();
+	}
+
+	/// Runs @c task for every index less than @c taskCount on the workers and the calling thread, returning once all have finished
+	/// @note This may only be called from a single thread at a time
+	void Run(Task task, void *context, size_t taskCount) noexcept;
+
+private:
+
+	void ThreadEntry();
+	/// Claims and runs tasks of the cycle in @c work until none remain
+	void RunTasks(uint64_t work) noexcept;
+
+	std::vector<std::thread> mThreads;
+	dispatch_semaphore_t mSemaphore;
+	std::atomic_bool mRunning;
+	/// The render cycle duration in host time units
+	uint64_t mPeriod;
+
+	/// The cycle number, task count, and next task index
+	alignas(64) std::atomic<uint64_t> mWork;
+	alignas(64) std::atomic<size_t> mCompletedTaskCount;
+	std::atomic<Task> mTask;
+	std::atomic<void *> mContext;
+
+};
@@ -0,0 +1,79 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <cstddef>
+#import <cstdint>
+
+/// The layout of a shared memory audio ring
+///
+/// The region consists of this header, followed by @c mBlockCapacity block records, followed by
+/// @c mChannelCount deinterleaved channels of @c mCapacityFrames 32-bit float samples each.
+/// Positions count frames written since the region was created and increase monotonically.
+/// Block records are written in position order, so the record for a position is found by advancing from the previous one.
+struct SFBSharedMemoryHeader
+{
+	static constexpr uint32_t kMagic = 'SFBm';
+	static constexpr uint32_t kVersion = 3;
+
+	/// A contiguous run of frames written by a single render cycle
+	struct Block
+	{
+		/// The position of the first frame, stored last so a reader can detect a record being rewritten
+		std::atomic<uint64_t> mPosition;
+		uint32_t mFrameCount;
+		uint32_t mReserved;
+		int64_t mSampleTime;
+		uint64_t mHostTime;
+	};
+
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint32_t mChannelCount;
+	/// The number of frames per channel, a power of two
+	uint32_t mCapacityFrames;
+	/// The number of block records, a power of two
+	uint32_t mBlockCapacity;
+	/// The process ID of the writer, set before anything else so a region left by a writer that exited can be identified
+	int32_t mWriterProcessID;
+	double mSampleRate;
+
+	/// The number of frames written
+	alignas(64) std::atomic<uint64_t> mWritePosition;
+	/// The end of the frames being written, published before they are copied so readers can detect frames being overwritten
+	std::atomic<uint64_t> mWriteEndPosition;
+	/// The number of blocks written
+	std::atomic<uint64_t> mBlockCount;
+
+	inline Block * Blocks() noexcept
+	{
+		return reinterpret_cast<Block *>(reinterpret_cast<unsigned char *>(this) + BlocksOffset());
+	}
+
+	inline float * Channel(uint32_t channel) noexcept
+	{
+		return reinterpret_cast<float *>(reinterpret_cast<unsigned char *>(this) + ChannelsOffset(mBlockCapacity)) + static_cast<size_t>(channel) * mCapacityFrames;
+	}
+
+	static inline size_t BlocksOffset() noexcept
+	{
+		return (sizeof(SFBSharedMemoryHeader) + 63) & ~static_cast<size_t>(63);
+	}
+
+	static inline size_t ChannelsOffset(uint32_t blockCapacity) noexcept
+	{
+		return (BlocksOffset() + blockCapacity * sizeof(Block) + 63) & ~static_cast<size_t>(63);
+	}
+
+	static inline size_t RegionSize(uint32_t channelCount, uint32_t capacityFrames, uint32_t blockCapacity) noexcept
+	{
+		return ChannelsOffset(blockCapacity) + static_cast<size_t>(channelCount) * capacityFrames * sizeof(float);
+	}
+};
+
+// The atomics are shared between processes so they must not be implemented with a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Lock-free 64-bit atomics are required");
@@ -0,0 +1,181 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBSharedMemoryReader.hpp"
+
+#import <algorithm>
+#import <cerrno>
+#import <cstring>
+#import <stdexcept>
+#import <system_error>
+
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#import "SFBSharedMemoryLayout.hpp"
+
+SFBSharedMemoryReader::SFBSharedMemoryReader(const std::string& name)
+: mHeader(nullptr), mSize(0), mReadPosition(0), mOverrunCount(0), mBlockIndex(0)
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(fd == -1)
+		throw std::system_error(errno, std::generic_category(), "shm_open");
+
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		auto error = errno;
+		close(fd);
+		throw std::system_error(error, std::generic_category(), "fstat");
+	}
+
+	mSize = static_cast<size_t>(st.st_size);
+	if(mSize < sizeof(SFBSharedMemoryHeader)) {
+		close(fd);
+		throw std::runtime_error("Shared memory too small");
+	}
+
+	auto region = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, fd, 0);
+	auto error = errno;
+	close(fd);
+	if(region == MAP_FAILED)
+		throw std::system_error(error, std::generic_category(), "mmap");
+
+	mHeader = static_cast<SFBSharedMemoryHeader *>(region);
+
+	const bool valid = mHeader->mMagic == SFBSharedMemoryHeader::kMagic && mHeader->mVersion == SFBSharedMemoryHeader::kVersion;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if(!valid || SFBSharedMemoryHeader::RegionSize(mHeader->mChannelCount, mHeader->mCapacityFrames, mHeader->mBlockCapacity) > mSize) {
+		munmap(region, mSize);
+		throw std::runtime_error("Shared memory is not a compatible audio ring");
+	}
+
+	mReadPosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+}
+
+SFBSharedMemoryReader::~SFBSharedMemoryReader()
+{
+	munmap(mHeader, mSize);
+}
+
+UInt32 SFBSharedMemoryReader::ChannelCount() const noexcept
+{
+	return mHeader->mChannelCount;
+}
+
+Float64 SFBSharedMemoryReader::SampleRate() const noexcept
+{
+	return mHeader->mSampleRate;
+}
+
+UInt32 SFBSharedMemoryReader::FramesAvailableToRead() const noexcept
+{
+	const auto writePosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+	return static_cast<UInt32>(std::min<uint64_t>(writePosition - mReadPosition, mHeader->mCapacityFrames));
+}
+
+UInt32 SFBSharedMemoryReader::Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t *sampleTime) noexcept
+{
+	const auto capacityFrames = mHeader->mCapacityFrames;
+
+	auto writePosition = mHeader->mWritePosition.load(std::memory_order_acquire);
+	// Frames before the end of the write in progress less the capacity may be partly overwritten
+	auto writeEndPosition = mHeader->mWriteEndPosition.load(std::memory_order_acquire);
+	if(writeEndPosition - mReadPosition > capacityFrames) {
+		++mOverrunCount;
+		mReadPosition = writePosition - capacityFrames / 2;
+	}
+
+	frameCount = std::min(frameCount, static_cast<UInt32>(writePosition - mReadPosition));
+	if(frameCount == 0) {
+		if(sampleTime)
+			*sampleTime = -1;
+		return 0;
+	}
+
+	const auto offset = static_cast<UInt32>(mReadPosition & (capacityFrames - 1));
+	const auto firstPart = std::min(frameCount, capacityFrames - offset);
+	const auto channelCount = std::min(bufferList->mNumberBuffers, mHeader->mChannelCount);
+
+	for(UInt32 channel = 0; channel < channelCount; ++channel) {
+		const auto input = mHeader->Channel(channel);
+		auto output = static_cast<float *>(bufferList->mBuffers[channel].mData);
+		std::memcpy(output, input + offset, firstPart * sizeof(float));
+		if(firstPart < frameCount)
+			std::memcpy(output + firstPart, input, (frameCount - firstPart) * sizeof(float));
+		bufferList->mBuffers[channel].mDataByteSize = frameCount * static_cast<UInt32>(sizeof(float));
+	}
+
+	// If the writer began overwriting any of the frames while they were copied the copy is torn
+	std::atomic_thread_fence(std::memory_order_acquire);
+	writeEndPosition = mHeader->mWriteEndPosition.load(std::memory_order_relaxed);
+	if(writeEndPosition - mReadPosition > capacityFrames) {
+		++mOverrunCount;
+		mReadPosition = mHeader->mWritePosition.load(std::memory_order_acquire) - capacityFrames / 2;
+		if(sampleTime)
+			*sampleTime = -1;
+		return 0;
+	}
+
+	if(sampleTime)
+		*sampleTime = SampleTimeAtPosition(mReadPosition);
+
+	mReadPosition += frameCount;
+	return frameCount;
+}
+
+int64_t SFBSharedMemoryReader::SampleTimeAtPosition(uint64_t position) noexcept
+{
+	const auto blockCapacity = mHeader->mBlockCapacity;
+	const auto blocks = mHeader->Blocks();
+	const auto blockCount = mHeader->mBlockCount.load(std::memory_order_acquire);
+	if(blockCount == 0)
+		return -1;
+
+	// The oldest record may already be being rewritten
+	const auto firstBlock = blockCount > blockCapacity ? blockCount - blockCapacity + 1 : 0;
+	if(firstBlock >= blockCount)
+		return -1;
+
+	// A record being rewritten belongs to a block newer than any position being looked up
+	auto blockPosition = [&](uint64_t index) {
+		return blocks[index & (blockCapacity - 1)].mPosition.load(std::memory_order_acquire);
+	};
+
+	// After an overrun or a long pause the previous block is gone, so find the last block starting at or before position
+	auto index = mBlockIndex;
+	if(index < firstBlock || index >= blockCount || blockPosition(index) > position) {
+		auto low = firstBlock, high = blockCount;
+		while(high - low > 1) {
+			const auto middle = low + (high - low) / 2;
+			if(blockPosition(middle) <= position)
+				low = middle;
+			else
+				high = middle;
+		}
+		index = low;
+	}
+
+	for(; index < blockCount; ++index) {
+		const auto& block = blocks[index & (blockCapacity - 1)];
+		const auto blockStart = block.mPosition.load(std::memory_order_acquire);
+		if(blockStart == UINT64_MAX || blockStart > position)
+			return -1;
+
+		const auto frameCount = block.mFrameCount;
+		const auto blockSampleTime = block.mSampleTime;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(block.mPosition.load(std::memory_order_relaxed) != blockStart)
+			return -1;
+
+		if(position < blockStart + frameCount) {
+			mBlockIndex = index;
+			return blockSampleTime < 0 ? -1 : blockSampleTime + static_cast<int64_t>(position - blockStart);
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,74 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <string>
+
+#import <CoreAudio/CoreAudio.h>
+
+struct SFBSharedMemoryHeader;
+
+/// Reads audio published by an @c SFBSharedMemoryWriter in another process
+///
+/// Each reader has a private read position so readers never contend with the writer or each other.
+/// A reader attaches at the current write position; if it falls more than the ring capacity behind it counts an
+/// overrun and resumes half a ring behind the writer.
+class SFBSharedMemoryReader
+{
+
+public:
+
+	/// Attaches to the shared memory ring named @c name
+	/// @throw @c std::system_error if the shared memory could not be opened
+	/// @throw @c std::runtime_error if the shared memory is not a compatible ring
+	explicit SFBSharedMemoryReader(const std::string& name);
+
+	// This class is non-copyable
+	SFBSharedMemoryReader(const SFBSharedMemoryReader& rhs) = delete;
+
+	// This class is non-assignable
+	SFBSharedMemoryReader& operator=(const SFBSharedMemoryReader& rhs) = delete;
+
+	~SFBSharedMemoryReader();
+
+	// This class is non-movable
+	SFBSharedMemoryReader(SFBSharedMemoryReader&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBSharedMemoryReader& operator=(SFBSharedMemoryReader&& rhs) = delete;
+
+
+	UInt32 ChannelCount() const noexcept;
+	Float64 SampleRate() const noexcept;
+
+	/// Returns the number of frames available to read
+	UInt32 FramesAvailableToRead() const noexcept;
+
+	/// Reads up to @c frameCount frames into @c bufferList
+	/// @param sampleTime If not @c nullptr, receives the writer's sample time of the first frame read or @c -1 if unknown
+	/// @return The number of frames read
+	UInt32 Read(AudioBufferList *bufferList, UInt32 frameCount, int64_t *sampleTime = nullptr) noexcept;
+
+	inline UInt64 OverrunCount() const noexcept
+	{
+		return mOverrunCount;
+	}
+
+private:
+
+	/// Returns the writer's sample time of the frame at @c position or @c -1 if its block record is no longer available
+	///
+	/// Reads are sequential, so the search starts from the block found by the previous call and usually ends there.
+	int64_t SampleTimeAtPosition(uint64_t position) noexcept;
+
+	SFBSharedMemoryHeader *mHeader;
+	size_t mSize;
+	uint64_t mReadPosition;
+	UInt64 mOverrunCount;
+	/// The index of the block containing the previous position looked up
+	uint64_t mBlockIndex;
+
+};
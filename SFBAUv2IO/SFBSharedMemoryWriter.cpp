@@ -0,0 +1,164 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBSharedMemoryWriter.hpp"
+
+#import <algorithm>
+#import <cerrno>
+#import <cstring>
+#import <new>
+#import <stdexcept>
+#import <system_error>
+
+#import <fcntl.h>
+#import <signal.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#import "SFBCAStreamBasicDescription.hpp"
+#import "SFBSharedMemoryLayout.hpp"
+
+namespace {
+
+UInt32 NextPowerOfTwo(UInt32 value)
+{
+	UInt32 result = 1;
+	while(result < value)
+		result <<= 1;
+	return result;
+}
+
+/// Returns @c true if the region named @c name was created by a writer process that no longer exists
+bool RegionIsStale(const std::string& name)
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(fd == -1)
+		return errno == ENOENT;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(SFBSharedMemoryHeader)) {
+		close(fd);
+		return false;
+	}
+
+	auto region = mmap(nullptr, sizeof(SFBSharedMemoryHeader), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(region == MAP_FAILED)
+		return false;
+
+	const pid_t writerProcessID = static_cast<const SFBSharedMemoryHeader *>(region)->mWriterProcessID;
+	munmap(region, sizeof(SFBSharedMemoryHeader));
+
+	// A region without a writer ID may still be being created
+	return writerProcessID > 0 && kill(writerProcessID, 0) == -1 && errno == ESRCH;
+}
+
+}
+
+SFBSharedMemoryWriter::SFBSharedMemoryWriter(const std::string& name, const AudioStreamBasicDescription& format, UInt32 capacityFrames, UInt32 minimumWriteFrames)
+: mName(name), mHeader(nullptr), mSize(0)
+{
+	SFB::CAStreamBasicDescription sharedFormat(format);
+	if(!sharedFormat.IsFloat() || !sharedFormat.IsNonInterleaved() || sharedFormat.mBitsPerChannel != 32)
+		throw std::invalid_argument("format must be deinterleaved 32-bit float");
+	if(capacityFrames == 0 || capacityFrames > 0x80000000)
+		throw std::invalid_argument("Invalid capacityFrames");
+	if(minimumWriteFrames == 0)
+		throw std::invalid_argument("minimumWriteFrames == 0");
+
+	const auto channelCount = sharedFormat.ChannelCount();
+	capacityFrames = NextPowerOfTwo(capacityFrames);
+	// Enough records to cover the whole ring when every write is the minimum size
+	const auto blockCapacity = NextPowerOfTwo(std::max(capacityFrames / minimumWriteFrames, 1u));
+
+	mSize = SFBSharedMemoryHeader::RegionSize(channelCount, capacityFrames, blockCapacity);
+
+	int fd = shm_open(mName.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	// Replace a region left behind by a writer that exited without unlinking it, but never one owned by a live writer
+	if(fd == -1 && errno == EEXIST && RegionIsStale(mName)) {
+		shm_unlink(mName.c_str());
+		fd = shm_open(mName.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	}
+	if(fd == -1)
+		throw std::system_error(errno, std::generic_category(), "shm_open");
+
+	if(ftruncate(fd, static_cast<off_t>(mSize)) == -1) {
+		auto error = errno;
+		close(fd);
+		shm_unlink(mName.c_str());
+		throw std::system_error(error, std::generic_category(), "ftruncate");
+	}
+
+	auto region = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	auto error = errno;
+	close(fd);
+	if(region == MAP_FAILED) {
+		shm_unlink(mName.c_str());
+		throw std::system_error(error, std::generic_category(), "mmap");
+	}
+
+	// Fault in every page now rather than in the render callback
+	std::memset(region, 0, mSize);
+
+	mHeader = new (region) SFBSharedMemoryHeader;
+	mHeader->mWriterProcessID = getpid();
+	mHeader->mChannelCount = channelCount;
+	mHeader->mCapacityFrames = capacityFrames;
+	mHeader->mBlockCapacity = blockCapacity;
+	mHeader->mSampleRate = sharedFormat.mSampleRate;
+	mHeader->mWritePosition = 0;
+	mHeader->mWriteEndPosition = 0;
+	mHeader->mBlockCount = 0;
+	for(UInt32 i = 0; i < blockCapacity; ++i)
+		new (mHeader->Blocks() + i) SFBSharedMemoryHeader::Block;
+
+	// Readers check the magic last
+	mHeader->mVersion = SFBSharedMemoryHeader::kVersion;
+	std::atomic_thread_fence(std::memory_order_release);
+	mHeader->mMagic = SFBSharedMemoryHeader::kMagic;
+}
+
+SFBSharedMemoryWriter::~SFBSharedMemoryWriter()
+{
+	munmap(mHeader, mSize);
+	shm_unlink(mName.c_str());
+}
+
+void SFBSharedMemoryWriter::Write(const AudioBufferList *bufferList, UInt32 frameCount, const AudioTimeStamp& timeStamp) noexcept
+{
+	const auto capacityFrames = mHeader->mCapacityFrames;
+	frameCount = std::min(frameCount, capacityFrames);
+
+	const auto position = mHeader->mWritePosition.load(std::memory_order_relaxed);
+	const auto offset = static_cast<UInt32>(position & (capacityFrames - 1));
+	const auto firstPart = std::min(frameCount, capacityFrames - offset);
+	const auto channelCount = std::min(bufferList->mNumberBuffers, mHeader->mChannelCount);
+
+	// Readers holding frames older than one capacity before this end are about to be overwritten
+	mHeader->mWriteEndPosition.store(position + frameCount, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for(UInt32 channel = 0; channel < channelCount; ++channel) {
+		auto input = static_cast<const float *>(bufferList->mBuffers[channel].mData);
+		auto output = mHeader->Channel(channel);
+		std::memcpy(output + offset, input, firstPart * sizeof(float));
+		if(firstPart < frameCount)
+			std::memcpy(output, input + firstPart, (frameCount - firstPart) * sizeof(float));
+	}
+
+	const auto blockIndex = mHeader->mBlockCount.load(std::memory_order_relaxed);
+	auto& block = mHeader->Blocks()[blockIndex & (mHeader->mBlockCapacity - 1)];
+	// Invalidate the record while it is rewritten
+	block.mPosition.store(UINT64_MAX, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	block.mFrameCount = frameCount;
+	block.mSampleTime = (timeStamp.mFlags & kAudioTimeStampSampleTimeValid) ? static_cast<int64_t>(timeStamp.mSampleTime) : -1;
+	block.mHostTime = (timeStamp.mFlags & kAudioTimeStampHostTimeValid) ? timeStamp.mHostTime : 0;
+	block.mPosition.store(position, std::memory_order_release);
+
+	mHeader->mBlockCount.store(blockIndex + 1, std::memory_order_release);
+	mHeader->mWritePosition.store(position + frameCount, std::memory_order_release);
+}
@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <string>
+
+#import <CoreAudio/CoreAudio.h>
+
+struct SFBSharedMemoryHeader;
+
+/// Publishes audio to other processes through a POSIX shared memory ring
+///
+/// Each block is copied once into shared memory together with its timestamp. Any number of
+/// @c SFBSharedMemoryReader instances may attach by name; readers keep their own positions so the writer never
+/// waits for or tracks them, and a reader that falls more than the ring capacity behind detects the overrun.
+class SFBSharedMemoryWriter
+{
+
+public:
+
+	/// Creates a shared memory ring named @c name
+	/// @param name The POSIX shared memory object name, beginning with a slash and at most 31 characters long on macOS
+	/// @param format The deinterleaved 32-bit float format of the audio to publish
+	/// @param capacityFrames The minimum ring capacity in frames, rounded up to a power of two
+	/// @param minimumWriteFrames The smallest number of frames expected per @c Write(), which sizes the timestamp records.
+	/// Readers get no sample time for frames older than the records cover if writes are smaller.
+	/// @throw @c std::invalid_argument
+	/// @throw @c std::system_error if the shared memory could not be created, with @c EEXIST if a running writer owns @c name
+	SFBSharedMemoryWriter(const std::string& name, const AudioStreamBasicDescription& format, UInt32 capacityFrames, UInt32 minimumWriteFrames);
+
+	// This class is non-copyable
+	SFBSharedMemoryWriter(const SFBSharedMemoryWriter& rhs) = delete;
+
+	// This class is non-assignable
+	SFBSharedMemoryWriter& operator=(const SFBSharedMemoryWriter& rhs) = delete;
+
+	/// Unmaps and unlinks the shared memory; attached readers keep their mappings
+	~SFBSharedMemoryWriter();
+
+	// This class is non-movable
+	SFBSharedMemoryWriter(SFBSharedMemoryWriter&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBSharedMemoryWriter& operator=(SFBSharedMemoryWriter&& rhs) = delete;
+
+
+	inline const std::string& Name() const noexcept
+	{
+		return mName;
+	}
+
+	/// Copies @c frameCount frames from @c bufferList into shared memory
+	/// @note This is called from the output render callback
+	void Write(const AudioBufferList *bufferList, UInt32 frameCount, const AudioTimeStamp& timeStamp) noexcept;
+
+private:
+
+	std::string mName;
+	SFBSharedMemoryHeader *mHeader;
+	size_t mSize;
+
+};
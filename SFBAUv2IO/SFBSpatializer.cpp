@@ -0,0 +1,414 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBSpatializer.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <limits>
+#import <stdexcept>
+
+#import <AudioToolbox/AudioToolbox.h>
+
+#import "SFBCAChannelLayout.hpp"
+
+namespace {
+
+/// Speakers whose elevations differ by less than this, in degrees, are treated as a ring
+const float kRingElevationTolerance = 1;
+/// Arcs at least this wide, in radians, are crossfaded instead of panned with vectors, which fail as the arc nears a half circle
+const float kMaximumVectorArcWidth = static_cast<float>(170 * M_PI / 180);
+/// The tolerance used when triangulating unit vectors
+const double kEpsilon = 1e-5;
+/// Gains below this are treated as zero
+const float kMinimumGain = 1e-5f;
+
+const float kRadiansPerDegree = static_cast<float>(M_PI / 180);
+
+/// A direction as a unit vector with x to the right, y to the front, and z up
+struct Vector
+{
+	double x, y, z;
+
+	Vector operator+(const Vector& rhs) const noexcept
+	{
+		return { x + rhs.x, y + rhs.y, z + rhs.z };
+	}
+
+	Vector operator-(const Vector& rhs) const noexcept
+	{
+		return { x - rhs.x, y - rhs.y, z - rhs.z };
+	}
+
+	double Dot(const Vector& rhs) const noexcept
+	{
+		return x * rhs.x + y * rhs.y + z * rhs.z;
+	}
+
+	Vector Cross(const Vector& rhs) const noexcept
+	{
+		return { y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x };
+	}
+
+	Vector Scaled(double scale) const noexcept
+	{
+		return { x * scale, y * scale, z * scale };
+	}
+};
+
+Vector VectorForDirection(double azimuth, double elevation) noexcept
+{
+	return { std::sin(azimuth) * std::cos(elevation), std::cos(azimuth) * std::cos(elevation), std::sin(elevation) };
+}
+
+/// Returns @c angle in radians wrapped to [0, 2π)
+float WrappedAngle(float angle) noexcept
+{
+	const auto twoPi = static_cast<float>(2 * M_PI);
+	angle = std::fmod(angle, twoPi);
+	return angle < 0 ? angle + twoPi : angle;
+}
+
+/// Returns the nominal position of the speaker for @c label following ITU-R BS.2051
+/// @return @c false if @c label has no position
+bool SpeakerForLabel(AudioChannelLabel label, SFBSpatializer::Speaker& speaker) noexcept
+{
+	speaker = {};
+	switch(label) {
+		case kAudioChannelLabel_Mono:
+		case kAudioChannelLabel_Center:					speaker.mAzimuth = 0;									return true;
+		case kAudioChannelLabel_Left:					speaker.mAzimuth = -30;									return true;
+		case kAudioChannelLabel_Right:					speaker.mAzimuth = 30;									return true;
+		case kAudioChannelLabel_LeftCenter:				speaker.mAzimuth = -15;									return true;
+		case kAudioChannelLabel_RightCenter:			speaker.mAzimuth = 15;									return true;
+		case kAudioChannelLabel_LeftWide:				speaker.mAzimuth = -60;									return true;
+		case kAudioChannelLabel_RightWide:				speaker.mAzimuth = 60;									return true;
+		case kAudioChannelLabel_LeftSurroundDirect:		speaker.mAzimuth = -90;									return true;
+		case kAudioChannelLabel_RightSurroundDirect:	speaker.mAzimuth = 90;									return true;
+		case kAudioChannelLabel_LeftSurround:			speaker.mAzimuth = -110;								return true;
+		case kAudioChannelLabel_RightSurround:			speaker.mAzimuth = 110;									return true;
+		case kAudioChannelLabel_RearSurroundLeft:		speaker.mAzimuth = -150;								return true;
+		case kAudioChannelLabel_RearSurroundRight:		speaker.mAzimuth = 150;									return true;
+		case kAudioChannelLabel_CenterSurround:			speaker.mAzimuth = 180;									return true;
+
+		case kAudioChannelLabel_VerticalHeightLeft:		speaker.mAzimuth = -45;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_VerticalHeightCenter:	speaker.mAzimuth = 0;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_VerticalHeightRight:	speaker.mAzimuth = 45;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_LeftTopMiddle:			speaker.mAzimuth = -90;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_RightTopMiddle:			speaker.mAzimuth = 90;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_TopBackLeft:
+		case kAudioChannelLabel_LeftTopRear:			speaker.mAzimuth = -135;	speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_TopBackCenter:
+		case kAudioChannelLabel_CenterTopRear:			speaker.mAzimuth = 180;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_TopBackRight:
+		case kAudioChannelLabel_RightTopRear:			speaker.mAzimuth = 135;		speaker.mElevation = 45;	return true;
+		case kAudioChannelLabel_TopCenterSurround:		speaker.mAzimuth = 0;		speaker.mElevation = 90;	return true;
+
+		case kAudioChannelLabel_LFEScreen:
+		case kAudioChannelLabel_LFE2:					speaker.mIsLowFrequency = true;							return true;
+
+		default:																								return false;
+	}
+}
+
+/// Returns the speakers of @c layout
+std::vector<SFBSpatializer::Speaker> SpeakersForLayout(const SFB::CAChannelLayout& layout)
+{
+	if(!layout)
+		throw std::invalid_argument("Invalid channel layout");
+
+	std::vector<SFBSpatializer::Speaker> speakers;
+	for(const auto& description : SFBSpatializer::ChannelDescriptions(layout)) {
+		SFBSpatializer::Speaker speaker;
+		if(description.mChannelLabel == kAudioChannelLabel_UseCoordinates) {
+			if(description.mChannelFlags & kAudioChannelFlags_SphericalCoordinates) {
+				speaker.mAzimuth = description.mCoordinates[kAudioChannelCoordinates_Azimuth];
+				speaker.mElevation = description.mCoordinates[kAudioChannelCoordinates_Elevation];
+			}
+			else {
+				const auto x = description.mCoordinates[kAudioChannelCoordinates_LeftRight];
+				const auto y = description.mCoordinates[kAudioChannelCoordinates_BackFront];
+				const auto z = description.mCoordinates[kAudioChannelCoordinates_DownUp];
+				speaker.mAzimuth = std::atan2(x, y) / kRadiansPerDegree;
+				speaker.mElevation = std::atan2(z, std::hypot(x, y)) / kRadiansPerDegree;
+			}
+		}
+		else if(!SpeakerForLabel(description.mChannelLabel, speaker))
+			throw std::invalid_argument("Channel layout contains a channel without a known position");
+		speakers.push_back(speaker);
+	}
+
+	return speakers;
+}
+
+}
+
+std::vector<AudioChannelDescription> SFBSpatializer::ChannelDescriptions(const AudioChannelLayout *layout)
+{
+	if(layout->mChannelLayoutTag == kAudioChannelLayoutTag_UseChannelDescriptions)
+		return std::vector<AudioChannelDescription>(layout->mChannelDescriptions, layout->mChannelDescriptions + layout->mNumberChannelDescriptions);
+
+	const bool useBitmap = layout->mChannelLayoutTag == kAudioChannelLayoutTag_UseChannelBitmap;
+	const auto propertyID = useBitmap ? kAudioFormatProperty_ChannelLayoutForBitmap : kAudioFormatProperty_ChannelLayoutForTag;
+	const void *specifier = useBitmap ? static_cast<const void *>(&layout->mChannelBitmap) : static_cast<const void *>(&layout->mChannelLayoutTag);
+	const UInt32 specifierSize = useBitmap ? sizeof(layout->mChannelBitmap) : sizeof(layout->mChannelLayoutTag);
+
+	UInt32 size = 0;
+	auto result = AudioFormatGetPropertyInfo(propertyID, specifierSize, specifier, &size);
+	if(result != noErr)
+		throw std::runtime_error("AudioFormatGetPropertyInfo (kAudioFormatProperty_ChannelLayoutForTag) failed");
+
+	std::vector<UInt8> storage(std::max<size_t>(size, sizeof(AudioChannelLayout)));
+	result = AudioFormatGetProperty(propertyID, specifierSize, specifier, &size, storage.data());
+	if(result != noErr)
+		throw std::runtime_error("AudioFormatGetProperty (kAudioFormatProperty_ChannelLayoutForTag) failed");
+
+	const auto expanded = reinterpret_cast<const AudioChannelLayout *>(storage.data());
+	return std::vector<AudioChannelDescription>(expanded->mChannelDescriptions, expanded->mChannelDescriptions + expanded->mNumberChannelDescriptions);
+}
+
+SFBSpatializer::SFBSpatializer(const SFB::CAChannelLayout& layout)
+: SFBSpatializer(SpeakersForLayout(layout))
+{}
+
+SFBSpatializer::SFBSpatializer(std::vector<Speaker> speakers)
+: mSpeakers(std::move(speakers))
+{
+	for(UInt32 channel = 0; channel < mSpeakers.size(); ++channel) {
+		if(!mSpeakers[channel].mIsLowFrequency)
+			mDirectionalChannels.push_back(channel);
+	}
+
+	if(mDirectionalChannels.empty())
+		throw std::invalid_argument("No full-range speakers");
+
+	Triangulate();
+}
+
+UInt32 SFBSpatializer::GainsForDirection(float azimuth, float elevation, Gain *gains) const noexcept
+{
+	if(mDirectionalChannels.size() == 1) {
+		gains[0] = { mDirectionalChannels[0], 1 };
+		return 1;
+	}
+
+	if(!mArcs.empty()) {
+		const auto angle = WrappedAngle(azimuth * kRadiansPerDegree);
+		for(const auto& arc : mArcs) {
+			const auto offset = WrappedAngle(angle - arc.mStart);
+			if(offset <= arc.mWidth)
+				return GainsForArc(arc, offset, gains);
+		}
+		return 0;
+	}
+
+	// Move directions on the open side of the hull onto its edge
+	auto direction = VectorForDirection(azimuth * kRadiansPerDegree, elevation * kRadiansPerDegree);
+	for(const auto& plane : mOpenPlanes) {
+		const Vector normal = { plane.mNormal[0], plane.mNormal[1], plane.mNormal[2] };
+		const auto height = direction.Dot(normal);
+		if(height > 0) {
+			const auto projected = direction - normal.Scaled(height);
+			const auto length = std::sqrt(projected.Dot(projected));
+			if(length > kEpsilon)
+				direction = projected.Scaled(1 / length);
+		}
+	}
+
+	// Use the face containing the direction, or else the face it is least outside of
+	const Triangle *best = nullptr;
+	float bestGains [3] = {};
+	float bestMinimum = -std::numeric_limits<float>::infinity();
+	for(const auto& triangle : mTriangles) {
+		const auto m = triangle.mInverse;
+		float g [3];
+		for(UInt32 i = 0; i < 3; ++i)
+			g[i] = static_cast<float>(direction.x * m[i] + direction.y * m[3 + i] + direction.z * m[6 + i]);
+		const auto minimum = std::min({ g[0], g[1], g[2] });
+		if(minimum > bestMinimum) {
+			bestMinimum = minimum;
+			best = &triangle;
+			std::copy(g, g + 3, bestGains);
+		}
+		if(minimum >= -kMinimumGain)
+			break;
+	}
+
+	if(!best)
+		return 0;
+
+	float power = 0;
+	for(auto& g : bestGains) {
+		if(g < kMinimumGain)
+			g = 0;
+		power += g * g;
+	}
+	if(power == 0)
+		return 0;
+
+	const auto scale = 1 / std::sqrt(power);
+	UInt32 count = 0;
+	for(UInt32 i = 0; i < 3; ++i) {
+		if(bestGains[i] > 0)
+			gains[count++] = { best->mChannels[i], bestGains[i] * scale };
+	}
+	return count;
+}
+
+void SFBSpatializer::Triangulate()
+{
+	const auto speakerCount = mDirectionalChannels.size();
+	if(speakerCount < 2)
+		return;
+
+	const auto firstElevation = mSpeakers[mDirectionalChannels[0]].mElevation;
+	const bool isRing = std::all_of(mDirectionalChannels.begin(), mDirectionalChannels.end(), [&](UInt32 channel) { return std::abs(mSpeakers[channel].mElevation - firstElevation) < kRingElevationTolerance; });
+
+	if(!isRing) {
+		std::vector<Vector> vectors;
+		for(auto channel : mDirectionalChannels)
+			vectors.push_back(VectorForDirection(mSpeakers[channel].mAzimuth * kRadiansPerDegree, mSpeakers[channel].mElevation * kRadiansPerDegree));
+
+		// A point inside each face, away from its edges and centroid
+		std::vector<Vector> interiorPoints;
+
+		// A face of the convex hull has every speaker on or behind its plane. Faces whose plane passes through the center,
+		// such as the floor of a layout with no lower speakers, do not enclose any direction and leave the hull open.
+		for(size_t i = 0; i < speakerCount; ++i) {
+			for(size_t j = i + 1; j < speakerCount; ++j) {
+				for(size_t k = j + 1; k < speakerCount; ++k) {
+					const auto& a = vectors[i];
+					const auto& b = vectors[j];
+					const auto& c = vectors[k];
+
+					auto normal = (b - a).Cross(c - a);
+					const auto length = std::sqrt(normal.Dot(normal));
+					if(length < kEpsilon)
+						continue;
+					normal = { normal.x / length, normal.y / length, normal.z / length };
+					auto distance = normal.Dot(a);
+					if(std::abs(distance) < kEpsilon) {
+						double highest = -std::numeric_limits<double>::infinity(), lowest = std::numeric_limits<double>::infinity();
+						for(const auto& p : vectors) {
+							highest = std::max(highest, normal.Dot(p));
+							lowest = std::min(lowest, normal.Dot(p));
+						}
+						if(lowest > -kEpsilon)
+							normal = normal.Scaled(-1);
+						else if(highest > kEpsilon)
+							continue;
+						const bool isKnown = std::any_of(mOpenPlanes.begin(), mOpenPlanes.end(), [&](const OpenPlane& plane) {
+							return normal.x * plane.mNormal[0] + normal.y * plane.mNormal[1] + normal.z * plane.mNormal[2] > 1 - kEpsilon;
+						});
+						if(!isKnown)
+							mOpenPlanes.push_back({ { static_cast<float>(normal.x), static_cast<float>(normal.y), static_cast<float>(normal.z) } });
+						continue;
+					}
+					if(distance < 0) {
+						normal = { -normal.x, -normal.y, -normal.z };
+						distance = -distance;
+					}
+
+					// The inverse of the matrix with rows a, b, and c
+					const auto determinant = a.Dot(b.Cross(c));
+					if(std::abs(determinant) < kEpsilon)
+						continue;
+					const Vector columns [3] = { b.Cross(c), c.Cross(a), a.Cross(b) };
+					Triangle triangle = { { mDirectionalChannels[i], mDirectionalChannels[j], mDirectionalChannels[k] }, {} };
+					for(UInt32 column = 0; column < 3; ++column) {
+						triangle.mInverse[column] = static_cast<float>(columns[column].x / determinant);
+						triangle.mInverse[3 + column] = static_cast<float>(columns[column].y / determinant);
+						triangle.mInverse[6 + column] = static_cast<float>(columns[column].z / determinant);
+					}
+
+					// A face sharing its plane with another speaker must not contain it
+					bool isFace = true;
+					for(size_t l = 0; l < speakerCount && isFace; ++l) {
+						if(l == i || l == j || l == k)
+							continue;
+						const auto& p = vectors[l];
+						const auto height = normal.Dot(p) - distance;
+						if(height > kEpsilon)
+							isFace = false;
+						else if(height > -kEpsilon) {
+							bool isInside = true;
+							for(UInt32 column = 0; column < 3; ++column)
+								isInside &= columns[column].Dot(p) / determinant > kEpsilon;
+							isFace = !isInside;
+						}
+					}
+
+					if(!isFace)
+						continue;
+
+					// Speakers sharing a plane can be triangulated more than one way; keep the first triangles found
+					const auto interiorPoint = a.Scaled(0.5) + b.Scaled(0.3) + c.Scaled(0.2);
+					const auto overlaps = [](const Triangle& triangle, const Vector& p) {
+						const auto m = triangle.mInverse;
+						for(UInt32 column = 0; column < 3; ++column) {
+							if(p.x * m[column] + p.y * m[3 + column] + p.z * m[6 + column] <= kEpsilon)
+								return false;
+						}
+						return true;
+					};
+					bool isOverlapping = false;
+					for(size_t l = 0; l < mTriangles.size() && !isOverlapping; ++l)
+						isOverlapping = overlaps(mTriangles[l], interiorPoint) || overlaps(triangle, interiorPoints[l]);
+					if(isOverlapping)
+						continue;
+
+					mTriangles.push_back(triangle);
+					interiorPoints.push_back(interiorPoint);
+				}
+			}
+		}
+
+		if(!mTriangles.empty())
+			return;
+	}
+
+	// A ring, or speakers that do not enclose a volume, are panned by azimuth alone
+	auto channels = mDirectionalChannels;
+	std::sort(channels.begin(), channels.end(), [&](UInt32 lhs, UInt32 rhs) { return WrappedAngle(mSpeakers[lhs].mAzimuth * kRadiansPerDegree) < WrappedAngle(mSpeakers[rhs].mAzimuth * kRadiansPerDegree); });
+	for(size_t i = 0; i < channels.size(); ++i) {
+		const auto first = channels[i];
+		const auto second = channels[(i + 1) % channels.size()];
+		const auto start = WrappedAngle(mSpeakers[first].mAzimuth * kRadiansPerDegree);
+		auto width = WrappedAngle(mSpeakers[second].mAzimuth * kRadiansPerDegree - start);
+		if(width == 0 && channels.size() == 2)
+			width = static_cast<float>(2 * M_PI);
+		if(width > 0)
+			mArcs.push_back({ { first, second }, start, width });
+	}
+}
+
+UInt32 SFBSpatializer::GainsForArc(const Arc& arc, float offset, Gain *gains) const noexcept
+{
+	float first, second;
+	if(arc.mWidth < kMaximumVectorArcWidth) {
+		// The vector base solution for a pair of speakers
+		first = std::sin(arc.mWidth - offset) / std::sin(arc.mWidth);
+		second = std::sin(offset) / std::sin(arc.mWidth);
+	}
+	else {
+		const auto angle = offset / arc.mWidth * static_cast<float>(M_PI_2);
+		first = std::cos(angle);
+		second = std::sin(angle);
+	}
+
+	first = std::max(first, 0.f);
+	second = std::max(second, 0.f);
+	const auto power = first * first + second * second;
+	if(power == 0)
+		return 0;
+
+	const auto scale = 1 / std::sqrt(power);
+	UInt32 count = 0;
+	if(first > 0)
+		gains[count++] = { arc.mChannels[0], first * scale };
+	if(second > 0)
+		gains[count++] = { arc.mChannels[1], second * scale };
+	return count;
+}
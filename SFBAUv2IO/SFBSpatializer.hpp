@@ -0,0 +1,136 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+namespace SFB {
+	class CAChannelLayout;
+}
+
+/// Computes speaker gains that place a sound at a direction on a speaker layout (VBAP)
+///
+/// Speakers at the same elevation form a ring and a direction is panned between the two adjacent speakers around it.
+/// Otherwise the speakers are triangulated into the faces of their convex hull and a direction is panned between the
+/// three speakers of the face containing it. A direction outside the speakers, such as below a layout with no lower
+/// speakers, is first projected onto the open side of the hull. Gains are normalized to constant power.
+///
+/// All storage is allocated at construction and gain lookups are safe on the render thread.
+class SFBSpatializer
+{
+
+public:
+
+	/// The largest number of speakers sounding for one direction
+	static constexpr UInt32 kMaximumGainCount = 3;
+
+	/// A speaker position in degrees
+	struct Speaker
+	{
+		/// The angle from front center, positive to the right
+		float mAzimuth = 0;
+		/// The angle above the horizontal plane
+		float mElevation = 0;
+		/// Whether the speaker is a subwoofer, which is never panned to
+		bool mIsLowFrequency = false;
+	};
+
+	/// The gain of one output channel
+	struct Gain
+	{
+		UInt32 mChannel;
+		float mGain;
+	};
+
+	/// Returns the channel descriptions of @c layout, expanding layout tags and bitmaps
+	/// @throw @c std::runtime_error if @c layout could not be expanded
+	static std::vector<AudioChannelDescription> ChannelDescriptions(const AudioChannelLayout *layout);
+
+	/// Creates a new @c SFBSpatializer for the channels of @c layout
+	///
+	/// Channels are positioned from their labels or, for @c kAudioChannelLabel_UseCoordinates, their coordinates.
+	/// @throw @c std::invalid_argument if @c layout is invalid or contains a channel without a known position
+	/// @throw @c std::runtime_error if @c layout could not be expanded
+	explicit SFBSpatializer(const SFB::CAChannelLayout& layout);
+
+	/// Creates a new @c SFBSpatializer for a custom rig with one speaker per output channel
+	/// @throw @c std::invalid_argument if @c speakers contains no full-range speaker
+	explicit SFBSpatializer(std::vector<Speaker> speakers);
+
+	// This class is non-copyable
+	SFBSpatializer(const SFBSpatializer& rhs) = delete;
+
+	// This class is non-assignable
+	SFBSpatializer& operator=(const SFBSpatializer& rhs) = delete;
+
+	~SFBSpatializer() = default;
+
+	// This class is non-movable
+	SFBSpatializer(SFBSpatializer&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBSpatializer& operator=(SFBSpatializer&& rhs) = delete;
+
+
+	inline UInt32 ChannelCount() const noexcept
+	{
+		return static_cast<UInt32>(mSpeakers.size());
+	}
+
+	inline const std::vector<Speaker>& Speakers() const noexcept
+	{
+		return mSpeakers;
+	}
+
+	/// Writes the nonzero gains placing a sound at @c azimuth and @c elevation, in degrees, to @c gains
+	/// @param gains Storage for @c kMaximumGainCount gains
+	/// @return The number of gains written
+	UInt32 GainsForDirection(float azimuth, float elevation, Gain *gains) const noexcept;
+
+private:
+
+	/// Two adjacent speakers of a ring
+	struct Arc
+	{
+		UInt32 mChannels [2];
+		/// The azimuth of the first speaker, in radians
+		float mStart;
+		/// The angle to the second speaker, in radians
+		float mWidth;
+	};
+
+	/// Three speakers forming a face of the convex hull
+	struct Triangle
+	{
+		UInt32 mChannels [3];
+		/// The inverse of the matrix whose rows are the speaker directions
+		float mInverse [9];
+	};
+
+	/// A plane through the center bounding every speaker, outside which no face of the hull lies
+	struct OpenPlane
+	{
+		/// The unit normal pointing away from the speakers
+		float mNormal [3];
+	};
+
+	/// Builds the arcs or triangles
+	void Triangulate();
+	/// Writes the gains for the direction @c offset radians past the first speaker of @c arc
+	UInt32 GainsForArc(const Arc& arc, float offset, Gain *gains) const noexcept;
+
+	std::vector<Speaker> mSpeakers;
+	/// Channels of full-range speakers
+	std::vector<UInt32> mDirectionalChannels;
+	/// The speaker pairs of a horizontal layout
+	std::vector<Arc> mArcs;
+	/// The speaker triplets of a three-dimensional layout
+	std::vector<Triangle> mTriangles;
+	std::vector<OpenPlane> mOpenPlanes;
+
+};
@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBTimeStretchPlayer.hpp"
+
+#import <algorithm>
+#import <cstring>
+#import <new>
+#import <stdexcept>
+
+#import <pthread.h>
+
+#import "SFBAudioAsset.hpp"
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+/// The duration of stretched output buffered ahead of playback, in seconds
+const double kLookaheadDuration = 0.1;
+/// The number of asset frames written to the stretcher at once
+const UInt32 kInputBlockSize = 4096;
+
+/// Returns @c asset, throwing if it is @c nullptr
+const std::shared_ptr<const SFBAudioAsset>& ValidatedAsset(const std::shared_ptr<const SFBAudioAsset>& asset)
+{
+	if(!asset)
+		throw std::invalid_argument("asset == nullptr");
+	return asset;
+}
+
+}
+
+SFBTimeStretchPlayer::SFBTimeStretchPlayer(std::shared_ptr<const SFBAudioAsset> asset, double tempo, Float64 startSampleTime, UInt32 maximumFrameCount)
+: mAsset(ValidatedAsset(asset)), mStretcher(mAsset->ChannelCount(), mAsset->SampleRate(), tempo), mAssetPosition(0), mLookaheadFrameCount(0), mStretchIsComplete(false), mStartSampleTime(startSampleTime), mUnderrunCount(0), mIsFinished(false), mStretchThreadRunning(false), mStretchSemaphore(nullptr)
+{
+	SFB::CAStreamBasicDescription format(SFB::CommonPCMFormat::float32, mAsset->SampleRate(), mAsset->ChannelCount(), false);
+
+	// The lookahead is a whole number of hops covering at least one render cycle
+	const auto hopSize = mStretcher.HopSize();
+	const auto lookahead = std::max(static_cast<UInt32>(mAsset->SampleRate() * kLookaheadDuration), maximumFrameCount);
+	mLookaheadFrameCount = (lookahead + hopSize - 1) / hopSize * hopSize;
+
+	if(!mOutput.Allocate(format, mLookaheadFrameCount) || !mHop.Allocate(format, hopSize) || !mRenderBuffer.Allocate(format, maximumFrameCount))
+		throw std::bad_alloc();
+
+	const AudioBufferList *hop = mHop;
+	for(UInt32 i = 0; i < hop->mNumberBuffers; ++i)
+		mHopChannels.push_back(static_cast<float *>(hop->mBuffers[i].mData));
+	mAssetChannels.resize(mAsset->ChannelCount());
+
+	// Playback starts with a full lookahead
+	FillLookahead();
+
+	mStretchSemaphore = dispatch_semaphore_create(0);
+	if(!mStretchSemaphore)
+		throw std::bad_alloc();
+
+	mStretchThreadRunning = true;
+	try {
+		mStretchThread = std::thread(&SFBTimeStretchPlayer::StretchThreadEntry, this);
+	}
+	catch(...) {
+		dispatch_release(mStretchSemaphore);
+		throw;
+	}
+}
+
+SFBTimeStretchPlayer::~SFBTimeStretchPlayer()
+{
+	if(mStretchThread.joinable()) {
+		mStretchThreadRunning = false;
+		dispatch_semaphore_signal(mStretchSemaphore);
+		mStretchThread.join();
+	}
+
+	if(mStretchSemaphore)
+		dispatch_release(mStretchSemaphore);
+}
+
+void SFBTimeStretchPlayer::SetTempo(double tempo) noexcept
+{
+	mStretcher.SetTempo(tempo);
+}
+
+bool SFBTimeStretchPlayer::Render(AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime) noexcept
+{
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+		std::memset(bufferList->mBuffers[i].mData, 0, frameCount * sizeof(float));
+
+	if(mIsFinished || frameCount > mRenderBuffer.FrameCapacity())
+		return false;
+
+	if(mStartSampleTime < 0)
+		mStartSampleTime = sampleTime;
+	if(mStartSampleTime >= sampleTime + frameCount)
+		return false;
+
+	UInt32 offset = 0;
+	if(mStartSampleTime > sampleTime)
+		offset = static_cast<UInt32>(mStartSampleTime - sampleTime);
+
+	// Read the completion flag first so frames written before it was set are not mistaken for an underrun
+	const bool stretchIsComplete = mStretchIsComplete;
+
+	mRenderBuffer.Reset();
+	const auto count = mOutput.Read(mRenderBuffer, frameCount - offset);
+	dispatch_semaphore_signal(mStretchSemaphore);
+
+	if(count < frameCount - offset) {
+		if(stretchIsComplete)
+			mIsFinished = true;
+		else
+			++mUnderrunCount;
+	}
+
+	const AudioBufferList *output = mRenderBuffer;
+	const auto channelCount = std::min(bufferList->mNumberBuffers, output->mNumberBuffers);
+	for(UInt32 i = 0; i < channelCount; ++i)
+		std::memcpy(static_cast<float *>(bufferList->mBuffers[i].mData) + offset, output->mBuffers[i].mData, count * sizeof(float));
+
+	return count > 0;
+}
+
+void SFBTimeStretchPlayer::FillLookahead() noexcept
+{
+	const auto hopSize = mStretcher.HopSize();
+	while(!mStretchIsComplete && mOutput.FramesAvailableToWrite() >= hopSize) {
+		if(mStretcher.Process(mHopChannels.data())) {
+			mHop.SetFrameLength(hopSize);
+			mOutput.Write(mHop, hopSize);
+			continue;
+		}
+
+		if(mStretcher.IsFinished()) {
+			mStretchIsComplete = true;
+			break;
+		}
+
+		const auto count = std::min({ mAsset->FrameLength() - mAssetPosition, mStretcher.FramesAvailableToWrite(), kInputBlockSize });
+		for(UInt32 channel = 0; channel < mAssetChannels.size(); ++channel)
+			mAssetChannels[channel] = mAsset->Channel(channel) + mAssetPosition;
+		mAssetPosition += mStretcher.Write(mAssetChannels.data(), count);
+		if(mAssetPosition == mAsset->FrameLength())
+			mStretcher.EndInput();
+	}
+}
+
+void SFBTimeStretchPlayer::StretchThreadEntry()
+{
+	pthread_setname_np("org.sbooth.AUv2IO.TimeStretch");
+
+	while(mStretchThreadRunning && !mStretchIsComplete) {
+		dispatch_semaphore_wait(mStretchSemaphore, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+		FillLookahead();
+	}
+}
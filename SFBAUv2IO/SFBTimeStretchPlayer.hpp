@@ -0,0 +1,116 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <memory>
+#import <thread>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+#import <dispatch/dispatch.h>
+
+#import "SFBAudioRingBuffer.hpp"
+#import "SFBCABufferList.hpp"
+#import "SFBTimeStretcher.hpp"
+
+class SFBAudioAsset;
+
+/// Plays an asset at a tempo that may change while it plays, without changing its pitch
+///
+/// A background thread stretches the asset and keeps a lookahead of output in a lock-free ring buffer, which the render thread
+/// reads. The ring is filled before playback starts. A tempo change applies to output not yet in the ring, so it is heard
+/// within @c LookaheadFrameCount() frames.
+class SFBTimeStretchPlayer
+{
+
+public:
+
+	/// Creates a new @c SFBTimeStretchPlayer and starts stretching @c asset
+	/// @param startSampleTime The sample time at which playback starts, or a negative value to start with the next render cycle
+	/// @param maximumFrameCount The largest number of frames rendered at once
+	/// @throw @c std::invalid_argument if @c asset is @c nullptr or @c tempo is out of range
+	/// @throw @c std::bad_alloc
+	/// @throw @c std::system_error if the background thread could not be started
+	SFBTimeStretchPlayer(std::shared_ptr<const SFBAudioAsset> asset, double tempo, Float64 startSampleTime, UInt32 maximumFrameCount);
+
+	// This class is non-copyable
+	SFBTimeStretchPlayer(const SFBTimeStretchPlayer& rhs) = delete;
+
+	// This class is non-assignable
+	SFBTimeStretchPlayer& operator=(const SFBTimeStretchPlayer& rhs) = delete;
+
+	~SFBTimeStretchPlayer();
+
+	// This class is non-movable
+	SFBTimeStretchPlayer(SFBTimeStretchPlayer&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBTimeStretchPlayer& operator=(SFBTimeStretchPlayer&& rhs) = delete;
+
+
+	/// Returns the number of stretched frames buffered ahead of playback
+	inline UInt32 LookaheadFrameCount() const noexcept
+	{
+		return mLookaheadFrameCount;
+	}
+
+	/// Sets the tempo of output not yet buffered, clamped to the supported range
+	void SetTempo(double tempo) noexcept;
+	inline double Tempo() const noexcept
+	{
+		return mStretcher.Tempo();
+	}
+
+	/// Returns the number of times the background thread failed to keep up with playback
+	inline UInt64 UnderrunCount() const noexcept
+	{
+		return mUnderrunCount;
+	}
+
+	/// Returns @c true once all of the stretched asset has been rendered
+	inline bool IsFinished() const noexcept
+	{
+		return mIsFinished;
+	}
+
+	/// Renders @c frameCount frames starting at @c sampleTime to @c bufferList
+	/// @return @c false if the rendered audio is silent
+	bool Render(AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime) noexcept;
+
+private:
+
+	/// Stretches the asset until the lookahead is full or the stretch is complete
+	void FillLookahead() noexcept;
+	void StretchThreadEntry();
+
+	std::shared_ptr<const SFBAudioAsset> mAsset;
+	/// Accessed by the constructor and then only by the background thread, except for the tempo
+	SFBTimeStretcher mStretcher;
+	/// The next asset frame to write to the stretcher
+	UInt32 mAssetPosition;
+	/// One hop of stretcher output
+	SFB::CABufferList mHop;
+	std::vector<float *> mHopChannels;
+	std::vector<const float *> mAssetChannels;
+
+	SFB::AudioRingBuffer mOutput;
+	UInt32 mLookaheadFrameCount;
+	/// Set once every stretched frame has been written to @c mOutput
+	std::atomic_bool mStretchIsComplete;
+
+	/// The sample time at which playback starts, accessed only by the render thread after construction
+	Float64 mStartSampleTime;
+	/// Ring output read by the render thread
+	SFB::CABufferList mRenderBuffer;
+	std::atomic_uint64_t mUnderrunCount;
+	std::atomic_bool mIsFinished;
+
+	std::atomic_bool mStretchThreadRunning;
+	std::thread mStretchThread;
+	dispatch_semaphore_t mStretchSemaphore;
+
+};
@@ -0,0 +1,237 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBTimeStretcher.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <cstring>
+#import <limits>
+#import <new>
+#import <stdexcept>
+
+#import "SFBAlignedBufferList.hpp"
+#import "SFBAudioAsset.hpp"
+#import "SFBCAStreamBasicDescription.hpp"
+
+namespace {
+
+/// The duration of a segment in seconds; output is produced in hops of half this
+const double kSegmentDuration = 0.04;
+/// The largest distance in seconds a segment is moved from its nominal position
+const double kToleranceDuration = 0.01;
+/// The distance in frames between candidates in the coarse search
+const UInt32 kCoarseSearchStep = 4;
+/// The number of input frames written to the stretcher at once by @c Stretch()
+const UInt32 kStretchInputBlockSize = 4096;
+
+}
+
+std::shared_ptr<const SFBAudioAsset> SFBTimeStretcher::Stretch(const SFBAudioAsset& asset, double tempo)
+{
+	if(!(tempo >= kMinimumTempo && tempo <= kMaximumTempo))
+		throw std::invalid_argument("Tempo out of range");
+
+	SFBTimeStretcher stretcher(asset.ChannelCount(), asset.SampleRate(), tempo);
+
+	const auto channelCount = asset.ChannelCount();
+	const auto frameLength = static_cast<UInt32>(std::llround(asset.FrameLength() / tempo));
+
+	SFB::CAStreamBasicDescription format(SFB::CommonPCMFormat::float32, asset.SampleRate(), channelCount, false);
+	SFBAlignedBufferList output;
+	if(!output.Allocate(format, frameLength + stretcher.HopSize()))
+		throw std::bad_alloc();
+
+	const AudioBufferList *outputBuffers = output;
+	std::vector<const float *> inputChannels(channelCount);
+	std::vector<float *> outputChannels(channelCount);
+
+	UInt32 framesRead = 0;
+	UInt32 framesWritten = 0;
+	while(framesWritten < frameLength && !stretcher.IsFinished()) {
+		for(UInt32 channel = 0; channel < channelCount; ++channel)
+			outputChannels[channel] = static_cast<float *>(outputBuffers->mBuffers[channel].mData) + framesWritten;
+		if(stretcher.Process(outputChannels.data())) {
+			framesWritten += stretcher.HopSize();
+			continue;
+		}
+
+		const auto count = std::min({ asset.FrameLength() - framesRead, stretcher.FramesAvailableToWrite(), kStretchInputBlockSize });
+		for(UInt32 channel = 0; channel < channelCount; ++channel)
+			inputChannels[channel] = asset.Channel(channel) + framesRead;
+		framesRead += stretcher.Write(inputChannels.data(), count);
+		if(framesRead == asset.FrameLength())
+			stretcher.EndInput();
+	}
+
+	return std::make_shared<const SFBAudioAsset>(outputBuffers, std::min(framesWritten, frameLength), asset.SampleRate());
+}
+
+SFBTimeStretcher::SFBTimeStretcher(UInt32 channelCount, Float64 sampleRate, double tempo)
+: mChannelCount(channelCount), mSegmentLength(0), mHopSize(0), mTolerance(0), mCapacity(0), mTempo(tempo), mInputStart(0), mInputEnd(0), mInputEnded(false), mAnalysisPosition(0), mPreviousSegmentStart(-1), mIsFinished(false)
+{
+	if(channelCount == 0)
+		throw std::invalid_argument("channelCount == 0");
+	if(!(tempo >= kMinimumTempo && tempo <= kMaximumTempo))
+		throw std::invalid_argument("Tempo out of range");
+
+	mHopSize = std::max(UInt32{64}, static_cast<UInt32>(sampleRate * kSegmentDuration / 2));
+	mSegmentLength = 2 * mHopSize;
+	mTolerance = std::max(UInt32{1}, static_cast<UInt32>(sampleRate * kToleranceDuration));
+
+	// The next hop reads from the earlier of the previous continuation and the search range, through a segment past the
+	// end of the search range; at the fastest tempo these span two tolerances, two segments, and the largest analysis hop
+	const auto span = 2 * mTolerance + 2 * mSegmentLength + static_cast<UInt32>(std::ceil(mHopSize * kMaximumTempo));
+	mCapacity = 2 * span;
+
+	mInput.resize(channelCount);
+	for(auto& channel : mInput)
+		channel.assign(mCapacity + span, 0);
+
+	mWindow.resize(mSegmentLength);
+	for(UInt32 i = 0; i < mSegmentLength; ++i)
+		mWindow[i] = static_cast<float>(0.5 - 0.5 * std::cos(2 * M_PI * i / mSegmentLength));
+
+	mAccumulator.resize(channelCount);
+	for(auto& channel : mAccumulator)
+		channel.assign(mSegmentLength, 0);
+}
+
+void SFBTimeStretcher::SetTempo(double tempo) noexcept
+{
+	mTempo.store(std::min(std::max(tempo, kMinimumTempo), kMaximumTempo), std::memory_order_relaxed);
+}
+
+UInt32 SFBTimeStretcher::FramesAvailableToWrite() const noexcept
+{
+	if(mInputEnded)
+		return 0;
+	return mCapacity - static_cast<UInt32>(mInputEnd - mInputStart);
+}
+
+UInt32 SFBTimeStretcher::Write(const float * const *channels, UInt32 frameCount) noexcept
+{
+	const auto count = std::min(frameCount, FramesAvailableToWrite());
+	if(count == 0)
+		return 0;
+
+	const auto offset = static_cast<size_t>(mInputEnd - mInputStart);
+	for(UInt32 channel = 0; channel < mChannelCount; ++channel)
+		std::memcpy(mInput[channel].data() + offset, channels[channel], count * sizeof(float));
+	mInputEnd += count;
+
+	return count;
+}
+
+void SFBTimeStretcher::EndInput() noexcept
+{
+	mInputEnded = true;
+}
+
+bool SFBTimeStretcher::Process(float * const *channels) noexcept
+{
+	if(mIsFinished)
+		return false;
+
+	const auto nominal = static_cast<SInt64>(std::llround(mAnalysisPosition));
+	const bool inputIsExhausted = mInputEnded && nominal >= mInputEnd;
+
+	if(!inputIsExhausted) {
+		// Without the end of the input every frame the search may read must be buffered; past the end it reads silence
+		auto requiredInputEnd = nominal + mTolerance + mSegmentLength;
+		if(mPreviousSegmentStart >= 0)
+			requiredInputEnd = std::max(requiredInputEnd, mPreviousSegmentStart + mHopSize + mSegmentLength);
+		if(!mInputEnded && mInputEnd < requiredInputEnd)
+			return false;
+
+		const auto start = mPreviousSegmentStart < 0 ? std::max(nominal, mInputStart) : BestSegmentStart(nominal);
+		for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+			const auto input = Input(channel, start);
+			auto accumulator = mAccumulator[channel].data();
+			for(UInt32 i = 0; i < mSegmentLength; ++i)
+				accumulator[i] += mWindow[i] * input[i];
+		}
+		mPreviousSegmentStart = start;
+	}
+
+	// The first hop of the accumulator has received every segment overlapping it
+	for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+		auto accumulator = mAccumulator[channel].data();
+		std::memcpy(channels[channel], accumulator, mHopSize * sizeof(float));
+		std::memmove(accumulator, accumulator + mHopSize, (mSegmentLength - mHopSize) * sizeof(float));
+		std::memset(accumulator + mSegmentLength - mHopSize, 0, mHopSize * sizeof(float));
+	}
+
+	if(inputIsExhausted) {
+		// One hop after the last segment its tail has been emitted
+		mIsFinished = true;
+		return true;
+	}
+
+	mAnalysisPosition += mHopSize * mTempo.load(std::memory_order_relaxed);
+
+	// Keep the continuation of this segment and the next search range
+	const auto nextNominal = static_cast<SInt64>(std::llround(mAnalysisPosition));
+	DiscardInput(std::min({ nextNominal - static_cast<SInt64>(mTolerance), mPreviousSegmentStart + static_cast<SInt64>(mHopSize), mInputEnd }));
+
+	return true;
+}
+
+SInt64 SFBTimeStretcher::BestSegmentStart(SInt64 nominal) const noexcept
+{
+	const auto first = std::max(nominal - static_cast<SInt64>(mTolerance), mInputStart);
+	const auto last = std::max(nominal + static_cast<SInt64>(mTolerance), first);
+
+	// Search every few candidates using every other frame, then refine around the best
+	auto best = first;
+	auto bestCorrelation = -std::numeric_limits<float>::infinity();
+	for(auto candidate = first; candidate <= last; candidate += kCoarseSearchStep) {
+		const auto correlation = Correlation(candidate, 2);
+		if(correlation > bestCorrelation) {
+			bestCorrelation = correlation;
+			best = candidate;
+		}
+	}
+
+	const auto refineFirst = std::max(first, best - static_cast<SInt64>(kCoarseSearchStep) + 1);
+	const auto refineLast = std::min(last, best + static_cast<SInt64>(kCoarseSearchStep) - 1);
+	bestCorrelation = -std::numeric_limits<float>::infinity();
+	for(auto candidate = refineFirst; candidate <= refineLast; ++candidate) {
+		const auto correlation = Correlation(candidate, 1);
+		if(correlation > bestCorrelation) {
+			bestCorrelation = correlation;
+			best = candidate;
+		}
+	}
+
+	return best;
+}
+
+float SFBTimeStretcher::Correlation(SInt64 start, UInt32 stride) const noexcept
+{
+	float sum = 0;
+	for(UInt32 channel = 0; channel < mChannelCount; ++channel) {
+		const auto candidate = Input(channel, start);
+		const auto continuation = Input(channel, mPreviousSegmentStart + mHopSize);
+		for(UInt32 i = 0; i < mSegmentLength; i += stride)
+			sum += candidate[i] * continuation[i];
+	}
+	return sum;
+}
+
+void SFBTimeStretcher::DiscardInput(SInt64 frame) noexcept
+{
+	if(frame <= mInputStart)
+		return;
+
+	const auto count = static_cast<size_t>(frame - mInputStart);
+	const auto remaining = static_cast<size_t>(mInputEnd - frame);
+	for(auto& channel : mInput) {
+		std::memmove(channel.data(), channel.data() + count, remaining * sizeof(float));
+		// The buffer past the input stays silent
+		std::memset(channel.data() + remaining, 0, count * sizeof(float));
+	}
+	mInputStart = frame;
+}
@@ -0,0 +1,144 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <memory>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+class SFBAudioAsset;
+
+/// Changes the tempo of streaming audio without changing its pitch (WSOLA)
+///
+/// Output is built by overlap-adding Hann-windowed input segments at a fixed synthesis hop. The input position of each
+/// segment advances by the hop scaled by the tempo and is then moved within a tolerance to the offset whose waveform best
+/// continues the previous segment, found by a coarse-to-fine cross-correlation search.
+///
+/// Input is written in blocks of any size and output is produced one hop at a time. The input needed ahead of the next hop is
+/// bounded by @c LookaheadFrameCount(). All storage is allocated at construction.
+class SFBTimeStretcher
+{
+
+public:
+
+	/// The slowest supported tempo
+	static constexpr double kMinimumTempo = 0.25;
+	/// The fastest supported tempo
+	static constexpr double kMaximumTempo = 4;
+
+	/// Returns @c asset played at @c tempo, rendered in one pass
+	/// @throw @c std::invalid_argument if @c tempo is out of range
+	/// @throw @c std::bad_alloc
+	static std::shared_ptr<const SFBAudioAsset> Stretch(const SFBAudioAsset& asset, double tempo);
+
+	/// Creates a new @c SFBTimeStretcher
+	/// @param channelCount The number of channels to process
+	/// @param sampleRate The sample rate of the audio, which sets the segment length and search tolerance
+	/// @param tempo The initial ratio of input duration to output duration
+	/// @throw @c std::invalid_argument if @c channelCount is zero or @c tempo is out of range
+	/// @throw @c std::bad_alloc
+	SFBTimeStretcher(UInt32 channelCount, Float64 sampleRate, double tempo);
+
+	// This class is non-copyable
+	SFBTimeStretcher(const SFBTimeStretcher& rhs) = delete;
+
+	// This class is non-assignable
+	SFBTimeStretcher& operator=(const SFBTimeStretcher& rhs) = delete;
+
+	~SFBTimeStretcher() = default;
+
+	// This class is non-movable
+	SFBTimeStretcher(SFBTimeStretcher&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBTimeStretcher& operator=(SFBTimeStretcher&& rhs) = delete;
+
+
+	/// Returns the number of frames produced by each call to @c Process()
+	inline UInt32 HopSize() const noexcept
+	{
+		return mHopSize;
+	}
+
+	/// Returns the largest number of input frames buffered ahead of the next hop
+	inline UInt32 LookaheadFrameCount() const noexcept
+	{
+		return mCapacity;
+	}
+
+	/// Sets the tempo used from the next hop, clamped to the supported range
+	/// @note This is safe to call from any thread
+	void SetTempo(double tempo) noexcept;
+	inline double Tempo() const noexcept
+	{
+		return mTempo.load(std::memory_order_relaxed);
+	}
+
+	/// Returns the number of input frames that may be written
+	UInt32 FramesAvailableToWrite() const noexcept;
+	/// Appends at most @c frameCount frames from @c channels to the input
+	/// @return The number of frames written
+	UInt32 Write(const float * const *channels, UInt32 frameCount) noexcept;
+	/// Marks the end of the input so the remaining input can be processed and the output flushed
+	void EndInput() noexcept;
+
+	/// Writes the next @c HopSize() frames of output to @c channels
+	/// @return @c false if more input is needed or the output is complete
+	bool Process(float * const *channels) noexcept;
+
+	/// Returns @c true once every output frame has been produced
+	inline bool IsFinished() const noexcept
+	{
+		return mIsFinished;
+	}
+
+private:
+
+	/// Returns the input segment start within the tolerance of @c nominal that best continues the previous segment
+	SInt64 BestSegmentStart(SInt64 nominal) const noexcept;
+	/// Returns the cross-correlation of the segment at @c start with the continuation of the previous segment, using every @c stride frames
+	float Correlation(SInt64 start, UInt32 stride) const noexcept;
+	/// Returns the buffered input of @c channel starting at absolute frame @c frame
+	inline const float * Input(UInt32 channel, SInt64 frame) const noexcept
+	{
+		return mInput[channel].data() + (frame - mInputStart);
+	}
+	/// Discards input before absolute frame @c frame
+	void DiscardInput(SInt64 frame) noexcept;
+
+	UInt32 mChannelCount;
+	/// The segment length, twice the hop size
+	UInt32 mSegmentLength;
+	UInt32 mHopSize;
+	/// The largest distance a segment is moved from its nominal position
+	UInt32 mTolerance;
+	/// The input buffer length, excluding the silent padding that follows it
+	UInt32 mCapacity;
+
+	std::atomic<double> mTempo;
+
+	/// Buffered input for each channel, followed by enough silence to read a segment past the end of the input
+	std::vector<std::vector<float>> mInput;
+	/// The absolute frame of the first buffered input frame
+	SInt64 mInputStart;
+	/// The absolute frame following the last buffered input frame
+	SInt64 mInputEnd;
+	bool mInputEnded;
+
+	/// The Hann window, which sums to one at the hop size
+	std::vector<float> mWindow;
+	/// Overlap-added output for each channel, one segment long
+	std::vector<std::vector<float>> mAccumulator;
+
+	/// The nominal input position of the next segment
+	double mAnalysisPosition;
+	/// The input start of the previous segment, or a negative value before the first segment
+	SInt64 mPreviousSegmentStart;
+	bool mIsFinished;
+
+};
@@ -0,0 +1,746 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#import "SFBVoiceRenderer.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <cstring>
+#import <limits>
+#import <stdexcept>
+
+namespace {
+
+/// The smallest number of commands that may be waiting for the render thread
+const size_t kMinimumCommandCapacity = 1024;
+
+/// The number of fractional bits in a phase
+const UInt32 kPhaseFractionBits = 32;
+const UInt64 kPhaseFractionMask = (UInt64{1} << kPhaseFractionBits) - 1;
+const float kPhaseFractionScale = 1.f / (UInt64{1} << kPhaseFractionBits);
+
+/// The number of sinc coefficient sets, selected by the leading fractional bits of the phase
+const UInt32 kSincPhaseBits = 10;
+const UInt32 kSincPhaseCount = 1 << kSincPhaseBits;
+const UInt32 kSincTapCount = 8;
+/// The sinc cutoff as a fraction of the asset's Nyquist frequency
+const double kSincCutoff = 0.9;
+
+/// Returns the number of taps preceding the interpolated position
+inline UInt32 LeadingTapCount(SFBVoiceRenderer::Interpolation interpolation) noexcept
+{
+	switch(interpolation) {
+		case SFBVoiceRenderer::Interpolation::linear:	return 0;
+		case SFBVoiceRenderer::Interpolation::cubic:	return 1;
+		case SFBVoiceRenderer::Interpolation::sinc:		return kSincTapCount / 2 - 1;
+	}
+	return 0;
+}
+
+/// Returns the number of taps following the interpolated position
+inline UInt32 TrailingTapCount(SFBVoiceRenderer::Interpolation interpolation) noexcept
+{
+	switch(interpolation) {
+		case SFBVoiceRenderer::Interpolation::linear:	return 1;
+		case SFBVoiceRenderer::Interpolation::cubic:	return 2;
+		case SFBVoiceRenderer::Interpolation::sinc:		return kSincTapCount / 2;
+	}
+	return 0;
+}
+
+inline UInt32 SlotFromVoiceID(SFBVoiceRenderer::VoiceID voice) noexcept
+{
+	return static_cast<UInt32>(voice & 0xffffffff);
+}
+
+inline UInt32 GenerationFromVoiceID(SFBVoiceRenderer::VoiceID voice) noexcept
+{
+	return static_cast<UInt32>(voice >> 32);
+}
+
+}
+
+SFBVoiceRenderer::SFBVoiceRenderer(UInt32 voiceCapacity, const AudioStreamBasicDescription& format, UInt32 maximumFrameCount)
+: mSampleRate(format.mSampleRate), mChannelCount(format.mChannelsPerFrame), mMaximumFrameCount(maximumFrameCount), mCommands(std::max(4 * static_cast<size_t>(voiceCapacity), kMinimumCommandCapacity)), mFinishedSlots(voiceCapacity), mPendingCommandCount(0), mActiveVoiceCount(0), mRenderSpatializer(nullptr)
+{
+	if(voiceCapacity == 0)
+		throw std::invalid_argument("voiceCapacity == 0");
+	if(format.mFormatID != kAudioFormatLinearPCM || !(format.mFormatFlags & kAudioFormatFlagIsFloat) || !(format.mFormatFlags & kAudioFormatFlagIsNonInterleaved) || format.mBitsPerChannel != 32 || format.mChannelsPerFrame == 0)
+		throw std::invalid_argument("Format must be deinterleaved 32-bit float");
+
+	mSlotAssets.resize(voiceCapacity);
+	mSlotGenerations.assign(voiceCapacity, 1);
+	// Hand out low slots first
+	mFreeSlots.resize(voiceCapacity);
+	for(UInt32 i = 0; i < voiceCapacity; ++i)
+		mFreeSlots[i] = voiceCapacity - 1 - i;
+
+	mVoices.resize(voiceCapacity);
+	mActiveSlots.reserve(voiceCapacity);
+
+	mLoopSeams.resize(static_cast<size_t>(voiceCapacity) * kMaximumAssetChannelCount * 2 * kMinimumLoopFrameCount);
+
+	// Tap k of phase p is centered on asset frame k - (kSincTapCount / 2 - 1) relative to the position p / kSincPhaseCount
+	mSincTable.resize(kSincPhaseCount * kSincTapCount);
+	const double halfWidth = kSincTapCount / 2;
+	for(UInt32 phase = 0; phase < kSincPhaseCount; ++phase) {
+		auto coefficients = mSincTable.data() + phase * kSincTapCount;
+		double sum = 0;
+		for(UInt32 tap = 0; tap < kSincTapCount; ++tap) {
+			const auto t = static_cast<double>(tap) - (kSincTapCount / 2 - 1) - static_cast<double>(phase) / kSincPhaseCount;
+			const auto x = M_PI * kSincCutoff * t;
+			const auto sinc = t == 0 ? 1 : std::sin(x) / x;
+			const auto window = std::abs(t) >= halfWidth ? 0 : 0.42 + 0.5 * std::cos(M_PI * t / halfWidth) + 0.08 * std::cos(2 * M_PI * t / halfWidth);
+			coefficients[tap] = static_cast<float>(sinc * window);
+			sum += coefficients[tap];
+		}
+		// Unity gain at DC for every phase
+		for(UInt32 tap = 0; tap < kSincTapCount; ++tap)
+			coefficients[tap] = static_cast<float>(coefficients[tap] / sum);
+	}
+
+	mWindowStarts.resize(maximumFrameCount);
+	mWindowIsInSeam.resize(maximumFrameCount);
+	mFractions.resize(maximumFrameCount);
+	mSincPhases.resize(maximumFrameCount);
+	mEnvelope.resize(maximumFrameCount);
+	mChannelBuffer.resize(maximumFrameCount);
+}
+
+SFBVoiceRenderer::VoiceID SFBVoiceRenderer::Play(std::shared_ptr<const SFBAudioAsset> asset, const VoiceParameters& parameters)
+{
+	if(!asset)
+		throw std::invalid_argument("asset == nullptr");
+	if(asset->ChannelCount() > kMaximumAssetChannelCount)
+		throw std::invalid_argument("Asset channel count > kMaximumAssetChannelCount");
+	if(!(parameters.mRate > 0))
+		throw std::invalid_argument("Rate must be positive");
+	if(!(parameters.mStartFrame >= 0 && parameters.mStartFrame < asset->FrameLength()))
+		throw std::invalid_argument("Start frame out of range");
+	if(parameters.mLoopEndFrame != 0 && (parameters.mLoopEndFrame > asset->FrameLength() || parameters.mLoopStartFrame + kMinimumLoopFrameCount > parameters.mLoopEndFrame || parameters.mStartFrame >= parameters.mLoopEndFrame))
+		throw std::invalid_argument("Invalid loop");
+
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	if(mFreeSlots.empty())
+		throw std::runtime_error("No free voices");
+
+	const auto slot = mFreeSlots.back();
+	const auto generation = mSlotGenerations[slot];
+
+	// The render thread does not touch a free slot's seam, and the command publishes it
+	if(parameters.mLoopEndFrame != 0) {
+		for(UInt32 channel = 0; channel < asset->ChannelCount(); ++channel) {
+			auto seam = LoopSeam(slot, channel);
+			std::memcpy(seam, asset->Channel(channel) + parameters.mLoopEndFrame - kMinimumLoopFrameCount, kMinimumLoopFrameCount * sizeof(float));
+			std::memcpy(seam + kMinimumLoopFrameCount, asset->Channel(channel) + parameters.mLoopStartFrame, kMinimumLoopFrameCount * sizeof(float));
+		}
+	}
+
+	Command command = {};
+	command.mType = Command::Type::start;
+	command.mSlot = slot;
+	command.mGeneration = generation;
+	command.mAsset = asset.get();
+	command.mParameters = parameters;
+	Submit(command);
+
+	mFreeSlots.pop_back();
+	mSlotAssets[slot] = std::move(asset);
+
+	return (static_cast<VoiceID>(generation) << 32) | slot;
+}
+
+bool SFBVoiceRenderer::Stop(VoiceID voice, Float64 sampleTime, UInt32 releaseFrameCount)
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	UInt32 slot;
+	if(!SlotForVoice(voice, slot))
+		return false;
+
+	Command command = {};
+	command.mType = Command::Type::stop;
+	command.mSlot = slot;
+	command.mGeneration = GenerationFromVoiceID(voice);
+	command.mSampleTime = sampleTime;
+	command.mReleaseFrameCount = releaseFrameCount;
+	Submit(command);
+
+	return true;
+}
+
+void SFBVoiceRenderer::StopAll()
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+
+	Command command = {};
+	command.mType = Command::Type::stopAll;
+	Submit(command);
+}
+
+bool SFBVoiceRenderer::SetGain(VoiceID voice, float gain)
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	UInt32 slot;
+	if(!SlotForVoice(voice, slot))
+		return false;
+
+	Command command = {};
+	command.mType = Command::Type::setGain;
+	command.mSlot = slot;
+	command.mGeneration = GenerationFromVoiceID(voice);
+	command.mValue = gain;
+	Submit(command);
+
+	return true;
+}
+
+bool SFBVoiceRenderer::SetPan(VoiceID voice, float pan)
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	UInt32 slot;
+	if(!SlotForVoice(voice, slot))
+		return false;
+
+	Command command = {};
+	command.mType = Command::Type::setPan;
+	command.mSlot = slot;
+	command.mGeneration = GenerationFromVoiceID(voice);
+	command.mValue = std::min(std::max(pan, -1.f), 1.f);
+	Submit(command);
+
+	return true;
+}
+
+bool SFBVoiceRenderer::SetPosition(VoiceID voice, float azimuth, float elevation, UInt32 frameCount)
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	UInt32 slot;
+	if(!SlotForVoice(voice, slot))
+		return false;
+
+	Command command = {};
+	command.mType = Command::Type::setPosition;
+	command.mSlot = slot;
+	command.mGeneration = GenerationFromVoiceID(voice);
+	command.mAzimuth = azimuth;
+	command.mElevation = std::min(std::max(elevation, -90.f), 90.f);
+	command.mFrameCount = frameCount;
+	Submit(command);
+
+	return true;
+}
+
+void SFBVoiceRenderer::SetSpatializer(std::shared_ptr<const SFBSpatializer> spatializer)
+{
+	if(spatializer && spatializer->ChannelCount() != mChannelCount)
+		throw std::invalid_argument("Spatializer channel count does not match the rendered audio");
+
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+
+	Command command = {};
+	command.mType = Command::Type::setSpatializer;
+	command.mSpatializer = spatializer.get();
+	Submit(command);
+
+	if(mSpatializer)
+		mRetiredSpatializers.push_back(std::move(mSpatializer));
+	mSpatializer = std::move(spatializer);
+}
+
+bool SFBVoiceRenderer::SetRate(VoiceID voice, Float64 rate)
+{
+	if(!(rate > 0))
+		throw std::invalid_argument("Rate must be positive");
+
+	std::lock_guard<std::mutex> lock(mControlLock);
+
+	ReclaimFinishedSlots();
+	UInt32 slot;
+	if(!SlotForVoice(voice, slot))
+		return false;
+
+	Command command = {};
+	command.mType = Command::Type::setRate;
+	command.mSlot = slot;
+	command.mGeneration = GenerationFromVoiceID(voice);
+	command.mRate = rate;
+	Submit(command);
+
+	return true;
+}
+
+void SFBVoiceRenderer::Collect()
+{
+	std::lock_guard<std::mutex> lock(mControlLock);
+	ReclaimFinishedSlots();
+}
+
+bool SFBVoiceRenderer::Render(AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime) noexcept
+{
+	Command command;
+	while(mCommands.Pop(command)) {
+		ApplyCommand(command, sampleTime);
+		mPendingCommandCount.fetch_sub(1, std::memory_order_release);
+	}
+
+	for(UInt32 i = 0; i < bufferList->mNumberBuffers; ++i)
+		std::memset(bufferList->mBuffers[i].mData, 0, frameCount * sizeof(float));
+
+	if(frameCount > mMaximumFrameCount || bufferList->mNumberBuffers < mChannelCount)
+		return false;
+
+	bool rendered = false;
+	for(size_t i = 0; i < mActiveSlots.size(); ) {
+		const auto slot = mActiveSlots[i];
+		if(RenderVoice(slot, bufferList, frameCount, sampleTime, rendered)) {
+			++i;
+			continue;
+		}
+
+		FinishVoice(slot);
+		mActiveSlots[i] = mActiveSlots.back();
+		mActiveSlots.pop_back();
+	}
+
+	mActiveVoiceCount.store(static_cast<UInt32>(mActiveSlots.size()), std::memory_order_relaxed);
+
+	return rendered;
+}
+
+void SFBVoiceRenderer::Submit(const Command& command)
+{
+	// Count the command first so it is never in the queue without being counted
+	mPendingCommandCount.fetch_add(1, std::memory_order_relaxed);
+	if(!mCommands.Push(command)) {
+		mPendingCommandCount.fetch_sub(1, std::memory_order_relaxed);
+		throw std::runtime_error("Voice command queue full");
+	}
+}
+
+bool SFBVoiceRenderer::SlotForVoice(VoiceID voice, UInt32& slot) const noexcept
+{
+	slot = SlotFromVoiceID(voice);
+	return slot < mSlotAssets.size() && mSlotGenerations[slot] == GenerationFromVoiceID(voice) && mSlotAssets[slot];
+}
+
+void SFBVoiceRenderer::ReclaimFinishedSlots() noexcept
+{
+	UInt32 slot;
+	while(mFinishedSlots.Pop(slot)) {
+		mSlotAssets[slot].reset();
+		// Commands for the finished voice still in the queue no longer match the slot
+		if(++mSlotGenerations[slot] == 0)
+			mSlotGenerations[slot] = 1;
+		mFreeSlots.push_back(slot);
+	}
+
+	// Once every command has been applied the render thread no longer uses a replaced spatializer
+	if(!mRetiredSpatializers.empty() && mPendingCommandCount.load(std::memory_order_acquire) == 0)
+		mRetiredSpatializers.clear();
+}
+
+UInt64 SFBVoiceRenderer::PhaseIncrement(const SFBAudioAsset& asset, Float64 rate) const noexcept
+{
+	return static_cast<UInt64>(std::llround(std::ldexp(rate * asset.SampleRate() / mSampleRate, kPhaseFractionBits)));
+}
+
+void SFBVoiceRenderer::ApplyCommand(const Command& command, Float64 sampleTime) noexcept
+{
+	if(command.mType == Command::Type::stopAll) {
+		for(auto slot : mActiveSlots) {
+			mVoices[slot].mStopSampleTime = std::min(mVoices[slot].mStopSampleTime, sampleTime);
+			mVoices[slot].mReleaseFrameCount = 0;
+		}
+		return;
+	}
+
+	if(command.mType == Command::Type::setSpatializer) {
+		// Playing voices move to the new layout without a ramp, since their routes are replaced
+		mRenderSpatializer = command.mSpatializer;
+		for(auto slot : mActiveSlots) {
+			auto& voice = mVoices[slot];
+			BuildRoutes(voice);
+			for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+				voice.mRoutes[i].mGain = voice.mRoutes[i].mTargetGain;
+		}
+		return;
+	}
+
+	auto& voice = mVoices[command.mSlot];
+
+	if(command.mType == Command::Type::start) {
+		const auto& parameters = command.mParameters;
+		const auto asset = command.mAsset;
+
+		voice.mAsset = asset;
+		voice.mGeneration = command.mGeneration;
+		voice.mIsActive = true;
+		voice.mHasStarted = false;
+		voice.mStartSampleTime = parameters.mStartSampleTime < 0 ? sampleTime : parameters.mStartSampleTime;
+		voice.mStopSampleTime = std::numeric_limits<Float64>::infinity();
+		voice.mReleaseFrameCount = 0;
+		voice.mPhase = static_cast<UInt64>(std::llround(std::ldexp(parameters.mStartFrame, kPhaseFractionBits)));
+		voice.mPhaseIncrement = PhaseIncrement(*asset, parameters.mRate);
+		voice.mInterpolation = parameters.mInterpolation;
+		voice.mLoopStartFrame = parameters.mLoopStartFrame;
+		voice.mLoopEndFrame = parameters.mLoopEndFrame;
+		voice.mHasLooped = false;
+		voice.mGain = parameters.mGain;
+		voice.mPan = std::min(std::max(parameters.mPan, -1.f), 1.f);
+		voice.mAzimuth = voice.mTargetAzimuth = parameters.mAzimuth;
+		voice.mElevation = voice.mTargetElevation = std::min(std::max(parameters.mElevation, -90.f), 90.f);
+		voice.mSpread = parameters.mSpread;
+		voice.mPositionFrameCount = 0;
+		BuildRoutes(voice);
+
+		mActiveSlots.push_back(command.mSlot);
+		return;
+	}
+
+	// The voice finished or its slot was reused after the command was sent
+	if(!voice.mIsActive || voice.mGeneration != command.mGeneration)
+		return;
+
+	switch(command.mType) {
+		case Command::Type::stop:
+			voice.mStopSampleTime = std::min(voice.mStopSampleTime, command.mSampleTime < 0 ? sampleTime : command.mSampleTime);
+			voice.mReleaseFrameCount = command.mReleaseFrameCount;
+			break;
+		case Command::Type::setGain:
+			voice.mGain = command.mValue;
+			UpdateRoutes(voice);
+			break;
+		case Command::Type::setPan:
+			voice.mPan = command.mValue;
+			UpdateRoutes(voice);
+			break;
+		case Command::Type::setRate:
+			voice.mPhaseIncrement = PhaseIncrement(*voice.mAsset, command.mRate);
+			break;
+		case Command::Type::setPosition:
+			voice.mTargetAzimuth = command.mAzimuth;
+			voice.mTargetElevation = command.mElevation;
+			voice.mPositionFrameCount = command.mFrameCount;
+			if(command.mFrameCount == 0) {
+				voice.mAzimuth = command.mAzimuth;
+				voice.mElevation = command.mElevation;
+				if(mRenderSpatializer) {
+					UpdateSpeakerGains(voice);
+					UpdateRoutes(voice);
+				}
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void SFBVoiceRenderer::BuildRoutes(Voice& voice) const noexcept
+{
+	const auto assetChannelCount = voice.mAsset->ChannelCount();
+	voice.mRouteCount = 0;
+
+	// Spatialized routes are added as the speaker gains require them
+	if(mRenderSpatializer) {
+		UpdateSpeakerGains(voice);
+		UpdateRoutes(voice);
+		return;
+	}
+
+	// Mono output sums the asset, mono assets are panned, and otherwise asset channels map to output channels
+	if(mChannelCount == 1) {
+		for(UInt32 channel = 0; channel < assetChannelCount; ++channel)
+			voice.mRoutes[voice.mRouteCount++] = { channel, 0, 0, 0 };
+	}
+	else if(assetChannelCount == 1) {
+		voice.mRoutes[voice.mRouteCount++] = { 0, 0, 0, 0 };
+		voice.mRoutes[voice.mRouteCount++] = { 0, 1, 0, 0 };
+	}
+	else {
+		for(UInt32 channel = 0; channel < std::min(assetChannelCount, mChannelCount); ++channel)
+			voice.mRoutes[voice.mRouteCount++] = { channel, channel, 0, 0 };
+	}
+	UpdateRoutes(voice);
+}
+
+void SFBVoiceRenderer::UpdateSpeakerGains(Voice& voice) const noexcept
+{
+	// The channels of a multichannel asset are spread evenly from left to right around the voice's azimuth
+	const auto assetChannelCount = voice.mAsset->ChannelCount();
+	for(UInt32 channel = 0; channel < assetChannelCount; ++channel) {
+		auto azimuth = voice.mAzimuth;
+		if(assetChannelCount > 1)
+			azimuth += voice.mSpread * (static_cast<float>(channel) / (assetChannelCount - 1) - 0.5f);
+		voice.mSpeakerGainCounts[channel] = mRenderSpatializer->GainsForDirection(azimuth, voice.mElevation, voice.mSpeakerGains[channel]);
+	}
+}
+
+void SFBVoiceRenderer::AdvancePosition(Voice& voice, UInt32 frameCount) const noexcept
+{
+	const auto count = std::min(frameCount, voice.mPositionFrameCount);
+	const auto fraction = static_cast<float>(count) / voice.mPositionFrameCount;
+	// Turn the shorter way around
+	const auto azimuthChange = std::remainder(voice.mTargetAzimuth - voice.mAzimuth, 360.f);
+	voice.mAzimuth += fraction * azimuthChange;
+	voice.mElevation += fraction * (voice.mTargetElevation - voice.mElevation);
+	voice.mPositionFrameCount -= count;
+
+	if(mRenderSpatializer) {
+		UpdateSpeakerGains(voice);
+		UpdateRoutes(voice);
+	}
+}
+
+void SFBVoiceRenderer::UpdateRoutes(Voice& voice) const noexcept
+{
+	const auto assetChannelCount = voice.mAsset->ChannelCount();
+
+	if(mRenderSpatializer) {
+		// Routes no longer used fade out and new routes fade in
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+			voice.mRoutes[i].mTargetGain = 0;
+
+		for(UInt32 channel = 0; channel < assetChannelCount; ++channel) {
+			for(UInt32 j = 0; j < voice.mSpeakerGainCounts[channel]; ++j) {
+				const auto& speakerGain = voice.mSpeakerGains[channel][j];
+				UInt32 i = 0;
+				while(i < voice.mRouteCount && !(voice.mRoutes[i].mSourceChannel == channel && voice.mRoutes[i].mDestinationChannel == speakerGain.mChannel))
+					++i;
+				if(i == voice.mRouteCount) {
+					if(voice.mRouteCount == kMaximumRouteCount)
+						continue;
+					voice.mRoutes[voice.mRouteCount++] = { channel, speakerGain.mChannel, 0, 0 };
+				}
+				voice.mRoutes[i].mTargetGain = voice.mGain * speakerGain.mGain;
+			}
+		}
+	}
+	else if(mChannelCount == 1) {
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+			voice.mRoutes[i].mTargetGain = voice.mGain / assetChannelCount;
+	}
+	else if(assetChannelCount == 1) {
+		// Equal-power pan
+		const auto angle = (voice.mPan + 1) * static_cast<float>(M_PI_4);
+		voice.mRoutes[0].mTargetGain = voice.mGain * std::cos(angle);
+		voice.mRoutes[1].mTargetGain = voice.mGain * std::sin(angle);
+	}
+	else if(assetChannelCount == 2) {
+		// Balance
+		voice.mRoutes[0].mTargetGain = voice.mGain * (voice.mPan > 0 ? 1 - voice.mPan : 1);
+		voice.mRoutes[1].mTargetGain = voice.mGain * (voice.mPan < 0 ? 1 + voice.mPan : 1);
+	}
+	else {
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+			voice.mRoutes[i].mTargetGain = voice.mGain;
+	}
+}
+
+bool SFBVoiceRenderer::RenderVoice(UInt32 slot, AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime, bool& rendered) noexcept
+{
+	auto& voice = mVoices[slot];
+
+	if(voice.mStartSampleTime >= sampleTime + frameCount)
+		return true;
+
+	UInt32 offset = 0;
+	if(voice.mStartSampleTime > sampleTime)
+		offset = static_cast<UInt32>(voice.mStartSampleTime - sampleTime);
+	const auto firstSampleTime = sampleTime + offset;
+	auto count = frameCount - offset;
+
+	// A moving voice's gains ramp to those at its position at the end of the cycle
+	if(voice.mPositionFrameCount > 0)
+		AdvancePosition(voice, count);
+
+	// Nothing is rendered once the release following the stop time is complete
+	bool finished = false;
+	const auto endSampleTime = voice.mStopSampleTime + voice.mReleaseFrameCount;
+	if(endSampleTime <= firstSampleTime)
+		return false;
+	if(endSampleTime < firstSampleTime + count) {
+		count = static_cast<UInt32>(endSampleTime - firstSampleTime);
+		finished = true;
+	}
+
+	// Compute the interpolation windows once for all channels
+	const auto asset = voice.mAsset;
+	const auto endPhase = static_cast<UInt64>(asset->FrameLength()) << kPhaseFractionBits;
+	const auto loopStart = voice.mLoopStartFrame;
+	const auto loopEnd = voice.mLoopEndFrame;
+	const bool loops = loopEnd > loopStart;
+	const auto loopEndPhase = static_cast<UInt64>(loopEnd) << kPhaseFractionBits;
+	const auto loopLengthPhase = static_cast<UInt64>(loopEnd - loopStart) << kPhaseFractionBits;
+	const auto leadingTaps = LeadingTapCount(voice.mInterpolation);
+	const auto trailingTaps = TrailingTapCount(voice.mInterpolation);
+
+	auto phase = voice.mPhase;
+	bool interpolate = false;
+	for(UInt32 i = 0; i < count; ++i) {
+		if(loops) {
+			while(phase >= loopEndPhase) {
+				phase -= loopLengthPhase;
+				voice.mHasLooped = true;
+			}
+		}
+		else if(phase >= endPhase) {
+			count = i;
+			finished = true;
+			break;
+		}
+
+		const auto index = static_cast<UInt32>(phase >> kPhaseFractionBits);
+		const auto fraction = static_cast<UInt32>(phase & kPhaseFractionMask);
+
+		// Windows crossing the loop seam read from the copy of the seam, in which frame kMinimumLoopFrameCount is the loop start.
+		// Other windows read the asset, whose guard frames supply the taps before the first frame and after the last.
+		if(loops && index + trailingTaps >= loopEnd) {
+			mWindowStarts[i] = static_cast<SInt32>(index - loopEnd + kMinimumLoopFrameCount - leadingTaps);
+			mWindowIsInSeam[i] = true;
+		}
+		else if(loops && voice.mHasLooped && index < loopStart + leadingTaps) {
+			mWindowStarts[i] = static_cast<SInt32>(index - loopStart + kMinimumLoopFrameCount - leadingTaps);
+			mWindowIsInSeam[i] = true;
+		}
+		else {
+			mWindowStarts[i] = static_cast<SInt32>(index) - static_cast<SInt32>(leadingTaps);
+			mWindowIsInSeam[i] = false;
+		}
+
+		mFractions[i] = static_cast<float>(fraction) * kPhaseFractionScale;
+		mSincPhases[i] = fraction >> (kPhaseFractionBits - kSincPhaseBits);
+		interpolate |= fraction != 0;
+
+		phase += voice.mPhaseIncrement;
+	}
+	voice.mPhase = phase;
+
+	if(count == 0)
+		return !finished;
+
+	// Release envelope
+	const bool releases = voice.mStopSampleTime < firstSampleTime + count;
+	if(releases) {
+		const auto releaseFrameCount = static_cast<Float64>(voice.mReleaseFrameCount);
+		for(UInt32 i = 0; i < count; ++i) {
+			const auto elapsed = firstSampleTime + i - voice.mStopSampleTime;
+			mEnvelope[i] = elapsed < 0 ? 1 : static_cast<float>((releaseFrameCount - elapsed) / (releaseFrameCount + 1));
+		}
+	}
+
+	const auto windowStarts = mWindowStarts.data();
+	const auto windowIsInSeam = mWindowIsInSeam.data();
+	const auto fractions = mFractions.data();
+	const auto envelope = mEnvelope.data();
+	const auto buffer = mChannelBuffer.data();
+
+	for(UInt32 channel = 0; channel < asset->ChannelCount(); ++channel) {
+		bool routed = false;
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+			routed |= voice.mRoutes[i].mSourceChannel == channel && (voice.mRoutes[i].mGain != 0 || voice.mRoutes[i].mTargetGain != 0);
+		if(!routed)
+			continue;
+
+		const auto input = asset->Channel(channel);
+		const auto seam = LoopSeam(slot, channel);
+		if(!interpolate) {
+			for(UInt32 i = 0; i < count; ++i)
+				buffer[i] = ((windowIsInSeam[i] ? seam : input) + windowStarts[i])[leadingTaps];
+		}
+		else if(voice.mInterpolation == Interpolation::linear) {
+			for(UInt32 i = 0; i < count; ++i) {
+				const auto x = (windowIsInSeam[i] ? seam : input) + windowStarts[i];
+				buffer[i] = x[0] + fractions[i] * (x[1] - x[0]);
+			}
+		}
+		else if(voice.mInterpolation == Interpolation::cubic) {
+			for(UInt32 i = 0; i < count; ++i) {
+				const auto x = (windowIsInSeam[i] ? seam : input) + windowStarts[i];
+				const auto t = fractions[i];
+				const auto c1 = 0.5f * (x[2] - x[0]);
+				const auto c2 = x[0] - 2.5f * x[1] + 2 * x[2] - 0.5f * x[3];
+				const auto c3 = 0.5f * (x[3] - x[0]) + 1.5f * (x[1] - x[2]);
+				buffer[i] = ((c3 * t + c2) * t + c1) * t + x[1];
+			}
+		}
+		else {
+			const auto sincPhases = mSincPhases.data();
+			const auto sincTable = mSincTable.data();
+			for(UInt32 i = 0; i < count; ++i) {
+				const auto x = (windowIsInSeam[i] ? seam : input) + windowStarts[i];
+				const auto h = sincTable + sincPhases[i] * kSincTapCount;
+				// A fixed-length dot product the compiler vectorizes
+				float sum = 0;
+				for(UInt32 tap = 0; tap < kSincTapCount; ++tap)
+					sum += x[tap] * h[tap];
+				buffer[i] = sum;
+			}
+		}
+
+		if(releases) {
+			for(UInt32 i = 0; i < count; ++i)
+				buffer[i] *= envelope[i];
+		}
+
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i) {
+			const auto& route = voice.mRoutes[i];
+			if(route.mSourceChannel != channel)
+				continue;
+
+			auto output = static_cast<float *>(bufferList->mBuffers[route.mDestinationChannel].mData) + offset;
+			// A voice starts at its gain, and later gain changes are ramped across the cycle
+			const auto gain = voice.mHasStarted ? route.mGain : route.mTargetGain;
+			const auto step = (route.mTargetGain - gain) / count;
+			if(step == 0) {
+				for(UInt32 j = 0; j < count; ++j)
+					output[j] += gain * buffer[j];
+			}
+			else {
+				for(UInt32 j = 0; j < count; ++j)
+					output[j] += (gain + step * (j + 1)) * buffer[j];
+			}
+		}
+	}
+
+	for(UInt32 i = 0; i < voice.mRouteCount; ++i)
+		voice.mRoutes[i].mGain = voice.mRoutes[i].mTargetGain;
+	voice.mHasStarted = true;
+
+	// Spatialized routes that have faded out are removed
+	if(mRenderSpatializer) {
+		UInt32 routeCount = 0;
+		for(UInt32 i = 0; i < voice.mRouteCount; ++i) {
+			if(voice.mRoutes[i].mTargetGain != 0)
+				voice.mRoutes[routeCount++] = voice.mRoutes[i];
+		}
+		voice.mRouteCount = routeCount;
+	}
+	rendered = true;
+
+	return !finished;
+}
+
+void SFBVoiceRenderer::FinishVoice(UInt32 slot) noexcept
+{
+	auto& voice = mVoices[slot];
+	voice.mIsActive = false;
+	voice.mAsset = nullptr;
+	// There is room for every slot
+	mFinishedSlots.Push(slot);
+}
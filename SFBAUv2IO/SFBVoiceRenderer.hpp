@@ -0,0 +1,317 @@
+//
+// Copyright (c) 2021 Stephen F. Booth <me@sbooth.org>
+// MIT license
+//
+
+#pragma once
+
+#import <atomic>
+#import <memory>
+#import <mutex>
+#import <vector>
+
+#import <CoreAudio/CoreAudio.h>
+
+#import "SFBAudioAsset.hpp"
+#import "SFBMessageQueue.hpp"
+#import "SFBSpatializer.hpp"
+
+/// Plays any number of overlapping voices from shared @c SFBAudioAsset objects
+///
+/// Voice storage is allocated up front for a fixed number of voices. Control threads start, stop, and modify voices by
+/// enqueuing commands that the render thread applies at the start of the next render cycle; the render thread returns
+/// finished voices the same way, and their assets are released on a control thread. Rendering never allocates or locks.
+///
+/// Each voice computes its read positions once per render cycle and uses them for every channel of its asset. Positions
+/// are 32.32 fixed-point phase accumulators, so a voice playing at a constant rate never drifts however long it plays.
+/// Gains are ramped across the render cycle in which they change. Start and stop times are sample accurate.
+///
+/// Voices are panned in stereo unless a spatializer is set, in which case each voice is placed on the speaker layout at
+/// its position. A voice's speaker gains are cached and recomputed only when its position or the layout changes, so each
+/// channel of a voice is mixed into at most @c SFBSpatializer::kMaximumGainCount output channels.
+class SFBVoiceRenderer
+{
+
+public:
+
+	/// Identifies a voice; never zero
+	using VoiceID = UInt64;
+
+	/// The largest number of channels in an asset played by a voice
+	static constexpr UInt32 kMaximumAssetChannelCount = 8;
+	/// The shortest loop a voice may play
+	static constexpr UInt32 kMinimumLoopFrameCount = 8;
+
+	/// How samples between asset frames are computed
+	///
+	/// The cost per voice channel and frame is fixed by the tap count and does not depend on the playback rate.
+	enum class Interpolation {
+		/// Two taps
+		linear,
+		/// Four taps, Catmull-Rom cubic Hermite
+		cubic,
+		/// Eight taps, Blackman-windowed sinc band-limited below the asset's Nyquist frequency
+		///
+		/// The passband is not narrowed for rates above one, so downward pitch changes are not anti-aliased.
+		sinc,
+	};
+
+	/// How a voice plays its asset
+	struct VoiceParameters
+	{
+		/// The sample time at which the voice starts, or a negative value to start with the next render cycle
+		Float64 mStartSampleTime = -1;
+		/// The asset frame at which playback begins
+		Float64 mStartFrame = 0;
+		/// The linear gain of the voice
+		float mGain = 1;
+		/// The position from left (@c -1) to right (@c 1), applied to mono and stereo assets without a spatializer
+		float mPan = 0;
+		/// The direction in degrees from front center, positive to the right, used with a spatializer
+		float mAzimuth = 0;
+		/// The direction in degrees above the horizontal plane, used with a spatializer
+		float mElevation = 0;
+		/// The azimuth in degrees across which the channels of a multichannel asset are spread, used with a spatializer
+		float mSpread = 60;
+		/// The playback rate relative to the asset's natural speed
+		Float64 mRate = 1;
+		Interpolation mInterpolation = Interpolation::linear;
+		/// The first frame of the loop
+		UInt32 mLoopStartFrame = 0;
+		/// The frame following the loop, or zero to play the asset once
+		///
+		/// The loop must be at least @c kMinimumLoopFrameCount frames long.
+		UInt32 mLoopEndFrame = 0;
+	};
+
+	/// Creates a new @c SFBVoiceRenderer
+	/// @param voiceCapacity The largest number of voices playing at once
+	/// @param format The deinterleaved 32-bit float format of the rendered audio
+	/// @param maximumFrameCount The largest number of frames rendered at once
+	/// @throw @c std::invalid_argument if @c voiceCapacity is zero or @c format is not deinterleaved float
+	/// @throw @c std::bad_alloc
+	SFBVoiceRenderer(UInt32 voiceCapacity, const AudioStreamBasicDescription& format, UInt32 maximumFrameCount);
+
+	// This class is non-copyable
+	SFBVoiceRenderer(const SFBVoiceRenderer& rhs) = delete;
+
+	// This class is non-assignable
+	SFBVoiceRenderer& operator=(const SFBVoiceRenderer& rhs) = delete;
+
+	~SFBVoiceRenderer() = default;
+
+	// This class is non-movable
+	SFBVoiceRenderer(SFBVoiceRenderer&& rhs) = delete;
+
+	// This class is non-move assignable
+	SFBVoiceRenderer& operator=(SFBVoiceRenderer&& rhs) = delete;
+
+
+	inline UInt32 VoiceCapacity() const noexcept
+	{
+		return static_cast<UInt32>(mVoices.size());
+	}
+
+	/// Returns the number of voices started or waiting to start as of the last render cycle
+	inline UInt32 ActiveVoiceCount() const noexcept
+	{
+		return mActiveVoiceCount.load(std::memory_order_relaxed);
+	}
+
+	/// Returns @c true if no voice is playing and no command is waiting for the render thread
+	inline bool IsIdle() const noexcept
+	{
+		return mActiveVoiceCount.load(std::memory_order_relaxed) == 0 && mPendingCommandCount.load(std::memory_order_acquire) == 0;
+	}
+
+	/// Starts a voice playing @c asset
+	/// @note The asset's sample rate is converted to the render sample rate by the playback rate
+	/// @throw @c std::invalid_argument if @c asset is @c nullptr or has too many channels, or @c parameters are out of range
+	/// @throw @c std::runtime_error if every voice is in use
+	VoiceID Play(std::shared_ptr<const SFBAudioAsset> asset, const VoiceParameters& parameters);
+
+	/// Stops @c voice at @c sampleTime, fading out over the following @c releaseFrameCount frames
+	/// @param sampleTime The sample time at which the voice stops, or a negative value to stop with the next render cycle
+	/// @return @c false if @c voice has already finished
+	bool Stop(VoiceID voice, Float64 sampleTime = -1, UInt32 releaseFrameCount = 0);
+	/// Stops every voice with the next render cycle
+	void StopAll();
+
+	/// @return @c false if @c voice has already finished
+	bool SetGain(VoiceID voice, float gain);
+	/// @return @c false if @c voice has already finished
+	bool SetPan(VoiceID voice, float pan);
+	/// @return @c false if @c voice has already finished
+	/// @throw @c std::invalid_argument if @c rate is not positive
+	bool SetRate(VoiceID voice, Float64 rate);
+	/// Moves @c voice to @c azimuth and @c elevation, in degrees, over the next @c frameCount frames
+	/// @note The position is used only with a spatializer
+	/// @return @c false if @c voice has already finished
+	bool SetPosition(VoiceID voice, float azimuth, float elevation, UInt32 frameCount = 0);
+
+	/// Places voices on the speakers of @c spatializer, or pans them in stereo if @c spatializer is @c nullptr
+	/// @throw @c std::invalid_argument if the channel count of @c spatializer does not match the rendered audio
+	void SetSpatializer(std::shared_ptr<const SFBSpatializer> spatializer);
+
+	/// Releases the assets of voices that have finished and spatializers no longer in use
+	/// @note This is also performed by the other control functions
+	void Collect();
+
+	/// Renders @c frameCount frames starting at @c sampleTime to @c bufferList
+	/// @note Only a single thread may render at a time
+	/// @return @c false if the rendered audio is silent
+	bool Render(AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime) noexcept;
+
+private:
+
+	struct Command
+	{
+		enum class Type {
+			start,
+			stop,
+			stopAll,
+			setGain,
+			setPan,
+			setRate,
+			setPosition,
+			setSpatializer,
+		};
+
+		Type mType;
+		UInt32 mSlot;
+		UInt32 mGeneration;
+		const SFBAudioAsset *mAsset;
+		VoiceParameters mParameters;
+		Float64 mSampleTime;
+		UInt32 mReleaseFrameCount;
+		float mValue;
+		Float64 mRate;
+		float mAzimuth;
+		float mElevation;
+		UInt32 mFrameCount;
+		const SFBSpatializer *mSpatializer;
+	};
+
+	/// The largest number of routes of a voice, which for a spatialized voice includes routes fading out
+	static constexpr UInt32 kMaximumRouteCount = 2 * SFBSpatializer::kMaximumGainCount * kMaximumAssetChannelCount;
+
+	/// An output channel fed by one asset channel
+	struct Route
+	{
+		UInt32 mSourceChannel;
+		UInt32 mDestinationChannel;
+		/// The gain applied at the end of the last render cycle
+		float mGain;
+		/// The gain to reach by the end of the next render cycle
+		float mTargetGain;
+	};
+
+	/// Render thread voice state
+	struct Voice
+	{
+		const SFBAudioAsset *mAsset;
+		UInt32 mGeneration;
+		bool mIsActive;
+		/// Whether the voice has rendered any frames
+		bool mHasStarted;
+		Float64 mStartSampleTime;
+		Float64 mStopSampleTime;
+		UInt32 mReleaseFrameCount;
+		/// The read position in asset frames, in 32.32 fixed point
+		UInt64 mPhase;
+		/// The asset frames advanced per rendered frame, in 32.32 fixed point
+		UInt64 mPhaseIncrement;
+		Interpolation mInterpolation;
+		UInt32 mLoopStartFrame;
+		UInt32 mLoopEndFrame;
+		/// Whether the voice has returned to the loop start at least once
+		bool mHasLooped;
+		float mGain;
+		float mPan;
+		float mAzimuth;
+		float mElevation;
+		float mSpread;
+		float mTargetAzimuth;
+		float mTargetElevation;
+		/// The number of frames until the voice reaches its target position
+		UInt32 mPositionFrameCount;
+		/// The unit-gain speaker gains of each asset channel at the current position
+		UInt32 mSpeakerGainCounts [kMaximumAssetChannelCount];
+		SFBSpatializer::Gain mSpeakerGains [kMaximumAssetChannelCount][SFBSpatializer::kMaximumGainCount];
+		UInt32 mRouteCount;
+		Route mRoutes [kMaximumRouteCount];
+	};
+
+	/// Sends @c command to the render thread, requires @c mControlLock
+	void Submit(const Command& command);
+	/// Returns the slot of @c voice if it has not finished, requires @c mControlLock
+	bool SlotForVoice(VoiceID voice, UInt32& slot) const noexcept;
+	/// Frees the slots of finished voices and retired spatializers, requires @c mControlLock
+	void ReclaimFinishedSlots() noexcept;
+	/// Returns the fixed-point phase increment for @c rate
+	UInt64 PhaseIncrement(const SFBAudioAsset& asset, Float64 rate) const noexcept;
+	/// Returns the frames of @c channel around the loop seam of @c slot
+	inline float * LoopSeam(UInt32 slot, UInt32 channel) noexcept
+	{
+		return mLoopSeams.data() + (slot * kMaximumAssetChannelCount + channel) * 2 * kMinimumLoopFrameCount;
+	}
+
+	void ApplyCommand(const Command& command, Float64 sampleTime) noexcept;
+	/// Creates the routes of @c voice for the current spatializer
+	void BuildRoutes(Voice& voice) const noexcept;
+	/// Recomputes the speaker gains of @c voice from its position
+	void UpdateSpeakerGains(Voice& voice) const noexcept;
+	/// Moves @c voice toward its target position by @c frameCount frames
+	void AdvancePosition(Voice& voice, UInt32 frameCount) const noexcept;
+	/// Sets the route target gains from the gain and pan or speaker gains of @c voice
+	void UpdateRoutes(Voice& voice) const noexcept;
+	/// Adds the next frames of the voice in @c slot to @c bufferList
+	/// @return @c false if the voice has finished
+	bool RenderVoice(UInt32 slot, AudioBufferList *bufferList, UInt32 frameCount, Float64 sampleTime, bool& rendered) noexcept;
+	void FinishVoice(UInt32 slot) noexcept;
+
+	Float64 mSampleRate;
+	UInt32 mChannelCount;
+	UInt32 mMaximumFrameCount;
+
+	/// Control to render thread commands
+	SFBMessageQueue<Command> mCommands;
+	/// Slots of finished voices returned to the control threads
+	SFBMessageQueue<UInt32> mFinishedSlots;
+	std::atomic_uint mPendingCommandCount;
+	std::atomic_uint mActiveVoiceCount;
+
+	/// Control thread state, requires @c mControlLock
+	std::mutex mControlLock;
+	std::vector<std::shared_ptr<const SFBAudioAsset>> mSlotAssets;
+	std::vector<UInt32> mSlotGenerations;
+	std::vector<UInt32> mFreeSlots;
+	std::shared_ptr<const SFBSpatializer> mSpatializer;
+	/// Spatializers replaced while the render thread may still be using them
+	std::vector<std::shared_ptr<const SFBSpatializer>> mRetiredSpatializers;
+
+	/// Render thread state
+	std::vector<Voice> mVoices;
+	/// Slots of active voices, in no particular order
+	std::vector<UInt32> mActiveSlots;
+	/// The spatializer used by the render thread
+	const SFBSpatializer *mRenderSpatializer;
+	/// For each slot and asset channel, the @c kMinimumLoopFrameCount frames preceding the loop end followed by as many
+	/// from the loop start, so interpolation windows crossing the loop seam are contiguous. Written by the control thread
+	/// before the voice starts.
+	std::vector<float> mLoopSeams;
+	/// The Blackman-windowed sinc coefficients for each phase
+	std::vector<float> mSincTable;
+
+	/// Per-frame interpolation windows shared by the channels of a voice: the offset of the first tap in the asset or
+	/// loop seam, the fractional position, and the sinc phase
+	std::vector<SInt32> mWindowStarts;
+	std::vector<UInt8> mWindowIsInSeam;
+	std::vector<float> mFractions;
+	std::vector<UInt32> mSincPhases;
+	/// The per-frame release envelope of a voice
+	std::vector<float> mEnvelope;
+	/// One interpolated channel of a voice
+	std::vector<float> mChannelBuffer;
+
+};